@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "agg.h"
+
+#define AGG_DEFAULT_WINDOW_MS 1000
+#define AGG_MIN_SLOTS 1024
+
+/* most one output line can take */
+#define AGG_ROW_MAX \
+	(AGG_KEY_MAX + 96 + AGG_MAX_FIELDS * (3 * AGG_NAME_MAX + 96))
+
+/* "key:field[+field...][,window_ms[,slide_ms]]", see agg.h */
+int
+agg_parse(struct agg *a, const char *spec)
+{
+	const char *p = spec, *end;
+	size_t n;
+
+	memset(a, 0, sizeof (*a));
+	if ((end = strchr(p, ':')) == NULL || end == p ||
+	    (n = end - p) >= AGG_NAME_MAX)
+		return (-1);
+	memcpy(a->key, p, n);
+	a->key_len = n;
+	for (p = end + 1; ; p = end + 1) {
+		end = p + strcspn(p, "+,");
+		if (end == p || (n = end - p) >= AGG_NAME_MAX ||
+		    a->nfields == AGG_MAX_FIELDS)
+			return (-1);
+		memcpy(a->fields[a->nfields], p, n);
+		a->field_len[a->nfields++] = n;
+		if (*end != '+')
+			break;
+	}
+
+	a->window_ms = AGG_DEFAULT_WINDOW_MS;
+	if (*end == ',') {
+		a->window_ms = strtoull(end + 1, (char **)&end, 10);
+		a->slide_ms = a->window_ms;
+		if (*end == ',')
+			a->slide_ms = strtoull(end + 1, (char **)&end, 10);
+	}
+	if (a->slide_ms == 0)
+		a->slide_ms = a->window_ms;
+	if (*end != '\0' || a->window_ms == 0 ||
+	    a->window_ms % a->slide_ms != 0 ||
+	    a->window_ms / a->slide_ms > AGG_MAX_PANES)
+		return (-1);
+	a->npanes = a->window_ms / a->slide_ms;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * An entry is the key, a length byte then its bytes, a record count
+ * per pane, then a cell per field and pane.
+ */
+static inline char *
+ent(struct agg *a, uint32_t i)
+{
+	return (a->ents + (size_t)i * a->ent_size);
+}
+
+static inline uint64_t *
+ent_counts(struct agg *a, char *e)
+{
+	(void) a;
+	return ((uint64_t *)(e + AGG_KEY_MAX));
+}
+
+static inline struct agg_cell *
+ent_cell(struct agg *a, char *e, int field, int pane)
+{
+	struct agg_cell *c = (struct agg_cell *)(e + AGG_KEY_MAX +
+	    a->npanes * sizeof (uint64_t));
+
+	return (&c[field * a->npanes + pane]);
+}
+
+int
+agg_init(struct agg *a)
+{
+	a->ent_size = AGG_KEY_MAX + a->npanes * sizeof (uint64_t) +
+	    a->nfields * a->npanes * sizeof (struct agg_cell);
+	a->max_keys = AGG_MAX_BYTES / a->ent_size;
+	if (a->max_keys > AGG_MAX_KEYS)
+		a->max_keys = AGG_MAX_KEYS;
+	a->mask = AGG_MIN_SLOTS - 1;
+	a->slots = calloc(AGG_MIN_SLOTS, sizeof (*a->slots));
+	a->ent_cap = AGG_MIN_SLOTS / 2;
+	a->ents = malloc(a->ent_cap * a->ent_size);
+	if (a->slots == NULL || a->ents == NULL) {
+		agg_free(a);
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+void
+agg_free(struct agg *a)
+{
+	free(a->slots);
+	free(a->ents);
+	free(a->out);
+	a->slots = NULL;
+	a->ents = NULL;
+	a->out = NULL;
+}
+
+/* FNV-1a, keys are short */
+static inline uint32_t
+agg_hash(const char *key, size_t klen)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < klen; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
+	}
+	return (h);
+}
+
+/*
+ * Double the table, the entries stay where they are.  Their array
+ * doubles too, up to max_keys.
+ */
+static int
+agg_grow(struct agg *a)
+{
+	uint32_t mask = a->mask * 2 + 1, cap = a->ent_cap * 2, i;
+	uint64_t *slots;
+	char *ents;
+
+	if (cap > a->max_keys)
+		cap = a->max_keys;
+	if ((slots = calloc((size_t)mask + 1, sizeof (*slots))) == NULL ||
+	    (ents = realloc(a->ents, (size_t)cap * a->ent_size)) == NULL) {
+		free(slots);
+		return (-1);
+	}
+	for (uint32_t s = 0; s <= a->mask; s++) {
+		if (a->slots[s] == 0)
+			continue;
+		for (i = (a->slots[s] >> 32) & mask; slots[i] != 0;
+		    i = (i + 1) & mask)
+			;
+		slots[i] = a->slots[s];
+	}
+	free(a->slots);
+	a->slots = slots;
+	a->mask = mask;
+	a->ents = ents;
+	a->ent_cap = cap;
+	return (EXIT_SUCCESS);
+}
+
+/* the slot pointing at entry i */
+static uint32_t
+agg_slot_of(struct agg *a, uint32_t i)
+{
+	char *e = ent(a, i);
+	uint32_t s;
+
+	for (s = agg_hash(e + 1, (unsigned char)e[0]) & a->mask;
+	    (uint32_t)a->slots[s] != i + 1; s = (s + 1) & a->mask)
+		;
+	return (s);
+}
+
+/*
+ * Drop entry i.  Its slot is emptied by shifting back the ones after it
+ * that probed past it, so lookups never need tombstones, and the last
+ * entry moves into its place to keep the entries dense.
+ */
+static void
+agg_evict(struct agg *a, uint32_t i)
+{
+	uint32_t s = agg_slot_of(a, i), j = s, home, last = a->nkeys - 1;
+
+	for (;;) {
+		a->slots[s] = 0;
+		for (;;) {
+			j = (j + 1) & a->mask;
+			if (a->slots[j] == 0)
+				goto moved;
+			/* stays if its home is in (s, j], cyclically */
+			home = (a->slots[j] >> 32) & a->mask;
+			if (s <= j ? (s < home && home <= j) :
+			    (s < home || home <= j))
+				continue;
+			break;
+		}
+		a->slots[s] = a->slots[j];
+		s = j;
+	}
+moved:
+	if (i != last) {
+		s = agg_slot_of(a, last);
+		a->slots[s] = (a->slots[s] & ~0xffffffffULL) | (i + 1);
+		memcpy(ent(a, i), ent(a, last), a->ent_size);
+	}
+	__atomic_store_n(&a->nkeys, last, __ATOMIC_RELAXED);
+	__atomic_store_n(&a->st.evicted, a->st.evicted + 1, __ATOMIC_RELAXED);
+}
+
+/* the key's entry, added if it's new; NULL if there's no room */
+static char *
+agg_lookup(struct agg *a, const char *key, size_t klen)
+{
+	uint32_t h = agg_hash(key, klen), i;
+	char *e;
+
+	for (i = h & a->mask; a->slots[i] != 0; i = (i + 1) & a->mask) {
+		if ((uint32_t)(a->slots[i] >> 32) != h)
+			continue;
+		e = ent(a, (uint32_t)a->slots[i] - 1);
+		if ((unsigned char)e[0] == klen &&
+		    memcmp(e + 1, key, klen) == 0)
+			return (e);
+	}
+
+	/* new key, keep the table at most half full */
+	if (a->nkeys >= a->max_keys)
+		return (NULL);
+	if (a->nkeys + 1 > a->ent_cap) {
+		if (EXIT_SUCCESS != agg_grow(a))
+			return (NULL);
+		for (i = h & a->mask; a->slots[i] != 0;
+		    i = (i + 1) & a->mask)
+			;
+	}
+	e = ent(a, a->nkeys);
+	memset(e, 0, a->ent_size);
+	e[0] = klen;
+	memcpy(e + 1, key, klen);
+	a->slots[i] = (uint64_t)h << 32 | (a->nkeys + 1);
+	__atomic_store_n(&a->nkeys, a->nkeys + 1, __ATOMIC_RELAXED);
+	return (e);
+}
+
+/*
+ * JSON scanning
+ * -------------
+ * Quotes are found 16 bytes at a time.  A string followed by ':' is a
+ * name, the value after it is only looked at when it's a name we want;
+ * other values are stepped over by the next quote search, since a
+ * string value is followed by ',' or '}' rather than ':'.
+ */
+static inline size_t
+find_quote(const char *p, size_t i, size_t len)
+{
+#ifdef __SSE2__
+	const __m128i q = _mm_set1_epi8('"');
+	int m;
+
+	for (; i + 16 <= len; i += 16) {
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(
+		    _mm_loadu_si128((const __m128i *)(p + i)), q));
+		if (m != 0)
+			return (i + __builtin_ctz(m));
+	}
+#endif
+	for (; i < len; i++)
+		if (p[i] == '"')
+			return (i);
+	return (len);
+}
+
+/* next quote that isn't escaped */
+static inline size_t
+next_quote(const char *p, size_t i, size_t len)
+{
+	size_t b;
+
+	for (;; i++) {
+		if ((i = find_quote(p, i, len)) >= len)
+			return (len);
+		for (b = i; b > 0 && p[b - 1] == '\\'; b--)
+			;
+		if ((i - b) % 2 == 0)
+			return (i);
+	}
+}
+
+static inline size_t
+skip_space(const char *p, size_t i, size_t len)
+{
+	while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\n' ||
+	    p[i] == '\r'))
+		i++;
+	return (i);
+}
+
+static const double pow10_tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * A JSON number at p[i], good to about 17 digits, which is plenty for
+ * min/max/mean.  Returns where it ended, or i if there was none.
+ */
+static size_t
+parse_num(const char *p, size_t i, size_t len, double *v)
+{
+	uint64_t m = 0;
+	int neg = 0, digits = 0, exp10 = 0, e = 0, eneg = 0;
+	size_t start = i;
+	double r;
+
+	if (i < len && p[i] == '-') {
+		neg = 1;
+		i++;
+	}
+	for (; i < len && p[i] >= '0' && p[i] <= '9'; i++, digits++) {
+		if (digits < 19)
+			m = m * 10 + (p[i] - '0');
+		else
+			exp10++;
+	}
+	if (i < len && p[i] == '.') {
+		for (i++; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
+			if (digits++ < 19) {
+				m = m * 10 + (p[i] - '0');
+				exp10--;
+			}
+		}
+	}
+	if (digits == 0)
+		return (start);
+	if (i < len && (p[i] == 'e' || p[i] == 'E')) {
+		i++;
+		if (i < len && (p[i] == '-' || p[i] == '+'))
+			eneg = p[i++] == '-';
+		for (; i < len && p[i] >= '0' && p[i] <= '9'; i++)
+			if (e < 1000)
+				e = e * 10 + (p[i] - '0');
+		exp10 += eneg ? -e : e;
+	}
+
+	r = m;
+	for (; exp10 > 22; exp10 -= 22)
+		r *= 1e22;
+	for (; exp10 < -22; exp10 += 22)
+		r /= 1e22;
+	r = exp10 >= 0 ? r * pow10_tab[exp10] : r / pow10_tab[-exp10];
+	*v = neg ? -r : r;
+	return (i);
+}
+
+/*
+ * Pull the key and the fields we want out of one record.  Returns -1
+ * if there's no key, otherwise a bit per field found.
+ */
+static int
+agg_scan(struct agg *a, const char *p, size_t len, const char **key,
+		size_t *klen, double *vals)
+{
+	size_t i = 0, q1, q2, n;
+	int have = 0, all = (1 << a->nfields) - 1, k;
+
+	*key = NULL;
+	*klen = 0;
+	while (i < len && (*key == NULL || have != all)) {
+		if ((q1 = next_quote(p, i, len)) >= len ||
+		    (q2 = next_quote(p, q1 + 1, len)) >= len)
+			break;
+		i = skip_space(p, q2 + 1, len);
+		if (i >= len || p[i] != ':')
+			continue;
+		i = skip_space(p, i + 1, len);
+		n = q2 - q1 - 1;
+
+		if (n == a->key_len && memcmp(p + q1 + 1, a->key, n) == 0) {
+			if (i < len && p[i] == '"') {
+				/* string key, as it is between the quotes */
+				q2 = next_quote(p, i + 1, len);
+				*key = p + i + 1;
+				*klen = q2 - i - 1;
+				i = q2 + 1;
+			} else {
+				/* a number or literal, up to where it ends */
+				*key = p + i;
+				while (i < len && p[i] != ',' && p[i] != '}' &&
+				    p[i] != ' ' && p[i] != '\n')
+					i++;
+				*klen = p + i - *key;
+			}
+			continue;
+		}
+		for (k = 0; k < a->nfields; k++) {
+			if (n == a->field_len[k] &&
+			    memcmp(p + q1 + 1, a->fields[k], n) == 0) {
+				if ((q2 = parse_num(p, i, len, &vals[k])) > i) {
+					have |= 1 << k;
+					i = q2;
+				}
+				break;
+			}
+		}
+	}
+	if (*key == NULL || *klen == 0 || *klen >= AGG_KEY_MAX)
+		return (-1);
+	return (have);
+}
+
+/* one record into the current pane */
+void
+agg_add(struct agg *a, const char *val, size_t len)
+{
+	double vals[AGG_MAX_FIELDS];
+	struct agg_cell *c;
+	const char *key;
+	size_t klen = 0;
+	int have, pane = a->pane % a->npanes;
+	char *e;
+
+	__atomic_store_n(&a->st.records, a->st.records + 1, __ATOMIC_RELAXED);
+	if ((have = agg_scan(a, val, len, &key, &klen, vals)) < 0) {
+		__atomic_store_n(&a->st.unparsed, a->st.unparsed + 1,
+		    __ATOMIC_RELAXED);
+		return;
+	}
+	if ((e = agg_lookup(a, key, klen)) == NULL) {
+		__atomic_store_n(&a->st.dropped, a->st.dropped + 1,
+		    __ATOMIC_RELAXED);
+		return;
+	}
+	ent_counts(a, e)[pane]++;
+	for (int k = 0; k < a->nfields; k++) {
+		if ((have & (1 << k)) == 0)
+			continue;
+		c = ent_cell(a, e, k, pane);
+		if (c->count++ == 0) {
+			c->min = c->max = c->sum = vals[k];
+			continue;
+		}
+		if (vals[k] < c->min)
+			c->min = vals[k];
+		if (vals[k] > c->max)
+			c->max = vals[k];
+		c->sum += vals[k];
+	}
+}
+
+/* a line per key with anything in the window that ends with this pane */
+static int
+agg_emit(struct agg *a, uint64_t end_ms)
+{
+	struct agg_cell w, *c;
+	uint64_t count, *counts;
+	size_t n;
+	char *e, *o;
+	int k, j;
+
+	for (uint32_t i = 0; i < a->nkeys; i++) {
+		e = ent(a, i);
+		counts = ent_counts(a, e);
+		count = 0;
+		for (j = 0; j < a->npanes; j++)
+			count += counts[j];
+		if (count == 0)
+			continue;
+
+		if (a->out_cap - a->out_len < AGG_ROW_MAX) {
+			if ((o = realloc(a->out, a->out_cap * 2 +
+			    AGG_ROW_MAX)) == NULL)
+				return (-1);
+			a->out = o;
+			a->out_cap = a->out_cap * 2 + AGG_ROW_MAX;
+		}
+		o = a->out + a->out_len;
+		n = sprintf(o, "{\"%s\":\"%.*s\",\"start\":%llu,\"end\":%llu,"
+		    "\"count\":%llu", a->key, (unsigned char)e[0], e + 1,
+		    (unsigned long long)(end_ms - a->window_ms),
+		    (unsigned long long)end_ms, (unsigned long long)count);
+		for (k = 0; k < a->nfields; k++) {
+			memset(&w, 0, sizeof (w));
+			for (j = 0; j < a->npanes; j++) {
+				c = ent_cell(a, e, k, j);
+				if (c->count == 0)
+					continue;
+				if (w.count == 0 || c->min < w.min)
+					w.min = c->min;
+				if (w.count == 0 || c->max > w.max)
+					w.max = c->max;
+				w.sum += c->sum;
+				w.count += c->count;
+			}
+			if (w.count == 0)
+				continue;
+			n += sprintf(o + n, ",\"%s_min\":%.10g,\"%s_max\":%.10g,"
+			    "\"%s_mean\":%.10g", a->fields[k], w.min,
+			    a->fields[k], w.max, a->fields[k],
+			    w.sum / w.count);
+		}
+		o[n++] = '}';
+		o[n++] = '\n';
+		a->out_len += n;
+		__atomic_store_n(&a->st.rows, a->st.rows + 1, __ATOMIC_RELAXED);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Empty a pane in every entry so it can be filled again, and drop the
+ * keys that have nothing left in the window.  Going from the end, the
+ * entry an eviction moves down has been seen already.
+ */
+static void
+agg_clear(struct agg *a, int pane)
+{
+	uint64_t *counts;
+	char *e;
+	int j;
+
+	for (uint32_t i = a->nkeys; i-- > 0; ) {
+		e = ent(a, i);
+		counts = ent_counts(a, e);
+		counts[pane] = 0;
+		for (int k = 0; k < a->nfields; k++)
+			ent_cell(a, e, k, pane)->count = 0;
+		for (j = 0; j < a->npanes && counts[j] == 0; j++)
+			;
+		if (j == a->npanes)
+			agg_evict(a, i);
+	}
+}
+
+/*
+ * Move time along to now_ms, closing the panes that have ended.  The
+ * lines for the windows that closed are in *out, good until the next
+ * call; returns their length.
+ */
+size_t
+agg_tick(struct agg *a, uint64_t now_ms, const char **out)
+{
+	uint64_t pane = now_ms / a->slide_ms;
+
+	a->out_len = 0;
+	*out = a->out;
+	if (a->pane == 0) {
+		a->pane = pane;
+		return (0);
+	}
+	for (int n = 0; a->pane < pane; n++) {
+		/* after a window's worth of empty panes there's nothing left */
+		if (n == a->npanes) {
+			a->pane = pane;
+			break;
+		}
+		if (EXIT_SUCCESS != agg_emit(a, (a->pane + 1) * a->slide_ms))
+			break;
+		a->pane++;
+		agg_clear(a, a->pane % a->npanes);
+	}
+	*out = a->out;
+	return (a->out_len);
+}
+
+void
+agg_get_stats(struct agg *a, struct agg_stats *st)
+{
+	st->records = __atomic_load_n(&a->st.records, __ATOMIC_RELAXED);
+	st->unparsed = __atomic_load_n(&a->st.unparsed, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&a->st.dropped, __ATOMIC_RELAXED);
+	st->evicted = __atomic_load_n(&a->st.evicted, __ATOMIC_RELAXED);
+	st->keys = __atomic_load_n(&a->nkeys, __ATOMIC_RELAXED);
+	st->rows = __atomic_load_n(&a->st.rows, __ATOMIC_RELAXED);
+}
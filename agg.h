@@ -0,0 +1,113 @@
+#ifndef AGG_H
+#define AGG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Windowed aggregation
+ * --------------------
+ * With -A the consumer keeps count/min/max/mean of some numeric fields
+ * per key and writes out one line per key and window instead of every
+ * record.  The spec names the key field, the value fields and the
+ * window:
+ *
+ *   key:field[+field...][,window_ms[,slide_ms]]
+ *
+ * e.g. "sensor:temp+hum,10000,1000" is a 10s window sliding every 1s.
+ * Without slide_ms windows tumble, without window_ms they are 1s.
+ * Windows go by arrival time, aligned to the wall clock so consumers
+ * on different hosts cut them at the same moments.  agg_tick() moves
+ * time along, a record goes in the pane current at the last tick, and
+ * each window is written out when it closes as
+ *
+ *   {"sensor":"s1","start":<ms>,"end":<ms>,"count":N,
+ *    "temp_min":x,"temp_max":y,"temp_mean":z,...}
+ *
+ * A window is kept as window_ms / slide_ms panes of slide_ms each, so
+ * sliding costs one pane per slide instead of a pass per window.  Keys
+ * live in an open-addressing table of (hash, entry) pairs with linear
+ * probing, their panes in one array next to it.  A key with nothing in
+ * the window writes no line, and is dropped from the table when its
+ * last pane is cleared, so a slide only walks the keys still reporting.
+ *
+ * Records are JSON objects with the fields at the top level.  The
+ * parser only looks for the configured names and never builds a tree:
+ * it finds the quotes 16 bytes at a time with SSE2 and only looks
+ * closer at the strings followed by a ':'.
+ *
+ * Aggregates live in memory only.  Offsets are committed as records
+ * are read, so the open windows are lost if the consumer dies.
+ */
+
+#define AGG_MAX_FIELDS 8
+#define AGG_MAX_PANES 64
+#define AGG_NAME_MAX 32
+#define AGG_KEY_MAX 48
+
+/*
+ * The key table is bounded, by count and by the memory its entries
+ * take; records for new keys past either are dropped.
+ */
+#define AGG_MAX_KEYS (1024 * 1024)
+#define AGG_MAX_BYTES (256UL * 1024 * 1024)
+
+struct agg_cell {
+	double min;
+	double max;
+	double sum;
+	uint64_t count;
+};
+
+struct agg_stats {
+	unsigned long records;
+	unsigned long unparsed;	/* no key, or not JSON */
+	unsigned long dropped;	/* the table was full */
+	unsigned long evicted;	/* keys dropped with an empty window */
+	unsigned long keys;
+	unsigned long rows;	/* lines written out */
+};
+
+struct agg {
+	/* from the spec */
+	char key[AGG_NAME_MAX];
+	char fields[AGG_MAX_FIELDS][AGG_NAME_MAX];
+	uint8_t key_len;
+	uint8_t field_len[AGG_MAX_FIELDS];
+	int nfields;
+	uint64_t window_ms;
+	uint64_t slide_ms;
+	int npanes;
+
+	/* open-addressing table, mask + 1 slots */
+	uint64_t *slots;	/* hash << 32 | entry + 1, 0 is empty */
+	uint32_t mask;
+	uint32_t nkeys;
+	uint32_t max_keys;
+
+	/*
+	 * entries, each the key then nfields x npanes cells, plus a
+	 * count per pane
+	 */
+	char *ents;
+	size_t ent_size;
+	uint32_t ent_cap;
+
+	uint64_t pane;		/* the one filling, in slide_ms since epoch */
+
+	/* what agg_tick() wrote */
+	char *out;
+	size_t out_len;
+	size_t out_cap;
+
+	struct agg_stats st;
+};
+
+int agg_parse(struct agg *a, const char *spec);
+int agg_init(struct agg *a);
+void agg_free(struct agg *a);
+void agg_add(struct agg *a, const char *val, size_t len);
+size_t agg_tick(struct agg *a, uint64_t now_ms, const char **out);
+void agg_get_stats(struct agg *a, struct agg_stats *st);
+
+#endif /* AGG_H */
@@ -0,0 +1,56 @@
+#include "aimd.h"
+
+/* the ceiling wins over the floor, so "rate 0" still stops sending */
+static void
+aimd_clamp(struct aimd *a)
+{
+	if (a->rate < AIMD_MIN_RATE)
+		a->rate = AIMD_MIN_RATE;
+	if (a->rate > a->ceiling)
+		a->rate = a->ceiling;
+}
+
+void
+aimd_init(struct aimd *a, double ceiling)
+{
+	a->ceiling = ceiling;
+	a->rate = a->peak = AIMD_START_RATE;
+	a->slow_start = 1;
+	a->hold = 0;
+	a->increases = a->decreases = 0;
+	aimd_clamp(a);
+}
+
+/* a new rate from the pipe, takes effect at once if it's lower */
+void
+aimd_set_ceiling(struct aimd *a, double ceiling)
+{
+	a->ceiling = ceiling;
+	aimd_clamp(a);
+}
+
+/* one tick's worth of news, returns the rate to send at next */
+double
+aimd_update(struct aimd *a, int congested, int used)
+{
+	if (a->hold > 0) {
+		a->hold--;
+		return (a->rate);
+	}
+	if (congested) {
+		/* a ceiling of 0 mustn't leave nothing to step up by */
+		a->peak = a->rate < AIMD_MIN_RATE ? AIMD_MIN_RATE : a->rate;
+		a->rate *= AIMD_BETA;
+		a->slow_start = 0;
+		a->hold = AIMD_HOLD_TICKS;
+		a->decreases++;
+	} else if (used && a->rate < a->ceiling) {
+		if (a->slow_start)
+			a->rate *= 2;
+		else
+			a->rate += a->peak * AIMD_STEP_FRAC;
+		a->increases++;
+	}
+	aimd_clamp(a);
+	return (a->rate);
+}
@@ -0,0 +1,57 @@
+#ifndef AIMD_H
+#define AIMD_H
+
+/*
+ * Adaptive send rate
+ * ------------------
+ * With -a the rate from the pipe becomes a ceiling, and the producer
+ * looks for the highest rate below it that the cluster keeps up with,
+ * the way TCP finds a link's bandwidth: additive increase,
+ * multiplicative decrease.
+ *
+ * Every AIMD_TICK_MS the producer calls aimd_update() with what it saw
+ * over the tick: whether it was congested (see the AIMD_* reasons) and
+ * whether the senders actually used the rate they were given.
+ *
+ *   - congested: the rate drops to AIMD_BETA of itself.  Acks for what
+ *     went out at the old rate keep arriving for a while, so after a
+ *     decrease we hold for AIMD_HOLD_TICKS before reacting again.
+ *   - otherwise, if the senders kept up with the rate, it goes up by
+ *     AIMD_STEP_FRAC of the rate it last backed off from, which is
+ *     roughly where the limit is.  If they didn't (slow input, -W)
+ *     there's no point asking for more and it stays where it is.
+ *
+ * Until the first congestion the rate doubles every tick instead,
+ * starting from AIMD_START_RATE, so it gets near the limit in a couple
+ * of seconds rather than climbing from nothing.  The rate never goes
+ * above the ceiling, nor below AIMD_MIN_RATE unless the ceiling is.
+ */
+
+#define AIMD_TICK_MS 100
+#define AIMD_BETA 0.7
+#define AIMD_STEP_FRAC 0.02
+#define AIMD_HOLD_TICKS 3
+#define AIMD_START_RATE 1000
+#define AIMD_MIN_RATE 10
+
+/* why a tick counted as congested, more than one may apply */
+#define AIMD_ERRORS 0x1		/* sends failed */
+#define AIMD_LATENCY 0x2	/* ack p99 over the target */
+#define AIMD_INFLIGHT 0x4	/* too many bytes waiting for acks */
+#define AIMD_BLOCKED 0x8	/* senders waited for slots or buffers */
+
+struct aimd {
+	double rate;
+	double ceiling;
+	double peak;		/* rate at the last decrease */
+	int slow_start;
+	int hold;		/* ticks left before we react again */
+	unsigned long increases;
+	unsigned long decreases;
+};
+
+void aimd_init(struct aimd *a, double ceiling);
+void aimd_set_ceiling(struct aimd *a, double ceiling);
+double aimd_update(struct aimd *a, int congested, int used);
+
+#endif /* AIMD_H */
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <streams/streams.h>
+#include "hist.h"
+#include "pacer.h"
+#include "rechdr.h"
+
+/*
+ * Producer/consumer benchmark
+ * ---------------------------
+ * Sends records of each given value size, at each given rate, from
+ * each given number of sender threads, and reports throughput and
+ * send-to-ack latency; with -c a consumer in the same process reads
+ * them back for produce-to-consume latency too.  Keys carry a rechdr.h
+ * header for the timing.
+ *
+ * Uses nothing but the streams API, so it measures a real cluster when
+ * built against libMapRClient and the local shim (shim/streams.c) when
+ * built with `./build.sh shim`, where STREAMS_SHIM_* inject latency and
+ * failures.
+ */
+
+#define BENCH_MAX_LIST 16
+#define BENCH_KEY_LEN (RECHDR_LEN + 24)
+#define BENCH_DRAIN_NS 10000000000ULL
+#define BENCH_POLL_MS 100
+
+struct run {
+	const char *topic;
+	int partitions;
+	streams_topic_partition_t *tps;
+	streams_producer_t producer;
+	uint32_t id;
+	long size;
+	long rate;
+	int threads;
+	long n;
+	char *value;
+
+	struct hist ack;
+	struct hist e2e;
+	unsigned long acked;
+	unsigned long failed;
+	unsigned long consumed;
+	int consumer_ready;
+	int stop;
+};
+
+struct sender {
+	struct run *r;
+	int idx;
+	pthread_t thread;
+};
+
+static int
+parse_list(const char *s, long *list)
+{
+	char *end;
+	int n = 0;
+
+	while (n < BENCH_MAX_LIST) {
+		list[n] = strtol(s, &end, 10);
+		if (end == s || list[n] < 0)
+			return (-1);
+		n++;
+		if (*end == '\0')
+			return (n);
+		if (*end != ',')
+			return (-1);
+		s = end + 1;
+	}
+	return (-1);
+}
+
+static void
+bench_cb(int32_t err, streams_producer_record_t record, int partitionid,
+		int64_t offset, void *ctx)
+{
+	struct run *r = ctx;
+	struct rechdr h;
+	const void *key;
+	uint32_t klen;
+	uint64_t now = rechdr_now_ns();
+
+	(void) partitionid;
+	(void) offset;
+	streams_producer_record_get_key(record, &key, &klen);
+	if (rechdr_get(key, klen, &h) != 0 && now >= h.send_ns)
+		hist_record(&r->ack, (now - h.send_ns) / 1000);
+	if (err != 0)
+		__atomic_fetch_add(&r->failed, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&r->acked, 1, __ATOMIC_RELAXED);
+	free((void *)key);
+	streams_producer_record_destroy(record);
+}
+
+/* sends every threads'th record, starting at idx */
+static void *
+sender_thread(void *arg)
+{
+	struct sender *s = arg;
+	struct run *r = s->r;
+	streams_producer_record_t record;
+	struct pacer pacer;
+	long seq, tokens = 0;
+	char *key;
+	size_t klen;
+
+	if (r->rate > 0)
+		pacer_init(&pacer, (double)r->rate / r->threads, 0);
+	for (seq = s->idx; seq < r->n; seq += r->threads) {
+		if (r->rate > 0 && tokens == 0)
+			tokens = pacer_take(&pacer, r->n);
+		if (tokens > 0)
+			tokens--;
+
+		/* the key has to live until the callback, which frees it */
+		if ((key = malloc(BENCH_KEY_LEN)) == NULL)
+			break;
+		klen = rechdr_put(key, r->id, seq, rechdr_now_ns());
+		klen += snprintf(key + klen, BENCH_KEY_LEN - klen, "k%ld", seq);
+		if (streams_producer_record_create(r->tps[seq % r->partitions],
+		    key, klen, r->value, r->size, &record) != 0) {
+			free(key);
+			__atomic_fetch_add(&r->failed, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (streams_producer_send(r->producer, record, bench_cb, r) !=
+		    0) {
+			streams_producer_record_destroy(record);
+			free(key);
+			__atomic_fetch_add(&r->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return (NULL);
+}
+
+/* reads the run's records back from the end of each partition */
+static void *
+consumer_thread(void *arg)
+{
+	struct run *r = arg;
+	streams_config_t config;
+	streams_consumer_t consumer;
+	streams_consumer_record_t *records;
+	uint32_t nrecords, nmsgs, klen;
+	struct rechdr h;
+	char gid[64];
+	void *key;
+	uint64_t now;
+
+	snprintf(gid, sizeof (gid), "bench-%u", r->id);
+	if (streams_config_create(&config) != 0)
+		goto out;
+	streams_config_set(config, "group.id", gid);
+	streams_config_set(config, "auto.offset.reset", "latest");
+	if (streams_consumer_create(config, &consumer) != 0) {
+		streams_config_destroy(config);
+		goto out;
+	}
+	if (streams_consumer_assign_partitions(consumer, r->tps,
+	    r->partitions) != 0 || streams_consumer_seek_to_end(consumer,
+	    r->tps, r->partitions) != 0) {
+		fprintf(stderr, "can't read %s\n", r->topic);
+		goto done;
+	}
+	__atomic_store_n(&r->consumer_ready, 1, __ATOMIC_RELEASE);
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		if (streams_consumer_poll(consumer, BENCH_POLL_MS, &records,
+		    &nrecords) != 0)
+			break;
+		now = rechdr_now_ns();
+		for (uint32_t i = 0; i < nrecords; i++) {
+			streams_consumer_record_get_message_count(records[i],
+			    &nmsgs);
+			for (uint32_t m = 0; m < nmsgs; m++) {
+				if (streams_msg_get_key(records[i], m, &key,
+				    &klen) != 0 ||
+				    rechdr_get(key, klen, &h) == 0 ||
+				    h.producer != r->id)
+					continue;
+				if (now >= h.send_ns)
+					hist_record(&r->e2e,
+					    (now - h.send_ns) / 1000);
+				__atomic_fetch_add(&r->consumed, 1,
+				    __ATOMIC_RELEASE);
+			}
+		}
+	}
+done:
+	streams_consumer_destroy(consumer);
+	streams_config_destroy(config);
+out:
+	/* don't leave the run waiting for us */
+	__atomic_store_n(&r->consumer_ready, -1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+static int
+bench_run(struct run *r, int consume)
+{
+	struct sender senders[r->threads];
+	struct hist ack, e2e;
+	streams_config_t config;
+	pthread_t cthread;
+	uint64_t start, elapsed, deadline;
+	double secs;
+
+	if (streams_config_create(&config) != 0 ||
+	    streams_producer_create(config, &r->producer) != 0) {
+		fprintf(stderr, "can't create producer\n");
+		return (-1);
+	}
+	if (consume) {
+		pthread_create(&cthread, NULL, consumer_thread, r);
+		while (__atomic_load_n(&r->consumer_ready,
+		    __ATOMIC_ACQUIRE) == 0)
+			usleep(1000);
+	}
+
+	start = pacer_now_ns();
+	for (int i = 0; i < r->threads; i++) {
+		senders[i].r = r;
+		senders[i].idx = i;
+		pthread_create(&senders[i].thread, NULL, sender_thread,
+		    &senders[i]);
+	}
+	for (int i = 0; i < r->threads; i++)
+		pthread_join(senders[i].thread, NULL);
+	streams_producer_flush(r->producer);
+	elapsed = pacer_now_ns() - start;
+
+	if (consume) {
+		deadline = pacer_now_ns() + BENCH_DRAIN_NS;
+		while (__atomic_load_n(&r->consumed, __ATOMIC_ACQUIRE) <
+		    r->acked && __atomic_load_n(&r->consumer_ready,
+		    __ATOMIC_ACQUIRE) > 0 && pacer_now_ns() < deadline)
+			usleep(1000);
+		__atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(cthread, NULL);
+	}
+	streams_producer_destroy(r->producer);
+	streams_config_destroy(config);
+
+	hist_snapshot(&r->ack, &ack);
+	hist_snapshot(&r->e2e, &e2e);
+	secs = elapsed / 1e9;
+	printf("%7ld %8ld %3d %10.0f %8.1f %8lu %8lu %8lu", r->size, r->rate,
+	    r->threads, r->acked / secs,
+	    r->acked * (r->size + BENCH_KEY_LEN) / secs / 1e6,
+	    (unsigned long)hist_percentile(&ack, 50),
+	    (unsigned long)hist_percentile(&ack, 99),
+	    (unsigned long)hist_percentile(&ack, 99.9));
+	if (consume)
+		printf(" %8lu %8lu %8lu", (unsigned long)hist_percentile(&e2e,
+		    50), (unsigned long)hist_percentile(&e2e, 99),
+		    r->acked - r->consumed);
+	printf(" %7lu\n", r->failed);
+	fflush(stdout);
+	return (0);
+}
+
+void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage:  %s [-c] [-n records] [-p partitions] "
+	    "[-r rate,...] [-s size,...] [-t threads,...] /stream:topic\n",
+	    argv0);
+	fprintf(stderr, "  -c  also consume, for produce-to-consume latency\n");
+	fprintf(stderr, "  -n  records per run (default 100000)\n");
+	fprintf(stderr, "  -p  partitions to spread them over (default 4)\n");
+	fprintf(stderr, "  -r  records/s, 0 for as fast as possible "
+	    "(default 0)\n");
+	fprintf(stderr, "  -s  value sizes in bytes (default 100,1000,10000)\n");
+	fprintf(stderr, "  -t  sender threads (default 1)\n");
+	fprintf(stderr, "Every combination of -r, -s and -t is run, latencies "
+	    "are in microseconds.\n");
+	exit(-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	long sizes[BENCH_MAX_LIST] = { 100, 1000, 10000 };
+	long rates[BENCH_MAX_LIST] = { 0 };
+	long threads[BENCH_MAX_LIST] = { 1 };
+	int nsizes = 3, nrates = 1, nthreads = 1;
+	int partitions = 4, consume = 0, opt, runs = 0;
+	long n = 100000, maxsize = 0;
+	streams_topic_partition_t *tps;
+	char *value;
+
+	while ((opt = getopt(argc, argv, "cn:p:r:s:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			consume = 1;
+			break;
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 'p':
+			partitions = atoi(optarg);
+			break;
+		case 'r':
+			if ((nrates = parse_list(optarg, rates)) < 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			if ((nsizes = parse_list(optarg, sizes)) < 0)
+				usage(argv[0]);
+			break;
+		case 't':
+			if ((nthreads = parse_list(optarg, threads)) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || n <= 0 || partitions <= 0)
+		usage(argv[0]);
+	for (int i = 0; i < nthreads; i++) {
+		if (threads[i] == 0)
+			usage(argv[0]);
+	}
+
+	tps = calloc(partitions, sizeof (*tps));
+	for (int i = 0; i < partitions; i++) {
+		if (streams_topic_partition_create(argv[optind], i,
+		    &tps[i]) != 0) {
+			fprintf(stderr, "streams_topic_partition_create() "
+			    "failed\n");
+			exit(-1);
+		}
+	}
+	for (int i = 0; i < nsizes; i++) {
+		if (sizes[i] > maxsize)
+			maxsize = sizes[i];
+	}
+	/* every record shares one value, nothing writes to it */
+	value = malloc(maxsize + 1);
+	memset(value, 'x', maxsize + 1);
+
+	printf("%7s %8s %3s %10s %8s %8s %8s %8s", "size", "rate", "thr",
+	    "msgs/s", "MB/s", "ack_p50", "ack_p99", "ack_p999");
+	if (consume)
+		printf(" %8s %8s %8s", "e2e_p50", "e2e_p99", "missing");
+	printf(" %7s\n", "failed");
+
+	for (int s = 0; s < nsizes; s++) {
+		for (int rt = 0; rt < nrates; rt++) {
+			for (int t = 0; t < nthreads; t++) {
+				struct run *r = calloc(1, sizeof (*r));
+
+				r->topic = argv[optind];
+				r->partitions = partitions;
+				r->tps = tps;
+				r->id = ((uint32_t)getpid() << 8) + runs++;
+				r->size = sizes[s];
+				r->rate = rates[rt];
+				r->threads = threads[t];
+				r->n = n;
+				r->value = value;
+				bench_run(r, consume);
+				free(r);
+			}
+		}
+	}
+
+	for (int i = 0; i < partitions; i++)
+		streams_topic_partition_destroy(tps[i]);
+	free(tps);
+	free(value);
+	return (0);
+}
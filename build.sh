@@ -2,14 +2,34 @@
 
 # Setup environment
 export MAPR_HOME=/opt/mapr
-GCC_OPTS="-ggdb -std=c99 \
+GCC_OPTS="-ggdb -std=c99 -pthread \
  -Wl,--allow-shlib-undefined -I. -I${MAPR_HOME}/include \
 -L${MAPR_HOME}/lib -lMapRClient -L${MAPR_HOME}/lib"
 
+# "./build.sh shim" builds against the local stand-in in shim/ instead,
+# no MapR client needed
+if [ "$1" = "shim" ]; then
+	GCC_OPTS="-O2 -ggdb -std=c99 -pthread -I. -Ishim"
+	STREAMS_SRC=shim/streams.c
+fi
+
+# -Z codecs, if their headers are installed (see compress.h)
+if [ -f /usr/include/lz4.h ]; then
+	GCC_OPTS="${GCC_OPTS} -DHAVE_LZ4"
+	CODEC_LIBS="${CODEC_LIBS} -llz4"
+fi
+if [ -f /usr/include/zstd.h ]; then
+	GCC_OPTS="${GCC_OPTS} -DHAVE_ZSTD"
+	CODEC_LIBS="${CODEC_LIBS} -lzstd"
+fi
+
 #Linking path
 export LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:${MAPR_HOME}/lib
 export LD_RUN_PATH=${LD_RUN_PATH}:${MAPR_HOME}/lib
 
 #Compile and Link
-gcc ${GCC_OPTS} producer.c -o producer
-gcc ${GCC_OPTS} consumer.c -o consumer
+gcc ${GCC_OPTS} producer.c metrics.c mapinput.c recpool.c pacer.c evloop.c hist.c compress.c loadgen.c aimd.c prof.c ckpt.c ${STREAMS_SRC} -o producer ${CODEC_LIBS}
+gcc ${GCC_OPTS} consumer.c metrics.c commit.c sink.c pipeline.c evloop.c e2e.c dedup.c lag.c prof.c hist.c compress.c agg.c ${STREAMS_SRC} -o consumer ${CODEC_LIBS}
+gcc ${GCC_OPTS} bench.c pacer.c hist.c ${STREAMS_SRC} -o bench
+gcc ${GCC_OPTS} streamstats.c metrics.c -o streamstats
+gcc ${GCC_OPTS} profstat.c -o profstat
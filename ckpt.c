@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "ckpt.h"
+
+#define CKPT_IDX_MAGIC 0x78646b63	/* "ckdx" */
+
+struct idx_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nsenders;
+	uint32_t step;
+};
+
+struct idx_entry {
+	uint32_t sender;
+	uint32_t pad;
+	uint64_t line;
+	uint64_t off;
+};
+
+static int
+index_append(struct ckpt_index *ix, uint64_t off)
+{
+	uint64_t *n;
+
+	if (ix->n == ix->cap) {
+		n = realloc(ix->off, (ix->cap ? ix->cap * 2 : 1024) *
+		    sizeof (*n));
+		if (n == NULL)
+			return (-1);
+		ix->off = n;
+		ix->cap = ix->cap ? ix->cap * 2 : 1024;
+	}
+	ix->off[ix->n++] = off;
+	return (EXIT_SUCCESS);
+}
+
+/* what the last run saved; entries past a gap or a torn write are cut */
+static int
+index_load(struct ckpt *c, FILE *f)
+{
+	struct idx_hdr h;
+	struct idx_entry e;
+	struct ckpt_index *ix;
+	long good = sizeof (h);
+
+	if (fread(&h, sizeof (h), 1, f) != 1 || h.magic != CKPT_IDX_MAGIC ||
+	    h.version != CKPT_VERSION || h.step != CKPT_STEP ||
+	    h.nsenders != (uint32_t)c->nsenders)
+		return (-1);
+	while (fread(&e, sizeof (e), 1, f) == 1) {
+		if (e.sender >= (uint32_t)c->nsenders)
+			break;
+		ix = &c->ix[e.sender];
+		if (e.line != ix->n * CKPT_STEP)
+			break;
+		if (EXIT_SUCCESS != index_append(ix, e.off))
+			return (-1);
+		ix->saved = ix->n;
+		good += sizeof (e);
+	}
+	if (ftruncate(fileno(f), good) != 0 || fseek(f, good, SEEK_SET) != 0)
+		return (-1);
+	return (EXIT_SUCCESS);
+}
+
+static int
+ckpt_load(struct ckpt *c, FILE *f)
+{
+	unsigned long long size, pos, nlines;
+	long long mtime;
+	int version, n, i;
+
+	if (fscanf(f, "streams-demo producer checkpoint %d\n", &version) != 1 ||
+	    version != CKPT_VERSION ||
+	    fscanf(f, "input %llu %lld\n", &size, &mtime) != 2 ||
+	    fscanf(f, "senders %d\n", &n) != 1 ||
+	    fscanf(f, "next_idx %ld\n", &c->next_idx) != 1) {
+		fprintf(stderr, "%s isn't a checkpoint\n", c->path);
+		return (-1);
+	}
+	if (size != c->size || mtime != c->mtime) {
+		fprintf(stderr, "the input has changed since %s was saved\n",
+		    c->path);
+		return (-1);
+	}
+	if (n != c->nsenders) {
+		fprintf(stderr, "%s is for -t %d\n", c->path, n);
+		return (-1);
+	}
+	while (fscanf(f, "sender %d %llu %llu\n", &i, &pos, &nlines) == 3) {
+		if (i < 0 || i >= n) {
+			fprintf(stderr, "%s isn't a checkpoint\n", c->path);
+			return (-1);
+		}
+		c->s[i].pos = pos;
+		c->s[i].nlines = nlines;
+	}
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Set up checkpointing to path for nsenders senders reading input,
+ * loading the checkpoint and index there if there are any.  *resumed
+ * says whether there were.
+ */
+int
+ckpt_open(struct ckpt *c, const char *path, const char *input,
+		int nsenders, int *resumed)
+{
+	char idxpath[sizeof (c->path) + 4];
+	struct idx_hdr h;
+	struct stat st;
+	FILE *f;
+
+	memset(c, 0, sizeof (*c));
+	snprintf(c->path, sizeof (c->path), "%s", path);
+	snprintf(c->tmppath, sizeof (c->tmppath), "%s.tmp", path);
+	snprintf(idxpath, sizeof (idxpath), "%s.idx", path);
+	if (stat(input, &st) != 0) {
+		perror(input);
+		return (-1);
+	}
+	c->size = st.st_size;
+	c->mtime = st.st_mtime;
+	c->nsenders = nsenders;
+	c->s = calloc(nsenders, sizeof (*c->s));
+	c->ix = calloc(nsenders, sizeof (*c->ix));
+	if (c->s == NULL || c->ix == NULL)
+		return (-1);
+	for (int i = 0; i < nsenders; i++)
+		pthread_mutex_init(&c->ix[i].lock, NULL);
+
+	*resumed = 0;
+	if ((f = fopen(path, "r")) != NULL) {
+		if (EXIT_SUCCESS != ckpt_load(c, f)) {
+			fclose(f);
+			return (-1);
+		}
+		fclose(f);
+		*resumed = 1;
+	} else if (errno != ENOENT) {
+		perror(path);
+		return (-1);
+	}
+
+	/* an index without its checkpoint is no use, start a new one */
+	if (*resumed && (c->idx = fopen(idxpath, "r+")) != NULL) {
+		if (EXIT_SUCCESS != index_load(c, c->idx)) {
+			fprintf(stderr, "can't use the index %s\n", idxpath);
+			return (-1);
+		}
+		return (EXIT_SUCCESS);
+	}
+	if ((c->idx = fopen(idxpath, "w+")) == NULL) {
+		perror(idxpath);
+		return (-1);
+	}
+	h.magic = CKPT_IDX_MAGIC;
+	h.version = CKPT_VERSION;
+	h.nsenders = nsenders;
+	h.step = CKPT_STEP;
+	if (fwrite(&h, sizeof (h), 1, c->idx) != 1) {
+		perror(idxpath);
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * A sender has reached line for the first time, at byte off.  Only
+ * every CKPT_STEP'th line is kept, and only if it's the next one.
+ */
+int
+ckpt_index_add(struct ckpt_index *ix, uint64_t line, uint64_t off)
+{
+	int ret_val = EXIT_SUCCESS;
+
+	pthread_mutex_lock(&ix->lock);
+	if (line == ix->n * CKPT_STEP)
+		ret_val = index_append(ix, off);
+	pthread_mutex_unlock(&ix->lock);
+	return (ret_val);
+}
+
+/*
+ * The nearest line at or before line that the index knows, and where
+ * it starts.  *off is left alone if there's none, line 0 is where the
+ * sender starts anyway.
+ */
+uint64_t
+ckpt_index_find(struct ckpt_index *ix, uint64_t line, uint64_t *off)
+{
+	uint64_t i = line / CKPT_STEP;
+
+	pthread_mutex_lock(&ix->lock);
+	if (ix->n == 0) {
+		pthread_mutex_unlock(&ix->lock);
+		return (0);
+	}
+	if (i >= ix->n)
+		i = ix->n - 1;
+	*off = ix->off[i];
+	pthread_mutex_unlock(&ix->lock);
+	return (i * CKPT_STEP);
+}
+
+/* the index first, so it always covers what the checkpoint points at */
+int
+ckpt_save(struct ckpt *c)
+{
+	struct ckpt_index *ix;
+	struct idx_entry e;
+	FILE *f;
+	int ret_val = EXIT_SUCCESS;
+
+	memset(&e, 0, sizeof (e));
+	for (int i = 0; i < c->nsenders && EXIT_SUCCESS == ret_val; i++) {
+		ix = &c->ix[i];
+		e.sender = i;
+		pthread_mutex_lock(&ix->lock);
+		for (; ix->saved < ix->n; ix->saved++) {
+			e.line = ix->saved * CKPT_STEP;
+			e.off = ix->off[ix->saved];
+			if (fwrite(&e, sizeof (e), 1, c->idx) != 1) {
+				ret_val = -1;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&ix->lock);
+	}
+	if (EXIT_SUCCESS != ret_val || fflush(c->idx) != 0 ||
+	    fdatasync(fileno(c->idx)) != 0)
+		return (-1);
+
+	if ((f = fopen(c->tmppath, "w")) == NULL)
+		return (-1);
+	fprintf(f, "streams-demo producer checkpoint %d\n", CKPT_VERSION);
+	fprintf(f, "input %llu %lld\n", (unsigned long long)c->size,
+	    (long long)c->mtime);
+	fprintf(f, "senders %d\n", c->nsenders);
+	fprintf(f, "next_idx %ld\n", c->next_idx);
+	for (int i = 0; i < c->nsenders; i++)
+		fprintf(f, "sender %d %llu %llu\n", i,
+		    (unsigned long long)c->s[i].pos,
+		    (unsigned long long)c->s[i].nlines);
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		fclose(f);
+		return (-1);
+	}
+	if (fclose(f) != 0 || rename(c->tmppath, c->path) != 0)
+		return (-1);
+	return (EXIT_SUCCESS);
+}
+
+void
+ckpt_close(struct ckpt *c)
+{
+	if (c->idx != NULL)
+		fclose(c->idx);
+	for (int i = 0; c->ix != NULL && i < c->nsenders; i++)
+		free(c->ix[i].off);
+	free(c->ix);
+	free(c->s);
+}
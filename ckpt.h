@@ -0,0 +1,84 @@
+#ifndef CKPT_H
+#define CKPT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Producer checkpoints
+ * --------------------
+ * With -c the producer saves, every CKPT_MS and when it finishes or
+ * gives up, where each sender has got to in the input counting only
+ * lines that have been acked, and starts from there next time instead
+ * of from line 1.
+ *
+ * A sender's place is a position, its pass through the input (-L) and
+ * a line number within its share of the file (-t), packed so positions
+ * compare in sending order.  Each in-flight record carries the position
+ * of its line (its first line, for a -B envelope); a sender's
+ * checkpoint is the lowest position it has handed out that isn't acked
+ * yet, so acks that come back out of order, retries and open envelopes
+ * hold it back.  Records dropped after their last retry count as done.
+ *
+ * Positions are line numbers, so that sending only has to store one
+ * number per record.  To get from a line number back to a byte offset,
+ * each sender also keeps a sparse index of its lines: where every
+ * CKPT_STEP'th one starts, noted as it reads them the first time
+ * through.  The index is appended to <checkpoint>.idx before each
+ * checkpoint is written, so on restart a sender seeks to the nearest
+ * entry and skips less than CKPT_STEP lines, however far into the file
+ * it was.  The checkpoint itself is a few lines of text, replaced with
+ * a rename.
+ *
+ * A checkpoint is only good for the same input and the same -t; the
+ * producer won't start from one that doesn't match.  Delete it (and
+ * its .idx) to start again from the top.
+ */
+
+#define CKPT_MS 1000
+#define CKPT_STEP 1024
+#define CKPT_VERSION 1
+
+#define CKPT_LINE_BITS 40
+#define CKPT_POS(pass, line) \
+	(((uint64_t)(pass) << CKPT_LINE_BITS) | (uint64_t)(line))
+#define CKPT_PASS(pos) ((pos) >> CKPT_LINE_BITS)
+#define CKPT_LINE(pos) ((pos) & ((1ULL << CKPT_LINE_BITS) - 1))
+
+/* one sender's sparse index, off[i] is where line i * CKPT_STEP starts */
+struct ckpt_index {
+	pthread_mutex_t lock;
+	uint64_t *off;
+	size_t n;
+	size_t cap;
+	size_t saved;		/* entries in the file already */
+};
+
+/* a sender's place, as saved or loaded */
+struct ckpt_sender {
+	uint64_t pos;		/* first line not acked */
+	uint64_t nlines;	/* lines in a pass, 0 until it's done one */
+};
+
+struct ckpt {
+	char path[4096];
+	char tmppath[4096 + 8];
+	FILE *idx;
+	uint64_t size;		/* of the input, to check it's the same one */
+	int64_t mtime;
+	int nsenders;
+	long next_idx;		/* msg_idx to start from */
+	struct ckpt_sender *s;
+	struct ckpt_index *ix;
+};
+
+int ckpt_open(struct ckpt *c, const char *path, const char *input,
+    int nsenders, int *resumed);
+int ckpt_index_add(struct ckpt_index *ix, uint64_t line, uint64_t off);
+uint64_t ckpt_index_find(struct ckpt_index *ix, uint64_t line,
+    uint64_t *off);
+int ckpt_save(struct ckpt *c);
+void ckpt_close(struct ckpt *c);
+
+#endif /* CKPT_H */
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "commit.h"
+
+/* carried through commit_all_async() so the callback can time it */
+struct commit_ctx {
+	struct commit_policy *cp;
+	uint64_t start_ns;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+commit_done(struct commit_policy *cp, int32_t err, uint64_t start_ns)
+{
+	uint64_t us = (now_ns() - start_ns) / 1000;
+	uint64_t max;
+
+	if (err != 0)
+		__atomic_fetch_add(&cp->failures, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cp->commits, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cp->lat_total_us, us, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&cp->lat_max_us, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&cp->lat_max_us,
+	    &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void
+commit_cb(int32_t err, streams_topic_partition_t *topic_partitions,
+		int64_t *offsets, uint32_t num_partitions, void *ctx)
+{
+	struct commit_ctx *cc = ctx;
+
+	(void) topic_partitions;
+	(void) offsets;
+	(void) num_partitions;
+	commit_done(cc->cp, err, cc->start_ns);
+	free(cc);
+}
+
+int
+commit_parse(struct commit_policy *cp, const char *spec)
+{
+	char buf[64], *tok, *save;
+
+	memset(cp, 0, sizeof (*cp));
+	cp->trigger = COMMIT_POLL;
+	if (spec == NULL)
+		return (EXIT_SUCCESS);
+
+	snprintf(buf, sizeof (buf), "%s", spec);
+	for (tok = strtok_r(buf, ",", &save); tok != NULL;
+	    tok = strtok_r(NULL, ",", &save)) {
+		if (strcmp(tok, "poll") == 0) {
+			cp->trigger = COMMIT_POLL;
+		} else if (strncmp(tok, "n:", 2) == 0) {
+			cp->trigger = COMMIT_COUNT;
+			cp->every_n = atol(tok + 2);
+			if (cp->every_n <= 0)
+				return (-1);
+		} else if (strncmp(tok, "ms:", 3) == 0) {
+			cp->trigger = COMMIT_TIME;
+			cp->every_ms = atol(tok + 3);
+			if (cp->every_ms <= 0)
+				return (-1);
+		} else if (strcmp(tok, "shutdown") == 0) {
+			cp->trigger = COMMIT_SHUTDOWN;
+		} else if (strcmp(tok, "async") == 0) {
+			cp->async = 1;
+		} else {
+			return (-1);
+		}
+	}
+	cp->last_ns = now_ns();
+	return (EXIT_SUCCESS);
+}
+
+/* always synchronous, for failover and shutdown */
+int
+commit_now(struct commit_policy *cp, streams_consumer_t consumer)
+{
+	uint64_t start = now_ns();
+	int ret_val;
+
+	ret_val = streams_consumer_commit_all_sync(consumer);
+	commit_done(cp, ret_val, start);
+	cp->pending = 0;
+	cp->last_ns = start;
+	return (ret_val);
+}
+
+/*
+ * Whether it's time to commit after a poll of nmsgs messages.  Worked
+ * out once per poll and handed to commit_maybe(), so a caller that
+ * processes messages elsewhere can finish them first on the same
+ * answer; a time trigger could come due in between two checks.
+ */
+int
+commit_due(struct commit_policy *cp, uint32_t nmsgs)
+{
+	if (cp->pending + nmsgs == 0)
+		return (0);
+
+	switch (cp->trigger) {
+	case COMMIT_POLL:
+		return (nmsgs > 0);
+	case COMMIT_COUNT:
+		return (cp->pending + nmsgs >= (unsigned long)cp->every_n);
+	case COMMIT_TIME:
+		return (now_ns() - cp->last_ns >=
+		    (uint64_t)cp->every_ms * 1000000);
+	default:
+		return (0);
+	}
+}
+
+/*
+ * Called after each poll, once its nmsgs messages have been processed.
+ * Commits if due, what commit_due() said for this poll.
+ */
+int
+commit_maybe(struct commit_policy *cp, streams_consumer_t consumer,
+		uint32_t nmsgs, int due)
+{
+	struct commit_ctx *cc;
+	uint64_t now;
+	int ret_val;
+
+	cp->pending += nmsgs;
+	if (!due)
+		return (EXIT_SUCCESS);
+
+	if (!cp->async)
+		return (commit_now(cp, consumer));
+
+	cc = malloc(sizeof (*cc));
+	if (cc == NULL)
+		return (commit_now(cp, consumer));
+	cc->cp = cp;
+	cc->start_ns = now = now_ns();
+
+	/* cc belongs to the callback from here on, it may already be gone */
+	ret_val = streams_consumer_commit_all_async(consumer, commit_cb, cc);
+	if (ret_val != 0) {
+		commit_done(cp, ret_val, now);
+		free(cc);
+		return (ret_val);
+	}
+	cp->pending = 0;
+	cp->last_ns = now;
+	return (EXIT_SUCCESS);
+}
+
+void
+commit_get_stats(struct commit_policy *cp, struct commit_stats *st)
+{
+	st->commits = __atomic_load_n(&cp->commits, __ATOMIC_RELAXED);
+	st->failures = __atomic_load_n(&cp->failures, __ATOMIC_RELAXED);
+	st->lat_max_us = __atomic_load_n(&cp->lat_max_us, __ATOMIC_RELAXED);
+	st->lat_avg_us = st->commits == 0 ? 0 :
+	    __atomic_load_n(&cp->lat_total_us, __ATOMIC_RELAXED) / st->commits;
+}
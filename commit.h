@@ -0,0 +1,72 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdint.h>
+#include <streams/streams.h>
+
+/*
+ * Consumer offset commit policy
+ * -----------------------------
+ * Decides when the consumer commits what it has read.  A policy is a
+ * trigger plus an optional async flag, written as e.g. "poll",
+ * "n:5000", "ms:500", "shutdown" or "n:5000,async":
+ *
+ *   poll      commit after every poll that returned messages (default)
+ *   n:N       commit once N messages have been processed
+ *   ms:T      commit once T milliseconds have passed since the last one
+ *   shutdown  only commit on failover or shutdown
+ *   async     use commit_all_async() with a completion callback instead
+ *             of waiting for the commit round trip
+ *
+ * Messages are always processed before the commit that covers them,
+ * so delivery stays at-least-once whatever the policy.  After a crash
+ * the messages redelivered are those processed since the last commit
+ * that completed:
+ *
+ *   poll      at most one poll's worth
+ *   n:N       fewer than N messages (plus the rest of the poll batch
+ *             that crossed N)
+ *   ms:T      about T ms of traffic, plus up to one poll timeout if
+ *             the stream went idle right after a batch
+ *   shutdown  everything since the consumer was started or failed over
+ *
+ * With async, add whatever was covered by the one commit still in
+ * flight when the process died.
+ */
+
+#define COMMIT_POLL 0
+#define COMMIT_COUNT 1
+#define COMMIT_TIME 2
+#define COMMIT_SHUTDOWN 3
+
+struct commit_policy {
+	int trigger;
+	int async;
+	long every_n;
+	long every_ms;
+
+	unsigned long pending;	/* processed since the last commit */
+	uint64_t last_ns;	/* when the last commit was started */
+
+	/* stats, updated from the async callback too */
+	unsigned long commits;
+	unsigned long failures;
+	uint64_t lat_total_us;
+	uint64_t lat_max_us;
+};
+
+struct commit_stats {
+	unsigned long commits;
+	unsigned long failures;
+	uint64_t lat_avg_us;
+	uint64_t lat_max_us;
+};
+
+int commit_parse(struct commit_policy *cp, const char *spec);
+int commit_due(struct commit_policy *cp, uint32_t nmsgs);
+int commit_maybe(struct commit_policy *cp, streams_consumer_t consumer,
+    uint32_t nmsgs, int due);
+int commit_now(struct commit_policy *cp, streams_consumer_t consumer);
+void commit_get_stats(struct commit_policy *cp, struct commit_stats *st);
+
+#endif /* COMMIT_H */
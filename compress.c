@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#include "compress.h"
+
+#define Z_DEFAULT_ZSTD_LEVEL 3
+
+static uint64_t
+cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+z_count(struct zstats *st, size_t in, size_t out, uint64_t ns)
+{
+	__atomic_fetch_add(&st->in_bytes, in, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->out_bytes, out, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->cpu_ns, ns, __ATOMIC_RELAXED);
+}
+
+/* "lz4" or "zstd[,level]", -1 if unknown or not built in */
+int
+z_parse(struct zcodec *zc, const char *spec)
+{
+	memset(zc, 0, sizeof (*zc));
+#ifdef HAVE_LZ4
+	if (strcmp(spec, "lz4") == 0) {
+		zc->codec = Z_LZ4;
+		return (EXIT_SUCCESS);
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (strncmp(spec, "zstd", 4) == 0 &&
+	    (spec[4] == '\0' || spec[4] == ',')) {
+		zc->codec = Z_ZSTD;
+		zc->level = spec[4] == ',' ? atoi(spec + 5) :
+		    Z_DEFAULT_ZSTD_LEVEL;
+		return (EXIT_SUCCESS);
+	}
+#endif
+	(void) spec;
+	return (-1);
+}
+
+const char *
+z_name(int codec)
+{
+	switch (codec) {
+	case Z_LZ4:
+		return ("lz4");
+	case Z_ZSTD:
+		return ("zstd");
+	default:
+		return ("none");
+	}
+}
+
+/* a zstd dictionary for compressing and decompressing */
+int
+z_load_dict(struct zcodec *zc, const char *path)
+{
+#ifdef HAVE_ZSTD
+	FILE *f;
+	char *buf;
+	long size;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return (-1);
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 ||
+	    fseek(f, 0, SEEK_SET) != 0 || (buf = malloc(size)) == NULL) {
+		fclose(f);
+		return (-1);
+	}
+	if (fread(buf, 1, size, f) != (size_t)size) {
+		free(buf);
+		fclose(f);
+		return (-1);
+	}
+	fclose(f);
+
+	zc->cdict = ZSTD_createCDict(buf, size, zc->level > 0 ? zc->level :
+	    Z_DEFAULT_ZSTD_LEVEL);
+	zc->ddict = ZSTD_createDDict(buf, size);
+	zc->dict_id = ZSTD_getDictID_fromDict(buf, size);
+	free(buf);
+	if (zc->cdict == NULL || zc->ddict == NULL)
+		return (-1);
+	return (EXIT_SUCCESS);
+#else
+	(void) zc;
+	(void) path;
+	return (-1);
+#endif
+}
+
+/* train a zstd dictionary on sample lines, returns its size or 0 */
+size_t
+z_train(void *dict, size_t cap, const void *samples, const size_t *sizes,
+		unsigned nsamples)
+{
+#ifdef HAVE_ZSTD
+	size_t n = ZDICT_trainFromBuffer(dict, cap, samples, sizes, nsamples);
+
+	if (ZDICT_isError(n)) {
+		fprintf(stderr, "dictionary training failed: %s\n",
+		    ZDICT_getErrorName(n));
+		return (0);
+	}
+	return (n);
+#else
+	(void) dict;
+	(void) cap;
+	(void) samples;
+	(void) sizes;
+	(void) nsamples;
+	return (0);
+#endif
+}
+
+int
+z_ctx_init(struct zctx *z)
+{
+	memset(z, 0, sizeof (*z));
+#ifdef HAVE_ZSTD
+	z->cctx = ZSTD_createCCtx();
+	z->dctx = ZSTD_createDCtx();
+	if (z->cctx == NULL || z->dctx == NULL) {
+		z_ctx_free(z);
+		return (-1);
+	}
+#endif
+	return (EXIT_SUCCESS);
+}
+
+void
+z_ctx_free(struct zctx *z)
+{
+#ifdef HAVE_ZSTD
+	if (z->cctx != NULL)
+		ZSTD_freeCCtx(z->cctx);
+	if (z->dctx != NULL)
+		ZSTD_freeDCtx(z->dctx);
+#endif
+	free(z->buf);
+	memset(z, 0, sizeof (*z));
+}
+
+/* most z_compress() can write for len bytes in */
+size_t
+z_bound(const struct zcodec *zc, size_t len)
+{
+	switch (zc->codec) {
+#ifdef HAVE_LZ4
+	case Z_LZ4:
+		return (Z_HDR_LEN + LZ4_compressBound(len));
+#endif
+#ifdef HAVE_ZSTD
+	case Z_ZSTD:
+		return (Z_HDR_LEN + ZSTD_compressBound(len));
+#endif
+	default:
+		return (Z_HDR_LEN + len);
+	}
+}
+
+/*
+ * Compress len bytes at src into dst, header and all.  Returns the
+ * length, or 0 if the value is better sent as it is.
+ */
+size_t
+z_compress(const struct zcodec *zc, struct zctx *z, void *dst, size_t cap,
+		const void *src, size_t len, struct zstats *st)
+{
+	unsigned char *p = dst;
+	uint64_t start = cpu_ns();
+	size_t n = 0;
+
+	(void) z;
+	(void) src;
+	if (len > Z_MAX_RAW || cap <= Z_HDR_LEN)
+		return (0);
+	switch (zc->codec) {
+#ifdef HAVE_LZ4
+	case Z_LZ4:
+		n = LZ4_compress_default(src, (char *)p + Z_HDR_LEN, len,
+		    cap - Z_HDR_LEN);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case Z_ZSTD:
+		if (zc->cdict != NULL)
+			n = ZSTD_compress_usingCDict(z->cctx, p + Z_HDR_LEN,
+			    cap - Z_HDR_LEN, src, len, zc->cdict);
+		else
+			n = ZSTD_compressCCtx(z->cctx, p + Z_HDR_LEN,
+			    cap - Z_HDR_LEN, src, len, zc->level);
+		if (ZSTD_isError(n))
+			n = 0;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	/* not worth it, the value goes as it is */
+	if (n == 0 || Z_HDR_LEN + n >= len) {
+		z_count(st, len, len, cpu_ns() - start);
+		return (0);
+	}
+	p[0] = Z_MAGIC0;
+	p[1] = Z_MAGIC1;
+	p[2] = Z_VERSION;
+	p[3] = zc->codec;
+	p[4] = len;
+	p[5] = len >> 8;
+	p[6] = len >> 16;
+	p[7] = len >> 24;
+	z_count(st, len, Z_HDR_LEN + n, cpu_ns() - start);
+	return (Z_HDR_LEN + n);
+}
+
+/*
+ * Inflate a value z_is_compressed() said yes to.  The result is in the
+ * context's buffer, good until its next call.
+ */
+int
+z_decompress(const struct zcodec *zc, struct zctx *z, const void *src,
+		size_t len, const char **out, uint32_t *outlen,
+		struct zstats *st)
+{
+	const unsigned char *p = src;
+	uint64_t start = cpu_ns();
+	uint32_t raw;
+	size_t n = 0;
+	int ok = 0;
+
+	(void) zc;
+	raw = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+	if (raw > Z_MAX_RAW)
+		goto fail;
+	if (z->cap < raw) {
+		free(z->buf);
+		z->cap = 0;
+		if ((z->buf = malloc(raw)) == NULL)
+			goto fail;
+		z->cap = raw;
+	}
+	switch (p[3]) {
+#ifdef HAVE_LZ4
+	case Z_LZ4:
+		ok = LZ4_decompress_safe((const char *)p + Z_HDR_LEN, z->buf,
+		    len - Z_HDR_LEN, raw) == (int)raw;
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case Z_ZSTD:
+		/* zstd looks up the dictionary id in the frame itself */
+		if (zc->ddict != NULL)
+			n = ZSTD_decompress_usingDDict(z->dctx, z->buf, raw,
+			    p + Z_HDR_LEN, len - Z_HDR_LEN, zc->ddict);
+		else
+			n = ZSTD_decompressDCtx(z->dctx, z->buf, raw,
+			    p + Z_HDR_LEN, len - Z_HDR_LEN);
+		ok = !ZSTD_isError(n) && n == raw;
+		break;
+#endif
+	default:
+		break;
+	}
+	(void) n;
+	if (!ok)
+		goto fail;
+	z_count(st, len, raw, cpu_ns() - start);
+	*out = z->buf;
+	*outlen = raw;
+	return (EXIT_SUCCESS);
+fail:
+	__atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+	return (-1);
+}
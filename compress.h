@@ -0,0 +1,94 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Value compression
+ * -----------------
+ * With -Z the producer compresses each record's value, an envelope
+ * (-B) as a whole, and wraps it in a small header the consumer looks
+ * for:
+ *
+ *   0   2 bytes  magic, 0xe2 0x5a
+ *   2   1 byte   version
+ *   3   1 byte   codec, Z_LZ4 or Z_ZSTD
+ *   4   4 bytes  uncompressed length, little-endian
+ *   8            the codec's output
+ *
+ * LZ4 is for speed.  zstd trades CPU for ratio, and with a dictionary
+ * trained on a sample of the input (-D) it does well even on single
+ * short lines, since the field names and structure that repeat on
+ * every line are in the dictionary rather than in each record.  The
+ * consumer has to be given the same dictionary file.
+ *
+ * The codecs are only there when built with HAVE_LZ4 / HAVE_ZSTD
+ * (build.sh turns them on when it finds the headers).  A value that
+ * doesn't compress to less than it was is sent as is.
+ */
+
+#define Z_NONE 0
+#define Z_LZ4 1
+#define Z_ZSTD 2
+
+#define Z_HDR_LEN 8
+#define Z_MAGIC0 0xe2
+#define Z_MAGIC1 0x5a
+#define Z_VERSION 1
+
+/* biggest value we'll inflate, anything claiming more is corrupt */
+#define Z_MAX_RAW (64U * 1024 * 1024)
+
+/* zstd dictionary size, and how much input to train it on */
+#define Z_DICT_MAX (64 * 1024)
+#define Z_TRAIN_MAX (8 * 1024 * 1024)
+
+/* what to compress with, shared by every thread */
+struct zcodec {
+	int codec;
+	int level;
+	void *cdict;		/* zstd with -D */
+	void *ddict;
+	unsigned dict_id;
+};
+
+/* per-thread codec state */
+struct zctx {
+	void *cctx;
+	void *dctx;
+	char *buf;		/* z_decompress() output */
+	size_t cap;
+};
+
+/* running totals, for the ratio and CPU time metrics */
+struct zstats {
+	unsigned long in_bytes;
+	unsigned long out_bytes;
+	unsigned long cpu_ns;
+	unsigned long errors;
+};
+
+int z_parse(struct zcodec *zc, const char *spec);
+const char *z_name(int codec);
+int z_load_dict(struct zcodec *zc, const char *path);
+size_t z_train(void *dict, size_t cap, const void *samples,
+    const size_t *sizes, unsigned nsamples);
+int z_ctx_init(struct zctx *z);
+void z_ctx_free(struct zctx *z);
+size_t z_bound(const struct zcodec *zc, size_t len);
+size_t z_compress(const struct zcodec *zc, struct zctx *z, void *dst,
+    size_t cap, const void *src, size_t len, struct zstats *st);
+int z_decompress(const struct zcodec *zc, struct zctx *z, const void *src,
+    size_t len, const char **out, uint32_t *outlen, struct zstats *st);
+
+static inline int
+z_is_compressed(const void *val, size_t len)
+{
+	const unsigned char *p = val;
+
+	return (len >= Z_HDR_LEN && p[0] == Z_MAGIC0 && p[1] == Z_MAGIC1 &&
+	    p[2] == Z_VERSION);
+}
+
+#endif /* COMPRESS_H */
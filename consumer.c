@@ -3,15 +3,102 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
 #include <streams/streams.h>
-#include <sys/time.h>
+#include <time.h>
+#include "metrics.h"
+#include "commit.h"
+#include "sink.h"
+#include "pipeline.h"
+#include "evloop.h"
+#include "e2e.h"
+#include "envelope.h"
+#include "compress.h"
+#include "agg.h"
+#include "dedup.h"
+#include "lag.h"
+#include "prof.h"
 
 int debug_on = 0;
 int inf_on = 1;
 char *consname;
 
-#define FAIL_OVER_CODE 999
-#define FAIL_BACK_CODE 998
+/* when to commit offsets, see commit.h; each instance has a copy */
+struct commit_policy cpolicy;
+
+/*
+ * the consumer group, and how many members of it we run (-g, -n).
+ * Aggregates and dedup windows aren't kept by partition, so they can't
+ * follow one that's revoked to another process; neither goes with -g.
+ */
+const char *group_id = "1";
+int group_set = 0;
+int ninstances = 1;
+
+/* where consumed values go, see sink.h */
+struct sink *out;
+
+/*
+ * worker threads when pipelined (-w), per instance, see pipeline.h.
+ * Output from the workers, or from several instances, goes under
+ * out_lock.
+ */
+int nworkers = 0;
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* produce-to-consume latency and sequence checks, see e2e.h */
+struct e2e e2e;
+
+/* drop messages seen already (-d), see dedup.h */
+struct dedup dedup;
+int dedup_on = 0;
+
+/* how far behind each partition we hold is, see lag.h */
+struct lag lag;
+
+/* records that turned out to be envelopes of several messages (-B) */
+unsigned long n_envelopes;
+
+/*
+ * Compressed values (producer -Z) are inflated on the poll thread into
+ * its instance's buffer, see compress.h.  zcodec only has the
+ * dictionary (-D).
+ */
+struct zcodec zcodec;
+struct zstats zstats;
+
+/* windowed aggregates instead of every value (-A), see agg.h */
+struct agg aggstate;
+struct agg *agg;
+
+/* keep the other cluster's consumer subscribed and ready (-H) */
+int hot_standby = 0;
+
+/*
+ * Read both clusters at once (-X), for a producer sending every record
+ * to both.  Each member of the group (-n) has a twin on the backup
+ * topics, and -d drops whichever copy of a record comes second.
+ */
+int active_active = 0;
+static const char *const cluster_name[] = { "primary", "backup" };
+
+/* -T stages, see prof.h */
+int profiling = 0;
+#define PROF_POLL 0
+#define PROF_EXTRACT 1
+#define PROF_OUTPUT 2
+#define PROF_FLUSH 3
+#define PROF_COMMIT 4
+static const char *const prof_stages[] = {
+	"poll", "extract", "output", "flush", "commit"
+};
+
+/* how long a poll may block, bounds how late a failover is acted on */
+#define CONS_POLL_MS 100
+
+/* how often the control loop reports the consume rate */
+#define REPORT_MS 1000
 
 /* debug messages */
 #define DPRINTF(...) if (debug_on) { fprintf(stderr, __VA_ARGS__); }
@@ -19,9 +106,6 @@ char *consname;
 /* informational during normal operation */
 #define IPRINTF(...) if (inf_on) { fprintf(stderr, __VA_ARGS__); }
 
-/* path to the python script that sends metrics to opentsdb */
-#define METRIC_SENDER_PATH "/home/mapr/msend.py"
-
 /*
  * Utility Functions
  * -----------------
@@ -30,76 +114,327 @@ char *consname;
 int
 send_metrics(const char *cur, const char *primary, const char *backup, int newrate)
 {
-	char namebuf1[100], namebuf2[100];
-	int ret_val;
+	char namebuf1[METRICS_NAME_MAX], namebuf2[METRICS_NAME_MAX];
 
 	if (cur == primary) {
-		snprintf(namebuf1, 100, "%s consumer_%s.primary_rate %d", 
-			METRIC_SENDER_PATH, consname, newrate);
-		snprintf(namebuf2, 100, "%s consumer_%s.backup_rate 0", 
-			METRIC_SENDER_PATH, consname);
+		snprintf(namebuf1, sizeof (namebuf1),
+		    "consumer_%s.primary_rate", consname);
+		snprintf(namebuf2, sizeof (namebuf2),
+		    "consumer_%s.backup_rate", consname);
 	} else {
-		snprintf(namebuf1, 100, "%s consumer_%s.backup_rate %d",
-				METRIC_SENDER_PATH, consname, newrate);
-		snprintf(namebuf2, 100, "%s consumer_%s.primary_rate 0",
-				METRIC_SENDER_PATH, consname);
+		snprintf(namebuf1, sizeof (namebuf1),
+		    "consumer_%s.backup_rate", consname);
+		snprintf(namebuf2, sizeof (namebuf2),
+		    "consumer_%s.primary_rate", consname);
 	}
-	ret_val = system(namebuf1);
-	if (ret_val < 0) {
-		IPRINTF("system() metric sender failed\n");
-		return (ret_val);
+
+	/* just queues the samples, the emitter thread does the network i/o */
+	metrics_put(namebuf1, newrate);
+	metrics_put(namebuf2, 0);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Commit counts and latency, to see what the commit policy costs.  All
+ * instances together.
+ */
+void
+send_commit_metrics(const struct commit_stats *st)
+{
+	char namebuf[METRICS_NAME_MAX];
+
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.commits", consname);
+	metrics_put(namebuf, st->commits);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.commit_failures",
+	    consname);
+	metrics_put(namebuf, st->failures);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.commit_avg_us",
+	    consname);
+	metrics_put(namebuf, st->lat_avg_us);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.commit_max_us",
+	    consname);
+	metrics_put(namebuf, st->lat_max_us);
+}
+
+/*
+ * End-to-end latency per topic and per cluster over the last interval,
+ * and the sequence check counts (running totals).
+ */
+void
+send_e2e_metrics(void)
+{
+	static struct hist snap;
+	struct e2e_stats st;
+	char namebuf[METRICS_NAME_MAX];
+	char tname[64];
+	static const char *cname[] = { "primary", "backup" };
+
+	e2e_get_stats(&e2e, &st);
+	if (st.headers == 0)
+		return;
+
+	for (int i = 0; i < e2e.ntopics; i++) {
+		/* "/stream:topic" isn't a usable metric path */
+		snprintf(tname, sizeof (tname), "%s", e2e.topics[i].name +
+		    (e2e.topics[i].name[0] == '/'));
+		for (char *p = tname; *p != '\0'; p++)
+			if (*p == '/' || *p == ':' || *p == '.')
+				*p = '_';
+		hist_snapshot(&e2e.topics[i].lat, &snap);
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e.%s.p50_us",
+		    consname, tname);
+		metrics_put(namebuf, hist_percentile(&snap, 50));
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e.%s.p99_us",
+		    consname, tname);
+		metrics_put(namebuf, hist_percentile(&snap, 99));
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e.%s.p999_us",
+		    consname, tname);
+		metrics_put(namebuf, hist_percentile(&snap, 99.9));
 	}
-	ret_val = system(namebuf2);
-	if (ret_val < 0) {
-		IPRINTF("system() metric sender failed\n");
-		return (ret_val);
+	for (int c = E2E_PRIMARY; c <= E2E_BACKUP; c++) {
+		hist_snapshot(&e2e.cluster[c], &snap);
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e_%s_p50_us",
+		    consname, cname[c]);
+		metrics_put(namebuf, hist_percentile(&snap, 50));
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e_%s_p99_us",
+		    consname, cname[c]);
+		metrics_put(namebuf, hist_percentile(&snap, 99));
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e_%s_max_us",
+		    consname, cname[c]);
+		metrics_put(namebuf, snap.max);
 	}
-	return (EXIT_SUCCESS);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.seq_gaps", consname);
+	metrics_put(namebuf, st.gaps);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.seq_reorders",
+	    consname);
+	metrics_put(namebuf, st.reorders);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.seq_dups", consname);
+	metrics_put(namebuf, st.dups);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.e2e_skewed",
+	    consname);
+	metrics_put(namebuf, st.skewed);
 }
 
-long
-tvdiff(struct timeval *stime, struct timeval *etime)
+/* consume_msg() says a message is a duplicate and isn't to be output */
+#define MSG_DROP UINT32_MAX
+
+/*
+ * Per-message work, returns the length of the value to output or
+ * MSG_DROP.  Runs on the poll thread, or on a worker thread when
+ * pipelined.
+ */
+uint32_t
+consume_msg(const char *topic, const char *key, uint32_t klen,
+		const char *val, uint32_t vlen)
+{
+	size_t hlen;
+
+	/* a stamped record's header is ours, not part of the key */
+	hlen = e2e_record(&e2e, topic, key, klen);
+	if (dedup_on && dedup_check(&dedup, topic, key, klen))
+		return (MSG_DROP);
+	key += hlen;
+	klen -= hlen;
+
+	/*
+	 * write by length, values from a mapped producer (-m) are not
+	 * NUL-terminated and the copying one sends the NUL along
+	 */
+	if (vlen > 0 && val[vlen - 1] == '\0')
+		vlen--;
+	DPRINTF("Consumed: (Key: %.*s Value: %.*s )\n",
+	    (int)klen, key, (int)vlen, val);
+	return (vlen);
+}
+
+/*
+ * Worker side of the pipeline.  The messages are worked on in
+ * parallel, only the output is serialized, a batch at a time so a
+ * partition's messages come out in order.
+ */
+void
+process_batch(struct pl_batch *b, int worker, void *arg)
+{
+	unsigned long *wins = arg;	/* the instance's, see deliver() */
+	uint64_t t0;
+
+	(void) worker;
+
+	for (uint32_t i = 0; i < b->count; i++) {
+		b->msgs[i].vlen = consume_msg(b->topic, pl_key(b, i),
+		    b->msgs[i].klen, pl_value(b, i), b->msgs[i].vlen);
+		if (active_active && b->msgs[i].vlen != MSG_DROP)
+			__atomic_fetch_add(wins, 1, __ATOMIC_RELAXED);
+	}
+
+	/* a batch's writes and flush, waiting for the lock included */
+	t0 = prof_now();
+	pthread_mutex_lock(&out_lock);
+	for (uint32_t i = 0; i < b->count; i++) {
+		if (b->msgs[i].vlen == MSG_DROP)
+			continue;
+		if (0 != sink_write(out, pl_value(b, i), b->msgs[i].vlen)) {
+			DPRINTF("sink write failed\n");
+			break;
+		}
+	}
+	/* the batch's arena is reused once we return */
+	if (0 != sink_flush(out)) {
+		DPRINTF("sink flush failed\n");
+	}
+	pthread_mutex_unlock(&out_lock);
+	prof_end(PROF_FLUSH, t0);
+}
+
+struct consstate;
+
+/*
+ * One member of the consumer group (-n), with its own consumers and
+ * poll thread.  Only the poll thread touches the consumer handles, the
+ * control loop asks it to fail over or flush through switch_to and
+ * flush_req.
+ */
+struct consinst {
+	struct consstate *cs;
+	int id;
+	int side;		/* -X: the cluster we read, 1 for the backup */
+	const char *cur_topic;
+	streams_config_t config;
+	streams_consumer_t consumer;
+
+	/* the other cluster's consumer, subscribed but not polled, with -H */
+	streams_config_t sb_config;
+	streams_consumer_t sb_consumer;
+
+	struct commit_policy cpolicy;
+	struct pipeline *pl;	/* with -w */
+	struct zctx zpoll;
+	pthread_t poller;
+
+	unsigned long tot;	/* messages consumed */
+	unsigned long wins;	/* -X: ones our copy of got here first */
+	int switch_to;		/* CMD_FAILOVER or CMD_FAILBACK, or 0 */
+	int flush_req;
+
+	/* partitions the group gave us, see on_revoked() */
+	int nparts, sb_nparts;
+	unsigned long rebalances;
+	uint64_t rebalance_us;	/* longest since the last report */
+	unsigned long last_tot;
+};
+
+/* State shared by the poll threads and the control loop. */
+struct consstate {
+	const char *primary, *primary2;
+	const char *backup, *backup2;
+	struct consinst *inst;
+	int ninst;
+	int stop;
+	int error;
+
+	/* control loop, see evloop.h */
+	struct evloop ev;
+	int pipe_fd;
+	struct cmdbuf cmdbuf;
+	uint64_t last_report;
+	unsigned long last_tot;
+	unsigned long last_side[2], last_wins[2];	/* -X */
+};
+
+static uint64_t
+now_ns(void)
 {
-	long diffmsec;
+	struct timespec ts;
 
-	diffmsec = (etime->tv_sec-stime->tv_sec) * 1000;
-	diffmsec += (etime->tv_usec-stime->tv_usec) / 1000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* -A windows are cut on the wall clock */
+static uint64_t
+wall_ms(void)
+{
+	struct timespec ts;
 
-	return (diffmsec);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
 
+/* poll thread: get everything processed, written and committed */
 int
-is_pipe_ready(int fd)
+flush_all(struct consinst *ci)
 {
-	int rc;
-	fd_set fds;
-	struct timeval tv;
+	if (ci->pl != NULL)
+		pipeline_drain(ci->pl);
+	pthread_mutex_lock(&out_lock);
+	if (0 != sink_flush(out)) {
+		DPRINTF("sink flush failed\n");
+	}
+	pthread_mutex_unlock(&out_lock);
+	return (commit_now(&ci->cpolicy, ci->consumer));
+}
 
-	FD_ZERO(&fds);
-	FD_SET(fd,&fds);
+/*
+ * Poll thread, from within the poll: the group is moving partitions
+ * away from us.  Everything read from them is finished, written out
+ * and committed before they go, so the next owner starts exactly where
+ * we stopped.  How long that takes is how long the handoff holds up
+ * those partitions.
+ */
+static void
+on_revoked(streams_topic_partition_t *tps, uint32_t n, void *ctx)
+{
+	struct consinst *ci = ctx;
+	uint64_t start = now_ns(), us;
+
+	if (0 != flush_all(ci)) {
+		DPRINTF("error committing revoked partitions\n");
+	}
+	for (uint32_t i = 0; i < n; i++)
+		lag_revoked(&lag, tps[i]);
+	us = (now_ns() - start) / 1000;
+	if (us > __atomic_load_n(&ci->rebalance_us, __ATOMIC_RELAXED))
+		__atomic_store_n(&ci->rebalance_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ci->rebalances, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&ci->nparts, n, __ATOMIC_RELAXED);
+	DPRINTF("instance %d: %u partitions revoked in %luus\n", ci->id, n,
+	    (unsigned long)us);
+}
 
-	tv.tv_sec = tv.tv_usec = 0;
-	rc = select(fd+1, &fds, NULL, NULL, &tv);
-	if (rc < 0)
-		return -1;
+/* the group gave us partitions, they start from its committed offsets */
+static void
+on_assigned(streams_topic_partition_t *tps, uint32_t n, void *ctx)
+{
+	struct consinst *ci = ctx;
+	int64_t pos;
 
-	return FD_ISSET(fd, &fds) ? 1 : 0;
+	for (uint32_t i = 0; i < n; i++) {
+		if (streams_consumer_get_position(ci->consumer, tps[i],
+		    &pos) != EXIT_SUCCESS)
+			pos = -1;
+		lag_assigned(&lag, tps[i], pos);
+	}
+	__atomic_fetch_add(&ci->rebalances, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ci->nparts, n, __ATOMIC_RELAXED);
+	DPRINTF("instance %d: %u partitions assigned\n", ci->id, n);
 }
 
 int
-consumer_shutdown(
+consumer_shutdown(struct consinst *ci,
 		streams_config_t *config, streams_consumer_t *consumer)
 {
 	int ret_val = EXIT_SUCCESS;
 
-	/* commit everything we've read */
-	if (0 != streams_consumer_commit_all_sync(*consumer)) {
+	/* commit everything we've read, whatever the policy */
+	if (ci->pl != NULL)
+		pipeline_drain(ci->pl);
+	if (0 != commit_now(&ci->cpolicy, *consumer)) {
 		DPRINTF("error committing\n");
 	} else {
 		DPRINTF("commit successful\n");
 	}
 
-	/* Destroy the consumer. */
+	/* Destroy the consumer, which gives its partitions back. */
 	DPRINTF("\nDestroying the consumer... \n");
 	ret_val = streams_consumer_destroy(*consumer);
 	if (EXIT_SUCCESS != ret_val) {
@@ -112,13 +447,15 @@ consumer_shutdown(
 	streams_config_destroy(*config);
 	DPRINTF("\n****** CONSUMER END ******\n");
 
-	*config = *consumer = 0;
+	*config = NULL;
+	*consumer = NULL;
 	return (ret_val);
 }
 
 int
 consumer_init(const char *fullTopicName, const char *ftn2, const char *gid,
-		streams_config_t *confp, streams_consumer_t *consp)
+		struct consinst *ci, streams_config_t *confp,
+		streams_consumer_t *consp)
 {
 	int ret_val = EXIT_SUCCESS;
 	const char *subs_topics[2];
@@ -164,12 +501,15 @@ consumer_init(const char *fullTopicName, const char *ftn2, const char *gid,
 		return (ret_val);
 	}
 
-	/* Subscribe the consumer to the topic. */
+	/*
+	 * Subscribe the consumer to the topic.  The group shares the
+	 * partitions out among its members and tells us as they move.
+	 */
 	DPRINTF("\nSTEP 4: Subscribing " " the consumer to the topic...\n");
 	subs_topics[0] = fullTopicName;
 	subs_topics[1] = ftn2;
 	ret_val = streams_consumer_subscribe_topics(*consp,
-	    subs_topics, 2, NULL, NULL, NULL);
+	    subs_topics, 2, on_assigned, on_revoked, ci);
 	if (EXIT_SUCCESS != ret_val) {
 		DPRINTF("subsc_topics() failed\n");
 		return (ret_val);
@@ -177,164 +517,914 @@ consumer_init(const char *fullTopicName, const char *ftn2, const char *gid,
 	return (ret_val);
 }
 
+static unsigned long
+inst_consumed(struct consinst *ci)
+{
+	if (ci->pl != NULL)
+		return (pipeline_done(ci->pl));
+	return (__atomic_load_n(&ci->tot, __ATOMIC_RELAXED));
+}
+
+static unsigned long
+consumed(struct consstate *cs)
+{
+	unsigned long tot = 0;
+
+	for (int i = 0; i < cs->ninst; i++)
+		tot += inst_consumed(&cs->inst[i]);
+	return (tot);
+}
+
+static void
+commit_stats(struct consstate *cs, struct commit_stats *st)
+{
+	struct commit_stats is;
+	uint64_t lat_total = 0;
+
+	memset(st, 0, sizeof (*st));
+	for (int i = 0; i < cs->ninst; i++) {
+		commit_get_stats(&cs->inst[i].cpolicy, &is);
+		st->commits += is.commits;
+		st->failures += is.failures;
+		lat_total += is.lat_avg_us * is.commits;
+		if (is.lat_max_us > st->lat_max_us)
+			st->lat_max_us = is.lat_max_us;
+	}
+	st->lat_avg_us = st->commits == 0 ? 0 : lat_total / st->commits;
+}
+
+/* poll thread: write out the aggregate windows that have closed */
+static int
+agg_output(uint64_t now_ms)
+{
+	const char *rows;
+	size_t len;
+
+	len = agg_tick(agg, now_ms, &rows);
+	if (len > 0 && 0 != sink_write(out, rows, len)) {
+		DPRINTF("sink write failed\n");
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+int poll_once(struct consinst *ci, long timeout_ms);
+
+/*
+ * Poll thread: move over to the other cluster.  With a hot standby the
+ * consumers just trade places, otherwise the old one is torn down and
+ * a new one subscribed.  Either way everything polled so far is
+ * processed and committed on the old one first, so it picks up where
+ * it left off if we come back.
+ *
+ * The standby has never been polled, so it hasn't joined its group or
+ * been given partitions yet; polling it earlier would fetch records we
+ * would have to drop.  The new consumer's first poll, which does the
+ * join, is made here without waiting and counts as part of the
+ * failover.
+ */
 int
-consumer(const char *fullTopicName, const char *ftn2,
-		const char *backupTopicName,
-		const char *btn2, const char *pipe_fname)
+failover(struct consinst *ci, const char *topic)
 {
+	struct consstate *cs = ci->cs;
+	char namebuf[METRICS_NAME_MAX];
+	streams_config_t conf;
+	streams_consumer_t cons;
+	uint64_t start = now_ns();
+	long us;
 	int ret_val;
-	int code;
-	streams_config_t config;
-	streams_consumer_t consumer;
-	struct timeval now, last_now;
-	const char *cur_topic = fullTopicName;
-	int tot = 0, last_tot = 0;
-	FILE *pipe_fp;
-	int pipe_fd;
-	long tdiff;
-	
-	ret_val = consumer_init(cur_topic,
-			cur_topic == fullTopicName ? ftn2 : btn2,
-			cur_topic == fullTopicName ? "1" : "1", &config, &consumer);
-	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("consumer_init() failed\n");
+
+	int nparts;
+
+	if (topic == ci->cur_topic)
+		return (EXIT_SUCCESS);
+	IPRINTF("failing over to %s cluster\n",
+	    topic == cs->backup ? "backup" : "primary");
+
+	if (hot_standby) {
+		if (0 != flush_all(ci)) {
+			DPRINTF("error committing\n");
+		}
+		conf = ci->config;
+		cons = ci->consumer;
+		ci->config = ci->sb_config;
+		ci->consumer = ci->sb_consumer;
+		ci->sb_config = conf;
+		ci->sb_consumer = cons;
+		nparts = ci->nparts;
+		__atomic_store_n(&ci->nparts, ci->sb_nparts, __ATOMIC_RELAXED);
+		ci->sb_nparts = nparts;
+		__atomic_store_n(&ci->cur_topic, topic, __ATOMIC_RELEASE);
+	} else {
+		ret_val = consumer_shutdown(ci, &ci->config, &ci->consumer);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("trying to failover: shutdown() failed\n");
+			return (ret_val);
+		}
+		__atomic_store_n(&ci->cur_topic, topic, __ATOMIC_RELEASE);
+		ret_val = consumer_init(topic,
+		    topic == cs->primary ? cs->primary2 : cs->backup2,
+		    group_id, ci, &ci->config, &ci->consumer);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("trying to failover: init() failed\n");
+			return (ret_val);
+		}
+	}
+	if (EXIT_SUCCESS != (ret_val = poll_once(ci, 0)))
 		return (ret_val);
+
+	/* how long consumption stopped for */
+	us = (now_ns() - start) / 1000;
+	IPRINTF("failover took %ldus\n", us);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.failover_us",
+	    consname);
+	metrics_put(namebuf, us);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Poll thread, not pipelined: the sink is shared when there are several
+ * instances (-n, or the -X twins), so each write and flush takes
+ * out_lock.  Only the sink is serialized, the instances still decode
+ * and check their messages in parallel.
+ */
+static int
+out_write(struct consinst *ci, const void *buf, size_t len)
+{
+	int ret_val;
+
+	if (ci->cs->ninst == 1)
+		return (sink_write(out, buf, len));
+	pthread_mutex_lock(&out_lock);
+	ret_val = sink_write(out, buf, len);
+	pthread_mutex_unlock(&out_lock);
+	return (ret_val);
+}
+
+static int
+out_flush(struct consinst *ci)
+{
+	int ret_val;
+
+	if (ci->cs->ninst == 1)
+		return (sink_flush(out));
+	pthread_mutex_lock(&out_lock);
+	ret_val = sink_flush(out);
+	pthread_mutex_unlock(&out_lock);
+	return (ret_val);
+}
+
+/* one message: handed to a worker, or processed and written out */
+static int
+deliver(struct consinst *ci, struct pl_batch *batch, const char *topic,
+		const char *key, uint32_t klen, const char *val, uint32_t vlen,
+		int64_t offset)
+{
+	if (batch != NULL) {
+		/* pipelined, copy it out for a worker */
+		if (0 != pipeline_add(batch, key, klen, val, vlen, offset)) {
+			DPRINTF("pipeline_add() failed\n");
+			return (-1);
+		}
+		return (EXIT_SUCCESS);
 	}
 
-	DPRINTF("opening pipe %s\n", pipe_fname);
-	pipe_fd = open(pipe_fname, O_RDWR|O_NONBLOCK);
-	if (pipe_fd < 0) {
-		DPRINTF("open of file %s failed\n", pipe_fname);
+	vlen = consume_msg(topic, key, klen, val, vlen);
+	if (vlen == MSG_DROP) {
+		__atomic_fetch_add(&ci->tot, 1, __ATOMIC_RELAXED);
+		return (EXIT_SUCCESS);
+	}
+	/* -X: not dropped, so the other cluster's copy hasn't come yet */
+	if (active_active)
+		__atomic_fetch_add(&ci->wins, 1, __ATOMIC_RELAXED);
+	if (agg != NULL) {
+		agg_add(agg, val, vlen);
+		__atomic_fetch_add(&ci->tot, 1, __ATOMIC_RELAXED);
+		return (EXIT_SUCCESS);
+	}
+	if (0 != out_write(ci, val, vlen)) {
+		DPRINTF("sink write failed\n");
 		return (-1);
 	}
-	pipe_fp = fdopen(pipe_fd, "r");
+	__atomic_fetch_add(&ci->tot, 1, __ATOMIC_RELAXED);
+	return (EXIT_SUCCESS);
+}
 
-	/* Poll for
-	 * messages
-	 * continuously. Process them and print
-	 them to standard output. */
-	DPRINTF("\nSTEP 6: Polling for messages:\n");
-	gettimeofday(&last_now, NULL);
-	for(;;) {
-		streams_consumer_record_t *records;
-		long poll_time_out = 1000;
-		uint32_t nRecords;
-		int d;
-		float fracs_of_sec;
-		int rate;
-
-		gettimeofday(&now, NULL);
-		tdiff = tvdiff(&last_now, &now);
-		if (tdiff >= 1000) {
-			fracs_of_sec  = tdiff / 1000.0;
-			d = tot - last_tot;
-			rate = d / fracs_of_sec;
-			IPRINTF("f = %f, d = %d, r = %d\n", fracs_of_sec, d, rate);
-
-			ret_val = send_metrics(cur_topic,
-			    fullTopicName, backupTopicName, rate);
-			if (EXIT_SUCCESS != ret_val) {
-				IPRINTF("send_metrics() failed\n");
-				return (ret_val);
-			}
-			gettimeofday(&last_now, NULL);
-			last_tot = tot;
+/* one poll's records, processed or handed to the workers */
+static int
+process_records(struct consinst *ci, streams_consumer_record_t *records,
+		uint32_t nRecords, uint32_t *nmsgsp)
+{
+	struct pipeline *pl = ci->pl;
+	uint32_t nmsgs = 0;
+	uint64_t t1;
+	int ret_val;
+
+	/* Get the # of
+	 * messages in each record. */
+	for (int rec = 0; rec < nRecords; ++rec) {
+		uint32_t nummsgs_c;
+		ret_val =
+		    streams_consumer_record_get_message_count(records
+							     [rec],
+							     &nummsgs_c);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("cons_grc()\n");
+			return (ret_val);
 		}
+		uint32_t key_size_c;
+		void *key_c;
+		uint32_t value_size_c;
+		void *value_c;
+		int64_t offset_c = 0;
+		struct pl_batch *batch = NULL;
+		const char *ekey, *eval, *val;
+		uint32_t nenv, eklen, evlen, vlen;
+		int inflated;
+		char topic[PL_TOPIC_MAX];
+		const char *tp;
+		uint32_t tlen;
+		int part;
+		int64_t lag_off, lag_ts;
+		uint64_t t0;
 
-		/* check the command pipe to see if we have something */
-		DPRINTF("checking pipe\n");
-		ret_val = is_pipe_ready(fileno(pipe_fp));
-		if (ret_val < 0) {
-			DPRINTF("is_pipe_ready() failed\n");
+		ret_val = streams_consumer_record_get_topic(records[rec],
+		    &tp, &tlen);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("cons_grt() failed\n");
 			return (ret_val);
 		}
-		if (ret_val > 0) {
-			(void) fscanf(pipe_fp, "%d", &code);
+		if (tlen >= sizeof (topic))
+			tlen = sizeof (topic) - 1;
+		memcpy(topic, tp, tlen);
+		topic[tlen] = '\0';
 
-			/* if we need to failover, toggle connection to the other cluster */
-			if (code != FAIL_OVER_CODE && code != FAIL_BACK_CODE) {
-				DPRINTF("got weird code %d, bailing\n", code);
+		ret_val = streams_consumer_record_get_partitionid(
+		    records[rec], &part);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("cons_grp() failed\n");
+			return (ret_val);
+		}
+		/* a record is one partition's, its last message is where we are */
+		if (nummsgs_c > 0 &&
+		    streams_msg_get_offset(records[rec], nummsgs_c - 1,
+		    &lag_off) == EXIT_SUCCESS &&
+		    streams_msg_get_timestamp(records[rec], nummsgs_c - 1,
+		    &lag_ts) == EXIT_SUCCESS)
+			lag_polled(&lag, topic, part, lag_off, lag_ts);
+
+		if (pl != NULL) {
+			batch = pipeline_batch(pl, topic, part);
+			if (batch == NULL) {
+				DPRINTF("pipeline_batch() failed\n");
 				return (-1);
 			}
+		}
 
-			IPRINTF("failing over to %s cluster\n",
-			    code == FAIL_OVER_CODE ? "backup" : "primary");
-
-			ret_val = consumer_shutdown(&config, &consumer);
+		for (uint32_t i = 0; i < nummsgs_c; ++i) {
+			t0 = prof_now();
+			/* Get the message key. */
+			ret_val =
+			    streams_msg_get_key(records[rec],
+					       i, &key_c, &key_size_c);
 			if (EXIT_SUCCESS != ret_val) {
-				DPRINTF("trying to failover: shutdown() failed\n");
+				DPRINTF("streams_mgk() failed\n");
 				return (ret_val);
 			}
-			cur_topic =
-			    code == FAIL_OVER_CODE ? backupTopicName : fullTopicName;
-			ret_val = consumer_init(cur_topic,
-			    cur_topic == fullTopicName ? ftn2 : btn2,
-			    cur_topic == fullTopicName ? "1" : "1",
-			    &config, &consumer);
+			/* get msg val. */
+			ret_val =
+			    streams_msg_get_value(records[rec], i, &value_c,
+						 &value_size_c);
 			if (EXIT_SUCCESS != ret_val) {
-				DPRINTF("trying to failover: init() failed\n");
+				DPRINTF("msg_gv()" " failed\n");
 				return (ret_val);
 			}
+			if (batch != NULL)
+				(void) streams_msg_get_offset(records[rec],
+				    i, &offset_c);
+
+			/* one we can't inflate is passed on as it came */
+			val = value_c;
+			vlen = value_size_c;
+			inflated = z_is_compressed(val, vlen) &&
+			    z_decompress(&zcodec, &ci->zpoll, value_c,
+			    value_size_c, &val, &vlen, &zstats) == EXIT_SUCCESS;
+
+			/* an envelope's messages count one by one */
+			nenv = env_count(val, vlen);
+			prof_end(PROF_EXTRACT, t0);
+			if (nenv == 0) {
+				nmsgs++;
+				t0 = prof_now();
+				ret_val = deliver(ci, batch, topic, key_c,
+				    key_size_c, val, vlen, offset_c);
+				prof_end(PROF_OUTPUT, t0);
+				if (EXIT_SUCCESS != ret_val)
+					return (ret_val);
+			} else {
+				__atomic_fetch_add(&n_envelopes, 1,
+				    __ATOMIC_RELAXED);
+			}
+			for (uint32_t j = 0; j < nenv; j++) {
+				env_msg(val, j, &ekey, &eklen, &eval, &evlen);
+				nmsgs++;
+				t0 = prof_now();
+				ret_val = deliver(ci, batch, topic, ekey,
+				    eklen, eval, evlen, offset_c);
+				prof_end(PROF_OUTPUT, t0);
+				if (EXIT_SUCCESS != ret_val)
+					return (ret_val);
+			}
+
+			/* the next one reuses zpoll's buffer */
+			if (inflated && batch == NULL) {
+				t0 = prof_now();
+				if (0 != out_flush(ci)) {
+					DPRINTF("sink flush failed\n");
+					return (-1);
+				}
+				prof_end(PROF_FLUSH, t0);
+			}
 		}
+	}
+	*nmsgsp = nmsgs;
+	if (pl != NULL) {
+		pipeline_dispatch(pl);
+		return (EXIT_SUCCESS);
+	}
+	t1 = prof_now();
+	if (0 != out_flush(ci)) {
+		/* values must be out before the next poll reuses them */
+		DPRINTF("sink flush failed\n");
+		return (-1);
+	}
+	if (nRecords > 0)
+		prof_end(PROF_FLUSH, t1);
+	return (EXIT_SUCCESS);
+}
 
-		/* now poll for messages */
-		ret_val =
-		    streams_consumer_poll(consumer,
-					 poll_time_out, &records, &nRecords);
+/* one poll's worth of messages, waiting up to timeout_ms for some */
+int
+poll_once(struct consinst *ci, long timeout_ms)
+{
+	streams_consumer_record_t *records;
+	uint32_t nRecords;
+	uint32_t nmsgs = 0;
+	unsigned long pending;
+	uint64_t t0;
+	int due, ret_val;
+
+	t0 = prof_now();
+	ret_val = streams_consumer_poll(ci->consumer, timeout_ms,
+	    &records, &nRecords);
+	prof_end(PROF_POLL, t0);
+	if (EXIT_SUCCESS != ret_val) {
+		DPRINTF("cons_poll() fail\n");
+		return (ret_val);
+	}
+
+	/* this poll's records go in the pane current after this */
+	if (agg != NULL && EXIT_SUCCESS != agg_output(wall_ms()))
+		return (-1);
+
+	ret_val = process_records(ci, records, nRecords, &nmsgs);
+	if (EXIT_SUCCESS != ret_val)
+		return (ret_val);
+
+	/* offsets may only cover what the workers finished */
+	due = commit_due(&ci->cpolicy, nmsgs);
+	if (due && ci->pl != NULL)
+		pipeline_drain(ci->pl);
+
+	t0 = prof_now();
+	pending = ci->cpolicy.pending + nmsgs;
+	if (0 != commit_maybe(&ci->cpolicy, ci->consumer, nmsgs, due)) {
+		DPRINTF("error committing\n");
+	}
+	/* only the polls that did commit */
+	if (pending > 0 && ci->cpolicy.pending == 0)
+		prof_end(PROF_COMMIT, t0);
+	return (EXIT_SUCCESS);
+}
+
+void *
+poll_thread(void *arg)
+{
+	struct consinst *ci = arg;
+	struct consstate *cs = ci->cs;
+	int ret_val = EXIT_SUCCESS;
+	int req;
+
+	prof_thread("poll%d", ci->id);
+	DPRINTF("\nSTEP 6: Polling for messages:\n");
+	while (!__atomic_load_n(&cs->stop, __ATOMIC_ACQUIRE)) {
+		req = __atomic_exchange_n(&ci->switch_to, 0, __ATOMIC_ACQ_REL);
+		if (req != 0) {
+			ret_val = failover(ci,
+			    req == CMD_FAILOVER ? cs->backup : cs->primary);
+			if (EXIT_SUCCESS != ret_val)
+				break;
+		}
+		if (__atomic_exchange_n(&ci->flush_req, 0, __ATOMIC_ACQ_REL) &&
+		    0 != flush_all(ci)) {
+			DPRINTF("error committing\n");
+		}
+
+		ret_val = poll_once(ci, CONS_POLL_MS);
+		if (EXIT_SUCCESS != ret_val)
+			break;
+	}
+
+	/* -A: what's in the pane filling now is written out too */
+	if (agg != NULL && EXIT_SUCCESS == ret_val &&
+	    (EXIT_SUCCESS != agg_output(wall_ms() + agg->slide_ms) ||
+	    0 != sink_flush(out))) {
+		DPRINTF("writing the last aggregates failed\n");
+	}
+
+	/* leave the group, so the others take over our partitions now */
+	if (EXIT_SUCCESS == ret_val && ci->consumer != NULL)
+		ret_val = consumer_shutdown(ci, &ci->config, &ci->consumer);
+
+	/* get the control loop out of epoll_wait */
+	if (EXIT_SUCCESS != ret_val)
+		cs->error = ret_val;
+	evloop_stop(&cs->ev);
+	return (NULL);
+}
+
+/* producer -Z: what we inflated and the CPU it cost */
+static void
+send_decompress_metrics(void)
+{
+	char namebuf[METRICS_NAME_MAX];
+	unsigned long in, errors;
+
+	in = __atomic_load_n(&zstats.in_bytes, __ATOMIC_RELAXED);
+	errors = __atomic_load_n(&zstats.errors, __ATOMIC_RELAXED);
+	if (in == 0 && errors == 0)
+		return;
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.decompress_in_bytes",
+	    consname);
+	metrics_put(namebuf, in);
+	snprintf(namebuf, sizeof (namebuf),
+	    "consumer_%s.decompress_out_bytes", consname);
+	metrics_put(namebuf, __atomic_load_n(&zstats.out_bytes,
+	    __ATOMIC_RELAXED));
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.decompress_cpu_us",
+	    consname);
+	metrics_put(namebuf, __atomic_load_n(&zstats.cpu_ns,
+	    __ATOMIC_RELAXED) / 1000);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.undecodable",
+	    consname);
+	metrics_put(namebuf, errors);
+}
+
+/* -A: how much aggregating is saving us, and what it couldn't use */
+static void
+send_agg_metrics(void)
+{
+	char namebuf[METRICS_NAME_MAX];
+	struct agg_stats st;
+
+	agg_get_stats(agg, &st);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.agg_keys", consname);
+	metrics_put(namebuf, st.keys);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.agg_rows", consname);
+	metrics_put(namebuf, st.rows);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.agg_unparsed",
+	    consname);
+	metrics_put(namebuf, st.unparsed);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.agg_dropped",
+	    consname);
+	metrics_put(namebuf, st.dropped);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.agg_evicted",
+	    consname);
+	metrics_put(namebuf, st.evicted);
+}
+
+/* -d: duplicates dropped, and what got through unchecked */
+static void
+send_dedup_metrics(void)
+{
+	char namebuf[METRICS_NAME_MAX];
+	struct dedup_stats st;
+
+	dedup_get_stats(&dedup, &st);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.dups_suppressed",
+	    consname);
+	metrics_put(namebuf, st.dropped);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.dedup_unkeyed",
+	    consname);
+	metrics_put(namebuf, st.unkeyed);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.dedup_too_old",
+	    consname);
+	metrics_put(namebuf, st.too_old);
+}
+
+/*
+ * Partitions held, rebalances and the longest revoke since last time,
+ * and with -n the rate of each instance, to see how evenly the group
+ * spreads the load.
+ */
+static void
+send_group_metrics(struct consstate *cs, float secs)
+{
+	char namebuf[METRICS_NAME_MAX];
+	unsigned long rebalances = 0, tot;
+	uint64_t us, max_us = 0;
+	int nparts = 0;
+
+	for (int i = 0; i < cs->ninst; i++) {
+		struct consinst *ci = &cs->inst[i];
+
+		nparts += __atomic_load_n(&ci->nparts, __ATOMIC_RELAXED);
+		rebalances += __atomic_load_n(&ci->rebalances,
+		    __ATOMIC_RELAXED);
+		us = __atomic_exchange_n(&ci->rebalance_us, 0,
+		    __ATOMIC_RELAXED);
+		if (us > max_us)
+			max_us = us;
+		if (cs->ninst == 1)
+			continue;
+		tot = inst_consumed(ci);
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.i%d.rate",
+		    consname, i);
+		metrics_put(namebuf, (tot - ci->last_tot) / secs);
+		ci->last_tot = tot;
+	}
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.partitions",
+	    consname);
+	metrics_put(namebuf, nparts);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.rebalances",
+	    consname);
+	metrics_put(namebuf, rebalances);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.rebalance_us",
+	    consname);
+	metrics_put(namebuf, max_us);
+}
+
+/*
+ * -X: each cluster's rate, and how many of the records came from it
+ * first, in all and as a share of the last interval's.
+ */
+static void
+send_race_metrics(struct consstate *cs, float secs)
+{
+	char namebuf[METRICS_NAME_MAX];
+	unsigned long tot[2] = { 0, 0 }, wins[2] = { 0, 0 }, d[2];
+
+	for (int i = 0; i < cs->ninst; i++) {
+		tot[cs->inst[i].side] += inst_consumed(&cs->inst[i]);
+		wins[cs->inst[i].side] += __atomic_load_n(&cs->inst[i].wins,
+		    __ATOMIC_RELAXED);
+	}
+	for (int c = 0; c < 2; c++) {
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.%s_rate",
+		    consname, cluster_name[c]);
+		metrics_put(namebuf, (tot[c] - cs->last_side[c]) / secs);
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.%s_wins",
+		    consname, cluster_name[c]);
+		metrics_put(namebuf, wins[c]);
+		d[c] = wins[c] - cs->last_wins[c];
+		cs->last_side[c] = tot[c];
+		cs->last_wins[c] = wins[c];
+	}
+	if (d[0] + d[1] > 0) {
+		snprintf(namebuf, sizeof (namebuf),
+		    "consumer_%s.primary_win_pct", consname);
+		metrics_put(namebuf, d[0] * 100 / (d[0] + d[1]));
+	}
+}
+
+/*
+ * Offset and time lag of every partition we hold, and the total offset
+ * lag and worst time lag of them all.
+ */
+static void
+send_lag_metrics(struct lag_stat *st, int n)
+{
+	char namebuf[METRICS_NAME_MAX];
+	char tname[64];
+	int64_t offsets = 0, ms = 0;
+
+	for (int i = 0; i < n; i++) {
+		/* "/stream:topic" isn't a usable metric path */
+		snprintf(tname, sizeof (tname), "%s", st[i].topic +
+		    (st[i].topic[0] == '/'));
+		for (char *p = tname; *p != '\0'; p++)
+			if (*p == '/' || *p == ':' || *p == '.')
+				*p = '_';
+		snprintf(namebuf, sizeof (namebuf),
+		    "consumer_%s.lag.%s.%d.offsets", consname, tname,
+		    st[i].partition);
+		metrics_put(namebuf, st[i].offsets);
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.lag.%s.%d.ms",
+		    consname, tname, st[i].partition);
+		metrics_put(namebuf, st[i].ms);
+		offsets += st[i].offsets;
+		if (st[i].ms > ms)
+			ms = st[i].ms;
+	}
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.lag_offsets",
+	    consname);
+	metrics_put(namebuf, offsets);
+	snprintf(namebuf, sizeof (namebuf), "consumer_%s.lag_ms", consname);
+	metrics_put(namebuf, ms);
+}
+
+/* apply one command from the pipe, see evloop.h */
+int
+do_command(struct cmd *c, void *arg)
+{
+	struct consstate *cs = arg;
+	struct commit_stats st;
+	struct e2e_stats es;
+	struct agg_stats as;
+	struct dedup_stats ds;
+	static struct lag_stat lagst[LAG_MAX_PARTS];
+	unsigned long wins[2];
+	int nlag;
+
+	switch (c->op) {
+	case CMD_FAILOVER:
+	case CMD_FAILBACK:
+		if (active_active) {
+			IPRINTF("reading both clusters (-X), nothing to fail "
+			    "over\n");
+			return (EXIT_SUCCESS);
+		}
+		/* the poll threads pick it up when their polls return */
+		for (int i = 0; i < cs->ninst; i++)
+			__atomic_store_n(&cs->inst[i].switch_to, c->op,
+			    __ATOMIC_RELEASE);
+		return (EXIT_SUCCESS);
+	case CMD_FLUSH:
+		for (int i = 0; i < cs->ninst; i++)
+			__atomic_store_n(&cs->inst[i].flush_req, 1,
+			    __ATOMIC_RELEASE);
+		return (EXIT_SUCCESS);
+	case CMD_STOP:
+		/* the poll threads commit and leave the group */
+		IPRINTF("stopping\n");
+		evloop_stop(&cs->ev);
+		return (EXIT_SUCCESS);
+	case CMD_STATS:
+		commit_stats(cs, &st);
+		fprintf(stderr, "consumed %lu, %s, %lu commits "
+		    "(%lu failed, avg %luus, max %luus)\n",
+		    consumed(cs), active_active ? "both clusters" :
+		    __atomic_load_n(&cs->inst[0].cur_topic,
+		    __ATOMIC_ACQUIRE) == cs->primary ? "primary cluster" :
+		    "backup cluster",
+		    st.commits, st.failures, (unsigned long)st.lat_avg_us,
+		    (unsigned long)st.lat_max_us);
+		nlag = lag_get(&lag, wall_ms(), lagst, LAG_MAX_PARTS);
+		for (int i = 0; i < nlag; i++)
+			fprintf(stderr, "lag %s[%d]: %lld behind, %lldms\n",
+			    lagst[i].topic, lagst[i].partition,
+			    (long long)lagst[i].offsets,
+			    (long long)lagst[i].ms);
+		for (int i = 0; i < cs->ninst; i++) {
+			struct consinst *ci = &cs->inst[i];
 
+			fprintf(stderr, "group %s instance %d%s%s: consumed "
+			    "%lu, %d partitions, %lu rebalances\n", group_id, i,
+			    active_active ? " on " : "",
+			    active_active ? cluster_name[ci->side] : "",
+			    inst_consumed(ci), __atomic_load_n(&ci->nparts,
+			    __ATOMIC_RELAXED), __atomic_load_n(&ci->rebalances,
+			    __ATOMIC_RELAXED));
+		}
+		if (active_active) {
+			wins[0] = wins[1] = 0;
+			for (int i = 0; i < cs->ninst; i++)
+				wins[cs->inst[i].side] += __atomic_load_n(
+				    &cs->inst[i].wins, __ATOMIC_RELAXED);
+			fprintf(stderr, "first to arrive: primary %lu, "
+			    "backup %lu (%.1f%% primary)\n", wins[0], wins[1],
+			    wins[0] + wins[1] > 0 ?
+			    wins[0] * 100.0 / (wins[0] + wins[1]) : 0.0);
+		}
+		fprintf(stderr, "output %s: %lu messages, %lu bytes\n",
+		    out->name, __atomic_load_n(&out->msgs, __ATOMIC_RELAXED),
+		    __atomic_load_n(&out->bytes, __ATOMIC_RELAXED));
+		e2e_get_stats(&e2e, &es);
+		if (es.headers > 0)
+			fprintf(stderr, "e2e: %lu stamped, %lu gaps, "
+			    "%lu reorders, %lu dups, %lu skewed\n", es.headers,
+			    es.gaps, es.reorders, es.dups, es.skewed);
+		if (__atomic_load_n(&n_envelopes, __ATOMIC_RELAXED) > 0)
+			fprintf(stderr, "%lu envelopes unpacked\n",
+			    __atomic_load_n(&n_envelopes, __ATOMIC_RELAXED));
+		if (__atomic_load_n(&zstats.in_bytes, __ATOMIC_RELAXED) > 0 ||
+		    __atomic_load_n(&zstats.errors, __ATOMIC_RELAXED) > 0)
+			fprintf(stderr, "inflated %lu bytes to %lu, %.1fms "
+			    "cpu, %lu undecodable\n",
+			    __atomic_load_n(&zstats.in_bytes, __ATOMIC_RELAXED),
+			    __atomic_load_n(&zstats.out_bytes,
+			    __ATOMIC_RELAXED),
+			    __atomic_load_n(&zstats.cpu_ns,
+			    __ATOMIC_RELAXED) / 1e6,
+			    __atomic_load_n(&zstats.errors, __ATOMIC_RELAXED));
+		if (dedup_on) {
+			dedup_get_stats(&dedup, &ds);
+			fprintf(stderr, "dedup: %lu checked, %lu duplicates "
+			    "dropped, %lu unkeyed, %lu too old to tell\n",
+			    ds.checked, ds.dropped, ds.unkeyed, ds.too_old);
+		}
+		if (agg != NULL) {
+			agg_get_stats(agg, &as);
+			fprintf(stderr, "aggregated %lu records over %lu keys "
+			    "into %lu rows, %lu unparsed, %lu dropped, "
+			    "%lu evicted\n", as.records, as.keys, as.rows,
+			    as.unparsed, as.dropped, as.evicted);
+		}
+		return (EXIT_SUCCESS);
+	default:
+		IPRINTF("ignoring command '%s'\n", c->line);
+		return (EXIT_SUCCESS);
+	}
+}
+
+static int
+on_pipe(void *arg)
+{
+	struct consstate *cs = arg;
+	int ret_val;
+
+	ret_val = cmd_read(cs->pipe_fd, &cs->cmdbuf, do_command, cs);
+	if (ret_val < 0) {
+		IPRINTF("reading command pipe failed\n");
+	}
+	return (ret_val);
+}
+
+/* every LAG_PROBE_MS: where the partitions end, and how far behind we are */
+static int
+on_lag(void *arg)
+{
+	static struct lag_stat st[LAG_MAX_PARTS];
+	int n;
+
+	(void) arg;
+	if (EXIT_SUCCESS != lag_probe(&lag)) {
+		DPRINTF("lag probe failed\n");
+		return (EXIT_SUCCESS);
+	}
+	n = lag_get(&lag, wall_ms(), st, LAG_MAX_PARTS);
+	send_lag_metrics(st, n);
+	return (EXIT_SUCCESS);
+}
+
+/* once a second, whether or not any messages are coming in */
+static int
+on_report(void *arg)
+{
+	struct consstate *cs = arg;
+	uint64_t now = now_ns();
+	unsigned long tot, nenv;
+	char namebuf[METRICS_NAME_MAX];
+	struct commit_stats st;
+	float fracs_of_sec;
+	int d, rate, ret_val;
+
+	tot = consumed(cs);
+	fracs_of_sec = (now - cs->last_report) / 1e9;
+	d = tot - cs->last_tot;
+	rate = d / fracs_of_sec;
+	IPRINTF("f = %f, d = %d, r = %d\n", fracs_of_sec, d, rate);
+
+	/* with -X both clusters have a rate of their own */
+	if (active_active) {
+		send_race_metrics(cs, fracs_of_sec);
+	} else {
+		ret_val = send_metrics(__atomic_load_n(&cs->inst[0].cur_topic,
+		    __ATOMIC_ACQUIRE), cs->primary, cs->backup, rate);
 		if (EXIT_SUCCESS != ret_val) {
-			DPRINTF("cons_poll() fail\n");
+			IPRINTF("send_metrics() failed\n");
 			return (ret_val);
 		}
-		/* Get the # of
-		 * messages in each record. */
-		for (int rec = 0; rec < nRecords; ++rec) {
-			uint32_t nummsgs_c;
-			ret_val =
-			    streams_consumer_record_get_message_count(records
-								     [rec],
-								     &nummsgs_c);
+	}
+	commit_stats(cs, &st);
+	send_commit_metrics(&st);
+	send_group_metrics(cs, fracs_of_sec);
+	send_e2e_metrics();
+	if ((nenv = __atomic_load_n(&n_envelopes, __ATOMIC_RELAXED)) > 0) {
+		snprintf(namebuf, sizeof (namebuf), "consumer_%s.envelopes",
+		    consname);
+		metrics_put(namebuf, nenv);
+	}
+	send_decompress_metrics();
+	if (agg != NULL)
+		send_agg_metrics();
+	if (dedup_on)
+		send_dedup_metrics();
+	cs->last_report = now;
+	cs->last_tot = tot;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Main Consumer Loop
+ * ------------------
+ * Polling happens on its own thread, this one sleeps in the event loop
+ * until a command or the metrics timer needs it.
+ */
+int
+consumer(const char *fullTopicName, const char *ftn2,
+		const char *backupTopicName,
+		const char *btn2, const char *pipe_fname)
+{
+	struct consstate consstate, *cs = &consstate;
+	struct consinst *ci;
+	int i, ret_val;
+
+	memset(cs, 0, sizeof (*cs));
+	cs->primary = fullTopicName;
+	cs->primary2 = ftn2;
+	cs->backup = backupTopicName;
+	cs->backup2 = btn2;
+	/* -X: the second ninstances read the backup topics */
+	cs->ninst = active_active ? ninstances * 2 : ninstances;
+	cs->inst = calloc(cs->ninst, sizeof (*cs->inst));
+	if (cs->inst == NULL) {
+		DPRINTF("can't allocate %d instances\n", cs->ninst);
+		return (-1);
+	}
+
+	for (i = 0; i < cs->ninst; i++) {
+		ci = &cs->inst[i];
+		ci->cs = cs;
+		ci->id = i;
+		ci->side = i >= ninstances;
+		ci->cur_topic = ci->side ? backupTopicName : fullTopicName;
+		ci->cpolicy = cpolicy;
+		if (EXIT_SUCCESS != z_ctx_init(&ci->zpoll)) {
+			fprintf(stderr, "z_ctx_init() failed\n");
+			return (-1);
+		}
+		if (nworkers > 0 && (ci->pl = pipeline_create(nworkers,
+		    process_batch, &ci->wins)) == NULL) {
+			fprintf(stderr, "can't start %d workers\n", nworkers);
+			return (-1);
+		}
+		ret_val = consumer_init(ci->cur_topic,
+		    ci->side ? cs->backup2 : cs->primary2, group_id,
+		    ci, &ci->config, &ci->consumer);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("consumer_init() failed\n");
+			return (ret_val);
+		}
+		if (hot_standby) {
+			ret_val = consumer_init(cs->backup, cs->backup2,
+			    group_id, ci, &ci->sb_config, &ci->sb_consumer);
 			if (EXIT_SUCCESS != ret_val) {
-				DPRINTF("cons_grc()\n");
+				DPRINTF("standby consumer_init() failed\n");
 				return (ret_val);
 			}
-			uint32_t key_size_c;
-			void *key_c;
-			uint32_t value_size_c;
-			void *value_c;
-
-			for (uint32_t i = 0; i < nummsgs_c; ++i) {
-				/* Get the message key. */
-				ret_val =
-				    streams_msg_get_key(records[rec],
-						       i, &key_c, &key_size_c);
-				if (EXIT_SUCCESS != ret_val) {
-					DPRINTF("streams_mgk() failed\n");
-					return (ret_val);
-				}
-				/* get msg val. */
-				ret_val =
-				    streams_msg_get_value(records[rec], i, &value_c,
-							 &value_size_c);
-				if (EXIT_SUCCESS != ret_val) {
-					DPRINTF("msg_gv()" " failed\n");
-					return (ret_val);
-				}
-				printf("%s", (char *)value_c);
-				DPRINTF("Consumed: MESSAGE %d "
-				       " (Key: %s Value: %s )\n", i,
-				       (char *)key_c, (char *)value_c);
-				tot++;
-			}
 		}
-		DPRINTF("committing...\n");
-		if (0 != streams_consumer_commit_all_sync(consumer)) {
-			DPRINTF("error committing\n");
-		} else {
-			DPRINTF("commit successful\n");
+	}
+
+	DPRINTF("opening pipe %s\n", pipe_fname);
+	cs->pipe_fd = open(pipe_fname, O_RDWR|O_NONBLOCK);
+	if (cs->pipe_fd < 0) {
+		DPRINTF("open of file %s failed\n", pipe_fname);
+		return (-1);
+	}
+	if (EXIT_SUCCESS != evloop_init(&cs->ev) ||
+	    EXIT_SUCCESS != evloop_add_fd(&cs->ev, cs->pipe_fd, on_pipe, cs) ||
+	    EXIT_SUCCESS != evloop_add_timer(&cs->ev, REPORT_MS, on_report,
+	    cs) ||
+	    EXIT_SUCCESS != evloop_add_timer(&cs->ev, LAG_PROBE_MS, on_lag,
+	    cs)) {
+		DPRINTF("can't set up the control loop\n");
+		return (-1);
+	}
+
+	cs->last_report = now_ns();
+	for (i = 0; i < cs->ninst; i++) {
+		if (pthread_create(&cs->inst[i].poller, NULL, poll_thread,
+		    &cs->inst[i]) != 0) {
+			DPRINTF("can't start the poll thread\n");
+			return (-1);
 		}
 	}
-	return (EXIT_SUCCESS);
+	ret_val = evloop_run(&cs->ev);
+
+	__atomic_store_n(&cs->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < cs->ninst; i++) {
+		ci = &cs->inst[i];
+		pthread_join(ci->poller, NULL);
+		if (ci->pl != NULL)
+			pipeline_destroy(ci->pl);
+	}
+	if (EXIT_SUCCESS == ret_val)
+		ret_val = cs->error;
+	evloop_destroy(&cs->ev);
+	close(cs->pipe_fd);
+	free(cs->inst);
+	return (ret_val);
 }
 
 /* MAIN */
@@ -346,24 +1436,158 @@ main(int argc, char *argv[])
 	char *maintopic, *backuptopic;
 	char *maintopic2, *backuptopic2;
 	char *pipename;
+	char *commit_spec = NULL;
+	char *sink_spec = NULL;
+	char *dictpath = NULL;
+	char *agg_spec = NULL;
+	int opt;
 
-	if (argc != 7) {
+	while ((opt = getopt(argc, argv, "A:C:dD:g:Hn:o:Tw:X")) != -1) {
+		switch (opt) {
+		case 'A':
+			agg_spec = optarg;
+			break;
+		case 'C':
+			commit_spec = optarg;
+			break;
+		case 'd':
+			dedup_on = 1;
+			break;
+		case 'D':
+			/* the producer's zstd dictionary (-Z zstd -D) */
+			dictpath = optarg;
+			break;
+		case 'g':
+			group_id = optarg;
+			group_set = 1;
+			break;
+		case 'H':
+			hot_standby = 1;
+			break;
+		case 'n':
+			ninstances = atoi(optarg);
+			if (ninstances < 1)
+				goto usage;
+			break;
+		case 'o':
+			sink_spec = optarg;
+			break;
+		case 'T':
+			profiling = 1;
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			if (nworkers < 1)
+				goto usage;
+			break;
+		case 'X':
+			active_active = 1;
+			dedup_on = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 6 || commit_parse(&cpolicy, commit_spec) != 0 ||
+	    (agg_spec != NULL && (nworkers > 0 || ninstances > 1 ||
+	    active_active || agg_parse(&aggstate, agg_spec) != 0)) ||
+	    ((agg_spec != NULL || dedup_on) && group_set) ||
+	    (active_active && hot_standby)) {
+usage:
 		fprintf(stderr, 
-		    "usage:  %s "
+		    "usage:  %s [-A aggregate] [-C commit_policy] [-d] [-D dictfile] [-g group] [-H] [-n instances] [-o sink] [-T] [-w workers] [-X] "
 		    "/stream1:topic /stream2:topic "
 		    "/backup_stream1:topic /backup_stream2:topic "
-		    " <pipe_filename> <name_for_metrics>\n", argv[0]);
+		    " <pipe_filename> <name_for_metrics>\n"
+		    "  -A  key:field[+field...][,window_ms[,slide_ms]], write "
+		    "per-key window\n"
+		    "      aggregates instead of values (not with -g, -w, -n "
+		    "or -X, see agg.h)\n"
+		    "  -C  poll, n:<msgs>, ms:<millis> or shutdown, "
+		    "optionally followed by ,async\n"
+		    "      (default poll, see commit.h)\n"
+		    "  -d  drop messages already seen, on either cluster "
+		    "(not with -g, see dedup.h)\n"
+		    "  -D  zstd dictionary the producer compressed with\n"
+		    "  -g  consumer group to join (default 1), its members "
+		    "share the partitions\n"
+		    "  -H  hot standby: keep a consumer on the backup "
+		    "cluster ready so failover is a swap\n"
+		    "  -n  run this many members of the group, each with its "
+		    "own poll thread\n"
+		    "  -o  stdout, null, writev[:path] or uring:path "
+		    "(default stdout, see sink.h)\n"
+		    "  -T  time each stage of consuming, for profstat "
+		    "(see prof.h)\n"
+		    "  -w  process messages on this many worker threads "
+		    "(see pipeline.h)\n"
+		    "  -X  active-active: read both clusters at once and keep "
+		    "whichever copy of\n"
+		    "      each record comes first (implies -d, not with -g "
+		    "or -H)\n",
+		    argv[0]);
+		exit(-1);
+	}
+
+	out = sink_open(sink_spec);
+	if (out == NULL) {
+		fprintf(stderr, "can't open output %s\n", sink_spec);
+		exit(-1);
+	}
+
+	maintopic = argv[optind];
+	maintopic2 = argv[optind + 1];
+	backuptopic = argv[optind + 2];
+	backuptopic2 = argv[optind + 3];
+	pipename = argv[optind + 4];
+	consname = argv[optind + 5];
+
+	if (EXIT_SUCCESS != metrics_init()) {
+		fprintf(stderr, "metrics_init() failed\n");
+		exit(-1);
+	}
+
+	if (profiling && EXIT_SUCCESS != prof_init("consumer", prof_stages,
+	    sizeof (prof_stages) / sizeof (prof_stages[0])))
 		exit(-1);
+
+	if (agg_spec != NULL) {
+		if (EXIT_SUCCESS != agg_init(&aggstate)) {
+			fprintf(stderr, "agg_init() failed\n");
+			exit(-1);
+		}
+		agg = &aggstate;
 	}
 
-	maintopic = argv[1];
-	maintopic2 = argv[2];
-	backuptopic = argv[3];
-	backuptopic2 = argv[4];
-	pipename = argv[5];
-	consname = argv[6];
+	if (dictpath != NULL && EXIT_SUCCESS != z_load_dict(&zcodec, dictpath)) {
+		fprintf(stderr, "can't load dictionary %s\n", dictpath);
+		exit(-1);
+	}
+
+	e2e_init(&e2e);
+	e2e_add_topic(&e2e, maintopic, E2E_PRIMARY);
+	e2e_add_topic(&e2e, maintopic2, E2E_PRIMARY);
+	e2e_add_topic(&e2e, backuptopic, E2E_BACKUP);
+	e2e_add_topic(&e2e, backuptopic2, E2E_BACKUP);
+
+	/* a topic and its backup carry the same messages */
+	dedup_init(&dedup);
+	dedup_add_topic(&dedup, maintopic, 0);
+	dedup_add_topic(&dedup, backuptopic, 0);
+	dedup_add_topic(&dedup, maintopic2, 1);
+	dedup_add_topic(&dedup, backuptopic2, 1);
+
+	if (EXIT_SUCCESS != lag_init(&lag)) {
+		fprintf(stderr, "lag_init() failed\n");
+		exit(-1);
+	}
 
 	ret_val = consumer(maintopic, maintopic2, backuptopic, backuptopic2, pipename);
+	lag_destroy(&lag);
+	sink_close(out);
+	metrics_shutdown();
+	prof_fini();
 
 	if (EXIT_SUCCESS != ret_val) {
 		DPRINTF("\nFAIL: consumer failed\n");
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rechdr.h"
+#include "dedup.h"
+
+#define KEY_PREFIX "Key_"
+#define KEY_PREFIX_LEN 4
+
+static struct dedup_win *
+producer_get(struct dedup *d, uint32_t id)
+{
+	struct dedup_win *p;
+	unsigned int h = (id * 2654435761u) % DEDUP_MAX_PRODUCERS;
+
+	for (int i = 0; i < DEDUP_MAX_PRODUCERS; i++) {
+		p = &d->producers[(h + i) % DEDUP_MAX_PRODUCERS];
+		if (__atomic_load_n(&p->used, __ATOMIC_ACQUIRE)) {
+			if (p->id == id)
+				return (p);
+			continue;
+		}
+
+		/* not there, claim this slot unless someone beat us to it */
+		pthread_mutex_lock(&d->plock);
+		if (!p->used) {
+			p->id = id;
+			__atomic_store_n(&p->used, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&d->plock);
+		if (p->id == id)
+			return (p);
+	}
+	return (NULL);
+}
+
+/* the msg_idx in a "Key_<msg_idx>" key, -1 if it isn't one */
+static int
+key_seq(const char *key, uint32_t klen, uint64_t *seq)
+{
+	uint32_t i;
+
+	if (klen <= KEY_PREFIX_LEN ||
+	    memcmp(key, KEY_PREFIX, KEY_PREFIX_LEN) != 0)
+		return (-1);
+	*seq = 0;
+	for (i = KEY_PREFIX_LEN; i < klen && key[i] >= '0' && key[i] <= '9';
+	    i++)
+		*seq = *seq * 10 + (key[i] - '0');
+	if (i == KEY_PREFIX_LEN || (i < klen && key[i] != '\0'))
+		return (-1);
+	return (EXIT_SUCCESS);
+}
+
+void
+dedup_init(struct dedup *d)
+{
+	memset(d, 0, sizeof (*d));
+	pthread_mutex_init(&d->plock, NULL);
+	for (int i = 0; i < DEDUP_MAX_PRODUCERS; i++) {
+		pthread_mutex_init(&d->producers[i].lock, NULL);
+		seqwin_init(&d->producers[i].win);
+	}
+	for (int i = 0; i < DEDUP_MAX_PAIRS; i++) {
+		pthread_mutex_init(&d->pairs[i].lock, NULL);
+		seqwin_init(&d->pairs[i].win);
+	}
+}
+
+/*
+ * Before any records arrive: a topic we read, and which pair it's in.
+ * A primary topic and its backup go in the same pair.
+ */
+int
+dedup_add_topic(struct dedup *d, const char *topic, int pair)
+{
+	if (d->ntopics == DEDUP_MAX_TOPICS || pair < 0 ||
+	    pair >= DEDUP_MAX_PAIRS)
+		return (-1);
+	snprintf(d->topics[d->ntopics].name, DEDUP_TOPIC_MAX, "%s", topic);
+	d->topics[d->ntopics++].pair = pair;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Whether a message has been seen before, from its key as it came,
+ * header and all.  Returns 1 for a duplicate to drop, otherwise 0.
+ */
+int
+dedup_check(struct dedup *d, const char *topic, const void *key,
+		uint32_t klen)
+{
+	struct dedup_win *w = NULL;
+	struct rechdr h;
+	uint64_t seq;
+	unsigned long gaps;
+	int ret;
+
+	__atomic_fetch_add(&d->checked, 1, __ATOMIC_RELAXED);
+	if (rechdr_get(key, klen, &h) > 0) {
+		w = producer_get(d, h.producer);
+		seq = h.seq;
+	} else if (key_seq(key, klen, &seq) == EXIT_SUCCESS) {
+		for (int i = 0; i < d->ntopics; i++) {
+			if (strcmp(d->topics[i].name, topic) == 0) {
+				w = &d->pairs[d->topics[i].pair];
+				break;
+			}
+		}
+	}
+	if (w == NULL) {
+		__atomic_fetch_add(&d->unkeyed, 1, __ATOMIC_RELAXED);
+		return (0);
+	}
+
+	pthread_mutex_lock(&w->lock);
+	ret = seqwin_check(&w->win, seq, &gaps);
+	pthread_mutex_unlock(&w->lock);
+	if (ret == SEQ_OLD)
+		__atomic_fetch_add(&d->too_old, 1, __ATOMIC_RELAXED);
+	if (ret != SEQ_DUP)
+		return (0);
+	__atomic_fetch_add(&d->dropped, 1, __ATOMIC_RELAXED);
+	return (1);
+}
+
+void
+dedup_get_stats(struct dedup *d, struct dedup_stats *st)
+{
+	st->checked = __atomic_load_n(&d->checked, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&d->dropped, __ATOMIC_RELAXED);
+	st->unkeyed = __atomic_load_n(&d->unkeyed, __ATOMIC_RELAXED);
+	st->too_old = __atomic_load_n(&d->too_old, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,71 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "seqwin.h"
+
+/*
+ * Duplicate suppression
+ * ---------------------
+ * With -d the consumer drops messages it has already seen.  Those come
+ * from reading the same records off both clusters around a failover,
+ * or all the time with -X, or from redelivery after an uncommitted
+ * poll.  A message is known by:
+ *
+ *   - the producer id and sequence number in its rechdr.h header,
+ *     when the producer ran with -E
+ *   - otherwise the msg_idx in its "Key_<msg_idx>" key.  There's no
+ *     producer id, so each primary topic and its backup share one
+ *     window, and only one producer without -E should write to them.
+ *
+ * Each producer (or topic pair) has a seqwin.h bitmap of its last
+ * SEQWIN_BITS sequence numbers, so memory is fixed: 8KB for each of
+ * up to DEDUP_MAX_PRODUCERS producers.  A duplicate that arrives more
+ * than SEQWIN_BITS messages after the original can't be told from a
+ * late message and is passed on, as are messages without either kind
+ * of key.  A producer restarted with the same id sends the same lines
+ * with the same sequence numbers, so those are dropped as duplicates
+ * too, unless it has gone far enough that it looks like a restart
+ * (see seqwin.h).  Safe to call from several worker threads.
+ */
+
+#define DEDUP_MAX_PRODUCERS 64
+#define DEDUP_MAX_TOPICS 16
+#define DEDUP_MAX_PAIRS 4
+#define DEDUP_TOPIC_MAX 256
+
+struct dedup_win {
+	uint32_t id;
+	int used;
+	pthread_mutex_t lock;
+	struct seqwin win;
+};
+
+struct dedup {
+	int ntopics;
+	struct {
+		char name[DEDUP_TOPIC_MAX];
+		int pair;
+	} topics[DEDUP_MAX_TOPICS];
+	struct dedup_win pairs[DEDUP_MAX_PAIRS];	/* Key_<n> keys */
+	pthread_mutex_t plock;
+	struct dedup_win producers[DEDUP_MAX_PRODUCERS];
+
+	unsigned long checked;
+	unsigned long dropped;	/* duplicates suppressed */
+	unsigned long unkeyed;	/* no header or Key_<n>, passed on */
+	unsigned long too_old;	/* behind the window, passed on */
+};
+
+struct dedup_stats {
+	unsigned long checked, dropped, unkeyed, too_old;
+};
+
+void dedup_init(struct dedup *d);
+int dedup_add_topic(struct dedup *d, const char *topic, int pair);
+int dedup_check(struct dedup *d, const char *topic, const void *key,
+    uint32_t klen);
+void dedup_get_stats(struct dedup *d, struct dedup_stats *st);
+
+#endif /* DEDUP_H */
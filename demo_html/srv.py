@@ -44,7 +44,8 @@ CONSUMER_FAIL_BACK_CMD = "ssh %s -l mapr -i %s 'echo %s > %s'" % \
 
 def write_command(str_cmd):
 	p = open(PROD_PIPE_NAME, 'w', 0)
-	p.write(str_cmd)
+	# the producer reads one command per line
+	p.write(str_cmd + "\n")
 	p.close()
 
 def do_action(form):
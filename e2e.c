@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "e2e.h"
+
+static struct e2e_producer *
+producer_get(struct e2e *e, uint32_t id)
+{
+	struct e2e_producer *p;
+	unsigned int h = (id * 2654435761u) % E2E_MAX_PRODUCERS;
+
+	for (int i = 0; i < E2E_MAX_PRODUCERS; i++) {
+		p = &e->producers[(h + i) % E2E_MAX_PRODUCERS];
+		if (__atomic_load_n(&p->used, __ATOMIC_ACQUIRE)) {
+			if (p->id == id)
+				return (p);
+			continue;
+		}
+
+		/* not there, claim this slot unless someone beat us to it */
+		pthread_mutex_lock(&e->plock);
+		if (!p->used) {
+			p->id = id;
+			seqwin_init(&p->win);
+			__atomic_store_n(&p->used, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&e->plock);
+		if (p->id == id)
+			return (p);
+	}
+	return (NULL);
+}
+
+static void
+seq_check(struct e2e *e, struct e2e_producer *p, uint64_t s)
+{
+	unsigned long gaps;
+	int ret;
+
+	pthread_mutex_lock(&p->lock);
+	ret = seqwin_check(&p->win, s, &gaps);
+	pthread_mutex_unlock(&p->lock);
+	switch (ret) {
+	case SEQ_OLD:
+		/* too old to tell late from replayed, it was a gap already */
+	case SEQ_LATE:
+		__atomic_fetch_add(&e->reorders, 1, __ATOMIC_RELAXED);
+		break;
+	case SEQ_DUP:
+		__atomic_fetch_add(&e->dups, 1, __ATOMIC_RELAXED);
+		break;
+	}
+	if (gaps > 0)
+		__atomic_fetch_add(&e->gaps, gaps, __ATOMIC_RELAXED);
+}
+
+void
+e2e_init(struct e2e *e)
+{
+	memset(e, 0, sizeof (*e));
+	pthread_mutex_init(&e->plock, NULL);
+	for (int i = 0; i < E2E_MAX_PRODUCERS; i++)
+		pthread_mutex_init(&e->producers[i].lock, NULL);
+}
+
+/* before any records arrive: a topic we read, and which cluster it's on */
+int
+e2e_add_topic(struct e2e *e, const char *topic, int cluster)
+{
+	struct e2e_topic *t;
+
+	if (e->ntopics == E2E_MAX_TOPICS)
+		return (-1);
+	t = &e->topics[e->ntopics++];
+	snprintf(t->name, sizeof (t->name), "%s", topic);
+	t->cluster = cluster;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Note the header on a record's key, if it has one.  Returns the
+ * header's length, so the caller can skip it, or 0.
+ */
+size_t
+e2e_record(struct e2e *e, const char *topic, const void *key, uint32_t klen)
+{
+	struct e2e_producer *p;
+	struct rechdr h;
+	uint64_t now, us = 0;
+	size_t hlen;
+	int i;
+
+	hlen = rechdr_get(key, klen, &h);
+	if (hlen == 0)
+		return (0);
+	__atomic_fetch_add(&e->headers, 1, __ATOMIC_RELAXED);
+
+	now = rechdr_now_ns();
+	if (now >= h.send_ns)
+		us = (now - h.send_ns) / 1000;
+	else
+		__atomic_fetch_add(&e->skewed, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < e->ntopics; i++) {
+		if (strcmp(e->topics[i].name, topic) == 0) {
+			hist_record(&e->topics[i].lat, us);
+			hist_record(&e->cluster[e->topics[i].cluster], us);
+			break;
+		}
+	}
+
+	p = producer_get(e, h.producer);
+	if (p != NULL)
+		seq_check(e, p, h.seq);
+	return (hlen);
+}
+
+void
+e2e_get_stats(struct e2e *e, struct e2e_stats *st)
+{
+	st->headers = __atomic_load_n(&e->headers, __ATOMIC_RELAXED);
+	st->skewed = __atomic_load_n(&e->skewed, __ATOMIC_RELAXED);
+	st->reorders = __atomic_load_n(&e->reorders, __ATOMIC_RELAXED);
+	st->dups = __atomic_load_n(&e->dups, __ATOMIC_RELAXED);
+	st->gaps = __atomic_load_n(&e->gaps, __ATOMIC_RELAXED);
+}
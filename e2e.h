@@ -0,0 +1,74 @@
+#ifndef E2E_H
+#define E2E_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "hist.h"
+#include "rechdr.h"
+#include "seqwin.h"
+
+/*
+ * End-to-end latency and sequence tracking
+ * ----------------------------------------
+ * The consumer side of rechdr.h.  For every record with a header
+ * e2e_record() notes produce-to-consume latency per topic and per
+ * cluster, and checks the producer's sequence numbers:
+ *
+ *   reorder  arrived after a higher sequence number from the same
+ *            producer (normal across partitions or sender threads)
+ *   dup      the same sequence number seen again
+ *   gap      never arrived, counted once SEQWIN_BITS later sequence
+ *            numbers have been seen; if it does turn up after that
+ *            it counts as a reorder as well
+ *
+ * Sequence numbers are tracked per producer id in a seqwin.h bitmap, so
+ * this works whatever the number of partitions or sender threads.  A
+ * producer that starts over from a low sequence number (a restart) is
+ * tracked afresh.  Safe to call from several worker threads.
+ */
+
+#define E2E_MAX_TOPICS 16
+#define E2E_MAX_PRODUCERS 64
+#define E2E_TOPIC_MAX 256
+
+#define E2E_PRIMARY 0
+#define E2E_BACKUP 1
+
+struct e2e_topic {
+	char name[E2E_TOPIC_MAX];
+	int cluster;
+	struct hist lat;
+};
+
+struct e2e_producer {
+	uint32_t id;
+	int used;
+	pthread_mutex_t lock;
+	struct seqwin win;
+};
+
+struct e2e {
+	int ntopics;
+	struct e2e_topic topics[E2E_MAX_TOPICS];
+	struct hist cluster[2];
+	pthread_mutex_t plock;
+	struct e2e_producer producers[E2E_MAX_PRODUCERS];
+
+	unsigned long headers;	/* records that had one */
+	unsigned long skewed;	/* sent "after" they arrived, clock skew */
+	unsigned long reorders;
+	unsigned long dups;
+	unsigned long gaps;
+};
+
+struct e2e_stats {
+	unsigned long headers, skewed, reorders, dups, gaps;
+};
+
+void e2e_init(struct e2e *e);
+int e2e_add_topic(struct e2e *e, const char *topic, int cluster);
+size_t e2e_record(struct e2e *e, const char *topic, const void *key,
+    uint32_t klen);
+void e2e_get_stats(struct e2e *e, struct e2e_stats *st);
+
+#endif /* E2E_H */
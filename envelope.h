@@ -0,0 +1,175 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Record envelopes
+ * ----------------
+ * With -B the producer packs many lines into one record's value, so
+ * the per-record cost of the client (create, send, callback) is paid
+ * once per envelope instead of once per line:
+ *
+ *   0   2 bytes  magic, 0xe2 0x42
+ *   2   1 byte   version
+ *   3   1 byte   flags, 0 for now
+ *   4   4 bytes  message count
+ *   8   4 bytes  length of the whole envelope
+ *   12  4 bytes  where the index starts
+ *   16           each message's key then its value, back to back
+ *   index        count x { offset, key length, value length }, 4 bytes
+ *                each, offsets from the start of the envelope
+ *
+ * Integers are little-endian.  The index goes at the end so messages
+ * can be copied in as they come; env_finish() moves it up behind the
+ * last one.  A value that doesn't parse as an envelope is a plain
+ * record, so producers with and without -B can share a topic.
+ */
+
+#define ENV_HDR_LEN 16
+#define ENV_IDX_LEN 12
+#define ENV_MAGIC0 0xe2
+#define ENV_MAGIC1 0x42
+#define ENV_VERSION 1
+
+/* an envelope being filled, in a buffer of cap bytes */
+struct envbuf {
+	char *buf;
+	uint32_t cap;
+	uint32_t len;		/* header and messages so far */
+	uint32_t count;
+	uint64_t first_ns;	/* when the first message went in */
+	long first_idx;		/* and its msg_idx */
+	uint64_t first_pos;	/* and its position, for -c (see ckpt.h) */
+};
+
+static inline void
+env_put32(void *buf, uint32_t v)
+{
+	unsigned char *p = buf;
+
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static inline uint32_t
+env_get32(const void *buf)
+{
+	const unsigned char *p = buf;
+
+	return (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+/* space one message takes, index entry included */
+static inline uint32_t
+env_size(uint32_t klen, uint32_t vlen)
+{
+	return (klen + vlen + ENV_IDX_LEN);
+}
+
+static inline void
+env_start(struct envbuf *e, char *buf, uint32_t cap)
+{
+	e->buf = buf;
+	e->cap = cap;
+	e->len = ENV_HDR_LEN;
+	e->count = 0;
+}
+
+static inline int
+env_fits(const struct envbuf *e, uint32_t klen, uint32_t vlen)
+{
+	return ((uint64_t)e->len + (e->count + 1) * ENV_IDX_LEN + klen +
+	    vlen <= e->cap);
+}
+
+/* the caller has checked env_fits() */
+static inline void
+env_add(struct envbuf *e, const void *key, uint32_t klen, const void *val,
+		uint32_t vlen)
+{
+	char *idx = e->buf + e->cap - (e->count + 1) * ENV_IDX_LEN;
+
+	env_put32(idx, e->len);
+	env_put32(idx + 4, klen);
+	env_put32(idx + 8, vlen);
+	memcpy(e->buf + e->len, key, klen);
+	memcpy(e->buf + e->len + klen, val, vlen);
+	e->len += klen + vlen;
+	e->count++;
+}
+
+/* fill in the header and the index, returns the envelope's length */
+static inline uint32_t
+env_finish(struct envbuf *e)
+{
+	uint32_t ilen = e->count * ENV_IDX_LEN;
+	char *idx = e->buf + e->len, tmp[ENV_IDX_LEN];
+
+	/* the index was built backwards from the end of the buffer */
+	memmove(idx, e->buf + e->cap - ilen, ilen);
+	for (uint32_t i = 0, j = e->count - 1; e->count > 0 && i < j;
+	    i++, j--) {
+		memcpy(tmp, idx + i * ENV_IDX_LEN, ENV_IDX_LEN);
+		memcpy(idx + i * ENV_IDX_LEN, idx + j * ENV_IDX_LEN,
+		    ENV_IDX_LEN);
+		memcpy(idx + j * ENV_IDX_LEN, tmp, ENV_IDX_LEN);
+	}
+	e->buf[0] = ENV_MAGIC0;
+	e->buf[1] = ENV_MAGIC1;
+	e->buf[2] = ENV_VERSION;
+	e->buf[3] = 0;
+	env_put32(e->buf + 4, e->count);
+	env_put32(e->buf + 8, e->len + ilen);
+	env_put32(e->buf + 12, e->len);
+	return (e->len + ilen);
+}
+
+/*
+ * Number of messages in the envelope at val, or 0 if it isn't one.
+ * Checks every index entry, so env_msg() can trust them.
+ */
+static inline uint32_t
+env_count(const void *val, uint32_t vlen)
+{
+	const unsigned char *p = val;
+	uint32_t count, ioff, off, klen, mlen;
+
+	if (vlen < ENV_HDR_LEN || p[0] != ENV_MAGIC0 ||
+	    p[1] != ENV_MAGIC1 || p[2] != ENV_VERSION)
+		return (0);
+	count = env_get32(p + 4);
+	ioff = env_get32(p + 12);
+	if (env_get32(p + 8) != vlen || ioff < ENV_HDR_LEN || ioff > vlen ||
+	    (vlen - ioff) / ENV_IDX_LEN != count ||
+	    (vlen - ioff) % ENV_IDX_LEN != 0)
+		return (0);
+	for (uint32_t i = 0; i < count; i++) {
+		off = env_get32(p + ioff + i * ENV_IDX_LEN);
+		klen = env_get32(p + ioff + i * ENV_IDX_LEN + 4);
+		mlen = env_get32(p + ioff + i * ENV_IDX_LEN + 8);
+		if (off < ENV_HDR_LEN || off > ioff || klen > ioff - off ||
+		    mlen > ioff - off - klen)
+			return (0);
+	}
+	return (count);
+}
+
+static inline void
+env_msg(const void *val, uint32_t i, const char **key, uint32_t *klen,
+		const char **mval, uint32_t *mlen)
+{
+	const char *p = val;
+	const char *idx = p + env_get32(p + 12) + i * ENV_IDX_LEN;
+	uint32_t off = env_get32(idx);
+
+	*klen = env_get32(idx + 4);
+	*mlen = env_get32(idx + 8);
+	*key = p + off;
+	*mval = p + off + *klen;
+}
+
+#endif /* ENVELOPE_H */
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include "evloop.h"
+
+#define EV_FD 0
+#define EV_TIMER 1
+#define EV_WAKE 2
+
+static int
+ev_add(struct evloop *ev, int fd, int kind, ev_handler fn, void *arg)
+{
+	struct ev_source *src;
+	struct epoll_event e;
+
+	if (ev->nsources == EV_MAX_SOURCES)
+		return (-1);
+	src = &ev->sources[ev->nsources];
+	src->fd = fd;
+	src->kind = kind;
+	src->fn = fn;
+	src->arg = arg;
+
+	memset(&e, 0, sizeof (e));
+	e.events = EPOLLIN;
+	e.data.ptr = src;
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &e) != 0)
+		return (-1);
+	ev->nsources++;
+	return (EXIT_SUCCESS);
+}
+
+int
+evloop_init(struct evloop *ev)
+{
+	memset(ev, 0, sizeof (*ev));
+	ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev->epfd < 0)
+		return (-1);
+	ev->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ev->wakefd < 0) {
+		close(ev->epfd);
+		return (-1);
+	}
+	if (ev_add(ev, ev->wakefd, EV_WAKE, NULL, NULL) != 0) {
+		evloop_destroy(ev);
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/* fn runs when fd is readable, it has to do the reading */
+int
+evloop_add_fd(struct evloop *ev, int fd, ev_handler fn, void *arg)
+{
+	return (ev_add(ev, fd, EV_FD, fn, arg));
+}
+
+/* fn runs every interval_ms, first time one interval from now */
+int
+evloop_add_timer(struct evloop *ev, long interval_ms, ev_handler fn,
+		void *arg)
+{
+	struct itimerspec its;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+		return (-1);
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(fd, 0, &its, NULL) != 0 ||
+	    ev_add(ev, fd, EV_TIMER, fn, arg) != 0) {
+		close(fd);
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+int
+evloop_run(struct evloop *ev)
+{
+	struct epoll_event evs[EV_MAX_SOURCES];
+	struct ev_source *src;
+	uint64_t n;
+	int nev, ret_val;
+
+	while (!__atomic_load_n(&ev->stop, __ATOMIC_ACQUIRE)) {
+		nev = epoll_wait(ev->epfd, evs, EV_MAX_SOURCES, -1);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		for (int i = 0; i < nev; i++) {
+			src = evs[i].data.ptr;
+
+			/* timers and wakeups just need their count cleared */
+			if (src->kind != EV_FD)
+				(void) read(src->fd, &n, sizeof (n));
+			if (src->kind == EV_WAKE)
+				continue;
+			ret_val = src->fn(src->arg);
+			if (EXIT_SUCCESS != ret_val)
+				return (ret_val);
+		}
+	}
+	return (EXIT_SUCCESS);
+}
+
+/* safe from any thread */
+void
+evloop_stop(struct evloop *ev)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&ev->stop, 1, __ATOMIC_RELEASE);
+	(void) write(ev->wakefd, &one, sizeof (one));
+}
+
+void
+evloop_destroy(struct evloop *ev)
+{
+	/* only the fds we created, evloop_add_fd() ones belong to the caller */
+	for (int i = 0; i < ev->nsources; i++)
+		if (ev->sources[i].kind != EV_FD)
+			close(ev->sources[i].fd);
+	close(ev->epfd);
+}
+
+/*
+ * Parse one command line in place.  Returns 1 if c holds a command,
+ * 0 for a blank line.
+ */
+int
+cmd_parse(char *line, struct cmd *c)
+{
+	char *end, *word, *rest;
+	long val;
+
+	while (isspace((unsigned char)*line))
+		line++;
+	end = line + strlen(line);
+	while (end > line && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	if (*line == '\0')
+		return (0);
+
+	c->op = CMD_UNKNOWN;
+	c->arg = 0;
+	c->line = line;
+
+	/* the old protocol, just a number */
+	val = strtol(line, &end, 10);
+	if (end != line && *end == '\0') {
+		if (val == FAIL_OVER_CODE)
+			c->op = CMD_FAILOVER;
+		else if (val == FAIL_BACK_CODE)
+			c->op = CMD_FAILBACK;
+		else if (val >= 0) {
+			c->op = CMD_RATE;
+			c->arg = val;
+		}
+		return (1);
+	}
+
+	word = line;
+	rest = word + strcspn(word, " \t");
+	if (*rest != '\0') {
+		*rest++ = '\0';
+		while (isspace((unsigned char)*rest))
+			rest++;
+	}
+
+	if (strcmp(word, "rate") == 0) {
+		val = strtol(rest, &end, 10);
+		if (end != rest && *end == '\0' && val >= 0) {
+			c->op = CMD_RATE;
+			c->arg = val;
+		}
+	} else if (*rest != '\0') {
+		/* none of the others take an argument */
+	} else if (strcmp(word, "failover") == 0) {
+		c->op = CMD_FAILOVER;
+	} else if (strcmp(word, "failback") == 0) {
+		c->op = CMD_FAILBACK;
+	} else if (strcmp(word, "flush") == 0) {
+		c->op = CMD_FLUSH;
+	} else if (strcmp(word, "stats") == 0) {
+		c->op = CMD_STATS;
+	} else if (strcmp(word, "stop") == 0) {
+		c->op = CMD_STOP;
+	}
+	return (1);
+}
+
+/*
+ * Read whatever is waiting on the (non-blocking) command fd and hand
+ * each complete line to fn.  A partial line is kept in cb for the next
+ * read.
+ */
+int
+cmd_read(int fd, struct cmdbuf *cb, cmd_handler fn, void *arg)
+{
+	struct cmd c;
+	char *nl, *start;
+	ssize_t n;
+	int ret_val;
+
+	for (;;) {
+		n = read(fd, cb->buf + cb->len, sizeof (cb->buf) - 1 - cb->len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (EXIT_SUCCESS);
+			return (-1);
+		}
+		if (n == 0)
+			return (EXIT_SUCCESS);
+		cb->len += n;
+		cb->buf[cb->len] = '\0';
+
+		start = cb->buf;
+		while ((nl = memchr(start, '\n', cb->buf + cb->len - start))
+		    != NULL) {
+			*nl = '\0';
+			if (cmd_parse(start, &c)) {
+				ret_val = fn(&c, arg);
+				if (EXIT_SUCCESS != ret_val)
+					return (ret_val);
+			}
+			start = nl + 1;
+		}
+		cb->len -= start - cb->buf;
+		memmove(cb->buf, start, cb->len);
+
+		/* no newline in a whole buffer, it's not a command */
+		if (cb->len == sizeof (cb->buf) - 1)
+			cb->len = 0;
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <stddef.h>
+
+/*
+ * Control event loop
+ * ------------------
+ * A small epoll loop for the control side of the producer and
+ * consumer: the command pipe, periodic timers (timerfd) and wakeups
+ * from other threads (eventfd).  The thread running evloop_run() sleeps
+ * in epoll_wait() until one of them fires, so an idle process burns
+ * no CPU and a command is acted on as soon as it is written.
+ *
+ * Handlers return EXIT_SUCCESS to keep going, anything else stops the
+ * loop and becomes evloop_run()'s return value.  evloop_stop() may be
+ * called from any thread.
+ *
+ * Commands are newline-terminated lines, several may arrive in one
+ * write:
+ *
+ *   rate N      send N messages per second (producer)
+ *   failover    switch to the backup cluster
+ *   failback    switch back to the primary cluster
+ *   flush       push out anything buffered
+ *   stats       dump counters to stderr
+ *   stop        finish up as if the input had run out (producer)
+ *
+ * A bare number is the old protocol: 999 is failover, 998 failback,
+ * anything else a rate.
+ */
+
+#define EV_MAX_SOURCES 8
+#define CMD_LINE_MAX 256
+
+/* old numeric failover codes from the UI */
+#define FAIL_OVER_CODE 999
+#define FAIL_BACK_CODE 998
+
+#define CMD_UNKNOWN 0
+#define CMD_RATE 1
+#define CMD_FAILOVER 2
+#define CMD_FAILBACK 3
+#define CMD_FLUSH 4
+#define CMD_STATS 5
+#define CMD_STOP 6
+
+struct cmd {
+	int op;
+	long arg;
+	const char *line;	/* command word, for error messages */
+};
+
+typedef int (*ev_handler)(void *arg);
+typedef int (*cmd_handler)(struct cmd *c, void *arg);
+
+struct ev_source {
+	int fd;
+	int kind;
+	ev_handler fn;
+	void *arg;
+};
+
+struct evloop {
+	int epfd;
+	int wakefd;
+	int stop;
+	int nsources;
+	struct ev_source sources[EV_MAX_SOURCES];
+};
+
+/* partial command line carried between reads */
+struct cmdbuf {
+	char buf[CMD_LINE_MAX];
+	size_t len;
+};
+
+int evloop_init(struct evloop *ev);
+int evloop_add_fd(struct evloop *ev, int fd, ev_handler fn, void *arg);
+int evloop_add_timer(struct evloop *ev, long interval_ms, ev_handler fn,
+    void *arg);
+int evloop_run(struct evloop *ev);
+void evloop_stop(struct evloop *ev);
+void evloop_destroy(struct evloop *ev);
+
+int cmd_parse(char *line, struct cmd *c);
+int cmd_read(int fd, struct cmdbuf *cb, cmd_handler fn, void *arg);
+
+#endif /* EVLOOP_H */
@@ -0,0 +1,82 @@
+#include <string.h>
+#include "hist.h"
+
+static int
+hist_index(uint64_t v)
+{
+	int msb, e;
+
+	if (v < HIST_LINEAR)
+		return ((int)v);
+	msb = 63 - __builtin_clzll(v);
+	e = msb - HIST_SUB_BITS;
+	return (HIST_LINEAR + (msb - HIST_SUB_BITS - 1) * HIST_SUB +
+	    (int)((v >> e) - HIST_SUB));
+}
+
+/* highest value that lands in bucket i */
+static uint64_t
+hist_value(int i)
+{
+	int k, e;
+
+	if (i < HIST_LINEAR)
+		return ((uint64_t)i);
+	k = i - HIST_LINEAR;
+	e = k / HIST_SUB + 1;
+	return ((((uint64_t)(HIST_SUB + k % HIST_SUB) + 1) << e) - 1);
+}
+
+void
+hist_record(struct hist *h, uint64_t v)
+{
+	uint64_t max;
+
+	__atomic_fetch_add(&h->b[hist_index(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Take the counts recorded so far and start over.  Values recorded
+ * while this runs land in one interval or the other, never neither.
+ */
+void
+hist_snapshot(struct hist *h, struct hist *snap)
+{
+	memset(snap, 0, sizeof (*snap));
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (__atomic_load_n(&h->b[i], __ATOMIC_RELAXED) == 0)
+			continue;
+		snap->b[i] = __atomic_exchange_n(&h->b[i], 0,
+		    __ATOMIC_RELAXED);
+		snap->count += snap->b[i];
+	}
+	(void) __atomic_fetch_sub(&h->count, snap->count, __ATOMIC_RELAXED);
+	snap->max = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+}
+
+/* value at or below which pct percent of the samples fall */
+uint64_t
+hist_percentile(const struct hist *h, double pct)
+{
+	unsigned long want, seen = 0;
+	uint64_t v;
+
+	if (h->count == 0)
+		return (0);
+	want = (unsigned long)(h->count * pct / 100.0 + 0.5);
+	if (want < 1)
+		want = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen >= want) {
+			v = hist_value(i);
+			return (v < h->max ? v : h->max);
+		}
+	}
+	return (h->max);
+}
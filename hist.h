@@ -0,0 +1,35 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+
+/*
+ * Latency histogram
+ * -----------------
+ * Log-linear buckets in the style of HdrHistogram: values below 64 get
+ * a bucket each, above that every power of two is split into 32
+ * buckets, so any recorded value is off by at most 1/32 (~3%) whatever
+ * its magnitude.  Recording is a couple of shifts and one atomic add,
+ * safe from any thread (the producer records from its ack callbacks).
+ *
+ * hist_snapshot() moves the counts into a private copy and zeroes the
+ * live histogram, so each report covers just the interval since the
+ * last one.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB)
+#define HIST_BUCKETS (HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * HIST_SUB)
+
+struct hist {
+	unsigned long count;
+	uint64_t max;
+	unsigned long b[HIST_BUCKETS];
+};
+
+void hist_record(struct hist *h, uint64_t v);
+void hist_snapshot(struct hist *h, struct hist *snap);
+uint64_t hist_percentile(const struct hist *h, double pct);
+
+#endif /* HIST_H */
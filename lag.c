@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lag.h"
+
+static int64_t
+wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* with the lock held; entries are never removed, so pointers stay good */
+static struct lag_part *
+part_find(struct lag *l, const char *topic, int partition)
+{
+	for (int i = 0; i < l->nparts; i++) {
+		if (l->parts[i].partition == partition &&
+		    strcmp(l->parts[i].topic, topic) == 0)
+			return (&l->parts[i]);
+	}
+	return (NULL);
+}
+
+int
+lag_init(struct lag *l)
+{
+	int ret_val;
+
+	memset(l, 0, sizeof (*l));
+	pthread_mutex_init(&l->lock, NULL);
+	ret_val = streams_config_create(&l->config);
+	if (EXIT_SUCCESS != ret_val)
+		return (ret_val);
+	/* no group.id: the probe must not take partitions from anyone */
+	ret_val = streams_consumer_create(l->config, &l->probe);
+	if (EXIT_SUCCESS != ret_val) {
+		streams_config_destroy(l->config);
+		return (ret_val);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/* from the assigned callback, with where the client will read from */
+void
+lag_assigned(struct lag *l, streams_topic_partition_t tp, int64_t position)
+{
+	char topic[LAG_TOPIC_MAX];
+	struct lag_part *p;
+	int partition;
+
+	if (streams_topic_partition_get_topic(tp, topic, sizeof (topic)) != 0 ||
+	    streams_topic_partition_get_partitionid(tp, &partition) != 0)
+		return;
+	pthread_mutex_lock(&l->lock);
+	if ((p = part_find(l, topic, partition)) == NULL &&
+	    l->nparts < LAG_MAX_PARTS &&
+	    streams_topic_partition_create(topic, partition,
+	    &l->parts[l->nparts].tp) == 0) {
+		p = &l->parts[l->nparts++];
+		snprintf(p->topic, sizeof (p->topic), "%s", topic);
+		p->partition = partition;
+	}
+	if (p != NULL) {
+		p->held = 1;
+		p->next = position;
+		p->ts_ms = wall_ms();
+		p->end = -1;
+		l->changed = 1;
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+void
+lag_revoked(struct lag *l, streams_topic_partition_t tp)
+{
+	char topic[LAG_TOPIC_MAX];
+	struct lag_part *p;
+	int partition;
+
+	if (streams_topic_partition_get_topic(tp, topic, sizeof (topic)) != 0 ||
+	    streams_topic_partition_get_partitionid(tp, &partition) != 0)
+		return;
+	pthread_mutex_lock(&l->lock);
+	if ((p = part_find(l, topic, partition)) != NULL && p->held) {
+		p->held = 0;
+		l->changed = 1;
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+/* the last message of a polled record */
+void
+lag_polled(struct lag *l, const char *topic, int partition, int64_t offset,
+		int64_t ts_ms)
+{
+	struct lag_part *p;
+
+	pthread_mutex_lock(&l->lock);
+	if ((p = part_find(l, topic, partition)) != NULL &&
+	    offset + 1 > p->next) {
+		p->next = offset + 1;
+		p->ts_ms = ts_ms;
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+/*
+ * Control loop: where each partition ends now.  The client calls are
+ * made without the lock, so polling doesn't wait on them.
+ */
+int
+lag_probe(struct lag *l)
+{
+	streams_topic_partition_t tps[LAG_MAX_PARTS];
+	int idx[LAG_MAX_PARTS];
+	int64_t end[LAG_MAX_PARTS];
+	uint32_t n = 0;
+	int changed, ret_val;
+
+	pthread_mutex_lock(&l->lock);
+	for (int i = 0; i < l->nparts; i++) {
+		if (!l->parts[i].held)
+			continue;
+		idx[n] = i;
+		tps[n++] = l->parts[i].tp;
+	}
+	changed = l->changed;
+	l->changed = 0;
+	pthread_mutex_unlock(&l->lock);
+
+	l->probes++;
+	if (changed)
+		ret_val = streams_consumer_assign_partitions(l->probe, tps, n);
+	else
+		ret_val = EXIT_SUCCESS;
+	if (EXIT_SUCCESS == ret_val && n > 0)
+		ret_val = streams_consumer_seek_to_end(l->probe, tps, n);
+	for (uint32_t k = 0; k < n && EXIT_SUCCESS == ret_val; k++)
+		ret_val = streams_consumer_get_position(l->probe, tps[k],
+		    &end[k]);
+	if (EXIT_SUCCESS != ret_val) {
+		/* assign again next time, in case that's what failed */
+		__atomic_store_n(&l->changed, 1, __ATOMIC_RELAXED);
+		l->failures++;
+		return (ret_val);
+	}
+
+	pthread_mutex_lock(&l->lock);
+	for (uint32_t k = 0; k < n; k++)
+		l->parts[idx[k]].end = end[k];
+	pthread_mutex_unlock(&l->lock);
+	return (EXIT_SUCCESS);
+}
+
+/* the partitions we hold and have probed, up to max of them */
+int
+lag_get(struct lag *l, int64_t now_ms, struct lag_stat *st, int max)
+{
+	struct lag_part *p;
+	int n = 0;
+
+	pthread_mutex_lock(&l->lock);
+	for (int i = 0; i < l->nparts && n < max; i++) {
+		p = &l->parts[i];
+		if (!p->held || p->end < 0 || p->next < 0)
+			continue;
+		st[n].topic = p->topic;
+		st[n].partition = p->partition;
+		st[n].offsets = p->end > p->next ? p->end - p->next : 0;
+		st[n].ms = st[n].offsets > 0 && now_ms > p->ts_ms ?
+		    now_ms - p->ts_ms : 0;
+		n++;
+	}
+	pthread_mutex_unlock(&l->lock);
+	return (n);
+}
+
+void
+lag_destroy(struct lag *l)
+{
+	streams_consumer_destroy(l->probe);
+	streams_config_destroy(l->config);
+	for (int i = 0; i < l->nparts; i++)
+		streams_topic_partition_destroy(l->parts[i].tp);
+}
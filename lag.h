@@ -0,0 +1,74 @@
+#ifndef LAG_H
+#define LAG_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <streams/streams.h>
+
+/*
+ * Consumer lag
+ * ------------
+ * How far behind the producers each partition we hold is, worked out
+ * in the consumer rather than by asking the cluster for every
+ * consumer's offsets.
+ *
+ *   - The poll threads note the offset and timestamp of the last
+ *     message of each record they poll, once per record, not per
+ *     message.  A newly assigned partition starts from the position
+ *     the client has for it.
+ *   - Every LAG_PROBE_MS the control loop asks a probe consumer of its
+ *     own, assigned the same partitions but in no group, for the end
+ *     of each one: seek_to_end() then get_position().
+ *
+ * Offset lag is the end less what has been polled; time lag is how
+ * old the last message polled is, if there's anything left to read,
+ * or how long ago we got the partition if nothing has been polled
+ * yet.  Both count from the poll, so messages waiting for a -w worker
+ * don't show up as lag.  Safe to call from several poll threads.
+ */
+
+#define LAG_PROBE_MS 250
+#define LAG_MAX_PARTS 1024
+#define LAG_TOPIC_MAX 256
+
+struct lag_part {
+	char topic[LAG_TOPIC_MAX];
+	int partition;
+	streams_topic_partition_t tp;	/* for the probe */
+	int held;
+	int64_t next;		/* offset after the last one polled, -1 unknown */
+	int64_t ts_ms;		/* when that one was produced */
+	int64_t end;		/* at the last probe, -1 if there's been none */
+};
+
+struct lag {
+	pthread_mutex_t lock;
+	int nparts;
+	struct lag_part parts[LAG_MAX_PARTS];
+	int changed;		/* the probe needs reassigning */
+
+	/* only the control loop touches the probe */
+	streams_config_t config;
+	streams_consumer_t probe;
+	unsigned long probes;
+	unsigned long failures;
+};
+
+struct lag_stat {
+	const char *topic;
+	int partition;
+	int64_t offsets;
+	int64_t ms;
+};
+
+int lag_init(struct lag *l);
+void lag_assigned(struct lag *l, streams_topic_partition_t tp,
+    int64_t position);
+void lag_revoked(struct lag *l, streams_topic_partition_t tp);
+void lag_polled(struct lag *l, const char *topic, int partition,
+    int64_t offset, int64_t ts_ms);
+int lag_probe(struct lag *l);
+int lag_get(struct lag *l, int64_t now_ms, struct lag_stat *st, int max);
+void lag_destroy(struct lag *l);
+
+#endif /* LAG_H */
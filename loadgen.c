@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "loadgen.h"
+
+/* "n" or "min-max", each at most limit */
+int
+lg_parse_size(struct lg_size *sz, const char *spec, uint32_t limit)
+{
+	char *end;
+
+	sz->min = sz->max = strtoul(spec, &end, 10);
+	if (*end == '-')
+		sz->max = strtoul(end + 1, &end, 10);
+	if (end == spec || *end != '\0' || sz->min == 0 ||
+	    sz->max < sz->min || sz->max > limit)
+		return (-1);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * len bytes of made-up sensor readings, one after another, with the
+ * usual mix of repeated field names and varying numbers.
+ */
+char *
+lg_template(size_t len, uint64_t seed)
+{
+	char *t, line[128];
+	size_t off = 0, n;
+	uint64_t r = seed | 1;
+
+	if ((t = malloc(len + sizeof (line))) == NULL)
+		return (NULL);
+	while (off < len) {
+		n = snprintf(line, sizeof (line), "{\"id\":%lu,\"sensor\":"
+		    "\"s%lu\",\"temp\":%lu.%lu,\"hum\":%lu,\"ts\":%lu}\n",
+		    (unsigned long)(lg_rand(&r) % 1000000),
+		    (unsigned long)(lg_rand(&r) % 500),
+		    (unsigned long)(lg_rand(&r) % 100),
+		    (unsigned long)(lg_rand(&r) % 10),
+		    (unsigned long)(lg_rand(&r) % 100),
+		    1600000000UL + (unsigned long)(off / 64));
+		memcpy(t + off, line, n);
+		off += n;
+	}
+	return (t);
+}
+
+/*
+ * The timestamp field of a JSON line, in ns since the epoch.  Only
+ * looks at the first "field": in the line, which needn't be
+ * NUL-terminated.
+ */
+int
+lg_line_ts(const char *line, size_t len, const char *field, uint64_t *ns)
+{
+	size_t flen = strlen(field), i;
+	const char *p, *end = line + len;
+	double v = 0, scale;
+
+	for (p = line; (p = memchr(p, '"', end - p)) != NULL; p++) {
+		if ((size_t)(end - p) > flen + 2 && p[flen + 1] == '"' &&
+		    memcmp(p + 1, field, flen) == 0)
+			break;
+	}
+	if (p == NULL)
+		return (-1);
+	for (p += flen + 2; p < end && (*p == ' ' || *p == ':'); p++)
+		;
+	for (i = 0; p < end && *p >= '0' && *p <= '9'; p++, i++)
+		v = v * 10 + (*p - '0');
+	if (i == 0)
+		return (-1);
+	if (p < end && *p == '.') {
+		for (p++, scale = 0.1; p < end && *p >= '0' && *p <= '9';
+		    p++, scale /= 10)
+			v += (*p - '0') * scale;
+	}
+
+	/* seconds until 5138 AD, then ms, us and ns */
+	if (v < 1e11)
+		v *= 1e9;
+	else if (v < 1e14)
+		v *= 1e6;
+	else if (v < 1e17)
+		v *= 1e3;
+	*ns = v;
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,67 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Load generation
+ * ---------------
+ * Helpers for the producer's replay and synthetic modes:
+ *
+ *   -L n       go through the input n times, 0 for until told to stop
+ *   -N n       stop after n records
+ *   -W f[,ts]  send each line when its timestamp field (default "ts")
+ *              comes due, with time running f times as fast as it did
+ *              in the input
+ *   -G         no input, send synthetic values; -K and -V set the key
+ *              and value sizes, "n" or "min-max" for a uniform spread
+ *
+ * Synthetic values are slices of one template built at startup, so
+ * nothing is generated or copied per record: a value is a pointer
+ * and a length, like a line in the input mapping (-m).  The template
+ * is JSON-like text so compression (-Z) sees something realistic, but
+ * a value is just bytes and has no trailing newline.
+ *
+ * Timestamps may be in seconds, milliseconds, microseconds or
+ * nanoseconds since the epoch, told apart by their size.
+ */
+
+/* spare template past the biggest value, for picking offsets in */
+#define LG_TEMPLATE_SLACK 4096
+
+/* biggest synthetic key, without its rechdr.h header */
+#define LG_KEY_MAX 128
+
+struct lg_size {
+	uint32_t min;
+	uint32_t max;
+};
+
+int lg_parse_size(struct lg_size *sz, const char *spec, uint32_t limit);
+char *lg_template(size_t len, uint64_t seed);
+int lg_line_ts(const char *line, size_t len, const char *field,
+    uint64_t *ns);
+
+/* xorshift64*, a sender's own generator */
+static inline uint64_t
+lg_rand(uint64_t *s)
+{
+	*s ^= *s >> 12;
+	*s ^= *s << 25;
+	*s ^= *s >> 27;
+	return (*s * 2685821657736338717ULL);
+}
+
+/* a size from the spread, the same every time for a given n */
+static inline uint32_t
+lg_size_for(const struct lg_size *sz, uint64_t n)
+{
+	uint64_t s = n * 0x9e3779b97f4a7c15ULL + 1;
+
+	if (sz->max == sz->min)
+		return (sz->min);
+	return (sz->min + lg_rand(&s) % (sz->max - sz->min + 1));
+}
+
+#endif /* LOADGEN_H */
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapinput.h"
+
+/* map fname, NULL if it can't be */
+struct mapinput *
+mapinput_open(const char *fname)
+{
+	struct mapinput *mi;
+	struct stat st;
+
+	if ((mi = calloc(1, sizeof (*mi))) == NULL)
+		return (NULL);
+	mi->fd = open(fname, O_RDONLY);
+	if (mi->fd < 0) {
+		free(mi);
+		return (NULL);
+	}
+
+	if (fstat(mi->fd, &st) < 0) {
+		close(mi->fd);
+		free(mi);
+		return (NULL);
+	}
+	mi->size = st.st_size;
+
+	/* an empty file can't be mapped, treat it as no lines */
+	if (mi->size > 0) {
+		mi->base = mmap(NULL, mi->size, PROT_READ, MAP_SHARED,
+		    mi->fd, 0);
+		if (mi->base == MAP_FAILED) {
+			close(mi->fd);
+			free(mi);
+			return (NULL);
+		}
+		(void) madvise(mi->base, mi->size, MADV_SEQUENTIAL);
+	}
+	mi->refs = 1;
+	return (mi);
+}
+
+/*
+ * Hand out the next line before `end'.  glibc's memchr() scans with
+ * SSE2/AVX2, so finding the newline costs a fraction of a
+ * byte-at-a-time loop.
+ */
+static int
+next_line(struct mapinput *mi, size_t *pos, size_t end,
+		const char **line, size_t *len)
+{
+	const char *start, *nl;
+	size_t left;
+
+	if (*pos >= end)
+		return (0);
+
+	start = mi->base + *pos;
+	left = end - *pos;
+	nl = memchr(start, '\n', left);
+	*len = nl != NULL ? (size_t)(nl - start) + 1 : left;
+	*line = start;
+	*pos += *len;
+	return (1);
+}
+
+int
+mapinput_next(struct mapinput *mi, const char **line, size_t *len)
+{
+	return (next_line(mi, &mi->pos, mi->size, line, len));
+}
+
+/* first line start at or after off */
+static size_t
+line_start(struct mapinput *mi, size_t off)
+{
+	const char *nl;
+
+	if (off == 0 || off >= mi->size)
+		return (off < mi->size ? off : mi->size);
+	if (mi->base[off - 1] == '\n')
+		return (off);
+	nl = memchr(mi->base + off, '\n', mi->size - off);
+	return (nl != NULL ? (size_t)(nl - mi->base) + 1 : mi->size);
+}
+
+/*
+ * Split the file into nshards byte ranges of about the same size, each
+ * moved forward to the next line start so no line is split or sent
+ * twice.  A shard can come out empty if lines are longer than the
+ * shard size.
+ */
+void
+mapinput_shard(struct mapinput *mi, int nshards, int idx,
+		struct mapshard *sh)
+{
+	sh->mi = mi;
+	sh->pos = line_start(mi, mi->size / nshards * idx);
+	sh->end = idx == nshards - 1 ? mi->size :
+	    line_start(mi, mi->size / nshards * (idx + 1));
+}
+
+int
+mapshard_next(struct mapshard *sh, const char **line, size_t *len)
+{
+	return (next_line(sh->mi, &sh->pos, sh->end, line, len));
+}
+
+void
+mapinput_hold(struct mapinput *mi)
+{
+	__atomic_fetch_add(&mi->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+mapinput_release(struct mapinput *mi)
+{
+	if (__atomic_sub_fetch(&mi->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if (mi->base != NULL)
+		munmap(mi->base, mi->size);
+	close(mi->fd);
+	free(mi);
+}
@@ -0,0 +1,47 @@
+#ifndef MAPINPUT_H
+#define MAPINPUT_H
+
+#include <stddef.h>
+
+/*
+ * Memory-mapped producer input
+ * ----------------------------
+ * The input file is mapped read-only and handed out one line at a time
+ * as pointers into the mapping, so records can be created without
+ * copying the data.  Lines include their trailing newline (if any) and
+ * are not NUL-terminated.
+ *
+ * The file can also be cut into shards on line boundaries so several
+ * threads can each walk their own byte range of it.
+ *
+ * The mapping is reference counted: the reader holds one reference from
+ * mapinput_open() until it calls mapinput_release(), and each record
+ * sent out of the mapping should take a reference with mapinput_hold()
+ * and drop it from the producer callback.  The file is unmapped and the
+ * struct freed when the last reference goes away, so a callback that
+ * comes after the reader has given up still has something to release.
+ */
+struct mapinput {
+	int fd;
+	char *base;
+	size_t size;
+	size_t pos;
+	int refs;
+};
+
+/* one thread's share of the mapping, [pos, end) */
+struct mapshard {
+	struct mapinput *mi;
+	size_t pos;
+	size_t end;
+};
+
+struct mapinput *mapinput_open(const char *fname);
+int mapinput_next(struct mapinput *mi, const char **line, size_t *len);
+void mapinput_shard(struct mapinput *mi, int nshards, int idx,
+    struct mapshard *sh);
+int mapshard_next(struct mapshard *sh, const char **line, size_t *len);
+void mapinput_hold(struct mapinput *mi);
+void mapinput_release(struct mapinput *mi);
+
+#endif /* MAPINPUT_H */
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "metrics.h"
+
+/* how often the sender thread wakes up to drain the queue */
+#define METRICS_DRAIN_MS 50
+
+/* reconnect backoff bounds */
+#define METRICS_BACKOFF_MIN_MS 100
+#define METRICS_BACKOFF_MAX_MS 5000
+#define METRICS_CONNECT_TIMEOUT_MS 1000
+
+/* lines waiting to go out on the socket */
+#define METRICS_OUTBUF_LEN 65536
+
+/*
+ * Bounded multi-producer queue: each slot carries a sequence number
+ * that tells producers whether it is free and the sender thread
+ * whether it has been filled, so neither side needs a lock.
+ */
+struct mslot {
+	unsigned long seq;
+	long value;
+	time_t ts;
+	char name[METRICS_NAME_MAX];
+};
+
+static struct mslot mq[METRICS_QUEUE_LEN];
+static unsigned long mq_tail;	/* next slot to fill, shared by producers */
+static unsigned long mq_head;	/* next slot to drain, sender thread only */
+
+static const char *mhost, *mport;
+static char mtag[128];
+static int msock = -1;
+static int mstop;
+static int mrunning;
+static pthread_t mthread;
+static struct metrics_stats mstats;
+
+static char outbuf[METRICS_OUTBUF_LEN];
+static size_t outlen;
+
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+stat_inc(unsigned long *c)
+{
+	__atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+}
+
+/* a slot on the queue for the sample, -1 if it's full */
+static int
+metrics_enqueue(const char *name, long value)
+{
+	struct mslot *s;
+	unsigned long pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&mq_tail, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &mq[pos % METRICS_QUEUE_LEN];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&mq_tail, &pos, pos + 1,
+			    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return (-1);
+		} else {
+			pos = __atomic_load_n(&mq_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	snprintf(s->name, sizeof (s->name), "%s", name);
+	s->value = value;
+	s->ts = time(NULL);
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	stat_inc(&mstats.queued);
+	return (EXIT_SUCCESS);
+}
+
+int
+metrics_put(const char *name, long value)
+{
+	if (metrics_enqueue(name, value) != EXIT_SUCCESS) {
+		/* queue is full, the sender is not keeping up */
+		stat_inc(&mstats.dropped);
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Like metrics_put(), but when the queue is full wait up to timeout_ms
+ * for the sender thread to drain it.  For callers that produce big
+ * batches of samples and can afford to wait, not for hot paths.
+ */
+int
+metrics_put_wait(const char *name, long value, long timeout_ms)
+{
+	struct timespec ts = { 0, METRICS_DRAIN_MS * 1000000L / 4 };
+	long deadline = now_ms() + timeout_ms;
+
+	while (metrics_enqueue(name, value) != EXIT_SUCCESS) {
+		if (now_ms() >= deadline) {
+			stat_inc(&mstats.dropped);
+			return (-1);
+		}
+		nanosleep(&ts, NULL);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/* move everything queued so far into outbuf as opentsdb put lines */
+static void
+metrics_drain(void)
+{
+	struct mslot *s;
+	char line[METRICS_NAME_MAX + 192];
+	int n;
+
+	for (;;) {
+		s = &mq[mq_head % METRICS_QUEUE_LEN];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != mq_head + 1)
+			break;
+
+		n = snprintf(line, sizeof (line), "put %s %ld %ld %s\n",
+		    s->name, (long)s->ts, s->value, mtag);
+		if (n > 0 && (size_t)n < sizeof (line) &&
+		    outlen + n <= sizeof (outbuf)) {
+			memcpy(outbuf + outlen, line, n);
+			outlen += n;
+		} else {
+			stat_inc(&mstats.dropped);
+		}
+
+		__atomic_store_n(&s->seq, mq_head + METRICS_QUEUE_LEN,
+		    __ATOMIC_RELEASE);
+		mq_head++;
+	}
+}
+
+static int
+metrics_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	struct pollfd pfd;
+	socklen_t elen;
+	int fd = -1, err, flags;
+
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(mhost, mport, &hints, &res) != 0)
+		return (-1);
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		/*
+		 * connect without blocking so an unreachable tsd host
+		 * can't hold up metrics_shutdown() for minutes
+		 */
+		flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		err = 0;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+			err = -1;
+			if (errno == EINPROGRESS) {
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				elen = sizeof (err);
+				if (poll(&pfd, 1, METRICS_CONNECT_TIMEOUT_MS) == 1)
+					getsockopt(fd, SOL_SOCKET, SO_ERROR,
+					    &err, &elen);
+			}
+		}
+		if (err == 0) {
+			fcntl(fd, F_SETFL, flags);
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return (fd);
+}
+
+/* push outbuf down the socket, (re)connecting if we have to */
+static void
+metrics_flush(void)
+{
+	static long next_try, backoff = METRICS_BACKOFF_MIN_MS;
+	size_t off = 0;
+	ssize_t n;
+
+	if (outlen == 0)
+		return;
+
+	if (msock < 0) {
+		if (now_ms() < next_try)
+			return;
+		msock = metrics_connect();
+		if (msock < 0) {
+			next_try = now_ms() + backoff;
+			backoff *= 2;
+			if (backoff > METRICS_BACKOFF_MAX_MS)
+				backoff = METRICS_BACKOFF_MAX_MS;
+			return;
+		}
+		backoff = METRICS_BACKOFF_MIN_MS;
+		stat_inc(&mstats.reconnects);
+	}
+
+	while (off < outlen) {
+		n = send(msock, outbuf + off, outlen - off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* keep whatever is left and retry on a new connection */
+			close(msock);
+			msock = -1;
+			break;
+		}
+		off += n;
+	}
+
+	/* count whole lines that made it out */
+	for (size_t i = 0; i < off; i++)
+		if (outbuf[i] == '\n')
+			__atomic_fetch_add(&mstats.sent, 1, __ATOMIC_RELAXED);
+	memmove(outbuf, outbuf + off, outlen - off);
+	outlen -= off;
+}
+
+static void *
+metrics_thread(void *arg)
+{
+	struct timespec ts = { 0, METRICS_DRAIN_MS * 1000000L };
+
+	(void) arg;
+	while (!__atomic_load_n(&mstop, __ATOMIC_ACQUIRE)) {
+		metrics_drain();
+		metrics_flush();
+		nanosleep(&ts, NULL);
+	}
+
+	/* last chance for anything queued before shutdown */
+	metrics_drain();
+	metrics_flush();
+	return (NULL);
+}
+
+int
+metrics_init(void)
+{
+	char hostname[64];
+
+	mhost = getenv("METRICS_HOST");
+	if (mhost == NULL)
+		mhost = METRICS_DEFAULT_HOST;
+	mport = getenv("METRICS_PORT");
+	if (mport == NULL)
+		mport = METRICS_DEFAULT_PORT;
+
+	/* opentsdb wants at least one tag, tag with our host like potsdb did */
+	if (gethostname(hostname, sizeof (hostname)) != 0)
+		strcpy(hostname, "unknown");
+	hostname[sizeof (hostname) - 1] = '\0';
+	snprintf(mtag, sizeof (mtag), "host=%s", hostname);
+
+	for (unsigned long i = 0; i < METRICS_QUEUE_LEN; i++)
+		mq[i].seq = i;
+
+	if (pthread_create(&mthread, NULL, metrics_thread, NULL) != 0)
+		return (-1);
+	mrunning = 1;
+	return (EXIT_SUCCESS);
+}
+
+void
+metrics_get_stats(struct metrics_stats *st)
+{
+	st->queued = __atomic_load_n(&mstats.queued, __ATOMIC_RELAXED);
+	st->sent = __atomic_load_n(&mstats.sent, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&mstats.dropped, __ATOMIC_RELAXED);
+	st->reconnects = __atomic_load_n(&mstats.reconnects, __ATOMIC_RELAXED);
+}
+
+void
+metrics_shutdown(void)
+{
+	if (!mrunning)
+		return;
+	__atomic_store_n(&mstop, 1, __ATOMIC_RELEASE);
+	pthread_join(mthread, NULL);
+	if (msock >= 0)
+		close(msock);
+	msock = -1;
+	mrunning = 0;
+}
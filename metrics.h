@@ -0,0 +1,39 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * In-process OpenTSDB metrics emitter
+ * -----------------------------------
+ * metrics_put() only copies the sample into a lock-free queue, a
+ * background thread drains it and writes batches of "put" lines over
+ * one persistent connection, reconnecting with backoff on failure.
+ *
+ * The defaults below can be overridden with the METRICS_HOST and
+ * METRICS_PORT environment variables, e.g. to point at a local
+ * listener standing in for OpenTSDB.
+ */
+
+/* set this to the hostname of the host running opentsdb */
+#define METRICS_DEFAULT_HOST "node71"
+#define METRICS_DEFAULT_PORT "4242"
+
+/* longest metric name we will queue, including the NUL */
+#define METRICS_NAME_MAX 128
+
+/* number of samples the queue can hold before we start dropping */
+#define METRICS_QUEUE_LEN 1024
+
+struct metrics_stats {
+	unsigned long queued;
+	unsigned long sent;
+	unsigned long dropped;
+	unsigned long reconnects;
+};
+
+int metrics_init(void);
+int metrics_put(const char *name, long value);
+int metrics_put_wait(const char *name, long value, long timeout_ms);
+void metrics_get_stats(struct metrics_stats *st);
+void metrics_shutdown(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "pacer.h"
+
+uint64_t
+pacer_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+pacer_refill(struct pacer *p, uint64_t now)
+{
+	p->tokens += (now - p->last_ns) * p->rate / 1e9;
+	if (p->tokens > p->burst)
+		p->tokens = p->burst;
+	p->last_ns = now;
+}
+
+/*
+ * The bucket has to hold at least one minimum sleep's worth of tokens,
+ * otherwise fast rates would be capped by the sleep granularity.
+ */
+static void
+pacer_set_burst(struct pacer *p)
+{
+	double floor = p->rate * PACER_MIN_SLEEP_NS / 1e9;
+
+	p->burst = p->burst_req > 0 ? p->burst_req :
+	    p->rate * PACER_DEFAULT_BURST_SEC;
+	if (p->burst < floor)
+		p->burst = floor;
+	if (p->burst < 1)
+		p->burst = 1;
+}
+
+void
+pacer_init(struct pacer *p, double rate, double burst)
+{
+	p->rate = rate > 0 ? rate : 0;
+	p->burst_req = burst;
+	pacer_set_burst(p);
+	p->tokens = 1;
+	p->last_ns = pacer_now_ns();
+}
+
+/* takes effect right away, tokens earned so far at the old rate are kept */
+void
+pacer_set_rate(struct pacer *p, double rate)
+{
+	pacer_refill(p, pacer_now_ns());
+	p->rate = rate > 0 ? rate : 0;
+	pacer_set_burst(p);
+	if (p->tokens > p->burst)
+		p->tokens = p->burst;
+}
+
+/*
+ * Wait for tokens and return how many the caller may send now, at most
+ * `want'.  Returns 0 if none came due within PACER_MAX_SLEEP_NS (e.g.
+ * a very low or zero rate), so the caller gets to look at its command
+ * pipe before asking again.
+ */
+long
+pacer_take(struct pacer *p, long want)
+{
+	struct timespec ts;
+	uint64_t now, wait, until;
+	long n;
+
+	now = pacer_now_ns();
+	pacer_refill(p, now);
+
+	if (p->tokens < 1) {
+		if (p->rate > 0)
+			wait = (uint64_t)((1 - p->tokens) * 1e9 / p->rate);
+		else
+			wait = PACER_MAX_SLEEP_NS;
+		if (wait < PACER_MIN_SLEEP_NS)
+			wait = PACER_MIN_SLEEP_NS;
+		if (wait > PACER_MAX_SLEEP_NS)
+			wait = PACER_MAX_SLEEP_NS;
+
+		until = now + wait;
+		ts.tv_sec = until / 1000000000ULL;
+		ts.tv_nsec = until % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &ts, NULL) == EINTR)
+			;
+		pacer_refill(p, pacer_now_ns());
+		if (p->tokens < 1)
+			return (0);
+	}
+
+	n = (long)p->tokens;
+	if (n > want)
+		n = want;
+	p->tokens -= n;
+	return (n);
+}
@@ -0,0 +1,41 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+/*
+ * Token bucket send pacing
+ * ------------------------
+ * Tokens accrue continuously at `rate' per second on the monotonic
+ * clock, up to `burst'.  pacer_take() sleeps until at least one token
+ * is available and hands out as many as the caller can use, so sends
+ * are spread evenly over the second instead of going out in one burst.
+ *
+ * At high rates a single token is worth less than the shortest sleep
+ * we can take reliably, so the caller gets a batch of tokens per
+ * wakeup instead (roughly rate * PACER_MIN_SLEEP_NS).
+ */
+
+/* shortest sleep worth taking, below this we batch */
+#define PACER_MIN_SLEEP_NS 50000L
+
+/* longest we'll sleep in one call, so callers can check for commands */
+#define PACER_MAX_SLEEP_NS 10000000L
+
+/* default burst, as a fraction of a second's worth of tokens */
+#define PACER_DEFAULT_BURST_SEC 0.01
+
+struct pacer {
+	double rate;		/* tokens per second */
+	double burst;		/* most tokens we'll let accumulate */
+	double burst_req;	/* burst asked for, 0 for the default */
+	double tokens;
+	uint64_t last_ns;
+};
+
+uint64_t pacer_now_ns(void);
+void pacer_init(struct pacer *p, double rate, double burst);
+void pacer_set_rate(struct pacer *p, double rate);
+long pacer_take(struct pacer *p, long want);
+
+#endif /* PACER_H */
@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "pipeline.h"
+
+/* how long the poll thread naps when a ring is full or draining */
+#define PL_WAIT_USEC 50
+
+/*
+ * Single-producer/single-consumer ring.  head and tail sit on their
+ * own cache lines so the two sides don't bounce one line between them.
+ */
+struct spsc {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	void *slot[PL_RING_LEN];
+};
+
+struct worker {
+	struct pipeline *pl;
+	int id;
+	pthread_t thread;
+	sem_t wake;
+};
+
+struct pipeline {
+	int nworkers;
+	pl_process_fn fn;
+	void *arg;
+	struct spsc work[PL_NRINGS];	/* poll thread -> worker */
+	struct spsc done[PL_NRINGS];	/* worker -> poll thread, for reuse */
+	struct pl_batch *open[PL_NRINGS];
+	struct worker *workers;
+	unsigned long dispatched;	/* poll thread only */
+	unsigned long processed;
+	int stop;
+};
+
+static int
+spsc_push(struct spsc *r, void *p)
+{
+	unsigned long t = r->tail;
+
+	if (t - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == PL_RING_LEN)
+		return (-1);
+	r->slot[t % PL_RING_LEN] = p;
+	__atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+	return (0);
+}
+
+static void *
+spsc_pop(struct spsc *r)
+{
+	unsigned long h = r->head;
+	void *p;
+
+	if (h == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return (NULL);
+	p = r->slot[h % PL_RING_LEN];
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+	return (p);
+}
+
+static void
+batch_free(struct pl_batch *b)
+{
+	free(b->msgs);
+	free(b->arena);
+	free(b);
+}
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct pipeline *pl = w->pl;
+	struct pl_batch *b;
+	unsigned long n;
+	int busy;
+
+	for (;;) {
+		sem_wait(&w->wake);
+		busy = 0;
+		for (int r = w->id; r < PL_NRINGS; r += pl->nworkers) {
+			while ((b = spsc_pop(&pl->work[r])) != NULL) {
+				pl->fn(b, w->id, pl->arg);
+
+				/* the poll thread may reuse b as soon as it's back */
+				n = b->count;
+				if (spsc_push(&pl->done[r], b) != 0)
+					batch_free(b);
+				__atomic_fetch_add(&pl->processed, n,
+				    __ATOMIC_RELEASE);
+				busy = 1;
+			}
+		}
+		if (!busy && __atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE))
+			break;
+	}
+	return (NULL);
+}
+
+struct pipeline *
+pipeline_create(int nworkers, pl_process_fn fn, void *arg)
+{
+	struct pipeline *pl;
+
+	if (nworkers < 1)
+		return (NULL);
+	pl = aligned_alloc(64, (sizeof (*pl) + 63) & ~(size_t)63);
+	if (pl == NULL)
+		return (NULL);
+	memset(pl, 0, sizeof (*pl));
+	pl->nworkers = nworkers;
+	pl->fn = fn;
+	pl->arg = arg;
+	pl->workers = calloc(nworkers, sizeof (*pl->workers));
+	if (pl->workers == NULL) {
+		free(pl);
+		return (NULL);
+	}
+	for (int i = 0; i < nworkers; i++) {
+		pl->workers[i].pl = pl;
+		pl->workers[i].id = i;
+		sem_init(&pl->workers[i].wake, 0, 0);
+		if (pthread_create(&pl->workers[i].thread, NULL,
+		    worker_thread, &pl->workers[i]) != 0) {
+			/* stop the ones that did start, nothing's queued */
+			sem_destroy(&pl->workers[i].wake);
+			pl->nworkers = i;
+			pipeline_destroy(pl);
+			return (NULL);
+		}
+	}
+	return (pl);
+}
+
+static unsigned int
+ring_for(const char *topic, int partition)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *topic != '\0'; topic++) {
+		h ^= (unsigned char)*topic;
+		h *= 16777619u;
+	}
+	h ^= (unsigned int)partition;
+	h *= 16777619u;
+	return (h % PL_NRINGS);
+}
+
+static void
+batch_push(struct pipeline *pl, struct pl_batch *b)
+{
+	pl->open[b->ring] = NULL;
+	pl->dispatched += b->count;
+
+	/* a full ring means that worker is behind, wait for it */
+	while (spsc_push(&pl->work[b->ring], b) != 0)
+		usleep(PL_WAIT_USEC);
+	sem_post(&pl->workers[b->ring % pl->nworkers].wake);
+}
+
+/* the batch this poll's messages for topic/partition should go into */
+struct pl_batch *
+pipeline_batch(struct pipeline *pl, const char *topic, int partition)
+{
+	unsigned int ring = ring_for(topic, partition);
+	struct pl_batch *b = pl->open[ring];
+
+	if (b != NULL && b->partition == partition &&
+	    strcmp(b->topic, topic) == 0)
+		return (b);
+
+	/*
+	 * Another partition landed on the same ring.  Send that one off,
+	 * or if it's empty keep it for this one: done[] has the worker on
+	 * its producing end, so we mustn't push to it too.
+	 */
+	if (b != NULL && b->count > 0) {
+		batch_push(pl, b);
+		b = NULL;
+	}
+	if (b == NULL) {
+		b = spsc_pop(&pl->done[ring]);
+		if (b == NULL) {
+			b = calloc(1, sizeof (*b));
+			if (b == NULL)
+				return (NULL);
+		}
+		b->ring = ring;
+		pl->open[ring] = b;
+	}
+	b->partition = partition;
+	snprintf(b->topic, sizeof (b->topic), "%s", topic);
+	b->count = 0;
+	b->used = 0;
+	return (b);
+}
+
+int
+pipeline_add(struct pl_batch *b, const void *key, uint32_t klen,
+		const void *val, uint32_t vlen, int64_t offset)
+{
+	struct pl_msg *m;
+	size_t need = b->used + klen + vlen;
+	void *p;
+
+	if (b->count == b->mcap) {
+		p = realloc(b->msgs, (b->mcap ? b->mcap * 2 : 64) *
+		    sizeof (*b->msgs));
+		if (p == NULL)
+			return (-1);
+		b->msgs = p;
+		b->mcap = b->mcap ? b->mcap * 2 : 64;
+	}
+	if (need > b->acap) {
+		size_t ncap = b->acap ? b->acap : 65536;
+
+		while (ncap < need)
+			ncap *= 2;
+		p = realloc(b->arena, ncap);
+		if (p == NULL)
+			return (-1);
+		b->arena = p;
+		b->acap = ncap;
+	}
+
+	m = &b->msgs[b->count++];
+	m->koff = b->used;
+	m->klen = klen;
+	memcpy(b->arena + b->used, key, klen);
+	b->used += klen;
+	m->voff = b->used;
+	m->vlen = vlen;
+	memcpy(b->arena + b->used, val, vlen);
+	b->used += vlen;
+	m->offset = offset;
+	return (0);
+}
+
+/* hand every batch filled since the last call to the workers */
+void
+pipeline_dispatch(struct pipeline *pl)
+{
+	for (int r = 0; r < PL_NRINGS; r++)
+		if (pl->open[r] != NULL && pl->open[r]->count > 0)
+			batch_push(pl, pl->open[r]);
+}
+
+void
+pipeline_drain(struct pipeline *pl)
+{
+	pipeline_dispatch(pl);
+	while (__atomic_load_n(&pl->processed, __ATOMIC_ACQUIRE) !=
+	    pl->dispatched)
+		usleep(PL_WAIT_USEC);
+}
+
+unsigned long
+pipeline_done(struct pipeline *pl)
+{
+	return (__atomic_load_n(&pl->processed, __ATOMIC_RELAXED));
+}
+
+void
+pipeline_destroy(struct pipeline *pl)
+{
+	struct pl_batch *b;
+
+	pipeline_drain(pl);
+	__atomic_store_n(&pl->stop, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < pl->nworkers; i++)
+		sem_post(&pl->workers[i].wake);
+	for (int i = 0; i < pl->nworkers; i++) {
+		pthread_join(pl->workers[i].thread, NULL);
+		sem_destroy(&pl->workers[i].wake);
+	}
+	for (int r = 0; r < PL_NRINGS; r++) {
+		if (pl->open[r] != NULL)
+			batch_free(pl->open[r]);
+		while ((b = spsc_pop(&pl->done[r])) != NULL)
+			batch_free(b);
+	}
+	free(pl->workers);
+	free(pl);
+}
@@ -0,0 +1,76 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Consumer poll/worker pipeline
+ * -----------------------------
+ * The poll thread copies each poll's messages into batches, one per
+ * topic partition, and hands them to a pool of worker threads through
+ * single-producer/single-consumer rings.  A partition always maps to
+ * the same ring and each ring is drained by exactly one worker, so
+ * messages of a partition are processed in order while different
+ * partitions run in parallel.
+ *
+ * Messages are copied because the client only guarantees record
+ * memory until the next poll, and the point is to keep polling while
+ * workers are busy.  Batches (and their arenas) are handed back to the
+ * poll thread on a return ring and reused.
+ *
+ * pipeline_drain() waits until every dispatched message has been
+ * processed, the consumer calls it before committing so offsets never
+ * get ahead of the work.
+ */
+
+#define PL_NRINGS 64
+#define PL_RING_LEN 256
+#define PL_TOPIC_MAX 256
+
+struct pl_msg {
+	uint32_t koff, klen;
+	uint32_t voff, vlen;
+	int64_t offset;
+};
+
+struct pl_batch {
+	int ring;
+	char topic[PL_TOPIC_MAX];
+	int partition;
+	uint32_t count;
+	uint32_t mcap;
+	struct pl_msg *msgs;
+	char *arena;
+	size_t used;
+	size_t acap;
+};
+
+struct pipeline;
+
+/* called on a worker thread for every batch, in partition order */
+typedef void (*pl_process_fn)(struct pl_batch *b, int worker, void *arg);
+
+struct pipeline *pipeline_create(int nworkers, pl_process_fn fn, void *arg);
+struct pl_batch *pipeline_batch(struct pipeline *pl, const char *topic,
+    int partition);
+int pipeline_add(struct pl_batch *b, const void *key, uint32_t klen,
+    const void *val, uint32_t vlen, int64_t offset);
+void pipeline_dispatch(struct pipeline *pl);
+void pipeline_drain(struct pipeline *pl);
+unsigned long pipeline_done(struct pipeline *pl);
+void pipeline_destroy(struct pipeline *pl);
+
+static inline const char *
+pl_key(struct pl_batch *b, uint32_t i)
+{
+	return (b->arena + b->msgs[i].koff);
+}
+
+static inline const char *
+pl_value(struct pl_batch *b, uint32_t i)
+{
+	return (b->arena + b->msgs[i].voff);
+}
+
+#endif /* PIPELINE_H */
@@ -3,9 +3,24 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <streams/streams.h>
-#include <sys/time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "metrics.h"
+#include "mapinput.h"
+#include "recpool.h"
+#include "pacer.h"
+#include "evloop.h"
+#include "hist.h"
+#include "rechdr.h"
+#include "envelope.h"
+#include "compress.h"
+#include "loadgen.h"
+#include "aimd.h"
+#include "prof.h"
+#include "ckpt.h"
 
 int keySize = 100;
 int valueSize = 100;
@@ -21,12 +36,226 @@ int inf_on = 1;
 /* per second */
 #define STARTING_RATE 10
 
-/* special code from UI telling us to failover */
-#define FAIL_OVER_CODE 999
-#define FAIL_BACK_CODE 998
+/* most records we'll send per pacer wakeup */
+#define PACER_MAX_BATCH 1024
 
-/* path to the python script that sends metrics to opentsdb */
-#define METRIC_SENDER_PATH "/home/mapr/html/msend.py"
+/* how often the control loop reports the send rate */
+#define REPORT_MS 1000
+
+/* warn when we manage less than this fraction of the asked for rate */
+#define FALLING_BEHIND_FRAC 0.9
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* the client's send buffer, senders block once this much is unacked */
+#define BUFFER_MEMORY (32 * 1024 * 1024)
+
+/* -a: back off once in-flight bytes pass this fraction of the buffer */
+#define AIMD_INFLIGHT_FRAC 0.5
+
+/*
+ * Every record in flight has a slot here, passed to the callback as
+ * ctx.  The slot holds the key, when it was sent and what owns the
+ * value: the input mapping (-m) or a pool buffer.  Message msg_idx
+ * takes slot msg_idx % INFLIGHT_SLOTS, waiting for the slot's previous
+ * record to be acked if we have lapped the table.  With -X each cluster
+ * has a table of its own, and a record and its copy take the same slot
+ * in each.
+ */
+#define INFLIGHT_SLOTS 65536
+#define INFLIGHT_KEY_LEN (RECHDR_LEN + LG_KEY_MAX)
+
+struct inflight {
+	int busy;
+	int tries;		/* sends so far that failed */
+	struct inflight *next;	/* on the retry queue */
+	uint64_t sent_ns;
+	uint64_t retry_ns;	/* don't retry before this */
+	struct mapinput *mi;	/* value lives in the mapping, or */
+	char *valbuf;		/* in this pool buffer */
+	const char *val;
+	uint32_t vlen;
+	uint32_t klen;
+	uint32_t hlen;		/* rechdr.h header in front of the key (-E) */
+	uint32_t nmsgs;		/* lines in it, more than 1 for an envelope */
+	uint32_t bytes;		/* counted in n_inflight_bytes once sent */
+	int part;		/* partition, or -1 to hash the key */
+	int sender;		/* -c: whose line it is, and where */
+	uint64_t pos;
+	int side;		/* -X: 0 for the primary cluster, 1 the backup */
+	char key[INFLIGHT_KEY_LEN];
+};
+
+static struct inflight *inflight[2];
+
+/* failed sends go again up to RETRY_MAX times, backing off each time */
+#define RETRY_MAX 5
+#define RETRY_BASE_NS 10000000ULL
+#define RETRY_MAX_NS 1000000000ULL
+#define RETRY_QUEUE_MAX 4096
+
+/* -B: default linger for a partly filled envelope, see envelope.h */
+#define ENV_LINGER_MS 5
+#define ENV_MAX (16 * 1024 * 1024)
+
+/* partitioning strategies for -P */
+#define PART_HASH 0
+#define PART_RR 1
+#define MAX_PARTITIONS 256
+#define MAX_SENDERS 64
+
+/* set from the command line */
+static int use_map = 0;
+static int nsenders = 1;
+static int npartitions = 1;
+static int part_strategy = PART_HASH;
+static double pacer_burst = 0;
+static int hot_standby = 0;
+static int active_active = 0;	/* -X */
+static int stamp = 0;
+static uint32_t producer_id;
+static unsigned long max_inflight = INFLIGHT_SLOTS;
+static uint32_t env_max;	/* envelope size, 0 for a record per line */
+static uint64_t env_linger_ns = ENV_LINGER_MS * 1000000ULL;
+static struct zcodec zcodec;	/* -Z, see compress.h */
+static int adaptive;		/* -a, see aimd.h */
+static uint64_t aimd_p99_us;	/* -a target for ack p99 */
+
+/* replay and synthetic load, see loadgen.h */
+static long loops = 1;		/* -L, 0 for until stopped */
+static long max_records;	/* -N, 0 for no limit */
+static double warp;		/* -W, 0 to go as fast as the pacer lets us */
+static const char *warp_field = "ts";
+static int synthetic;		/* -G */
+static struct lg_size gen_ksize, gen_vsize;
+static char *gen_template;
+
+/* -T stages, see prof.h */
+static int profiling;
+#define PROF_READ 0
+#define PROF_CREATE 1
+#define PROF_SEND 2
+#define PROF_CALLBACK 3
+static const char *const prof_stages[] = {
+	"read", "create", "send", "callback"
+};
+
+/*
+ * -c, see ckpt.h.  With more than one sender, msg_idx isn't tied to a
+ * line, so a resumed run's keys start this far past the last ones
+ * checkpointed rather than reuse ones that went out since.
+ */
+static const char *ckpt_path;
+static struct ckpt ckpt;
+#define CKPT_IDX_RESERVE (1L << 24)
+
+/*
+ * Failed sends waiting to go again.  When the connection a record
+ * failed on has just been swapped out (-H, reconciling > 0) it goes
+ * again right away on the active one, otherwise after a backoff.
+ */
+static pthread_mutex_t retry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inflight *retry_head, *retry_tail;
+static unsigned long retry_count;
+static uint64_t retry_next_ns;	/* earliest retry_ns on the queue */
+static int reconciling;
+
+/* send-to-ack latency in microseconds, and what became of each send */
+static struct hist ack_hist;
+static struct hist ack_last;	/* the last reporting interval */
+static struct hist aimd_hist;	/* -a, over the last tick */
+static struct hist aimd_last;
+static unsigned long n_acked, n_failed, n_retried, n_dropped;
+static unsigned long n_inflight_bytes;
+static unsigned long n_bp_waits;
+static unsigned long n_envelopes;
+static struct zstats zstats;
+
+/*
+ * Records in flight per cluster, only the primary's without -X.  With
+ * -X each cluster's acks are counted as well, and the copies it didn't
+ * get because it had -I records in flight already.
+ */
+static const char *const side_name[] = { "primary", "backup" };
+static unsigned long side_inflight[2];
+static unsigned long side_acked[2], side_failed[2], side_shed[2];
+static struct hist side_hist[2], side_last[2];
+
+/*
+ * State shared by the sender threads and the control loop.  The
+ * connection (producer, config and partitions) is only swapped with
+ * conn_lock held for writing, senders hold it for reading while they
+ * create and send a record.
+ */
+struct prodstate {
+	const char *primary;
+	const char *backup;
+	const char *cur_topic;
+	int nparts;
+	int part_strategy;
+	streams_topic_partition_t tps[MAX_PARTITIONS];
+	streams_config_t config;
+	streams_producer_t producer;
+	pthread_rwlock_t conn_lock;
+
+	/* the other cluster, initialized and waiting with -H */
+	streams_topic_partition_t sb_tps[MAX_PARTITIONS];
+	streams_config_t sb_config;
+	streams_producer_t sb_producer;
+
+	/* one rate for the whole producer, however many senders */
+	struct pacer pacer;
+	pthread_mutex_t pacer_lock;
+	int rate;		/* from the pipe, a ceiling with -a */
+
+	/* -a: the rate we're actually sending at, and last tick's counts */
+	struct aimd aimd;
+	unsigned long aimd_sent, aimd_failed, aimd_waits, aimd_pool_waits;
+	unsigned long aimd_why[4];	/* congested ticks by reason */
+
+	long next_idx;		/* next msg_idx to hand out */
+	int running;		/* senders still going */
+	int stop;		/* tells the senders to give up */
+	int done;		/* or to finish as if out of input */
+	int error;
+
+	/* -W: the input's first timestamp and how long it spans, in ns */
+	uint64_t warp_t0;
+	uint64_t warp_span;
+	uint64_t warp_start;
+
+	/* control loop, see evloop.h */
+	struct evloop ev;
+	int pipe_fd;
+	struct cmdbuf cmdbuf;
+	struct sender *senders;
+	uint64_t last_report;
+	unsigned long last_sent;
+};
+
+struct sender {
+	int id;
+	pthread_t thread;
+	struct prodstate *ps;
+	FILE *fp;		/* getline input, single sender only */
+	struct mapshard shard;	/* otherwise our share of the mapping */
+	struct mapshard shard_start;
+	long pass;		/* times through the input so far (-L) */
+	uint64_t warp_base;	/* added to timestamps, a span per pass */
+	uint64_t rng;		/* -G */
+	unsigned long rr;	/* next partition for round robin */
+	unsigned long sent;
+	struct envbuf *env;	/* -B, an envelope filling per partition */
+	struct zctx z;		/* -Z */
+
+	/* -c, see ckpt.h */
+	struct ckpt_index *ix;
+	uint64_t line;		/* in our share of the input, this pass */
+	uint64_t nlines;	/* in a pass, once we've been through one */
+	uint64_t pos;		/* of the line being sent */
+	uint64_t next_pos;	/* every line before it has gone to a slot */
+	uint64_t env_low;	/* the lowest in an open envelope */
+};
 
 /* debug messages */
 #define DPRINTF(...) if (debug_on) { fprintf(stderr, __VA_ARGS__); }
@@ -38,38 +267,66 @@ int inf_on = 1;
  * Utility Functions
  * -----------------
  */
-long
-tvdiff(struct timeval *stime, struct timeval *etime)
+/* done with a slot, let go of the value and free it up */
+static void
+inflight_release(struct inflight *f)
 {
-	long diffmsec;
-
-	diffmsec = (etime->tv_sec-stime->tv_sec) * 1000;
-	diffmsec += (etime->tv_usec-stime->tv_usec) / 1000;
-
-	return (diffmsec);
+	if (f->mi != NULL)
+		mapinput_release(f->mi);
+	else
+		recpool_free(f->valbuf);
+	f->mi = NULL;
+	f->valbuf = NULL;
+	__atomic_fetch_sub(&n_inflight_bytes, f->bytes, __ATOMIC_RELAXED);
+	f->bytes = 0;
+	__atomic_fetch_sub(&side_inflight[f->side], 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->busy, 0, __ATOMIC_RELEASE);
 }
 
-int
-is_pipe_ready(int fd)
+static unsigned long
+total_inflight(void)
 {
-	int rc;
-	fd_set fds;
-	struct timeval tv;
-
-	FD_ZERO(&fds);
-	FD_SET(fd,&fds);
+	return (__atomic_load_n(&side_inflight[0], __ATOMIC_RELAXED) +
+	    __atomic_load_n(&side_inflight[1], __ATOMIC_RELAXED));
+}
 
-	tv.tv_sec = tv.tv_usec = 0;
-	rc = select(fd+1, &fds, NULL, NULL, &tv);
-	if (rc < 0)
-		return -1;
+/* queue a failed send to go again, -1 if we should give up on it */
+static int
+retry_put(struct inflight *f, uint64_t now)
+{
+	uint64_t backoff = 0;
 
-	return FD_ISSET(fd, &fds) ? 1 : 0;
+	if (f->tries >= RETRY_MAX)
+		return (-1);
+	pthread_mutex_lock(&retry_lock);
+	if (retry_count >= RETRY_QUEUE_MAX) {
+		pthread_mutex_unlock(&retry_lock);
+		return (-1);
+	}
+	if (__atomic_load_n(&reconciling, __ATOMIC_ACQUIRE) == 0) {
+		backoff = RETRY_BASE_NS << f->tries;
+		if (backoff > RETRY_MAX_NS)
+			backoff = RETRY_MAX_NS;
+	}
+	f->tries++;
+	f->retry_ns = now + backoff;
+	f->next = NULL;
+	if (retry_tail != NULL)
+		retry_tail->next = f;
+	else
+		retry_head = f;
+	retry_tail = f;
+	if (retry_count == 0 || f->retry_ns < retry_next_ns)
+		__atomic_store_n(&retry_next_ns, f->retry_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&retry_count, retry_count + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&retry_lock);
+	return (EXIT_SUCCESS);
 }
 
 /* This is a producer callback function. Callbacks are required,
  * so that producers are notified when memory held by records
- * can be reclaimed.
+ * can be reclaimed.  ctx is the record's in-flight slot: an ack
+ * is timed and frees the slot, a failure goes on the retry queue.
  */
 void
 producerCallback(int32_t err,
@@ -78,8 +335,8 @@ producerCallback(int32_t err,
     int64_t offset,
     void *ctx)
 {
-	char *keyp, *valp;
-	uint32_t ks, vs;
+	struct inflight *f = ctx;
+	uint64_t now = pacer_now_ns(), t0 = prof_now();
 	int ret_val;
 
 	/*
@@ -89,27 +346,38 @@ producerCallback(int32_t err,
 	DPRINTF("Message Offset"
 	    ": %d \n", offset);
 	*/
-	    
-	ret_val = streams_producer_record_get_key(record,
-	    (const void **)&keyp, &ks);
-	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("get_key() failed\n");
-	}
-	ret_val = streams_producer_record_get_value(record,
-	    (const void **)&valp, &vs);
 
+	ret_val = streams_producer_record_destroy(record);
 	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("get_value() failed\n");
+		DPRINTF("destroy failed\n");
 	}
 
-	/* free the key and value buffers */
-	free(keyp);
-	free(valp);
+	/* counts are per line, an envelope counts for all of its lines */
+	if (err == 0) {
+		hist_record(&ack_hist, (now - f->sent_ns) / 1000);
+		if (adaptive)
+			hist_record(&aimd_hist, (now - f->sent_ns) / 1000);
+		__atomic_fetch_add(&n_acked, f->nmsgs, __ATOMIC_RELAXED);
+		if (active_active) {
+			hist_record(&side_hist[f->side],
+			    (now - f->sent_ns) / 1000);
+			__atomic_fetch_add(&side_acked[f->side], f->nmsgs,
+			    __ATOMIC_RELAXED);
+		}
+		inflight_release(f);
+		prof_end(PROF_CALLBACK, t0);
+		return;
+	}
 
-	ret_val = streams_producer_record_destroy(record);
-	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("destroy failed\n");
+	__atomic_fetch_add(&n_failed, f->nmsgs, __ATOMIC_RELAXED);
+	if (active_active)
+		__atomic_fetch_add(&side_failed[f->side], f->nmsgs,
+		    __ATOMIC_RELAXED);
+	if (retry_put(f, now) != EXIT_SUCCESS) {
+		__atomic_fetch_add(&n_dropped, f->nmsgs, __ATOMIC_RELAXED);
+		inflight_release(f);
 	}
+	prof_end(PROF_CALLBACK, t0);
 }
 
 /*
@@ -117,27 +385,31 @@ producerCallback(int32_t err,
  * ---------------------
  */
 int
-producer_init(const char *fullTopicName,
-		streams_topic_partition_t *tp, streams_config_t *confp, streams_producer_t *prodp)
+producer_init(const char *fullTopicName, int nparts,
+		streams_topic_partition_t *tps, streams_config_t *confp, streams_producer_t *prodp)
 {
+	char buf[32];
 	int ret_val;
 
 	DPRINTF("\ninitializing producer");
 	/* Create a topic partition, which is an object that specifies
 	 * which stream and topic to publish messages to. It is not
 	 * the same as an actual partition in a topic. Producers
-	 * cannot add partitions to topics.
+	 * cannot add partitions to topics, so the topic must already
+	 * have at least nparts partitions.
 	 */
 
-	DPRINTF("\nSTEP 1: Creating a topic partition... %s \n",
-	    fullTopicName);
+	DPRINTF("\nSTEP 1: Creating %d topic partition(s)... %s \n",
+	    nparts, fullTopicName);
 
-	ret_val = streams_topic_partition_create(
-	    fullTopicName, 0, tp);
+	for (int i = 0; i < nparts; i++) {
+		ret_val = streams_topic_partition_create(
+		    fullTopicName, i, &tps[i]);
 
-	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("streams_topic_partition_create() failed\n");
-		return (ret_val);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("streams_topic_partition_create() failed\n");
+			return (ret_val);
+		}
 	}
 
 	/* Create a config, which you can use to set non-default
@@ -156,7 +428,8 @@ producer_init(const char *fullTopicName,
 	 * set is simply the default for the specified configuration
 	 * parameter.
 	 */
-	ret_val = streams_config_set(*confp, "buffer.memory", "33554432");
+	snprintf(buf, sizeof (buf), "%d", BUFFER_MEMORY);
+	ret_val = streams_config_set(*confp, "buffer.memory", buf);
 	if (EXIT_SUCCESS != ret_val) {
 		DPRINTF("streams_config_set() failed\n");
 		return (ret_val);
@@ -179,7 +452,7 @@ producer_init(const char *fullTopicName,
 }
 
 int
-producer_shutdown(streams_topic_partition_t *topic,
+producer_shutdown(int nparts, streams_topic_partition_t *tps,
 		streams_config_t *config, streams_producer_t *producer)
 {
 	int ret_val;
@@ -192,11 +465,14 @@ producer_shutdown(streams_topic_partition_t *topic,
 		return (ret_val);
 	}
 
-	/* destroy the topic partition */
-	ret_val = streams_topic_partition_destroy(*topic);
-	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("partition destroy failed\n");
-		return (ret_val);
+	/* destroy the topic partitions */
+	for (int i = 0; i < nparts; i++) {
+		ret_val = streams_topic_partition_destroy(tps[i]);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("partition destroy failed\n");
+			return (ret_val);
+		}
+		tps[i] = 0;
 	}
 
 	/* destroy the config */
@@ -206,255 +482,1900 @@ producer_shutdown(streams_topic_partition_t *topic,
 		DPRINTF("partition destroy failed\n");
 		return (ret_val);
 	}
-	*topic = *config = *producer = 0;
+	*config = NULL;
+	*producer = NULL;
 	return (EXIT_SUCCESS);
 }
 
 int
 send_metrics(const char *cur, const char *primary, const char *backup, int newrate)
 {
-	char namebuf1[100], namebuf2[100];
-	int ret_val;
-
-	if (cur == primary) {
-		snprintf(namebuf1, 100, "%s producer.primary_rate %d", 
-			METRIC_SENDER_PATH, newrate);
-		snprintf(namebuf2, 100, "%s producer.backup_rate 0", 
-			METRIC_SENDER_PATH);
+	/* just queues the samples, the emitter thread does the network i/o */
+	if (active_active) {
+		/* -X, everything goes to both */
+		metrics_put("producer.primary_rate", newrate);
+		metrics_put("producer.backup_rate", newrate);
+	} else if (cur == primary) {
+		metrics_put("producer.primary_rate", newrate);
+		metrics_put("producer.backup_rate", 0);
 	} else {
-		snprintf(namebuf1, 100, "%s producer.backup_rate %d", 
-				METRIC_SENDER_PATH, newrate);
-		snprintf(namebuf2, 100, "%s producer.primary_rate 0", 
-				METRIC_SENDER_PATH);
+		metrics_put("producer.backup_rate", newrate);
+		metrics_put("producer.primary_rate", 0);
 	}
-	ret_val = system(namebuf1);
-	if (ret_val < 0) {
-		IPRINTF("system() metric sender failed\n");
-		return (ret_val);
+	return (EXIT_SUCCESS);
+}
+
+/* pool counters, for sizing the cap (-M) to our traffic */
+void
+send_pool_metrics(void)
+{
+	struct recpool_stats st;
+
+	recpool_get_stats(&st);
+	metrics_put("producer.pool_hits", st.hits);
+	metrics_put("producer.pool_misses", st.misses);
+	metrics_put("producer.pool_waits", st.waits);
+	metrics_put("producer.pool_borrows", st.borrows);
+	metrics_put("producer.pool_timeouts", st.timeouts);
+	metrics_put("producer.pool_in_use", st.in_use);
+	metrics_put("producer.pool_high_water", st.high_water);
+}
+
+/*
+ * Send-to-ack latency over the last interval, and what happened to the
+ * sends.  The counts are running totals.
+ */
+void
+send_ack_metrics(void)
+{
+	hist_snapshot(&ack_hist, &ack_last);
+	metrics_put("producer.ack_p50_us", hist_percentile(&ack_last, 50));
+	metrics_put("producer.ack_p99_us", hist_percentile(&ack_last, 99));
+	metrics_put("producer.ack_p999_us", hist_percentile(&ack_last, 99.9));
+	metrics_put("producer.ack_max_us", ack_last.max);
+	metrics_put("producer.inflight", total_inflight());
+	metrics_put("producer.inflight_bytes",
+	    __atomic_load_n(&n_inflight_bytes, __ATOMIC_RELAXED));
+	metrics_put("producer.acked",
+	    __atomic_load_n(&n_acked, __ATOMIC_RELAXED));
+	metrics_put("producer.failed",
+	    __atomic_load_n(&n_failed, __ATOMIC_RELAXED));
+	metrics_put("producer.retried",
+	    __atomic_load_n(&n_retried, __ATOMIC_RELAXED));
+	metrics_put("producer.dropped",
+	    __atomic_load_n(&n_dropped, __ATOMIC_RELAXED));
+	metrics_put("producer.inflight_waits",
+	    __atomic_load_n(&n_bp_waits, __ATOMIC_RELAXED));
+	if (env_max > 0)
+		metrics_put("producer.envelopes",
+		    __atomic_load_n(&n_envelopes, __ATOMIC_RELAXED));
+}
+
+/* -X: how each cluster is keeping up, and what it has had to shed */
+void
+send_side_metrics(void)
+{
+	char namebuf[METRICS_NAME_MAX];
+
+	for (int i = 0; i < 2; i++) {
+		hist_snapshot(&side_hist[i], &side_last[i]);
+		snprintf(namebuf, sizeof (namebuf), "producer.%s_ack_p99_us",
+		    side_name[i]);
+		metrics_put(namebuf, hist_percentile(&side_last[i], 99));
+		snprintf(namebuf, sizeof (namebuf), "producer.%s_inflight",
+		    side_name[i]);
+		metrics_put(namebuf, __atomic_load_n(&side_inflight[i],
+		    __ATOMIC_RELAXED));
+		snprintf(namebuf, sizeof (namebuf), "producer.%s_acked",
+		    side_name[i]);
+		metrics_put(namebuf, __atomic_load_n(&side_acked[i],
+		    __ATOMIC_RELAXED));
+		snprintf(namebuf, sizeof (namebuf), "producer.%s_failed",
+		    side_name[i]);
+		metrics_put(namebuf, __atomic_load_n(&side_failed[i],
+		    __ATOMIC_RELAXED));
+		snprintf(namebuf, sizeof (namebuf), "producer.%s_shed",
+		    side_name[i]);
+		metrics_put(namebuf, __atomic_load_n(&side_shed[i],
+		    __ATOMIC_RELAXED));
 	}
-	ret_val = system(namebuf2);
-	if (ret_val < 0) {
-		IPRINTF("system() metric sender failed\n");
-		return (ret_val);
+}
+
+/* -a: where the controller has the rate, see aimd.h */
+void
+send_aimd_metrics(struct prodstate *ps)
+{
+	metrics_put("producer.rate_ceiling", ps->rate);
+	metrics_put("producer.aimd_increases", ps->aimd.increases);
+	metrics_put("producer.aimd_decreases", ps->aimd.decreases);
+}
+
+/* -Z: bytes in and out of the codec, and the CPU it took */
+void
+send_compress_metrics(void)
+{
+	unsigned long in = __atomic_load_n(&zstats.in_bytes, __ATOMIC_RELAXED);
+	unsigned long out = __atomic_load_n(&zstats.out_bytes,
+	    __ATOMIC_RELAXED);
+
+	metrics_put("producer.compress_in_bytes", in);
+	metrics_put("producer.compress_out_bytes", out);
+	metrics_put("producer.compress_pct", in > 0 ? out * 100 / in : 100);
+	metrics_put("producer.compress_cpu_us",
+	    __atomic_load_n(&zstats.cpu_ns, __ATOMIC_RELAXED) / 1000);
+}
+
+/* FNV-1a, so a given key always lands on the same partition */
+static uint32_t
+key_hash(const char *key, size_t klen)
+{
+	uint32_t h = 2166136261u;
+
+	for (size_t i = 0; i < klen; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619u;
 	}
-	return (EXIT_SUCCESS);
+	return (h);
+}
+
+static int
+pick_partition(struct prodstate *ps, struct sender *s,
+		const char *key, size_t klen)
+{
+	if (ps->nparts == 1)
+		return (0);
+	if (ps->part_strategy == PART_RR)
+		return (s->rr++ % ps->nparts);
+	return (key_hash(key, klen) % ps->nparts);
 }
 
 /*
- * Main Producer Loop
- * ------------------
+ * Create and send one in-flight slot's record on the current
+ * connection, or with -X on its cluster's.  The caller keeps the slot
+ * until this returns EXIT_SUCCESS, after that it belongs to the
+ * callback.
  */
 int
-producer(const char *fullTopicName, const char *backupTopicName,
-		const char *fname, const char *pipe_fname)
+send_record(struct prodstate *ps, struct sender *s, struct inflight *f)
 {
-	int ret_val;
-	char key_content[keySize];
-	FILE *fp, *pipe_fp;
-	int pipe_fd;
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
-	int msg_idx = 0;
-	char *linebuf = NULL;
-	char *keybuf = NULL;
-	struct timeval now, last_now;
-	int newrate, rate = STARTING_RATE;
-	int n_sent_this_sec = 0;
-	long tdiff;
-	const char *cur_topic = fullTopicName;
-	char namebuf[100];
-	streams_topic_partition_t topic;
-	streams_config_t config;
+	streams_producer_record_t record;
+	streams_topic_partition_t *tps;
 	streams_producer_t producer;
+	uint64_t t0;
+	int ret_val, part;
 
-	ret_val = producer_init(cur_topic, &topic, &config, &producer);
+	pthread_rwlock_rdlock(&ps->conn_lock);
+	tps = f->side ? ps->sb_tps : ps->tps;
+	producer = f->side ? ps->sb_producer : ps->producer;
+	part = f->part >= 0 ? f->part :
+	    pick_partition(ps, s, f->key + f->hlen, f->klen - f->hlen);
+	t0 = prof_now();
+	ret_val = streams_producer_record_create(
+	    tps[part], f->key, f->klen, f->val, f->vlen, &record);
+	prof_end(PROF_CREATE, t0);
 	if (EXIT_SUCCESS != ret_val) {
-		DPRINTF("producer_init() failed\n");
+		DPRINTF("streams_producer_record_create() failed\n");
+		pthread_rwlock_unlock(&ps->conn_lock);
 		return (ret_val);
 	}
 
-	fp = fopen(fname, "ro");
-	if (fp == NULL) {
-		DPRINTF("open of file %s failed\n", fname);
-		return (-1);
-	}
-	DPRINTF("opening pipe %s\n", pipe_fname);
-	pipe_fd = open(pipe_fname, O_RDWR|O_NONBLOCK);
-	if (pipe_fd < 0) {
-		DPRINTF("open of file %s failed\n", pipe_fname);
-		return (-1);
+	/* counted before the ack can come back, retries already are */
+	if (f->bytes == 0) {
+		f->bytes = f->klen + f->vlen;
+		__atomic_fetch_add(&n_inflight_bytes, f->bytes,
+		    __ATOMIC_RELAXED);
 	}
-	pipe_fp = fdopen(pipe_fd, "r");
-
-	DPRINTF("\nSTEP 4: The producer will create, send, "
-	    "and flush now\n");
 
-	/* send initial metrics */
-	ret_val = send_metrics(cur_topic, fullTopicName, backupTopicName, rate);
+	/* Buffer the message. */
+	f->sent_ns = pacer_now_ns();
+	t0 = prof_now();
+	ret_val = streams_producer_send(producer,
+	    record, producerCallback, f);
+	prof_end(PROF_SEND, t0);
 	if (EXIT_SUCCESS != ret_val) {
-		IPRINTF("send_metrics() failed\n");
-		return (ret_val);
+		DPRINTF("streams_producer_send() failed\n");
+		streams_producer_record_destroy(record);
 	}
+	pthread_rwlock_unlock(&ps->conn_lock);
+	return (ret_val);
+}
 
-	gettimeofday(&last_now, NULL);
-	while ((read = getline(&line, &len, fp)) != -1) {
-		/*
-		 * check if we've sent enough,
-		 * if so wait it out so we keep to the specified rate
-		 */
-		if (n_sent_this_sec >= rate) {
+/* send the queued retries whose backoff is up */
+static int
+retry_drain(struct prodstate *ps, struct sender *s)
+{
+	struct inflight *f, *next, *keep = NULL, *keep_tail = NULL;
+	uint64_t now = pacer_now_ns(), next_ns = 0;
+	unsigned long nkeep = 0;
+	int ret_val = EXIT_SUCCESS;
 
-			/* send new metrics */
-			ret_val = send_metrics(cur_topic, fullTopicName, backupTopicName, rate);
-			if (EXIT_SUCCESS != ret_val) {
-				IPRINTF("send_metrics() failed\n");
-				return (ret_val);
-			}
+	pthread_mutex_lock(&retry_lock);
+	f = retry_head;
+	retry_head = retry_tail = NULL;
+	__atomic_store_n(&retry_count, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&retry_lock);
 
-			gettimeofday(&now, NULL);
-			tdiff = tvdiff(&last_now, &now);
-			printf("time diff %lu rate %d\n", tdiff, rate);
-			if (tdiff < 1000) {
-				DPRINTF("produced %d messages in %lums, sleeping\n",
-				    rate, tdiff);
-				usleep((1000 - tdiff) * 1000);
-			} else if (tdiff >= 1000) {
-				DPRINTF("warning:  falling behind, took %lums to write"
-				    " %d messages\n", tdiff, rate);
-			}
-			gettimeofday(&last_now, NULL);
-			n_sent_this_sec = 0;
-
-			/* check the pipe for a rate change */
-			DPRINTF("checking pipe\n");
-			ret_val = is_pipe_ready(fileno(pipe_fp));
-			if (ret_val < 0) {
-				IPRINTF("is_pipe_ready() failed\n");
-				return (ret_val);
-			}
-			if (ret_val > 0) {
-				(void) fscanf(pipe_fp, "%d", &newrate);
-				IPRINTF("new rate: %d\n", newrate);
-
-				/* if we need to failover, toggle connection to the other cluster */
-				if (newrate == FAIL_OVER_CODE || newrate == FAIL_BACK_CODE) {
-					IPRINTF("failing over to %s cluster\n",
-					    newrate == FAIL_OVER_CODE ? "backup" : "primary");
-					ret_val = producer_shutdown(&topic, &config, &producer);
-					if (EXIT_SUCCESS != ret_val) {
-						DPRINTF("trying to failover: shutdown() failed\n");
-						return (ret_val);
-					}
-					cur_topic =
-					    newrate == FAIL_OVER_CODE ? backupTopicName : fullTopicName;
-					ret_val = producer_init(cur_topic, &topic, &config, &producer);
-					if (EXIT_SUCCESS != ret_val) {
-						DPRINTF("trying to failover: init() failed\n");
-						return (ret_val);
-					}
-					/* this was an out-of-band code so leave rate unchanged */
-				} else {
-					/* this was a rate request, set the new rate to it */
-					rate = newrate;
-
-					/* send new metrics */
-					ret_val =
-					    send_metrics(cur_topic,
-					    fullTopicName, backupTopicName, rate);
-					if (EXIT_SUCCESS != ret_val) {
-						IPRINTF("send_metrics() failed\n");
-						return (ret_val);
-					}
-				}
-			}
+	for (; f != NULL; f = next) {
+		next = f->next;
+		f->next = NULL;
+		if (f->retry_ns > now && EXIT_SUCCESS == ret_val) {
+			if (keep_tail != NULL)
+				keep_tail->next = f;
+			else
+				keep = f;
+			keep_tail = f;
+			if (nkeep++ == 0 || f->retry_ns < next_ns)
+				next_ns = f->retry_ns;
 			continue;
 		}
-		printf("sending inc %d\n", n_sent_this_sec);
-		n_sent_this_sec++;
+		if (EXIT_SUCCESS == ret_val)
+			ret_val = send_record(ps, s, f);
+		if (EXIT_SUCCESS == ret_val)
+			__atomic_fetch_add(&n_retried, f->nmsgs,
+			    __ATOMIC_RELAXED);
+		else
+			inflight_release(f);
+	}
+	if (keep == NULL)
+		return (ret_val);
 
-		/* DPRINTF("Retrieved line of length %zu :\n", read); */
-		/* DPRINTF("%s", line); */
+	/* not due yet, back on the queue */
+	pthread_mutex_lock(&retry_lock);
+	keep_tail->next = retry_head;
+	retry_head = keep;
+	if (retry_tail == NULL)
+		retry_tail = keep_tail;
+	if (retry_count == 0 || next_ns < retry_next_ns)
+		__atomic_store_n(&retry_next_ns, next_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&retry_count, retry_count + nkeep, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&retry_lock);
+	return (ret_val);
+}
 
-		/* Create a unique key and value for each message. */
-		char key_content[keySize];
-		sprintf(key_content, "Key_%d", msg_idx);
+/* giving up: let go of the records still waiting to go again */
+static void
+retry_discard(void)
+{
+	struct inflight *f, *next;
 
-		linebuf = malloc(strlen(line) + 1);
-		keybuf = malloc(strlen(key_content) + 1);
-		strcpy(keybuf, key_content);
-		strcpy(linebuf, line);
+	pthread_mutex_lock(&retry_lock);
+	f = retry_head;
+	retry_head = retry_tail = NULL;
+	__atomic_store_n(&retry_count, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&retry_lock);
+	for (; f != NULL; f = next) {
+		next = f->next;
+		__atomic_fetch_add(&n_dropped, f->nmsgs, __ATOMIC_RELAXED);
+		inflight_release(f);
+	}
+}
 
-		/* Create a record that contains the message. */
-		streams_producer_record_t record;
-		ret_val = streams_producer_record_create(
-		    topic, keybuf, strlen(keybuf) + 1,
-		    linebuf, strlen(linebuf) + 1, &record);
+/* wait for the callbacks of everything sent so far, on both connections */
+static int
+producer_flush_all(struct prodstate *ps)
+{
+	int ret_val;
 
-		if (EXIT_SUCCESS != ret_val) {
-			DPRINTF("streams_producer_record_create() failed\n");
-			return (ret_val);
-		}
+	pthread_rwlock_rdlock(&ps->conn_lock);
+	ret_val = streams_producer_flush(ps->producer);
+	if (ps->sb_producer != NULL && EXIT_SUCCESS == ret_val)
+		ret_val = streams_producer_flush(ps->sb_producer);
+	pthread_rwlock_unlock(&ps->conn_lock);
+	if (EXIT_SUCCESS != ret_val) {
+		DPRINTF("streams_producer_flush() failed\n");
+	}
+	return (ret_val);
+}
 
-		/* Buffer the message. */
-		/* DPRINTF("calling streams_producer_send()\n"); */
-		ret_val =
-		    streams_producer_send(producer,
-		    record, producerCallback, NULL);
-	
-		if (EXIT_SUCCESS != ret_val) {
-			DPRINTF("streams_producer_send() failed\n");
-			return (ret_val);
-		}
-		msg_idx++;
-	
-		/* Flush the message.
-		 * this is the synchronous approach but reduces throughput
-		 *
-		ret_val = streams_producer_flush(producer);
-		if (EXIT_SUCCESS != ret_val) {
-			DPRINTF("streams_producer_flush() failed\n");
-			return (ret_val);
+static int
+retry_due(void)
+{
+	return (__atomic_load_n(&retry_count, __ATOMIC_ACQUIRE) > 0 &&
+	    pacer_now_ns() >= __atomic_load_n(&retry_next_ns,
+	    __ATOMIC_RELAXED));
+}
+
+/* while waiting for a slot, keep retries moving, they may be what we wait on */
+static int
+inflight_wait(struct prodstate *ps, struct sender *s)
+{
+	if (__atomic_load_n(&ps->stop, __ATOMIC_RELAXED))
+		return (-1);
+	if (retry_due())
+		return (retry_drain(ps, s));
+	usleep(100);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * A pool buffer, waiting for one as long as it takes: the cap is what
+ * holds the senders to the rate the cluster acks at, slow or failing
+ * over.  NULL only if we're stopping or size can never fit.
+ */
+static void *
+pool_alloc(struct prodstate *ps, struct sender *s, size_t size)
+{
+	void *p;
+
+	while ((p = recpool_alloc(size)) == NULL && errno == EAGAIN) {
+		if (EXIT_SUCCESS != inflight_wait(ps, s))
+			return (NULL);
+	}
+	return (p);
+}
+
+/*
+ * "Key_<msg_idx>", behind a rechdr.h header with -E and padded out to
+ * the -K size with -G; returns its length
+ */
+static uint32_t
+make_key(char *key, long msg_idx, uint32_t *hlen)
+{
+	uint32_t n, size;
+
+	*hlen = 0;
+	if (stamp)
+		*hlen = rechdr_put(key, producer_id, msg_idx, rechdr_now_ns());
+	n = snprintf(key + *hlen, INFLIGHT_KEY_LEN - *hlen, "Key_%ld",
+	    msg_idx) + 1;
+	if (synthetic && (size = lg_size_for(&gen_ksize, msg_idx)) > n) {
+		memset(key + *hlen + n, 'k', size - n);
+		n = size;
+	}
+	return (*hlen + n);
+}
+
+/*
+ * Slot for message msg_idx on a cluster, unless it has -I records in
+ * flight already or its slot's last record hasn't been acked.
+ */
+static struct inflight *
+slot_try(int side, long msg_idx)
+{
+	struct inflight *f = &inflight[side][msg_idx % INFLIGHT_SLOTS];
+	int idle = 0;
+
+	if (__atomic_load_n(&side_inflight[side], __ATOMIC_RELAXED) >=
+	    max_inflight || !__atomic_compare_exchange_n(&f->busy, &idle, 1,
+	    0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return (NULL);
+	__atomic_fetch_add(&side_inflight[side], 1, __ATOMIC_RELAXED);
+	f->side = side;
+	f->tries = 0;
+	f->mi = NULL;
+	f->valbuf = NULL;
+	return (f);
+}
+
+/*
+ * Slot for message msg_idx.  Waits while -I records are already in
+ * flight, and for the slot's last record if we've lapped the table.
+ * With -X only while both clusters are that far behind, the record goes
+ * to whichever isn't first and the other gets a copy if it can.
+ */
+static struct inflight *
+inflight_claim(struct prodstate *ps, struct sender *s, long msg_idx)
+{
+	struct inflight *f;
+
+	while ((f = slot_try(0, msg_idx)) == NULL &&
+	    (!active_active || (f = slot_try(1, msg_idx)) == NULL)) {
+		__atomic_fetch_add(&n_bp_waits, 1, __ATOMIC_RELAXED);
+		if (EXIT_SUCCESS != inflight_wait(ps, s))
+			return (NULL);
+	}
+	f->nmsgs = 1;
+	f->part = -1;
+	f->sender = s->id;
+	__atomic_store_n(&f->pos, s->pos, __ATOMIC_RELAXED);
+
+	/* stamped once, retries keep the original send time */
+	f->klen = make_key(f->key, msg_idx, &f->hlen);
+	return (f);
+}
+
+/*
+ * With -Z, swap the slot's value for a compressed copy in a pool
+ * buffer and let go of the original.  A value that doesn't shrink, or
+ * that the pool has no room for, goes as it is.
+ */
+static void
+compress_value(struct sender *s, struct inflight *f)
+{
+	size_t cap = z_bound(&zcodec, f->vlen), n;
+	char *buf;
+
+	if ((buf = recpool_alloc(cap)) == NULL)
+		return;
+	n = z_compress(&zcodec, &s->z, buf, cap, f->val, f->vlen, &zstats);
+	if (n == 0) {
+		recpool_free(buf);
+		return;
+	}
+	if (f->mi != NULL)
+		mapinput_release(f->mi);
+	else
+		recpool_free(f->valbuf);
+	f->mi = NULL;
+	f->valbuf = buf;
+	f->val = buf;
+	f->vlen = n;
+}
+
+/*
+ * -X: a copy of a claimed slot for the other cluster.  It has to be
+ * made before the slot is sent, the slot may be acked and reused as
+ * soon as it is.  The copy never waits: if the other cluster has -I
+ * records in flight, or the pool is at its cap, it's shed and that
+ * cluster doesn't get this record.
+ */
+static struct inflight *
+mirror_claim(struct inflight *f, long msg_idx)
+{
+	int side = !f->side;
+	struct inflight *m;
+
+	if ((m = slot_try(side, msg_idx)) == NULL)
+		goto shed;
+	if (f->valbuf != NULL) {
+		if ((m->valbuf = recpool_try_alloc(f->vlen)) == NULL) {
+			inflight_release(m);
+			goto shed;
 		}
-		DPRINTF("Produced: MESSAGE %d: ", msg_idx);
-		*/
+		memcpy(m->valbuf, f->val, f->vlen);
+		m->val = m->valbuf;
+	} else {
+		/* the mapping, or the -G template, can be shared */
+		if ((m->mi = f->mi) != NULL)
+			mapinput_hold(m->mi);
+		m->val = f->val;
 	}
-	fclose(fp);
-	if (line)
-		free(line);
+	m->vlen = f->vlen;
+	m->nmsgs = f->nmsgs;
+	m->part = f->part;
+	m->sender = f->sender;
+	__atomic_store_n(&m->pos, f->pos, __ATOMIC_RELAXED);
 
-	/* send 0 metric now that we're shuttong down */
-	ret_val = send_metrics(cur_topic, fullTopicName, backupTopicName, 0);
-	if (EXIT_SUCCESS != ret_val) {
-		IPRINTF("send_metrics() failed\n");
+	/* header and all, so the consumers see the same record twice */
+	memcpy(m->key, f->key, f->klen);
+	m->klen = f->klen;
+	m->hlen = f->hlen;
+	return (m);
+shed:
+	__atomic_fetch_add(&side_shed[side], f->nmsgs, __ATOMIC_RELAXED);
+	return (NULL);
+}
+
+/*
+ * Send a claimed slot, and with -X a copy of it on the other cluster.
+ * Slots that can't be sent are let go of here.  With -X a cluster
+ * that fails the send just sheds the record, it's only an error if
+ * neither takes it.
+ */
+static int
+send_slot(struct prodstate *ps, struct sender *s, struct inflight *f,
+		long msg_idx)
+{
+	struct inflight *m = NULL;
+	uint32_t nmsgs = f->nmsgs;
+	int side = f->side, ret_val;
+
+	if (active_active)
+		m = mirror_claim(f, msg_idx);
+	ret_val = send_record(ps, s, f);
+	if (EXIT_SUCCESS != ret_val)
+		inflight_release(f);
+	if (m == NULL)
+		return (ret_val);
+	if (EXIT_SUCCESS != ret_val)
+		__atomic_fetch_add(&side_shed[side], nmsgs, __ATOMIC_RELAXED);
+	if (EXIT_SUCCESS != send_record(ps, s, m)) {
+		__atomic_fetch_add(&side_shed[!side], nmsgs, __ATOMIC_RELAXED);
+		inflight_release(m);
 		return (ret_val);
 	}
 	return (EXIT_SUCCESS);
 }
 
-/* MAIN */
+/* Send one line straight out of the input mapping, or a -G template. */
 int
-main(int argc, char *argv[])
+send_mapped(struct prodstate *ps, struct sender *s, struct mapinput *mi,
+		const char *mline, size_t mlen, long msg_idx)
 {
-	char *maintopic, *backuptopic, *fname;
-	char *pipename;
+	struct inflight *f = inflight_claim(ps, s, msg_idx);
+
+	if (f == NULL)
+		return (-1);
+	/* -G templates have no mapping, and stay put */
+	f->mi = mi;
+	if (mi != NULL)
+		mapinput_hold(mi);
+	f->val = mline;
+	f->vlen = mlen;
+	if (zcodec.codec != Z_NONE)
+		compress_value(s, f);
+	return (send_slot(ps, s, f, msg_idx));
+}
+
+/* Send a copy of a line read with getline(), in a pool buffer. */
+int
+send_copy(struct prodstate *ps, struct sender *s,
+		const char *line, size_t read, long msg_idx)
+{
+	struct inflight *f = inflight_claim(ps, s, msg_idx);
+
+	if (f == NULL)
+		return (-1);
+
+	/* blocks here if the pool is at its cap until acks catch up */
+	f->valbuf = pool_alloc(ps, s, read + 1);
+	if (f->valbuf == NULL) {
+		if (errno == E2BIG)
+			DPRINTF("line of %zu bytes can't fit in the pool\n",
+			    read);
+		inflight_release(f);
+		return (-1);
+	}
+	memcpy(f->valbuf, line, read + 1);
+	f->val = f->valbuf;
+	f->vlen = read + 1;
+	if (zcodec.codec != Z_NONE)
+		compress_value(s, f);
+	return (send_slot(ps, s, f, msg_idx));
+}
+
+/* -c: the lowest position still in one of our open envelopes */
+static void
+env_low_update(struct prodstate *ps, struct sender *s)
+{
+	uint64_t low = UINT64_MAX;
+
+	if (s->ix == NULL)
+		return;
+	for (int p = 0; p < ps->nparts; p++) {
+		if (s->env[p].buf != NULL && s->env[p].first_pos < low)
+			low = s->env[p].first_pos;
+	}
+	__atomic_store_n(&s->env_low, low, __ATOMIC_RELEASE);
+}
+
+/*
+ * Send a partition's envelope (-B) as one record, keyed like its first
+ * line.  The envelope's buffer goes with the slot either way.
+ */
+static int
+env_send(struct prodstate *ps, struct sender *s, int part)
+{
+	struct envbuf *e = &s->env[part];
+	struct inflight *f;
 	int ret_val;
 
-	if (argc != 5) {
-		fprintf(stderr, 
-		    "usage:  %s "
-		    "/stream:topic /backup_stream:topic "
-		    " <filename> <pipe_filename>\n", argv[0]);
-		exit(-1);
+	f = inflight_claim(ps, s, e->first_idx);
+	if (f == NULL) {
+		recpool_free(e->buf);
+		e->buf = NULL;
+		return (-1);
 	}
-	maintopic = argv[1];
-	backuptopic = argv[2];
-	fname = argv[3];
-	pipename = argv[4];
+	f->valbuf = e->buf;
+	f->val = e->buf;
+	f->vlen = env_finish(e);
+	f->nmsgs = e->count;
+	f->part = part;
+	__atomic_store_n(&f->pos, e->first_pos, __ATOMIC_RELAXED);
+	e->buf = NULL;
+	env_low_update(ps, s);
 
-	/* Produce Messages */
-	ret_val = producer(maintopic, backuptopic,
-			fname, pipename);
+	/* the whole envelope, where the codec has the most to work with */
+	if (zcodec.codec != Z_NONE)
+		compress_value(s, f);
+
+	ret_val = send_slot(ps, s, f, e->first_idx);
+	if (EXIT_SUCCESS == ret_val)
+		__atomic_fetch_add(&n_envelopes, 1, __ATOMIC_RELAXED);
+	return (ret_val);
+}
+
+/* send the envelopes that have lingered long enough, or all of them */
+static int
+env_flush(struct prodstate *ps, struct sender *s, int all)
+{
+	uint64_t now = pacer_now_ns();
+	int ret_val = EXIT_SUCCESS;
+
+	for (int p = 0; p < ps->nparts; p++) {
+		if (s->env[p].buf == NULL ||
+		    (!all && now - s->env[p].first_ns < env_linger_ns))
+			continue;
+		if (EXIT_SUCCESS == ret_val)
+			ret_val = env_send(ps, s, p);
+		else
+			recpool_free(s->env[p].buf);
+		s->env[p].buf = NULL;
+	}
+	if (EXIT_SUCCESS != ret_val)
+		env_low_update(ps, s);
+	return (ret_val);
+}
+
+/*
+ * Add a line to its partition's envelope (-B), sending the envelope
+ * first if the line doesn't fit.  Lines are copied in, -m or not.
+ */
+int
+send_enveloped(struct prodstate *ps, struct sender *s,
+		const char *line, size_t len, long msg_idx)
+{
+	char key[INFLIGHT_KEY_LEN];
+	struct envbuf *e;
+	uint32_t klen, hlen, size;
+	char *buf;
+	int part, ret_val;
+
+	klen = make_key(key, msg_idx, &hlen);
+	part = pick_partition(ps, s, key + hlen, klen - hlen);
+	e = &s->env[part];
+	if (e->buf != NULL && !env_fits(e, klen, len)) {
+		ret_val = env_send(ps, s, part);
+		if (EXIT_SUCCESS != ret_val)
+			return (ret_val);
+	}
+	if (e->buf == NULL) {
+		/* a line too big for an envelope gets one to itself */
+		size = ENV_HDR_LEN + env_size(klen, len);
+		if (size < env_max)
+			size = env_max;
+		if ((buf = pool_alloc(ps, s, size)) == NULL) {
+			if (errno == E2BIG)
+				DPRINTF("envelope of %u bytes can't fit in "
+				    "the pool\n", size);
+			return (-1);
+		}
+		env_start(e, buf, size);
+		e->first_ns = pacer_now_ns();
+		e->first_idx = msg_idx;
+		e->first_pos = s->pos;
+		env_low_update(ps, s);
+	}
+	env_add(e, key, klen, line, len);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * The sender's next line, from the mapping or getline(), going round
+ * again at the end with -L; or with -G, a slice of the template.
+ * Returns 0 when there are no more.
+ */
+static int
+sender_next(struct prodstate *ps, struct sender *s, const char **line,
+		size_t *len, char **buf, size_t *cap)
+{
+	ssize_t read;
+	int wrapped = 0;
+
+	if (synthetic) {
+		*len = gen_vsize.min + lg_rand(&s->rng) %
+		    (gen_vsize.max - gen_vsize.min + 1);
+		*line = gen_template + lg_rand(&s->rng) % LG_TEMPLATE_SLACK;
+		return (1);
+	}
+	for (;;) {
+		/* -c: the first time through, note where every so often */
+		if (s->ix != NULL && s->line % CKPT_STEP == 0 &&
+		    s->line / CKPT_STEP == s->ix->n &&
+		    EXIT_SUCCESS != ckpt_index_add(s->ix, s->line, use_map ?
+		    s->shard.pos : (uint64_t)ftello(s->fp))) {
+			DPRINTF("can't grow the checkpoint index\n");
+		}
+		if (use_map) {
+			if (mapshard_next(&s->shard, line, len)) {
+				s->pos = CKPT_POS(s->pass, s->line++);
+				return (1);
+			}
+		} else if ((read = getline(buf, cap, s->fp)) != -1) {
+			*line = *buf;
+			*len = read;
+			s->pos = CKPT_POS(s->pass, s->line++);
+			return (1);
+		}
+		/* an empty input (or shard) isn't worth going round */
+		if (wrapped || (loops != 0 && ++s->pass >= loops))
+			return (0);
+		if (s->nlines == 0)
+			__atomic_store_n(&s->nlines, s->line, __ATOMIC_RELAXED);
+		s->line = 0;
+
+		/* round again, everything a pass later in time for -W */
+		if (use_map)
+			s->shard = s->shard_start;
+		else
+			rewind(s->fp);
+		s->warp_base += ps->warp_span;
+		wrapped = 1;
+	}
+}
+
+/*
+ * -c: pick up where the checkpoint left the sender, from the nearest
+ * line in the index.  Comes after warp_scan(), for -W's timestamps.
+ */
+static int
+sender_seek(struct prodstate *ps, struct sender *s,
+		const struct ckpt_sender *cs)
+{
+	uint64_t line = CKPT_LINE(cs->pos), at, off;
+	const char *l;
+	char *buf = NULL;
+	size_t len, cap = 0;
+
+	s->pass = CKPT_PASS(cs->pos);
+	s->nlines = cs->nlines;
+	s->warp_base = s->pass * ps->warp_span;
+	off = use_map ? s->shard.pos : 0;
+	at = ckpt_index_find(s->ix, line, &off);
+	if (use_map)
+		s->shard.pos = off;
+	else if (fseeko(s->fp, off, SEEK_SET) != 0)
+		return (-1);
+	for (; at < line; at++) {
+		if (use_map ? !mapshard_next(&s->shard, &l, &len) :
+		    getline(&buf, &cap, s->fp) == -1)
+			break;
+	}
+	free(buf);
+	s->line = at;
+	s->pos = s->next_pos = CKPT_POS(s->pass, at);
+	IPRINTF("sender %d resuming at pass %lu line %lu\n", s->id,
+	    (unsigned long)s->pass, (unsigned long)at);
+	return (EXIT_SUCCESS);
+}
+
+/* -W: wait until the line's timestamp comes round at the warped speed */
+static void
+warp_wait(struct prodstate *ps, struct sender *s, const char *line,
+		size_t len)
+{
+	uint64_t ts, due, now;
+
+	if (lg_line_ts(line, len, warp_field, &ts) != EXIT_SUCCESS)
+		return;
+	ts += s->warp_base;
+	due = ps->warp_start + (ts > ps->warp_t0 ?
+	    (uint64_t)((ts - ps->warp_t0) / warp) : 0);
+	while ((now = pacer_now_ns()) < due &&
+	    !__atomic_load_n(&ps->stop, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&ps->done, __ATOMIC_RELAXED))
+		usleep(due - now > 10000000 ? 10000 : (due - now) / 1000);
+}
+
+/*
+ * Sender Thread
+ * -------------
+ * Reads its share of the input and sends it as fast as the shared
+ * pacer allows.  Message indexes are reserved a pacer batch at a time
+ * so threads don't fight over the counter on every record.
+ */
+void *
+sender_thread(void *arg)
+{
+	struct sender *s = arg;
+	struct prodstate *ps = s->ps;
+	char *line = NULL;
+	size_t len = 0;
+	const char *mline;
+	size_t mlen;
+	long granted = 0, msg_idx = 0;
+	uint64_t t0;
+	int ret_val;
+
+	prof_thread("sender%d", s->id);
+	while (!__atomic_load_n(&ps->stop, __ATOMIC_RELAXED) &&
+	    !__atomic_load_n(&ps->done, __ATOMIC_RELAXED)) {
+		/* resends go ahead of new records, they were paced already */
+		if (retry_due()) {
+			ret_val = retry_drain(ps, s);
+			if (EXIT_SUCCESS != ret_val) {
+				ps->error = ret_val;
+				__atomic_store_n(&ps->stop, 1, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		if (granted == 0) {
+			/* between pacer waits, so at most 10ms late */
+			if (env_max > 0 &&
+			    EXIT_SUCCESS != (ret_val = env_flush(ps, s, 0))) {
+				ps->error = ret_val;
+				__atomic_store_n(&ps->stop, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			pthread_mutex_lock(&ps->pacer_lock);
+			granted = pacer_take(&ps->pacer, PACER_MAX_BATCH);
+			pthread_mutex_unlock(&ps->pacer_lock);
+			msg_idx = __atomic_fetch_add(&ps->next_idx, granted,
+			    __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (max_records > 0 && msg_idx >= max_records)
+			break;
+		t0 = prof_now();
+		if (!sender_next(ps, s, &mline, &mlen, &line, &len))
+			break;
+		prof_end(PROF_READ, t0);
+		granted--;
+		if (warp > 0)
+			warp_wait(ps, s, mline, mlen);
+
+		/* getline() lines are copied, NUL and all */
+		if (env_max > 0)
+			ret_val = send_enveloped(ps, s, mline,
+			    use_map || synthetic ? mlen : mlen + 1, msg_idx);
+		else if (use_map || synthetic)
+			ret_val = send_mapped(ps, s, s->shard.mi,
+			    mline, mlen, msg_idx);
+		else
+			ret_val = send_copy(ps, s, mline, mlen, msg_idx);
+		if (EXIT_SUCCESS != ret_val) {
+			ps->error = ret_val;
+			__atomic_store_n(&ps->stop, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		msg_idx++;
+		__atomic_store_n(&s->sent, s->sent + 1, __ATOMIC_RELAXED);
+		if (s->ix != NULL)
+			__atomic_store_n(&s->next_pos, s->pos + 1,
+			    __ATOMIC_RELEASE);
+	}
+
+	if (line)
+		free(line);
+
+	/* what's left in the envelopes, dropped if we're stopping */
+	if (env_max > 0 && EXIT_SUCCESS != env_flush(ps, s, 1) &&
+	    !__atomic_load_n(&ps->stop, __ATOMIC_RELAXED))
+		ps->error = -1;
+	free(s->env);
+	z_ctx_free(&s->z);
+
+	/* the last one out lets the control loop finish */
+	if (__atomic_sub_fetch(&ps->running, 1, __ATOMIC_ACQ_REL) == 0)
+		evloop_stop(&ps->ev);
+	return (NULL);
+}
+
+static unsigned long
+total_sent(struct sender *senders)
+{
+	unsigned long sent = 0;
+
+	for (int i = 0; i < nsenders; i++)
+		sent += __atomic_load_n(&senders[i].sent, __ATOMIC_RELAXED);
+	return (sent);
+}
+
+/* what we send at: the pipe's rate, or with -a the controller's */
+static int
+send_rate(struct prodstate *ps)
+{
+	return (adaptive ? (int)ps->aimd.rate : ps->rate);
+}
+
+/*
+ * Flush the connection we just left, so everything still in flight on
+ * it is either acked or failed onto the retry queue.
+ */
+static void *
+reconcile_thread(void *arg)
+{
+	streams_producer_t *old = arg;
+
+	if (EXIT_SUCCESS != streams_producer_flush(*old)) {
+		DPRINTF("flushing the old connection failed\n");
+	}
+	free(old);
+	__atomic_fetch_sub(&reconciling, 1, __ATOMIC_RELEASE);
+	return (NULL);
+}
+
+/* make the standby connection the active one and vice versa */
+static int
+swap_standby(struct prodstate *ps, const char *topic)
+{
+	streams_topic_partition_t tp;
+	streams_config_t conf;
+	streams_producer_t prod, *old;
+	pthread_t tid;
+
+	old = malloc(sizeof (*old));
+	if (old == NULL)
+		return (-1);
+
+	/* wait for the senders to get out of the connection */
+	pthread_rwlock_wrlock(&ps->conn_lock);
+	for (int i = 0; i < ps->nparts; i++) {
+		tp = ps->tps[i];
+		ps->tps[i] = ps->sb_tps[i];
+		ps->sb_tps[i] = tp;
+	}
+	conf = ps->config;
+	ps->config = ps->sb_config;
+	ps->sb_config = conf;
+	prod = ps->producer;
+	ps->producer = ps->sb_producer;
+	ps->sb_producer = prod;
+	ps->cur_topic = topic;
+	pthread_rwlock_unlock(&ps->conn_lock);
+
+	/* the old one stays up as the standby, sort out what it still has */
+	*old = prod;
+	__atomic_fetch_add(&reconciling, 1, __ATOMIC_RELEASE);
+	if (pthread_create(&tid, NULL, reconcile_thread, old) != 0) {
+		__atomic_fetch_sub(&reconciling, 1, __ATOMIC_RELEASE);
+		free(old);
+		return (EXIT_SUCCESS);
+	}
+	pthread_detach(tid);
+	return (EXIT_SUCCESS);
+}
+
+/* move every sender over to the other cluster */
+int
+failover(struct prodstate *ps, const char *topic)
+{
+	uint64_t start = pacer_now_ns();
+	long us;
+	int ret_val;
+
+	if (active_active) {
+		IPRINTF("sending to both clusters (-X), nothing to fail "
+		    "over\n");
+		return (EXIT_SUCCESS);
+	}
+	if (topic == ps->cur_topic)
+		return (EXIT_SUCCESS);
+	IPRINTF("failing over to %s cluster\n",
+	    topic == ps->backup ? "backup" : "primary");
+
+	if (hot_standby) {
+		ret_val = swap_standby(ps, topic);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("trying to failover: swap failed\n");
+			return (ret_val);
+		}
+	} else {
+		/* wait for the senders to get out of the connection */
+		pthread_rwlock_wrlock(&ps->conn_lock);
+		ret_val = producer_shutdown(ps->nparts, ps->tps,
+		    &ps->config, &ps->producer);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("trying to failover: shutdown() failed\n");
+			pthread_rwlock_unlock(&ps->conn_lock);
+			return (ret_val);
+		}
+		ps->cur_topic = topic;
+		ret_val = producer_init(ps->cur_topic, ps->nparts, ps->tps,
+		    &ps->config, &ps->producer);
+		pthread_rwlock_unlock(&ps->conn_lock);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("trying to failover: init() failed\n");
+			return (ret_val);
+		}
+	}
+
+	/* how long the senders were held up */
+	us = (pacer_now_ns() - start) / 1000;
+	IPRINTF("failover took %ldus\n", us);
+	metrics_put("producer.failover_us", us);
+	return (EXIT_SUCCESS);
+}
+
+/* apply one command from the pipe, see evloop.h */
+int
+do_command(struct cmd *c, void *arg)
+{
+	struct prodstate *ps = arg;
+	struct recpool_stats st;
+	unsigned long nenv, zin, zout;
+	int ret_val;
+
+	switch (c->op) {
+	case CMD_RATE:
+		/* takes effect right away */
+		IPRINTF("new rate: %ld\n", c->arg);
+		ps->rate = c->arg;
+		if (adaptive)
+			aimd_set_ceiling(&ps->aimd, ps->rate);
+		pthread_mutex_lock(&ps->pacer_lock);
+		pacer_set_rate(&ps->pacer, send_rate(ps));
+		pthread_mutex_unlock(&ps->pacer_lock);
+		ret_val = send_metrics(ps->cur_topic, ps->primary, ps->backup,
+		    send_rate(ps));
+		if (EXIT_SUCCESS != ret_val) {
+			IPRINTF("send_metrics() failed\n");
+			return (ret_val);
+		}
+		return (EXIT_SUCCESS);
+	case CMD_FAILOVER:
+		return (failover(ps, ps->backup));
+	case CMD_FAILBACK:
+		return (failover(ps, ps->primary));
+	case CMD_FLUSH:
+		(void) producer_flush_all(ps);
+		return (EXIT_SUCCESS);
+	case CMD_STOP:
+		/* the senders finish up as if the input had run out */
+		IPRINTF("stopping\n");
+		__atomic_store_n(&ps->done, 1, __ATOMIC_RELAXED);
+		return (EXIT_SUCCESS);
+	case CMD_STATS:
+		recpool_get_stats(&st);
+		fprintf(stderr, "sent %lu, rate %d, %s, %d sender(s), "
+		    "%d partition(s)\n", total_sent(ps->senders), ps->rate,
+		    active_active ? "both clusters" :
+		    ps->cur_topic == ps->primary ? "primary cluster" :
+		    "backup cluster", nsenders, ps->nparts);
+		if (adaptive)
+			fprintf(stderr, "adaptive: sending at %d of %d, "
+			    "%lu increases, %lu decreases; congested ticks: "
+			    "%lu errors, %lu latency, %lu in flight, "
+			    "%lu blocked\n", send_rate(ps), ps->rate,
+			    ps->aimd.increases, ps->aimd.decreases,
+			    ps->aimd_why[0], ps->aimd_why[1], ps->aimd_why[2],
+			    ps->aimd_why[3]);
+		fprintf(stderr, "%lu in flight, %lu acked, %lu failed, "
+		    "%lu retried, %lu dropped, %lu waiting to retry\n",
+		    total_inflight(),
+		    __atomic_load_n(&n_acked, __ATOMIC_RELAXED),
+		    __atomic_load_n(&n_failed, __ATOMIC_RELAXED),
+		    __atomic_load_n(&n_retried, __ATOMIC_RELAXED),
+		    __atomic_load_n(&n_dropped, __ATOMIC_RELAXED),
+		    __atomic_load_n(&retry_count, __ATOMIC_RELAXED));
+		fprintf(stderr, "ack latency (last %dms): p50 %luus, p99 %luus, "
+		    "p99.9 %luus, max %luus\n", REPORT_MS,
+		    (unsigned long)hist_percentile(&ack_last, 50),
+		    (unsigned long)hist_percentile(&ack_last, 99),
+		    (unsigned long)hist_percentile(&ack_last, 99.9),
+		    (unsigned long)ack_last.max);
+		for (int i = 0; active_active && i < 2; i++)
+			fprintf(stderr, "%s: %lu in flight, %lu acked, "
+			    "%lu failed, %lu shed, ack p99 %luus\n",
+			    side_name[i], __atomic_load_n(&side_inflight[i],
+			    __ATOMIC_RELAXED), __atomic_load_n(&side_acked[i],
+			    __ATOMIC_RELAXED), __atomic_load_n(&side_failed[i],
+			    __ATOMIC_RELAXED), __atomic_load_n(&side_shed[i],
+			    __ATOMIC_RELAXED),
+			    (unsigned long)hist_percentile(&side_last[i], 99));
+		fprintf(stderr, "pool: %lu hits, %lu misses, %lu waits, "
+		    "%lu in use, %lu high water\n", st.hits, st.misses,
+		    st.waits, st.in_use, st.high_water);
+		nenv = __atomic_load_n(&n_envelopes, __ATOMIC_RELAXED);
+		if (nenv > 0)
+			fprintf(stderr, "%lu envelopes, %.1f lines each\n",
+			    nenv, (double)total_sent(ps->senders) / nenv);
+		zin = __atomic_load_n(&zstats.in_bytes, __ATOMIC_RELAXED);
+		zout = __atomic_load_n(&zstats.out_bytes, __ATOMIC_RELAXED);
+		if (zcodec.codec != Z_NONE && zin > 0)
+			fprintf(stderr, "%s: %lu bytes to %lu (%.1f%%), "
+			    "%.1fms cpu\n", z_name(zcodec.codec), zin, zout,
+			    zout * 100.0 / zin, __atomic_load_n(&zstats.cpu_ns,
+			    __ATOMIC_RELAXED) / 1e6);
+		return (EXIT_SUCCESS);
+	default:
+		IPRINTF("ignoring unknown command '%s'\n", c->line);
+		return (EXIT_SUCCESS);
+	}
+}
+
+static int
+on_pipe(void *arg)
+{
+	struct prodstate *ps = arg;
+	int ret_val;
+
+	ret_val = cmd_read(ps->pipe_fd, &ps->cmdbuf, do_command, ps);
+	if (ret_val < 0) {
+		IPRINTF("reading command pipe failed\n");
+	}
+	return (ret_val);
+}
+
+/*
+ * -c: save each sender's lowest position not acked yet: the next line
+ * it will send, unless there's one in an open envelope or in a slot
+ * that's lower, on either cluster with -X.  The senders' positions are
+ * read before the slots, so a line on its way into a slot is still
+ * covered by next_pos.  A slot read just as it's claimed may show its
+ * last record's position, which can only be lower, so a checkpoint
+ * never goes back.
+ */
+static int
+ckpt_update(struct prodstate *ps)
+{
+	static int warned;
+	uint64_t low[MAX_SENDERS], env, pos;
+	struct inflight *f;
+	struct sender *s;
+	long next_idx;
+	int i;
+
+	for (i = 0; i < nsenders; i++) {
+		s = &ps->senders[i];
+		low[i] = __atomic_load_n(&s->next_pos, __ATOMIC_ACQUIRE);
+		env = __atomic_load_n(&s->env_low, __ATOMIC_ACQUIRE);
+		if (env < low[i])
+			low[i] = env;
+	}
+	for (int k = 0; k < INFLIGHT_SLOTS * (active_active ? 2 : 1); k++) {
+		f = &inflight[k / INFLIGHT_SLOTS][k % INFLIGHT_SLOTS];
+		if (!__atomic_load_n(&f->busy, __ATOMIC_ACQUIRE))
+			continue;
+		i = f->sender;
+		pos = __atomic_load_n(&f->pos, __ATOMIC_RELAXED);
+		if (i >= 0 && i < nsenders && pos < low[i])
+			low[i] = pos;
+	}
+	for (i = 0; i < nsenders; i++) {
+		if (low[i] > ckpt.s[i].pos)
+			ckpt.s[i].pos = low[i];
+		ckpt.s[i].nlines = __atomic_load_n(&ps->senders[i].nlines,
+		    __ATOMIC_RELAXED);
+	}
+
+	/* one sender's msg_idx counts its lines, so resent ones keep theirs */
+	next_idx = __atomic_load_n(&ps->next_idx, __ATOMIC_RELAXED);
+	if (nsenders == 1) {
+		ckpt.next_idx = CKPT_PASS(ckpt.s[0].pos) * ckpt.s[0].nlines +
+		    CKPT_LINE(ckpt.s[0].pos);
+	} else {
+		if (next_idx > ckpt.next_idx && ckpt.next_idx > 0 &&
+		    !warned++)
+			IPRINTF("over %ld messages between checkpoints, "
+			    "a resume may reuse keys\n", CKPT_IDX_RESERVE);
+		ckpt.next_idx = next_idx + CKPT_IDX_RESERVE;
+	}
+	if (EXIT_SUCCESS != ckpt_save(&ckpt)) {
+		IPRINTF("can't save checkpoint %s\n", ckpt.path);
+		return (-1);
+	}
+	return (EXIT_SUCCESS);
+}
+
+static int
+on_ckpt(void *arg)
+{
+	(void) ckpt_update(arg);
+	return (EXIT_SUCCESS);
+}
+
+/* once a second: how we're keeping up, and the metrics */
+static int
+on_report(void *arg)
+{
+	struct prodstate *ps = arg;
+	uint64_t now_ns = pacer_now_ns();
+	unsigned long sent = total_sent(ps->senders);
+	long tdiff = (now_ns - ps->last_report) / 1000000;
+	int ret_val;
+
+	DPRINTF("time diff %ld rate %d\n", tdiff, send_rate(ps));
+	/*
+	 * with -W the input's timestamps set the pace and rate is only a
+	 * cap, with -a the controller keeps the rate to what we manage
+	 */
+	if (warp == 0 && !adaptive &&
+	    sent - ps->last_sent < ps->rate * (tdiff / 1000.0) *
+	    FALLING_BEHIND_FRAC) {
+		DPRINTF("warning:  falling behind, only sent "
+		    "%lu messages in %lums at rate %d\n",
+		    sent - ps->last_sent, tdiff, ps->rate);
+	}
+	ret_val = send_metrics(ps->cur_topic, ps->primary, ps->backup,
+	    send_rate(ps));
+	if (EXIT_SUCCESS != ret_val) {
+		IPRINTF("send_metrics() failed\n");
+		return (ret_val);
+	}
+	if (!use_map)
+		send_pool_metrics();
+	send_ack_metrics();
+	if (adaptive)
+		send_aimd_metrics(ps);
+	if (active_active)
+		send_side_metrics();
+	if (zcodec.codec != Z_NONE)
+		send_compress_metrics();
+	ps->last_report = now_ns;
+	ps->last_sent = sent;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * -a: every AIMD_TICK_MS, whether the last tick was congested and
+ * whether the senders kept up, and the rate that comes out of it.
+ */
+static int
+on_aimd(void *arg)
+{
+	struct prodstate *ps = arg;
+	struct recpool_stats st;
+	unsigned long sent = total_sent(ps->senders);
+	unsigned long failed = __atomic_load_n(&n_failed, __ATOMIC_RELAXED);
+	unsigned long waits = __atomic_load_n(&n_bp_waits, __ATOMIC_RELAXED);
+	double rate = ps->aimd.rate;
+	int why = 0, used;
+
+	hist_snapshot(&aimd_hist, &aimd_last);
+	if (failed != ps->aimd_failed)
+		why |= AIMD_ERRORS;
+	if (aimd_last.count > 0 &&
+	    hist_percentile(&aimd_last, 99) > aimd_p99_us)
+		why |= AIMD_LATENCY;
+	if (__atomic_load_n(&n_inflight_bytes, __ATOMIC_RELAXED) >
+	    BUFFER_MEMORY * AIMD_INFLIGHT_FRAC)
+		why |= AIMD_INFLIGHT;
+	if (waits != ps->aimd_waits)
+		why |= AIMD_BLOCKED;
+	if (!use_map) {
+		recpool_get_stats(&st);
+		if (st.waits != ps->aimd_pool_waits)
+			why |= AIMD_BLOCKED;
+		ps->aimd_pool_waits = st.waits;
+	}
+	for (int i = 0; i < 4; i++) {
+		if (why & (1 << i))
+			ps->aimd_why[i]++;
+	}
+	used = sent - ps->aimd_sent >=
+	    rate * AIMD_TICK_MS / 1000.0 * FALLING_BEHIND_FRAC;
+	ps->aimd_sent = sent;
+	ps->aimd_failed = failed;
+	ps->aimd_waits = waits;
+
+	if (aimd_update(&ps->aimd, why != 0, used) != rate) {
+		pthread_mutex_lock(&ps->pacer_lock);
+		pacer_set_rate(&ps->pacer, ps->aimd.rate);
+		pthread_mutex_unlock(&ps->pacer_lock);
+	}
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * -W: the input's first timestamp and how long it runs to the last,
+ * plus a typical gap so a pass doesn't start on top of the one before
+ */
+static int
+warp_scan(struct prodstate *ps, const char *fname)
+{
+	struct mapinput *mi;
+	const char *line;
+	size_t len;
+	uint64_t ts, high = 0;
+	unsigned long n = 0;
+
+	if ((mi = mapinput_open(fname)) == NULL) {
+		DPRINTF("mapping of file %s failed\n", fname);
+		return (-1);
+	}
+	while (mapinput_next(mi, &line, &len)) {
+		if (lg_line_ts(line, len, warp_field, &ts) != EXIT_SUCCESS)
+			continue;
+		if (n++ == 0)
+			ps->warp_t0 = ts;
+		if (ts > high)
+			high = ts;
+	}
+	mapinput_release(mi);
+	if (n == 0) {
+		fprintf(stderr, "no \"%s\" timestamps in %s for -W\n",
+		    warp_field, fname);
+		return (-1);
+	}
+	if (high > ps->warp_t0)
+		ps->warp_span = high - ps->warp_t0 +
+		    (n > 1 ? (high - ps->warp_t0) / (n - 1) : 0);
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Main Producer Loop
+ * ------------------
+ * The senders do the work, this thread sits in the event loop
+ * handling commands and reporting metrics until they have all run
+ * out of input.
+ */
+int
+producer(const char *fullTopicName, const char *backupTopicName,
+		const char *fname, const char *pipe_fname)
+{
+	int ret_val;
+	FILE *fp = NULL;
+	struct mapinput *mapin = NULL;
+	struct sender *senders = NULL;
+	struct prodstate prodstate, *ps = &prodstate;
+	pthread_rwlockattr_t rwattr;
+	uint64_t start_ns;
+	unsigned long sent;
+	double secs;
+	int resumed = 0, ev_up = 0, ckpt_up = 0, started = 0;
+
+	memset(ps, 0, sizeof (*ps));
+	ps->primary = fullTopicName;
+	ps->backup = backupTopicName;
+	ps->cur_topic = fullTopicName;
+	ps->nparts = npartitions;
+	ps->part_strategy = part_strategy;
+	ps->rate = STARTING_RATE;
+	ps->pipe_fd = -1;
+	pthread_mutex_init(&ps->pacer_lock, NULL);
+
+	/* don't let a stream of senders starve a failover */
+	pthread_rwlockattr_init(&rwattr);
+	pthread_rwlockattr_setkind_np(&rwattr,
+	    PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&ps->conn_lock, &rwattr);
+
+	ret_val = producer_init(ps->cur_topic, ps->nparts, ps->tps,
+	    &ps->config, &ps->producer);
+	if (EXIT_SUCCESS != ret_val) {
+		DPRINTF("producer_init() failed\n");
+		goto out;
+	}
+	/* -X sends on it too, rather than keep it waiting */
+	if (hot_standby || active_active) {
+		ret_val = producer_init(ps->backup, ps->nparts, ps->sb_tps,
+		    &ps->sb_config, &ps->sb_producer);
+		if (EXIT_SUCCESS != ret_val) {
+			DPRINTF("standby producer_init() failed\n");
+			goto out;
+		}
+	}
+
+	ret_val = -1;
+	senders = calloc(nsenders, sizeof (*senders));
+	for (int i = 0; i < (active_active ? 2 : 1); i++)
+		inflight[i] = calloc(INFLIGHT_SLOTS, sizeof (struct inflight));
+	if (senders == NULL || inflight[0] == NULL ||
+	    (active_active && inflight[1] == NULL)) {
+		DPRINTF("can't allocate senders\n");
+		goto out;
+	}
+	for (int i = 0; env_max > 0 && i < nsenders; i++) {
+		senders[i].env = calloc(ps->nparts, sizeof (struct envbuf));
+		if (senders[i].env == NULL) {
+			DPRINTF("can't allocate envelopes\n");
+			goto out;
+		}
+	}
+	for (int i = 0; zcodec.codec != Z_NONE && i < nsenders; i++) {
+		if (EXIT_SUCCESS != z_ctx_init(&senders[i].z)) {
+			DPRINTF("can't set up the codec\n");
+			goto out;
+		}
+	}
+
+	if (synthetic) {
+		/* a value at any offset in the slack still fits */
+		gen_template = lg_template(gen_vsize.max + LG_TEMPLATE_SLACK,
+		    pacer_now_ns());
+		if (gen_template == NULL) {
+			DPRINTF("can't allocate the -G template\n");
+			goto out;
+		}
+		for (int i = 0; i < nsenders; i++)
+			senders[i].rng = (i + 1) * 0x9e3779b97f4a7c15ULL ^
+			    pacer_now_ns();
+	} else if (use_map) {
+		if ((mapin = mapinput_open(fname)) == NULL) {
+			DPRINTF("mapping of file %s failed\n", fname);
+			goto out;
+		}
+		for (int i = 0; i < nsenders; i++) {
+			mapinput_shard(mapin, nsenders, i, &senders[i].shard);
+			senders[i].shard_start = senders[i].shard;
+		}
+	} else {
+		fp = fopen(fname, "ro");
+		if (fp == NULL) {
+			DPRINTF("open of file %s failed\n", fname);
+			goto out;
+		}
+		senders[0].fp = fp;
+	}
+	if (ckpt_path != NULL) {
+		ckpt_up = 1;
+		if (EXIT_SUCCESS != ckpt_open(&ckpt, ckpt_path, fname, nsenders,
+		    &resumed))
+			goto out;
+		for (int i = 0; i < nsenders; i++) {
+			senders[i].ix = &ckpt.ix[i];
+			senders[i].env_low = UINT64_MAX;
+		}
+	}
+	DPRINTF("opening pipe %s\n", pipe_fname);
+	ps->pipe_fd = open(pipe_fname, O_RDWR|O_NONBLOCK);
+	if (ps->pipe_fd < 0) {
+		DPRINTF("open of file %s failed\n", pipe_fname);
+		goto out;
+	}
+	if (EXIT_SUCCESS != evloop_init(&ps->ev)) {
+		DPRINTF("can't set up the control loop\n");
+		goto out;
+	}
+	ev_up = 1;
+	if (EXIT_SUCCESS != evloop_add_fd(&ps->ev, ps->pipe_fd, on_pipe, ps) ||
+	    EXIT_SUCCESS != evloop_add_timer(&ps->ev, REPORT_MS, on_report,
+	    ps) || (adaptive && EXIT_SUCCESS != evloop_add_timer(&ps->ev,
+	    AIMD_TICK_MS, on_aimd, ps)) || (ckpt_path != NULL &&
+	    EXIT_SUCCESS != evloop_add_timer(&ps->ev, CKPT_MS, on_ckpt, ps))) {
+		DPRINTF("can't set up the control loop\n");
+		goto out;
+	}
+	if (adaptive)
+		aimd_init(&ps->aimd, ps->rate);
+
+	DPRINTF("\nSTEP 4: The producer will create, send, "
+	    "and flush now\n");
+
+	/* send initial metrics */
+	ret_val = send_metrics(ps->cur_topic, ps->primary, ps->backup,
+	    send_rate(ps));
+	if (EXIT_SUCCESS != ret_val) {
+		IPRINTF("send_metrics() failed\n");
+		goto out;
+	}
+
+	ret_val = -1;
+	if (warp > 0 && EXIT_SUCCESS != warp_scan(ps, fname))
+		goto out;
+
+	for (int i = 0; resumed && i < nsenders; i++) {
+		senders[i].id = i;
+		if (EXIT_SUCCESS != sender_seek(ps, &senders[i],
+		    &ckpt.s[i])) {
+			DPRINTF("can't seek sender %d\n", i);
+			goto out;
+		}
+	}
+	if (resumed)
+		ps->next_idx = ckpt.next_idx;
+
+	pacer_init(&ps->pacer, send_rate(ps), pacer_burst);
+	start_ns = ps->last_report = ps->warp_start = pacer_now_ns();
+	ps->senders = senders;
+	ps->running = nsenders;
+	ret_val = EXIT_SUCCESS;
+	for (; started < nsenders; started++) {
+		senders[started].id = started;
+		senders[started].ps = ps;
+		senders[started].rr = started;
+		if (pthread_create(&senders[started].thread, NULL,
+		    sender_thread, &senders[started]) != 0) {
+			DPRINTF("can't start sender %d\n", started);
+			ret_val = -1;
+			break;
+		}
+	}
+
+	/* the last sender to finish stops the loop, so all of them must run */
+	if (EXIT_SUCCESS == ret_val)
+		ret_val = evloop_run(&ps->ev);
+
+	if (EXIT_SUCCESS != ret_val)
+		__atomic_store_n(&ps->stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < started; i++)
+		pthread_join(senders[i].thread, NULL);
+	if (EXIT_SUCCESS == ret_val)
+		ret_val = ps->error;
+
+	/*
+	 * The senders are gone, see what's still in flight through.  Giving
+	 * up or not, every callback has to have come back before the
+	 * mapping, the senders and ps go away under it.
+	 */
+	for (;;) {
+		producer_flush_all(ps);
+		while (__atomic_load_n(&reconciling, __ATOMIC_ACQUIRE) > 0)
+			usleep(1000);
+		if (EXIT_SUCCESS != ret_val ||
+		    __atomic_load_n(&retry_count, __ATOMIC_ACQUIRE) == 0)
+			break;
+		usleep(RETRY_BASE_NS / 1000);
+		ret_val = retry_drain(ps, &senders[0]);
+	}
+	retry_discard();
+	if (__atomic_load_n(&n_dropped, __ATOMIC_RELAXED) > 0)
+		IPRINTF("%lu records failed %d times and were dropped\n",
+		    n_dropped, RETRY_MAX + 1);
+
+	/* so we can see how throughput scales with -t */
+	secs = (pacer_now_ns() - start_ns) / 1e9;
+	sent = total_sent(senders);
+	for (int i = 0; i < nsenders && nsenders > 1; i++)
+		IPRINTF("sender %d: %lu messages\n", i, senders[i].sent);
+	IPRINTF("sent %lu messages in %.2fs (%.0f/s), %d sender(s), "
+	    "%d partition(s)\n", sent, secs, secs > 0 ? sent / secs : 0,
+	    nsenders, ps->nparts);
+
+	/* what's acked, whether we finished or gave up */
+	if (ckpt_path != NULL)
+		(void) ckpt_update(ps);
+
+	if (EXIT_SUCCESS == ret_val) {
+		/* send 0 metric now that we're shuttong down */
+		ret_val = send_metrics(ps->cur_topic, ps->primary, ps->backup,
+		    0);
+		if (EXIT_SUCCESS != ret_val) {
+			IPRINTF("send_metrics() failed\n");
+		}
+	}
+
+out:
+	/* destroying a producer flushes it, so nothing calls back after */
+	if (ps->producer != NULL && EXIT_SUCCESS != producer_shutdown(
+	    ps->nparts, ps->tps, &ps->config, &ps->producer)) {
+		DPRINTF("producer_shutdown() failed\n");
+	}
+	if (ps->sb_producer != NULL && EXIT_SUCCESS != producer_shutdown(
+	    ps->nparts, ps->sb_tps, &ps->sb_config, &ps->sb_producer)) {
+		DPRINTF("standby producer_shutdown() failed\n");
+	}
+	retry_discard();
+	if (ckpt_up)
+		ckpt_close(&ckpt);
+
+	/* in-flight records kept the mapping alive until now */
+	if (mapin != NULL)
+		mapinput_release(mapin);
+	if (fp != NULL)
+		fclose(fp);
+	for (int i = started; senders != NULL && i < nsenders; i++) {
+		free(senders[i].env);
+		z_ctx_free(&senders[i].z);
+	}
+	free(senders);
+	for (int i = 0; i < 2; i++) {
+		free(inflight[i]);
+		inflight[i] = NULL;
+	}
+	if (ev_up)
+		evloop_destroy(&ps->ev);
+	if (ps->pipe_fd >= 0)
+		close(ps->pipe_fd);
+	return (ret_val);
+}
+
+/*
+ * Train a zstd dictionary on the start of the input and save it to
+ * dictpath, for the consumers (-D) to load too.  The lines are already
+ * back to back in the mapping, so they are the samples as they are.
+ */
+static int
+train_dict(const char *fname, const char *dictpath)
+{
+	struct mapinput *mi;
+	const char *line;
+	size_t len, total = 0, dlen, *sizes = NULL, *tmp;
+	unsigned n = 0, cap = 0;
+	char *dict;
+	FILE *f;
+	int ret_val = -1;
+
+	if ((mi = mapinput_open(fname)) == NULL) {
+		fprintf(stderr, "can't map %s to train on\n", fname);
+		return (-1);
+	}
+	while (total < Z_TRAIN_MAX && mapinput_next(mi, &line, &len)) {
+		if (n == cap) {
+			cap = cap > 0 ? cap * 2 : 1024;
+			if ((tmp = realloc(sizes, cap * sizeof (*sizes))) ==
+			    NULL)
+				goto out;
+			sizes = tmp;
+		}
+		sizes[n++] = len;
+		total += len;
+	}
+	if ((dict = malloc(Z_DICT_MAX)) == NULL)
+		goto out;
+	dlen = z_train(dict, Z_DICT_MAX, mi->base, sizes, n);
+	if (dlen > 0 && (f = fopen(dictpath, "w")) != NULL) {
+		if (fwrite(dict, 1, dlen, f) == dlen)
+			ret_val = EXIT_SUCCESS;
+		if (fclose(f) != 0)
+			ret_val = -1;
+	}
+	if (EXIT_SUCCESS == ret_val)
+		IPRINTF("trained a %zu byte dictionary on %u lines, "
+		    "saved as %s\n", dlen, n, dictpath);
+	free(dict);
+out:
+	free(sizes);
+	mapinput_release(mi);
+	return (ret_val);
+}
+
+/* MAIN */
+int
+main(int argc, char *argv[])
+{
+	char *maintopic, *backuptopic, *fname;
+	char *pipename, *dictpath = NULL;
+	int ret_val;
+	int opt;
+	char *end;
+	size_t pool_cap = RECPOOL_DEFAULT_CAP;
+	struct recpool_stats st;
+
+	while ((opt = getopt(argc, argv, "a:b:B:c:D:E:GHI:K:L:mM:N:p:P:t:TV:W:XZ:")) != -1) {
+		switch (opt) {
+		case 'a':
+			/* adapt the rate, keeping ack p99 under this many ms */
+			adaptive = 1;
+			aimd_p99_us = strtod(optarg, &end) * 1000;
+			if (*end != '\0' || aimd_p99_us == 0)
+				goto usage;
+			break;
+		case 'b':
+			/* how many sends may bunch up after a stall */
+			pacer_burst = strtod(optarg, NULL);
+			break;
+		case 'B':
+			/* pack lines into envelopes of this many bytes */
+			env_max = strtoul(optarg, &end, 10);
+			if (*end == ',')
+				env_linger_ns = strtoull(end + 1, &end, 10) *
+				    1000000ULL;
+			if (*end != '\0' || env_max < ENV_HDR_LEN ||
+			    env_max > ENV_MAX)
+				goto usage;
+			break;
+		case 'c':
+			/* checkpoint acked lines here, resume from it */
+			ckpt_path = optarg;
+			break;
+		case 'D':
+			/* zstd dictionary, trained on the input if not there */
+			dictpath = optarg;
+			break;
+		case 'E':
+			/* stamp records for end-to-end latency, see rechdr.h */
+			stamp = 1;
+			producer_id = strtoul(optarg, NULL, 10);
+			break;
+		case 'G':
+			/* synthetic values, no input */
+			synthetic = 1;
+			break;
+		case 'H':
+			/* keep the backup connection up, for fast failover */
+			hot_standby = 1;
+			break;
+		case 'I':
+			/* most records waiting for an ack at once */
+			max_inflight = strtoul(optarg, NULL, 10);
+			if (max_inflight < 1 || max_inflight > INFLIGHT_SLOTS)
+				goto usage;
+			break;
+		case 'K':
+			if (lg_parse_size(&gen_ksize, optarg, LG_KEY_MAX) != 0)
+				goto usage;
+			break;
+		case 'L':
+			/* times through the input, 0 for until stopped */
+			loops = strtol(optarg, &end, 10);
+			if (*end != '\0' || loops < 0)
+				goto usage;
+			break;
+		case 'm':
+			/* send lines straight out of a mapping of the input */
+			use_map = 1;
+			break;
+		case 'M':
+			/* cap on record buffer memory, in megabytes */
+			pool_cap = strtoul(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case 'N':
+			max_records = strtol(optarg, &end, 10);
+			if (*end != '\0' || max_records < 0)
+				goto usage;
+			break;
+		case 'p':
+			npartitions = atoi(optarg);
+			if (npartitions < 1 || npartitions > MAX_PARTITIONS)
+				goto usage;
+			break;
+		case 'P':
+			if (strcmp(optarg, "hash") == 0)
+				part_strategy = PART_HASH;
+			else if (strcmp(optarg, "rr") == 0)
+				part_strategy = PART_RR;
+			else
+				goto usage;
+			break;
+		case 't':
+			nsenders = atoi(optarg);
+			if (nsenders < 1 || nsenders > MAX_SENDERS)
+				goto usage;
+			break;
+		case 'T':
+			/* time the hot path for profstat, see prof.h */
+			profiling = 1;
+			break;
+		case 'V':
+			if (lg_parse_size(&gen_vsize, optarg, ENV_MAX) != 0)
+				goto usage;
+			break;
+		case 'W':
+			/* replay at the input's timestamps, sped up this much */
+			warp = strtod(optarg, &end);
+			if (*end == ',' && end[1] != '\0')
+				warp_field = end + 1;
+			else if (*end != '\0')
+				goto usage;
+			if (warp <= 0)
+				goto usage;
+			break;
+		case 'X':
+			/* active-active: send everything to both clusters */
+			active_active = 1;
+			break;
+		case 'Z':
+			/* compress values, see compress.h */
+			if (EXIT_SUCCESS != z_parse(&zcodec, optarg)) {
+				fprintf(stderr, "unknown codec %s, or not "
+				    "built in\n", optarg);
+				goto usage;
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 4) {
+usage:
+		fprintf(stderr, 
+		    "usage:  %s [-a p99_ms] [-b burst] [-B bytes[,linger_ms]] [-c checkpoint] [-D dictfile] [-E producer_id] [-G] [-H] [-I max_inflight] [-K size] [-L loops] [-m] [-M pool_mb] [-N records] [-p partitions] "
+		    "[-P hash|rr] [-t threads] [-T] [-V size] [-W speedup[,field]] [-X] [-Z lz4|zstd[,level]] "
+		    "/stream:topic /backup_stream:topic "
+		    " <filename> <pipe_filename>\n"
+		    "  -a  adaptive: treat the rate as a ceiling and back off "
+		    "when sends fail,\n"
+		    "      ack p99 goes over p99_ms or the client buffer fills "
+		    "(see aimd.h)\n"
+		    "  -b  let up to burst messages go out back to back "
+		    "(default 10ms worth)\n"
+		    "  -B  pack lines into envelope records of up to bytes, "
+		    "sent after linger_ms\n"
+		    "      at most (default %d)\n"
+		    "  -c  save how far the acks have got to this file, and "
+		    "resume from it\n"
+		    "      (see ckpt.h)\n"
+		    "  -D  zstd dictionary for -Z, trained on <filename> and "
+		    "saved if it isn't there\n"
+		    "  -E  put a latency/sequence header on each record's key, "
+		    "with this id\n"
+		    "  -G  send synthetic values instead of <filename>'s lines "
+		    "(see loadgen.h)\n"
+		    "  -H  hot standby: keep the backup connection ready so "
+		    "failover is a swap\n"
+		    "  -I  wait for acks once this many records are in flight "
+		    "(default %d)\n"
+		    "  -K  -G key size, n or min-max (default %d)\n"
+		    "  -L  go through the input this many times, 0 for until "
+		    "stopped (default 1)\n"
+		    "  -m  zero-copy: send records straight from an "
+		    "mmap of <filename>\n"
+		    "  -M  cap record buffer memory at pool_mb megabytes "
+		    "(default %lu)\n"
+		    "  -N  stop after this many records\n"
+		    "  -p  spread records over this many partitions "
+		    "(default 1)\n"
+		    "  -P  pick partitions by key hash or round robin "
+		    "(default hash)\n"
+		    "  -t  sender threads, each taking a share of the file "
+		    "(implies -m)\n"
+		    "  -T  time each stage of sending, for profstat "
+		    "(see prof.h)\n"
+		    "  -V  -G value size, n or min-max (default %d)\n"
+		    "  -W  send lines when their timestamp field (default ts) "
+		    "comes due,\n"
+		    "      with time running speedup times as fast\n"
+		    "  -X  active-active: send every record to both clusters, "
+		    "each with its own\n"
+		    "      -I records in flight\n"
+		    "  -Z  compress record values (whole envelopes with -B)\n",
+		    argv[0], ENV_LINGER_MS, INFLIGHT_SLOTS, keySize,
+		    RECPOOL_DEFAULT_CAP / (1024 * 1024), valueSize);
+		exit(-1);
+	}
+	maintopic = argv[optind];
+	backuptopic = argv[optind + 1];
+	fname = argv[optind + 2];
+	pipename = argv[optind + 3];
+
+	/* senders split the input by byte range, which needs the mapping */
+	if (nsenders > 1)
+		use_map = 1;
+
+	/* -G has no input, keys and values default to keySize/valueSize */
+	if (synthetic) {
+		use_map = 0;
+		if (warp > 0) {
+			fprintf(stderr, "-W replays the input's timestamps, "
+			    "-G has none\n");
+			exit(-1);
+		}
+		if (ckpt_path != NULL) {
+			fprintf(stderr, "-c saves a place in the input, "
+			    "-G has none\n");
+			exit(-1);
+		}
+	}
+	/* one controller can't pace two clusters that answer differently */
+	if (active_active && adaptive) {
+		fprintf(stderr, "-a and -X don't go together\n");
+		exit(-1);
+	}
+	if (gen_ksize.max == 0)
+		gen_ksize.min = gen_ksize.max = keySize;
+	if (gen_vsize.max == 0)
+		gen_vsize.min = gen_vsize.max = valueSize;
+
+	/*
+	 * Each sender keeps an envelope open per partition, and can't wait
+	 * on the pool for a new one while holding those
+	 */
+	if ((uint64_t)env_max * npartitions * nsenders > pool_cap / 2) {
+		fprintf(stderr, "-B %u with %d partitions and %d senders needs "
+		    "a pool over %luMB (-M)\n", env_max, npartitions, nsenders,
+		    (unsigned long)((uint64_t)env_max * npartitions * nsenders *
+		    2 / (1024 * 1024)));
+		exit(-1);
+	}
+
+	if (dictpath != NULL) {
+		if (zcodec.codec != Z_ZSTD) {
+			fprintf(stderr, "-D goes with -Z zstd\n");
+			exit(-1);
+		}
+		if (access(dictpath, F_OK) != 0 &&
+		    EXIT_SUCCESS != train_dict(fname, dictpath))
+			exit(-1);
+		if (EXIT_SUCCESS != z_load_dict(&zcodec, dictpath)) {
+			fprintf(stderr, "can't load dictionary %s\n",
+			    dictpath);
+			exit(-1);
+		}
+	}
+
+	if (profiling && EXIT_SUCCESS != prof_init("producer", prof_stages,
+	    sizeof (prof_stages) / sizeof (prof_stages[0])))
+		exit(-1);
+
+	/* start the metrics emitter before anything wants to report */
+	if (EXIT_SUCCESS != metrics_init()) {
+		fprintf(stderr, "metrics_init() failed\n");
+		exit(-1);
+	}
+
+	recpool_init(pool_cap);
+
+	/* Produce Messages */
+	ret_val = producer(maintopic, backuptopic,
+			fname, pipename);
+
+	/* let the final metrics go out */
+	metrics_shutdown();
+	prof_fini();
+
+	if (!use_map) {
+		recpool_get_stats(&st);
+		IPRINTF("record pool: %lu hits, %lu misses, %lu waits, "
+		    "%lu borrows, %lu timeouts, "
+		    "high water %zu bytes of %zu reserved\n",
+		    st.hits, st.misses, st.waits, st.borrows, st.timeouts,
+		    st.high_water, st.reserved);
+	}
 
 	if (EXIT_SUCCESS != ret_val) {
 		DPRINTF("\nFAIL: producer failed\n");
@@ -0,0 +1,106 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "prof.h"
+
+struct prof_seg *prof;
+static char prof_path[64];
+static __thread struct prof_thread *prof_me;
+
+/* map a new segment for this process; nothing is timed until this works */
+int
+prof_init(const char *prog, const char *const *stages, int nstages)
+{
+	struct prof_seg *seg;
+	int fd;
+
+	if (nstages > PROF_MAX_STAGES)
+		return (EXIT_FAILURE);
+	snprintf(prof_path, sizeof (prof_path), "%s/streams-prof.%d", PROF_DIR,
+	    (int)getpid());
+	if ((fd = open(prof_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(prof_path);
+		return (EXIT_FAILURE);
+	}
+	if (ftruncate(fd, sizeof (*seg)) != 0) {
+		perror(prof_path);
+		close(fd);
+		unlink(prof_path);
+		return (EXIT_FAILURE);
+	}
+	seg = mmap(NULL, sizeof (*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	    0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		perror(prof_path);
+		unlink(prof_path);
+		return (EXIT_FAILURE);
+	}
+	seg->version = PROF_VERSION;
+	seg->pid = getpid();
+	seg->nstages = nstages;
+	snprintf(seg->prog, sizeof (seg->prog), "%s", prog);
+	for (int i = 0; i < nstages; i++)
+		snprintf(seg->stage[i], sizeof (seg->stage[i]), "%s", stages[i]);
+	/* the reader checks this, so it goes in last */
+	__atomic_store_n(&seg->magic, PROF_MAGIC, __ATOMIC_RELEASE);
+	prof = seg;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Name the calling thread's slot, taking one if it has none.  Threads
+ * we didn't start, like the client's callback thread, get one when they
+ * first record something, named after the slot if fmt is NULL.
+ */
+void
+prof_thread(const char *fmt, int n)
+{
+	uint32_t i;
+
+	if (prof == NULL)
+		return;
+	if (prof_me == NULL) {
+		i = __atomic_fetch_add(&prof->nthreads, 1, __ATOMIC_RELAXED);
+		/* past the end, the last slot is shared and counts may be lost */
+		prof_me = &prof->t[i < PROF_MAX_THREADS ? i :
+		    PROF_MAX_THREADS - 1];
+		if (fmt == NULL) {
+			fmt = "thread%d";
+			n = i;
+		}
+	}
+	if (fmt != NULL)
+		snprintf(prof_me->name, sizeof (prof_me->name), fmt, n);
+}
+
+/*
+ * Only this thread writes its slot, so a load and a store will do; they
+ * are atomic only so the reader never sees half of a 64 bit value.
+ */
+void
+prof_record(int stage, uint64_t ns)
+{
+	struct prof_stage *st;
+	uint64_t *b;
+
+	if (prof_me == NULL)
+		prof_thread(NULL, 0);
+	st = &prof_me->st[stage];
+	b = &st->b[prof_bucket(ns)];
+	__atomic_store_n(b, __atomic_load_n(b, __ATOMIC_RELAXED) + 1,
+	    __ATOMIC_RELAXED);
+	__atomic_store_n(&st->total_ns, st->total_ns + ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->count, st->count + 1, __ATOMIC_RELEASE);
+}
+
+void
+prof_fini(void)
+{
+	if (prof == NULL)
+		return;
+	unlink(prof_path);
+}
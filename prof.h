@@ -0,0 +1,112 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Stage profiler
+ * --------------
+ * With -T the producer and consumer time each stage of their hot paths
+ * (see the PROF_* stage numbers in producer.c and consumer.c) and keep
+ * a histogram per stage per thread in a shared memory segment,
+ * PROF_DIR/streams-prof.<pid>, which profstat reads while they run.
+ *
+ * Timing is a CLOCK_MONOTONIC read on either side of the stage, which
+ * the vDSO answers from the TSC without a syscall.  Each thread has a
+ * slot of its own in the segment, claimed the first time it records
+ * anything, so recording is a few plain stores with no locks or atomic
+ * read-modify-writes.  The counts only ever go up; the reader works
+ * out rates and percentiles from the difference between two looks.
+ *
+ * Buckets are log-linear like hist.h's, but with PROF_SUB per power of
+ * two (~12%) to keep a thread's slot small.  Values are nanoseconds.
+ * Without -T, prof is NULL and a stage costs one predictable branch.
+ */
+
+#define PROF_DIR "/dev/shm"
+#define PROF_MAGIC 0x66727073	/* "sprf" */
+#define PROF_VERSION 1
+#define PROF_MAX_THREADS 64
+#define PROF_MAX_STAGES 8
+#define PROF_NAME_MAX 32
+
+#define PROF_SUB_BITS 3
+#define PROF_SUB (1 << PROF_SUB_BITS)
+#define PROF_LINEAR (2 * PROF_SUB)
+#define PROF_BUCKETS (PROF_LINEAR + (64 - PROF_SUB_BITS - 1) * PROF_SUB)
+
+struct prof_stage {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t b[PROF_BUCKETS];
+};
+
+struct prof_thread {
+	char name[PROF_NAME_MAX];
+	struct prof_stage st[PROF_MAX_STAGES];
+};
+
+struct prof_seg {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t nstages;
+	uint32_t nthreads;	/* slots claimed so far */
+	char prog[PROF_NAME_MAX];
+	char stage[PROF_MAX_STAGES][PROF_NAME_MAX];
+	struct prof_thread t[PROF_MAX_THREADS];
+};
+
+extern struct prof_seg *prof;
+
+int prof_init(const char *prog, const char *const *stages, int nstages);
+void prof_thread(const char *fmt, int n);
+void prof_record(int stage, uint64_t ns);
+void prof_fini(void);
+
+static inline uint64_t
+prof_now(void)
+{
+	struct timespec ts;
+
+	if (prof == NULL)
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* time since start, from prof_now(), goes to the stage */
+static inline void
+prof_end(int stage, uint64_t start)
+{
+	if (prof != NULL)
+		prof_record(stage, prof_now() - start);
+}
+
+static inline int
+prof_bucket(uint64_t v)
+{
+	int msb;
+
+	if (v < PROF_LINEAR)
+		return ((int)v);
+	msb = 63 - __builtin_clzll(v);
+	return (PROF_LINEAR + (msb - PROF_SUB_BITS - 1) * PROF_SUB +
+	    (int)(v >> (msb - PROF_SUB_BITS)) - PROF_SUB);
+}
+
+/* the middle of what lands in bucket i */
+static inline uint64_t
+prof_value(int i)
+{
+	int msb;
+
+	if (i < PROF_LINEAR)
+		return ((uint64_t)i);
+	msb = (i - PROF_LINEAR) / PROF_SUB + PROF_SUB_BITS + 1;
+	return (((uint64_t)((i - PROF_LINEAR) % PROF_SUB + PROF_SUB) <<
+	    (msb - PROF_SUB_BITS)) + (1ULL << (msb - PROF_SUB_BITS)) / 2);
+}
+
+#endif /* PROF_H */
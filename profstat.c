@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "prof.h"
+
+/*
+ * Stage profile reader
+ * --------------------
+ * Prints what a producer or consumer started with -T is spending its
+ * time on, from its segment (see prof.h), every interval:
+ *
+ *   stage     thread       rate/s      avg      p50      p99    p99.9      max
+ *   send      all          100213    1.1us    0.9us    3.2us     12us     40us
+ *
+ * rate/s is how many times the stage ran in the interval, the rest is
+ * how long it took, from the interval's histogram; max is the top of
+ * the highest bucket used.  -t breaks each stage down by thread as
+ * well.  Stops when the process goes away.
+ */
+
+/* prof.h's inlines want it; we time nothing, so it stays NULL */
+struct prof_seg *prof;
+
+static int per_thread;
+
+static struct prof_seg *
+seg_open(const char *arg, char *path, size_t pathlen)
+{
+	struct prof_seg *seg;
+	char *end;
+	int fd;
+
+	/* a pid, or the path of a segment */
+	strtol(arg, &end, 10);
+	if (*end == '\0')
+		snprintf(path, pathlen, "%s/streams-prof.%s", PROF_DIR, arg);
+	else
+		snprintf(path, pathlen, "%s", arg);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return (NULL);
+	}
+	seg = mmap(NULL, sizeof (*seg), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		perror(path);
+		return (NULL);
+	}
+	if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != PROF_MAGIC ||
+	    seg->version != PROF_VERSION || seg->nstages > PROF_MAX_STAGES) {
+		fprintf(stderr, "%s isn't a profile segment\n", path);
+		munmap(seg, sizeof (*seg));
+		return (NULL);
+	}
+	return (seg);
+}
+
+/* a word at a time, the writers are still going */
+static void
+stage_copy(struct prof_stage *to, const struct prof_stage *from)
+{
+	to->count = __atomic_load_n(&from->count, __ATOMIC_ACQUIRE);
+	to->total_ns = __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+	for (int i = 0; i < PROF_BUCKETS; i++)
+		to->b[i] = __atomic_load_n(&from->b[i], __ATOMIC_RELAXED);
+}
+
+/* d = a - b */
+static void
+stage_diff(struct prof_stage *d, const struct prof_stage *a,
+		const struct prof_stage *b)
+{
+	d->count = a->count - b->count;
+	d->total_ns = a->total_ns - b->total_ns;
+	for (int i = 0; i < PROF_BUCKETS; i++)
+		d->b[i] = a->b[i] - b->b[i];
+}
+
+static void
+stage_add(struct prof_stage *to, const struct prof_stage *from)
+{
+	to->count += from->count;
+	to->total_ns += from->total_ns;
+	for (int i = 0; i < PROF_BUCKETS; i++)
+		to->b[i] += from->b[i];
+}
+
+static uint64_t
+stage_percentile(const struct prof_stage *st, uint64_t n, double p)
+{
+	uint64_t seen = 0, rank = (uint64_t)(p * n / 100.0);
+
+	if (rank >= n)
+		rank = n - 1;
+	for (int i = 0; i < PROF_BUCKETS; i++) {
+		seen += st->b[i];
+		if (seen > rank)
+			return (prof_value(i));
+	}
+	return (0);
+}
+
+static uint64_t
+stage_max(const struct prof_stage *st)
+{
+	for (int i = PROF_BUCKETS - 1; i >= 0; i--) {
+		if (st->b[i] != 0)
+			return (prof_value(i));
+	}
+	return (0);
+}
+
+static const char *
+fmt_ns(char *buf, size_t len, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, len, "%luns", (unsigned long)ns);
+	else if (ns < 10000)
+		snprintf(buf, len, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000)
+		snprintf(buf, len, "%luus", (unsigned long)(ns / 1000));
+	else if (ns < 10000000)
+		snprintf(buf, len, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buf, len, "%lums", (unsigned long)(ns / 1000000));
+	return (buf);
+}
+
+static void
+print_line(const char *stage, const char *thread,
+		const struct prof_stage *d, double secs)
+{
+	char avg[16], p50[16], p99[16], p999[16], max[16];
+	uint64_t n;
+
+	/* the buckets, not count, so a half-done record can't skew them */
+	n = 0;
+	for (int i = 0; i < PROF_BUCKETS; i++)
+		n += d->b[i];
+	if (n == 0) {
+		printf("%-9s %-10s %8.0f\n", stage, thread, 0.0);
+		return;
+	}
+	printf("%-9s %-10s %8.0f %8s %8s %8s %8s %8s\n", stage, thread,
+	    d->count / secs,
+	    fmt_ns(avg, sizeof (avg), d->count ? d->total_ns / d->count : 0),
+	    fmt_ns(p50, sizeof (p50), stage_percentile(d, n, 50)),
+	    fmt_ns(p99, sizeof (p99), stage_percentile(d, n, 99)),
+	    fmt_ns(p999, sizeof (p999), stage_percentile(d, n, 99.9)),
+	    fmt_ns(max, sizeof (max), stage_max(d)));
+}
+
+static void
+report(const struct prof_seg *seg, const struct prof_thread *cur,
+		const struct prof_thread *last, int nthreads, double secs)
+{
+	struct prof_stage d, all;
+
+	printf("%s %d, %.2fs\n", seg->prog, seg->pid, secs);
+	printf("%-9s %-10s %8s %8s %8s %8s %8s %8s\n", "stage", "thread",
+	    "rate/s", "avg", "p50", "p99", "p99.9", "max");
+	for (uint32_t s = 0; s < seg->nstages; s++) {
+		memset(&all, 0, sizeof (all));
+		for (int t = 0; t < nthreads; t++) {
+			stage_diff(&d, &cur[t].st[s], &last[t].st[s]);
+			stage_add(&all, &d);
+			if (per_thread && d.count > 0)
+				print_line(seg->stage[s], cur[t].name, &d,
+				    secs);
+		}
+		print_line(seg->stage[s], "all", &all, secs);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct prof_seg *seg;
+	struct prof_thread *cur, *last, *tmp;
+	char path[256];
+	double interval = 1, t_last, t_cur;
+	long rounds = 0;
+	int opt, nthreads;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "i:n:t")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtod(optarg, &end);
+			if (*end != '\0' || interval <= 0)
+				goto usage;
+			break;
+		case 'n':
+			rounds = strtol(optarg, &end, 10);
+			if (*end != '\0' || rounds < 0)
+				goto usage;
+			break;
+		case 't':
+			per_thread = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 1)
+		goto usage;
+
+	if ((seg = seg_open(argv[optind], path, sizeof (path))) == NULL)
+		exit(-1);
+	cur = calloc(PROF_MAX_THREADS, sizeof (*cur));
+	last = calloc(PROF_MAX_THREADS, sizeof (*last));
+	if (cur == NULL || last == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(-1);
+	}
+
+	/* the first interval counts from when we started looking */
+	t_last = now_s();
+	for (int t = 0; t < PROF_MAX_THREADS; t++) {
+		for (uint32_t s = 0; s < seg->nstages; s++)
+			stage_copy(&last[t].st[s], &seg->t[t].st[s]);
+	}
+	for (long r = 0; rounds == 0 || r < rounds; r++) {
+		usleep(interval * 1000000);
+		t_cur = now_s();
+		nthreads = __atomic_load_n(&seg->nthreads, __ATOMIC_ACQUIRE);
+		if (nthreads > PROF_MAX_THREADS)
+			nthreads = PROF_MAX_THREADS;
+		for (int t = 0; t < nthreads; t++) {
+			memcpy(cur[t].name, seg->t[t].name, PROF_NAME_MAX);
+			cur[t].name[PROF_NAME_MAX - 1] = '\0';
+			for (uint32_t s = 0; s < seg->nstages; s++)
+				stage_copy(&cur[t].st[s], &seg->t[t].st[s]);
+		}
+		report(seg, cur, last, nthreads, t_cur - t_last);
+		tmp = last;
+		last = cur;
+		cur = tmp;
+		t_last = t_cur;
+
+		/* its last interval is in, there won't be any more */
+		if (kill(seg->pid, 0) != 0 && errno == ESRCH) {
+			printf("%s %d has exited\n", seg->prog, seg->pid);
+			break;
+		}
+	}
+	munmap(seg, sizeof (*seg));
+	free(cur);
+	free(last);
+	return (EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "usage:  %s [-i interval_s] [-n rounds] [-t] "
+	    "<pid | segment>\n"
+	    "  -i  seconds between reports (default 1)\n"
+	    "  -n  stop after this many reports (default: until the "
+	    "process exits)\n"
+	    "  -t  each thread's numbers too, not just the totals\n"
+	    "  <pid> of a producer or consumer run with -T, or the path of "
+	    "its segment\n"
+	    "      (%s/streams-prof.<pid>)\n", argv[0], PROF_DIR);
+	exit(-1);
+}
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "recpool.h"
+
+/* typical sensor lines are 100-400 bytes, keys are under 32 */
+static const size_t class_size[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+#define NCLASSES (sizeof (class_size) / sizeof (class_size[0]))
+
+#define SLAB_BLOCKS 256
+#define MAX_SLABS 4096
+#define OVERSIZE 0xff
+
+/* time to wait for buffers to come back when we're at the cap */
+#define CAP_WAIT_USEC 200
+/* and how long before handing the wait back to the caller to look around */
+#define CAP_WAIT_MAX_USEC (100 * 1000)
+
+/*
+ * Every buffer is preceded by this header.  Blocks are named by their
+ * index within the class so the free list head can carry an ABA tag in
+ * the same 64-bit word.
+ */
+struct rphdr {
+	uint32_t idx;
+	uint32_t next;		/* idx + 1 of the next free block, 0 ends */
+	uint32_t cls;
+	uint32_t size;		/* for oversize buffers */
+};
+
+struct rpclass {
+	size_t bsize;		/* block size including the header */
+	uint64_t head;		/* tag << 32 | (idx + 1) */
+	char *slabs[MAX_SLABS];
+	uint32_t nslabs;
+};
+
+static struct rpclass classes[NCLASSES];
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pool_cap = RECPOOL_DEFAULT_CAP;
+static struct recpool_stats pstats;
+
+static struct rphdr *
+block_at(struct rpclass *c, uint32_t idx)
+{
+	return ((struct rphdr *)(c->slabs[idx / SLAB_BLOCKS] +
+	    (size_t)(idx % SLAB_BLOCKS) * c->bsize));
+}
+
+static struct rphdr *
+class_pop(struct rpclass *c)
+{
+	uint64_t old, new;
+	struct rphdr *b;
+
+	old = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+	while ((old & 0xffffffff) != 0) {
+		/* slabs are never freed, so peeking at next is always safe */
+		b = block_at(c, (uint32_t)(old & 0xffffffff) - 1);
+		new = ((old >> 32) + 1) << 32 |
+		    __atomic_load_n(&b->next, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&c->head, &old, new, 1,
+		    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return (b);
+	}
+	return (NULL);
+}
+
+static void
+class_push(struct rpclass *c, struct rphdr *b)
+{
+	uint64_t old, new;
+
+	old = __atomic_load_n(&c->head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&b->next, (uint32_t)(old & 0xffffffff),
+		    __ATOMIC_RELAXED);
+		new = ((old >> 32) + 1) << 32 | (b->idx + 1);
+	} while (!__atomic_compare_exchange_n(&c->head, &old, new, 1,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* reserve bytes from the system, failing if it would go over the cap */
+static int
+reserve(size_t bytes)
+{
+	size_t cur = __atomic_load_n(&pstats.reserved, __ATOMIC_RELAXED);
+
+	do {
+		if (cur + bytes > pool_cap)
+			return (-1);
+	} while (!__atomic_compare_exchange_n(&pstats.reserved, &cur,
+	    cur + bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return (0);
+}
+
+/* add a slab to a class, returning one of its blocks to the caller */
+static struct rphdr *
+class_grow(struct rpclass *c, uint32_t cls)
+{
+	struct rphdr *b;
+	size_t slab_bytes = c->bsize * SLAB_BLOCKS;
+	uint32_t base;
+	char *slab;
+
+	pthread_mutex_lock(&grow_lock);
+
+	/* somebody may have freed or grown while we waited */
+	if ((b = class_pop(c)) != NULL) {
+		pthread_mutex_unlock(&grow_lock);
+		return (b);
+	}
+	if (c->nslabs == MAX_SLABS || reserve(slab_bytes) < 0) {
+		pthread_mutex_unlock(&grow_lock);
+		return (NULL);
+	}
+	slab = malloc(slab_bytes);
+	if (slab == NULL) {
+		__atomic_fetch_sub(&pstats.reserved, slab_bytes,
+		    __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&grow_lock);
+		return (NULL);
+	}
+
+	base = c->nslabs * SLAB_BLOCKS;
+	c->slabs[c->nslabs] = slab;
+	__atomic_store_n(&c->nslabs, c->nslabs + 1, __ATOMIC_RELEASE);
+	for (uint32_t i = 0; i < SLAB_BLOCKS; i++) {
+		b = (struct rphdr *)(slab + (size_t)i * c->bsize);
+		b->idx = base + i;
+		b->cls = cls;
+		if (i > 0)
+			class_push(c, b);
+	}
+	pthread_mutex_unlock(&grow_lock);
+	return ((struct rphdr *)slab);
+}
+
+static void
+note_in_use(size_t bytes)
+{
+	size_t cur, hw;
+
+	cur = __atomic_add_fetch(&pstats.in_use, bytes, __ATOMIC_RELAXED);
+	hw = __atomic_load_n(&pstats.high_water, __ATOMIC_RELAXED);
+	while (cur > hw && !__atomic_compare_exchange_n(&pstats.high_water,
+	    &hw, cur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static struct rphdr *
+try_alloc(size_t size)
+{
+	struct rphdr *b;
+	uint32_t cls;
+
+	for (cls = 0; cls < NCLASSES; cls++)
+		if (size <= class_size[cls])
+			break;
+
+	if (cls == NCLASSES) {
+		if (reserve(sizeof (*b) + size) < 0)
+			return (NULL);
+		b = malloc(sizeof (*b) + size);
+		if (b == NULL) {
+			__atomic_fetch_sub(&pstats.reserved,
+			    sizeof (*b) + size, __ATOMIC_RELAXED);
+			return (NULL);
+		}
+		b->cls = OVERSIZE;
+		b->size = size;
+		__atomic_fetch_add(&pstats.misses, 1, __ATOMIC_RELAXED);
+		note_in_use(size);
+		return (b);
+	}
+
+	if ((b = class_pop(&classes[cls])) != NULL) {
+		__atomic_fetch_add(&pstats.hits, 1, __ATOMIC_RELAXED);
+	} else if ((b = class_grow(&classes[cls], cls)) != NULL) {
+		__atomic_fetch_add(&pstats.misses, 1, __ATOMIC_RELAXED);
+	} else {
+		/*
+		 * Slabs are never given back, so once the cap is spread
+		 * over other classes this one can't grow again.  Borrow a
+		 * free block from a bigger class instead; it keeps its own
+		 * class in the header and goes back there when freed.
+		 */
+		while (++cls < NCLASSES)
+			if ((b = class_pop(&classes[cls])) != NULL)
+				break;
+		if (b == NULL)
+			return (NULL);
+		__atomic_fetch_add(&pstats.borrows, 1, __ATOMIC_RELAXED);
+	}
+	note_in_use(class_size[b->cls]);
+	return (b);
+}
+
+int
+recpool_init(size_t cap)
+{
+	for (uint32_t cls = 0; cls < NCLASSES; cls++)
+		classes[cls].bsize = sizeof (struct rphdr) + class_size[cls];
+	if (cap > 0)
+		pool_cap = cap;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Get a buffer of at least size bytes, waiting for buffers to come
+ * back if the pool is at its cap.  Fails with E2BIG for requests that
+ * could never fit, and with EAGAIN after CAP_WAIT_MAX_USEC of waiting,
+ * so the caller can check whether it should still be sending before it
+ * asks again.
+ */
+void *
+recpool_alloc(size_t size)
+{
+	struct rphdr *b;
+	unsigned long waited = 0;
+
+	if (size + sizeof (*b) > pool_cap) {
+		errno = E2BIG;
+		return (NULL);
+	}
+
+	while ((b = try_alloc(size)) == NULL) {
+		if (waited == 0)
+			__atomic_fetch_add(&pstats.waits, 1, __ATOMIC_RELAXED);
+		if (waited >= CAP_WAIT_MAX_USEC) {
+			__atomic_fetch_add(&pstats.timeouts, 1,
+			    __ATOMIC_RELAXED);
+			errno = EAGAIN;
+			return (NULL);
+		}
+		usleep(CAP_WAIT_USEC);
+		waited += CAP_WAIT_USEC;
+	}
+	return (b + 1);
+}
+
+/*
+ * Like recpool_alloc() but never waits: NULL if the pool is at its cap,
+ * for copies we can do without.
+ */
+void *
+recpool_try_alloc(size_t size)
+{
+	struct rphdr *b;
+
+	if (size + sizeof (*b) > pool_cap || (b = try_alloc(size)) == NULL)
+		return (NULL);
+	return (b + 1);
+}
+
+void
+recpool_free(void *p)
+{
+	struct rphdr *b;
+
+	if (p == NULL)
+		return;
+
+	b = (struct rphdr *)p - 1;
+	if (b->cls == OVERSIZE) {
+		__atomic_fetch_sub(&pstats.in_use, b->size, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&pstats.reserved, sizeof (*b) + b->size,
+		    __ATOMIC_RELAXED);
+		free(b);
+		return;
+	}
+	__atomic_fetch_sub(&pstats.in_use, class_size[b->cls],
+	    __ATOMIC_RELAXED);
+	class_push(&classes[b->cls], b);
+}
+
+void
+recpool_get_stats(struct recpool_stats *st)
+{
+	st->hits = __atomic_load_n(&pstats.hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n(&pstats.misses, __ATOMIC_RELAXED);
+	st->waits = __atomic_load_n(&pstats.waits, __ATOMIC_RELAXED);
+	st->borrows = __atomic_load_n(&pstats.borrows, __ATOMIC_RELAXED);
+	st->timeouts = __atomic_load_n(&pstats.timeouts, __ATOMIC_RELAXED);
+	st->in_use = __atomic_load_n(&pstats.in_use, __ATOMIC_RELAXED);
+	st->high_water = __atomic_load_n(&pstats.high_water,
+	    __ATOMIC_RELAXED);
+	st->reserved = __atomic_load_n(&pstats.reserved, __ATOMIC_RELAXED);
+}
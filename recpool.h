@@ -0,0 +1,46 @@
+#ifndef RECPOOL_H
+#define RECPOOL_H
+
+#include <stddef.h>
+
+/*
+ * Record buffer pool
+ * ------------------
+ * Buffers for record keys and values are carved from slabs in a few
+ * size classes picked for sensor JSON lines.  Each class keeps its free
+ * blocks on a lock-free stack, so the producer callback thread can hand
+ * buffers back without contending with the send loop.  Requests bigger
+ * than the largest class fall back to malloc() but still count against
+ * the cap.
+ *
+ * The pool never holds more than its cap.  When the cap is reached
+ * recpool_alloc() waits for the callbacks to return buffers, which
+ * slows the send loop down to what the cluster is acking instead of
+ * letting memory grow.  A class that can't grow any more borrows free
+ * blocks from the bigger classes.  The wait is handed back to the
+ * caller every so often with EAGAIN, so it can stop waiting when it is
+ * told to stop, and otherwise asks again.  recpool_try_alloc() doesn't
+ * wait, it fails.
+ */
+
+/* default cap on memory held by the pool */
+#define RECPOOL_DEFAULT_CAP (64UL * 1024 * 1024)
+
+struct recpool_stats {
+	unsigned long hits;	/* served from a free list */
+	unsigned long misses;	/* had to grow a class or malloc */
+	unsigned long waits;	/* allocations that had to wait for the cap */
+	unsigned long borrows;	/* served from a bigger class's free list */
+	unsigned long timeouts;	/* waits handed back with EAGAIN */
+	size_t in_use;		/* bytes handed out right now */
+	size_t high_water;	/* most bytes ever handed out at once */
+	size_t reserved;	/* bytes held from the system */
+};
+
+int recpool_init(size_t cap);
+void *recpool_alloc(size_t size);
+void *recpool_try_alloc(size_t size);
+void recpool_free(void *p);
+void recpool_get_stats(struct recpool_stats *st);
+
+#endif /* RECPOOL_H */
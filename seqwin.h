@@ -0,0 +1,123 @@
+#ifndef SEQWIN_H
+#define SEQWIN_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Sequence number window
+ * ----------------------
+ * Which of a producer's last SEQWIN_BITS sequence numbers have been
+ * seen, one bit each, so memory stays the same however long it runs.
+ * seqwin_check() notes a sequence number and says what it was:
+ *
+ *   SEQ_NEW      higher than any so far; on the way up, numbers that
+ *                fell out of the window without being seen are gaps
+ *   SEQ_LATE     lower than the highest, not seen before
+ *   SEQ_DUP      seen before
+ *   SEQ_OLD      too far back to tell late from seen
+ *   SEQ_RESTART  so far back the producer must have started over, the
+ *                window starts again from here
+ *
+ * Not locked, the caller serializes.
+ */
+
+#define SEQWIN_BITS 65536
+
+/* a producer that drops this far back has started over */
+#define SEQWIN_RESTART (4ULL * SEQWIN_BITS)
+
+#define SEQ_NEW 0
+#define SEQ_LATE 1
+#define SEQ_DUP 2
+#define SEQ_OLD 3
+#define SEQ_RESTART 4
+
+struct seqwin {
+	uint64_t first;		/* where we started, nothing below is a gap */
+	uint64_t high;		/* highest so far, UINT64_MAX for none */
+	uint64_t bits[SEQWIN_BITS / 64];
+};
+
+#define SEQWIN_BIT(s) ((s) % SEQWIN_BITS)
+
+static inline int
+seqwin_test(const struct seqwin *w, uint64_t s)
+{
+	return ((w->bits[SEQWIN_BIT(s) / 64] >> (SEQWIN_BIT(s) % 64)) & 1);
+}
+
+static inline void
+seqwin_set(struct seqwin *w, uint64_t s)
+{
+	w->bits[SEQWIN_BIT(s) / 64] |= 1ULL << (SEQWIN_BIT(s) % 64);
+}
+
+static inline void
+seqwin_clear(struct seqwin *w, uint64_t s)
+{
+	w->bits[SEQWIN_BIT(s) / 64] &= ~(1ULL << (SEQWIN_BIT(s) % 64));
+}
+
+static inline void
+seqwin_init(struct seqwin *w)
+{
+	w->first = w->high = UINT64_MAX;
+}
+
+static inline void
+seqwin_start(struct seqwin *w, uint64_t s)
+{
+	memset(w->bits, 0, sizeof (w->bits));
+	w->first = w->high = s;
+	seqwin_set(w, s);
+}
+
+/*
+ * Move the window up to s.  Each bit reused on the way belonged to the
+ * sequence number one window back; if that one never showed up it's a
+ * gap.
+ */
+static inline unsigned long
+seqwin_advance(struct seqwin *w, uint64_t s)
+{
+	unsigned long gaps = 0;
+	uint64_t t = w->high + 1;
+
+	if (s - w->high > SEQWIN_BITS) {
+		/* skipped past the whole window, those never had a bit */
+		gaps += s - w->high - SEQWIN_BITS;
+		t = s - SEQWIN_BITS + 1;
+	}
+	for (; t <= s; t++) {
+		if (t >= w->first + SEQWIN_BITS && !seqwin_test(w, t))
+			gaps++;
+		seqwin_clear(w, t);
+	}
+	seqwin_set(w, s);
+	w->high = s;
+	return (gaps);
+}
+
+static inline int
+seqwin_check(struct seqwin *w, uint64_t s, unsigned long *gaps)
+{
+	*gaps = 0;
+	if (w->high == UINT64_MAX || (s < w->high &&
+	    w->high - s > SEQWIN_RESTART)) {
+		seqwin_start(w, s);
+		return (SEQ_RESTART);
+	}
+	if (s > w->high) {
+		*gaps = seqwin_advance(w, s);
+		return (SEQ_NEW);
+	}
+	if (s + SEQWIN_BITS <= w->high)
+		return (SEQ_OLD);
+	if (seqwin_test(w, s))
+		return (SEQ_DUP);
+	seqwin_set(w, s);
+	return (SEQ_LATE);
+}
+
+#endif /* SEQWIN_H */
@@ -0,0 +1,1688 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include "streams/streams.h"
+
+/*
+ * Log layout: an 8-byte header holding the next record offset, then
+ * records of a struct loghdr followed by the key and the value.  Both
+ * are only ever appended to, under flock() so other processes' appends
+ * don't interleave; readers never lock, they just stop at the first
+ * record that isn't all there yet.
+ */
+
+#define SHIM_DEFAULT_DIR "/dev/shm/streams-shim"
+#define SHIM_NAME_MAX 256
+#define SHIM_CONF_MAX 32
+#define SHIM_MAX_TOPICS 16
+#define SHIM_MAX_PARTS 1024
+#define SHIM_FILE_HDR 8
+#define SHIM_IOV_RECS 256
+#define SHIM_BUFFER_DEFAULT (32 * 1024 * 1024)
+#define SHIM_FETCH_DEFAULT (1024 * 1024)
+#define SHIM_RESCAN_NS 1000000000ULL
+#define SHIM_GROUP_RESCAN_NS 200000000ULL
+#define SHIM_BEAT_NS 500000000ULL
+#define SHIM_SESSION_NS 3000000000ULL
+
+struct loghdr {
+	uint32_t klen;
+	uint32_t vlen;
+	int64_t offset;
+	int64_t ts_ms;
+};
+
+struct streams_config_s {
+	int n;
+	char *name[SHIM_CONF_MAX];
+	char *value[SHIM_CONF_MAX];
+};
+
+/* one partition's log file, shared by everything in this process */
+struct part {
+	struct part *next;
+	char topic[SHIM_NAME_MAX];
+	int id;
+	int fd;
+	pthread_mutex_t lock;
+};
+
+struct streams_topic_partition_s {
+	char topic[SHIM_NAME_MAX];
+	int id;
+	struct part *p;		/* looked up on first use */
+};
+
+struct streams_producer_record_s {
+	struct streams_producer_record_s *next;
+	streams_topic_partition_t tp;
+	const void *key;
+	const void *value;
+	uint32_t klen;
+	uint32_t vlen;
+	streams_producer_cb cb;
+	void *ctx;
+	uint64_t seq;
+	uint64_t sent_ns;
+	uint64_t due_ns;
+	int32_t err;
+	int64_t offset;
+};
+
+struct streams_producer_s {
+	pthread_mutex_t lock;
+	pthread_cond_t wcond;	/* writer waits for sends */
+	pthread_cond_t acond;	/* acker waits for written records */
+	pthread_cond_t space;	/* senders and flush wait for acks */
+	streams_producer_record_t sendq, *sendq_tail;
+	streams_producer_record_t ackq, *ackq_tail;
+	uint64_t bytes;		/* sent and not yet acked */
+	uint64_t buffer_max;
+	unsigned long outstanding;
+	uint64_t seq;
+	uint64_t last_due;
+	unsigned int seed;
+	int stop;
+	streams_producer_record_t *batch;
+	size_t batchcap;
+	pthread_t writer, acker;
+};
+
+struct cmsg {
+	uint32_t koff, klen;
+	uint32_t voff, vlen;
+	int64_t offset;
+	int64_t ts_ms;
+};
+
+struct streams_consumer_record_s {
+	struct cpart *cp;
+	uint32_t n;
+};
+
+/* a partition this consumer reads */
+struct cpart {
+	struct streams_topic_partition_s tp;
+	int64_t pos;		/* next byte to read */
+	int64_t offset;		/* and its record offset */
+	int64_t committed;	/* -1 if nothing committed yet */
+	int cfd;		/* the group's committed offset file */
+	char cpath[PATH_MAX];
+	char *buf;
+	size_t bufsz;
+	struct cmsg *msgs;
+	uint32_t msgcap;
+	int owned;		/* no other group member reads it */
+	struct streams_consumer_record_s rec;
+};
+
+/* an async commit whose callback runs from the next poll */
+struct pending_commit {
+	struct pending_commit *next;
+	streams_commit_cb cb;
+	void *ctx;
+	int32_t err;
+	uint32_t n;
+	streams_topic_partition_t *tps;
+	int64_t *offsets;
+};
+
+struct streams_consumer_s {
+	char group[SHIM_NAME_MAX];
+	int latest;
+	size_t fetch_max;
+	int ntopics;
+	char topics[SHIM_MAX_TOPICS][SHIM_NAME_MAX];
+	streams_rebalance_cb assigned, revoked;
+	void *cb_ctx;
+	int nparts;
+	struct cpart *parts[SHIM_MAX_PARTS];
+	streams_consumer_record_t recs[SHIM_MAX_PARTS];
+	int next;		/* partition the next fetch starts at */
+	int ifd;		/* inotify on the log directory */
+	uint64_t scan_ns;
+	struct pending_commit *commits, **commits_tail;
+	int grouped;		/* partitions shared out among the group */
+	int joined;
+	char member[64];	/* our file in the group's members/ */
+	char gdir[PATH_MAX / 2];
+	ino_t ino;		/* of the member file */
+	uint64_t beat_ns;
+};
+
+/* another consumer in our group, see group_scan() */
+struct member {
+	char name[64];
+	char *topics;		/* one per line */
+};
+
+/* a partition file of one of our topics */
+struct found {
+	int t;
+	int id;
+};
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static char shim_dir[PATH_MAX / 2];
+static uint64_t shim_lat_ns, shim_jitter_ns;
+static double shim_fail_pct;
+
+static unsigned long member_seq;
+
+static pthread_mutex_t parts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct part *parts;
+
+static pthread_mutex_t down_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t down_checked;
+static struct timespec down_mtime;
+static char down_list[4096];
+
+/* how often we look at the down file */
+#define SHIM_DOWN_CHECK_NS 10000000ULL
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int64_t
+wall_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+shim_init(void)
+{
+	const char *s;
+	char path[PATH_MAX];
+
+	s = getenv("STREAMS_SHIM_DIR");
+	snprintf(shim_dir, sizeof (shim_dir), "%s",
+	    s != NULL && *s != '\0' ? s : SHIM_DEFAULT_DIR);
+	if ((s = getenv("STREAMS_SHIM_LATENCY_US")) != NULL)
+		shim_lat_ns = strtoull(s, NULL, 10) * 1000;
+	if ((s = getenv("STREAMS_SHIM_JITTER_US")) != NULL)
+		shim_jitter_ns = strtoull(s, NULL, 10) * 1000;
+	if ((s = getenv("STREAMS_SHIM_FAIL_PCT")) != NULL)
+		shim_fail_pct = strtod(s, NULL);
+
+	(void) mkdir(shim_dir, 0755);
+	snprintf(path, sizeof (path), "%s/offsets", shim_dir);
+	(void) mkdir(path, 0755);
+	snprintf(path, sizeof (path), "%s/groups", shim_dir);
+	(void) mkdir(path, 0755);
+}
+
+/* "/stream:topic" to a file name, '/' and '%' escaped */
+static void
+escape(char *buf, size_t len, const char *topic)
+{
+	size_t o = 0;
+
+	for (; *topic != '\0' && o + 4 < len; topic++) {
+		if (*topic == '/' || *topic == '%')
+			o += sprintf(buf + o, "%%%02x", *topic);
+		else
+			buf[o++] = *topic;
+	}
+	buf[o] = '\0';
+}
+
+/*
+ * Is the topic's stream listed in the down file?  Looked at every 10ms
+ * at most, and re-read only when it has changed.
+ */
+static int
+topic_down(const char *topic)
+{
+	char path[PATH_MAX], *line, *end;
+	struct stat st;
+	uint64_t now = now_ns();
+	FILE *f;
+	size_t n;
+	int down = 0;
+
+	pthread_mutex_lock(&down_lock);
+	if (now - down_checked >= SHIM_DOWN_CHECK_NS) {
+		down_checked = now;
+		snprintf(path, sizeof (path), "%s/down", shim_dir);
+		if (stat(path, &st) != 0) {
+			down_list[0] = '\0';
+			memset(&down_mtime, 0, sizeof (down_mtime));
+		} else if (st.st_mtim.tv_sec != down_mtime.tv_sec ||
+		    st.st_mtim.tv_nsec != down_mtime.tv_nsec) {
+			down_mtime = st.st_mtim;
+			down_list[0] = '\0';
+			if ((f = fopen(path, "r")) != NULL) {
+				n = fread(down_list, 1, sizeof (down_list) - 1,
+				    f);
+				down_list[n] = '\0';
+				fclose(f);
+			}
+		}
+	}
+	for (line = down_list; *line != '\0' && !down; line = end) {
+		if ((end = strchr(line, '\n')) == NULL)
+			end = line + strlen(line);
+		down = end > line && strncmp(topic, line, end - line) == 0;
+		if (*end == '\n')
+			end++;
+	}
+	pthread_mutex_unlock(&down_lock);
+	return (down);
+}
+
+static struct part *
+part_get(const char *topic, int id)
+{
+	char esc[SHIM_NAME_MAX * 3], path[PATH_MAX];
+	static const char zero[SHIM_FILE_HDR];
+	struct part *p;
+	struct stat st;
+	int fd;
+
+	pthread_mutex_lock(&parts_lock);
+	for (p = parts; p != NULL; p = p->next) {
+		if (p->id == id && strcmp(p->topic, topic) == 0)
+			break;
+	}
+	if (p != NULL) {
+		pthread_mutex_unlock(&parts_lock);
+		return (p);
+	}
+
+	escape(esc, sizeof (esc), topic);
+	snprintf(path, sizeof (path), "%s/%s.%d", shim_dir, esc, id);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || (p = calloc(1, sizeof (*p))) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_unlock(&parts_lock);
+		return (NULL);
+	}
+	/* whoever gets here first writes the header */
+	flock(fd, LOCK_EX);
+	if (fstat(fd, &st) == 0 && st.st_size < SHIM_FILE_HDR)
+		(void) pwrite(fd, zero, sizeof (zero), 0);
+	flock(fd, LOCK_UN);
+
+	snprintf(p->topic, sizeof (p->topic), "%s", topic);
+	p->id = id;
+	p->fd = fd;
+	pthread_mutex_init(&p->lock, NULL);
+	p->next = parts;
+	parts = p;
+	pthread_mutex_unlock(&parts_lock);
+	return (p);
+}
+
+static struct part *
+tp_part(streams_topic_partition_t tp)
+{
+	struct part *p = __atomic_load_n(&tp->p, __ATOMIC_ACQUIRE);
+
+	if (p == NULL) {
+		p = part_get(tp->topic, tp->id);
+		__atomic_store_n(&tp->p, p, __ATOMIC_RELEASE);
+	}
+	return (p);
+}
+
+/* the next offset and the end of the file, with the file locked */
+static int
+part_end_locked(struct part *p, int64_t *offset, int64_t *pos)
+{
+	struct stat st;
+
+	if (pread(p->fd, offset, sizeof (*offset), 0) != sizeof (*offset) ||
+	    fstat(p->fd, &st) != 0)
+		return (EIO);
+	*pos = st.st_size;
+	return (0);
+}
+
+static int
+part_end(struct part *p, int64_t *offset, int64_t *pos)
+{
+	int ret;
+
+	flock(p->fd, LOCK_SH);
+	ret = part_end_locked(p, offset, pos);
+	flock(p->fd, LOCK_UN);
+	return (ret);
+}
+
+/* append n records to one partition, setting their offsets */
+static int32_t
+part_append(struct part *p, streams_producer_record_t *recs, size_t n)
+{
+	struct iovec iov[3 * SHIM_IOV_RECS];
+	struct loghdr h[SHIM_IOV_RECS];
+	int64_t next, pos, ts = wall_ms();
+	size_t i = 0, j, k;
+	ssize_t want, got;
+	int32_t err = 0;
+
+	pthread_mutex_lock(&p->lock);
+	flock(p->fd, LOCK_EX);
+	if (part_end_locked(p, &next, &pos) != 0) {
+		err = EIO;
+		goto out;
+	}
+	for (i = 0; i < n && err == 0; i += j) {
+		want = 0;
+		for (j = 0, k = 0; j < SHIM_IOV_RECS && i + j < n; j++) {
+			streams_producer_record_t r = recs[i + j];
+
+			h[j].klen = r->klen;
+			h[j].vlen = r->vlen;
+			h[j].offset = r->offset = next + i + j;
+			h[j].ts_ms = ts;
+			iov[k].iov_base = &h[j];
+			iov[k++].iov_len = sizeof (h[j]);
+			iov[k].iov_base = (void *)r->key;
+			iov[k++].iov_len = r->klen;
+			iov[k].iov_base = (void *)r->value;
+			iov[k++].iov_len = r->vlen;
+			want += sizeof (h[j]) + r->klen + r->vlen;
+		}
+		got = pwritev(p->fd, iov, k, pos);
+		if (got != want) {
+			/* don't leave half a record for readers to trip on */
+			err = got < 0 ? errno : ENOSPC;
+			(void) ftruncate(p->fd, pos);
+			break;
+		}
+		pos += got;
+	}
+	if (i > 0) {
+		/* records before a failed chunk did make it */
+		next += err == 0 ? (int64_t)n : (int64_t)i;
+		(void) pwrite(p->fd, &next, sizeof (next), 0);
+	}
+out:
+	for (; i < n; i++)
+		recs[i]->err = err;
+	flock(p->fd, LOCK_UN);
+	pthread_mutex_unlock(&p->lock);
+	return (err);
+}
+
+static const char *
+config_get(streams_config_t c, const char *name, const char *dflt)
+{
+	for (int i = 0; c != NULL && i < c->n; i++) {
+		if (strcmp(c->name[i], name) == 0)
+			return (c->value[i]);
+	}
+	return (dflt);
+}
+
+int32_t
+streams_config_create(streams_config_t *config)
+{
+	*config = calloc(1, sizeof (**config));
+	return (*config == NULL ? ENOMEM : 0);
+}
+
+int32_t
+streams_config_destroy(streams_config_t c)
+{
+	for (int i = 0; i < c->n; i++) {
+		free(c->name[i]);
+		free(c->value[i]);
+	}
+	free(c);
+	return (0);
+}
+
+int32_t
+streams_config_set(streams_config_t c, const char *name, const char *value)
+{
+	int i;
+
+	for (i = 0; i < c->n; i++) {
+		if (strcmp(c->name[i], name) == 0)
+			break;
+	}
+	if (i == SHIM_CONF_MAX)
+		return (ENOSPC);
+	if (i == c->n) {
+		c->name[i] = strdup(name);
+		c->n++;
+	} else {
+		free(c->value[i]);
+	}
+	c->value[i] = strdup(value);
+	return (0);
+}
+
+int32_t
+streams_topic_partition_create(const char *topic, int partitionid,
+		streams_topic_partition_t *tp)
+{
+	if (strlen(topic) >= SHIM_NAME_MAX || partitionid < 0)
+		return (EINVAL);
+	pthread_once(&shim_once, shim_init);
+	*tp = calloc(1, sizeof (**tp));
+	if (*tp == NULL)
+		return (ENOMEM);
+	snprintf((*tp)->topic, sizeof ((*tp)->topic), "%s", topic);
+	(*tp)->id = partitionid;
+	return (0);
+}
+
+int32_t
+streams_topic_partition_destroy(streams_topic_partition_t tp)
+{
+	free(tp);
+	return (0);
+}
+
+int32_t
+streams_topic_partition_get_topic(streams_topic_partition_t tp, char *buf,
+		uint32_t len)
+{
+	snprintf(buf, len, "%s", tp->topic);
+	return (0);
+}
+
+int32_t
+streams_topic_partition_get_partitionid(streams_topic_partition_t tp,
+		int *partitionid)
+{
+	*partitionid = tp->id;
+	return (0);
+}
+
+static int
+by_partition(const void *a, const void *b)
+{
+	streams_producer_record_t ra = *(streams_producer_record_t *)a;
+	streams_producer_record_t rb = *(streams_producer_record_t *)b;
+
+	if (ra->tp->p != rb->tp->p)
+		return (ra->tp->p < rb->tp->p ? -1 : 1);
+	return (ra->seq < rb->seq ? -1 : ra->seq > rb->seq);
+}
+
+/*
+ * Write out one batch, a partition at a time.  Returns the batch as a
+ * list again, in the order the callbacks should run.
+ */
+static streams_producer_record_t
+producer_write(streams_producer_t pr, streams_producer_record_t list)
+{
+	streams_producer_record_t r, *b;
+	size_t n = 0, i, j, cap;
+	uint64_t now, due;
+
+	for (r = list; r != NULL; r = r->next) {
+		if (n == pr->batchcap) {
+			cap = pr->batchcap ? 2 * pr->batchcap : 1024;
+			b = realloc(pr->batch, cap * sizeof (*b));
+			if (b == NULL)
+				break;
+			pr->batch = b;
+			pr->batchcap = cap;
+		}
+		pr->batch[n++] = r;
+		r->err = 0;
+		r->offset = -1;
+		if (tp_part(r->tp) == NULL)
+			r->err = EIO;
+		else if (topic_down(r->tp->topic))
+			r->err = ETIMEDOUT;
+		else if (shim_fail_pct > 0 &&
+		    rand_r(&pr->seed) < shim_fail_pct / 100 * RAND_MAX)
+			r->err = EIO;
+	}
+	if (r != NULL) {
+		/* no room to sort the batch, none of it is written */
+		for (r = list; r != NULL; r = r->next) {
+			r->err = ENOMEM;
+			r->offset = -1;
+		}
+		n = 0;
+	}
+	b = pr->batch;
+	if (n > 0)
+		qsort(b, n, sizeof (*b), by_partition);
+
+	for (i = 0; i < n; i = j) {
+		size_t ok = 0;
+
+		/* gather this partition's records that are still good */
+		for (j = i; j < n && b[j]->tp->p == b[i]->tp->p; j++) {
+			if (b[j]->err == 0)
+				b[i + ok++] = b[j];
+		}
+		if (ok > 0 && b[i]->tp->p != NULL)
+			(void) part_append(b[i]->tp->p, b + i, ok);
+	}
+
+	/* b[] got compacted above, rebuild the order from the list */
+	now = now_ns();
+	for (r = list; r != NULL; r = r->next) {
+		due = r->sent_ns + shim_lat_ns;
+		if (shim_jitter_ns > 0)
+			due += (uint64_t)rand_r(&pr->seed) % shim_jitter_ns;
+		if (due < now)
+			due = now;
+		/* callbacks go out in order */
+		if (due < pr->last_due)
+			due = pr->last_due;
+		r->due_ns = pr->last_due = due;
+	}
+	return (list);
+}
+
+static void *
+producer_writer(void *arg)
+{
+	streams_producer_t pr = arg;
+	streams_producer_record_t batch, *tail;
+
+	pthread_mutex_lock(&pr->lock);
+	for (;;) {
+		while (pr->sendq == NULL && !pr->stop)
+			pthread_cond_wait(&pr->wcond, &pr->lock);
+		if (pr->sendq == NULL)
+			break;
+		batch = pr->sendq;
+		tail = pr->sendq_tail;
+		pr->sendq = NULL;
+		pr->sendq_tail = &pr->sendq;
+		pthread_mutex_unlock(&pr->lock);
+
+		batch = producer_write(pr, batch);
+
+		pthread_mutex_lock(&pr->lock);
+		*pr->ackq_tail = batch;
+		pr->ackq_tail = tail;
+		pthread_cond_signal(&pr->acond);
+	}
+	pthread_mutex_unlock(&pr->lock);
+	return (NULL);
+}
+
+static void *
+producer_acker(void *arg)
+{
+	streams_producer_t pr = arg;
+	streams_producer_record_t r, next, done;
+	struct timespec ts;
+	uint64_t now, bytes;
+	unsigned long n;
+
+	pthread_mutex_lock(&pr->lock);
+	for (;;) {
+		if (pr->ackq == NULL) {
+			if (pr->stop)
+				break;
+			pthread_cond_wait(&pr->acond, &pr->lock);
+			continue;
+		}
+		now = now_ns();
+		if (pr->ackq->due_ns > now) {
+			ts.tv_sec = pr->ackq->due_ns / 1000000000ULL;
+			ts.tv_nsec = pr->ackq->due_ns % 1000000000ULL;
+			pthread_cond_timedwait(&pr->acond, &pr->lock, &ts);
+			continue;
+		}
+
+		/* everything that's due */
+		done = pr->ackq;
+		for (r = done; r->next != NULL && r->next->due_ns <= now;
+		    r = r->next)
+			;
+		pr->ackq = r->next;
+		r->next = NULL;
+		if (pr->ackq == NULL)
+			pr->ackq_tail = &pr->ackq;
+		pthread_mutex_unlock(&pr->lock);
+
+		/* the callback may destroy the record */
+		n = 0;
+		bytes = 0;
+		for (r = done; r != NULL; r = next) {
+			next = r->next;
+			bytes += sizeof (struct loghdr) + r->klen + r->vlen;
+			n++;
+			r->cb(r->err, r, r->tp->id, r->offset, r->ctx);
+		}
+
+		pthread_mutex_lock(&pr->lock);
+		pr->outstanding -= n;
+		pr->bytes -= bytes;
+		pthread_cond_broadcast(&pr->space);
+	}
+	pthread_mutex_unlock(&pr->lock);
+	return (NULL);
+}
+
+int32_t
+streams_producer_create(streams_config_t config, streams_producer_t *producer)
+{
+	streams_producer_t pr;
+	pthread_condattr_t ca;
+
+	pthread_once(&shim_once, shim_init);
+	if ((pr = calloc(1, sizeof (*pr))) == NULL)
+		return (ENOMEM);
+	pr->buffer_max = strtoull(config_get(config, "buffer.memory", "0"),
+	    NULL, 10);
+	if (pr->buffer_max == 0)
+		pr->buffer_max = SHIM_BUFFER_DEFAULT;
+	pr->sendq_tail = &pr->sendq;
+	pr->ackq_tail = &pr->ackq;
+	pr->seed = (unsigned int)now_ns();
+	pthread_mutex_init(&pr->lock, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&pr->acond, &ca);
+	pthread_condattr_destroy(&ca);
+	pthread_cond_init(&pr->wcond, NULL);
+	pthread_cond_init(&pr->space, NULL);
+
+	if (pthread_create(&pr->writer, NULL, producer_writer, pr) != 0) {
+		free(pr);
+		return (EAGAIN);
+	}
+	if (pthread_create(&pr->acker, NULL, producer_acker, pr) != 0) {
+		pthread_mutex_lock(&pr->lock);
+		pr->stop = 1;
+		pthread_cond_signal(&pr->wcond);
+		pthread_mutex_unlock(&pr->lock);
+		pthread_join(pr->writer, NULL);
+		free(pr);
+		return (EAGAIN);
+	}
+	*producer = pr;
+	return (0);
+}
+
+int32_t
+streams_producer_destroy(streams_producer_t pr)
+{
+	(void) streams_producer_flush(pr);
+	pthread_mutex_lock(&pr->lock);
+	pr->stop = 1;
+	pthread_cond_signal(&pr->wcond);
+	pthread_cond_signal(&pr->acond);
+	pthread_mutex_unlock(&pr->lock);
+	pthread_join(pr->writer, NULL);
+	pthread_join(pr->acker, NULL);
+	free(pr->batch);
+	free(pr);
+	return (0);
+}
+
+int32_t
+streams_producer_record_create(streams_topic_partition_t tp, const void *key,
+		uint32_t klen, const void *value, uint32_t vlen,
+		streams_producer_record_t *record)
+{
+	streams_producer_record_t r;
+
+	if ((r = calloc(1, sizeof (*r))) == NULL)
+		return (ENOMEM);
+	r->tp = tp;
+	r->key = key;
+	r->klen = klen;
+	r->value = value;
+	r->vlen = vlen;
+	*record = r;
+	return (0);
+}
+
+int32_t
+streams_producer_record_destroy(streams_producer_record_t record)
+{
+	free(record);
+	return (0);
+}
+
+int32_t
+streams_producer_record_get_key(streams_producer_record_t record,
+		const void **key, uint32_t *klen)
+{
+	*key = record->key;
+	*klen = record->klen;
+	return (0);
+}
+
+int32_t
+streams_producer_record_get_value(streams_producer_record_t record,
+		const void **value, uint32_t *vlen)
+{
+	*value = record->value;
+	*vlen = record->vlen;
+	return (0);
+}
+
+/*
+ * Like the real client, key and value are not copied: they have to
+ * stay put until the callback.  Blocks while buffer.memory is used up.
+ */
+int32_t
+streams_producer_send(streams_producer_t pr, streams_producer_record_t r,
+		streams_producer_cb cb, void *ctx)
+{
+	uint64_t size = sizeof (struct loghdr) + r->klen + r->vlen;
+
+	if (cb == NULL)
+		return (EINVAL);
+	pthread_mutex_lock(&pr->lock);
+	while (pr->bytes > 0 && pr->bytes + size > pr->buffer_max &&
+	    !pr->stop)
+		pthread_cond_wait(&pr->space, &pr->lock);
+	if (pr->stop) {
+		pthread_mutex_unlock(&pr->lock);
+		return (EINVAL);
+	}
+	r->cb = cb;
+	r->ctx = ctx;
+	r->seq = pr->seq++;
+	r->sent_ns = now_ns();
+	r->next = NULL;
+	*pr->sendq_tail = r;
+	pr->sendq_tail = &r->next;
+	pr->outstanding++;
+	pr->bytes += size;
+	pthread_cond_signal(&pr->wcond);
+	pthread_mutex_unlock(&pr->lock);
+	return (0);
+}
+
+/* wait for every send so far to have had its callback */
+int32_t
+streams_producer_flush(streams_producer_t pr)
+{
+	pthread_mutex_lock(&pr->lock);
+	while (pr->outstanding > 0)
+		pthread_cond_wait(&pr->space, &pr->lock);
+	pthread_mutex_unlock(&pr->lock);
+	return (0);
+}
+
+int32_t
+streams_consumer_create(streams_config_t config, streams_consumer_t *consumer)
+{
+	streams_consumer_t cs;
+
+	pthread_once(&shim_once, shim_init);
+	if ((cs = calloc(1, sizeof (*cs))) == NULL)
+		return (ENOMEM);
+	snprintf(cs->group, sizeof (cs->group), "%s",
+	    config_get(config, "group.id", ""));
+	cs->latest = strcmp(config_get(config, "auto.offset.reset", "latest"),
+	    "earliest") != 0;
+	cs->fetch_max = strtoul(config_get(config,
+	    "max.partition.fetch.bytes", "0"), NULL, 10);
+	if (cs->fetch_max == 0)
+		cs->fetch_max = SHIM_FETCH_DEFAULT;
+	cs->commits_tail = &cs->commits;
+	cs->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cs->ifd < 0 || inotify_add_watch(cs->ifd, shim_dir,
+	    IN_MODIFY | IN_CREATE) < 0) {
+		int err = errno;
+
+		if (cs->ifd >= 0)
+			close(cs->ifd);
+		free(cs);
+		return (err);
+	}
+	*consumer = cs;
+	return (0);
+}
+
+static int
+committed_read(struct cpart *cp)
+{
+	char buf[64];
+	long long off, pos;
+	ssize_t n;
+
+	n = pread(cp->cfd, buf, sizeof (buf) - 1, 0);
+	if (n <= 0)
+		return (-1);
+	buf[n] = '\0';
+	if (sscanf(buf, "%lld %lld", &off, &pos) != 2)
+		return (-1);
+	cp->committed = cp->offset = off;
+	cp->pos = pos;
+	return (0);
+}
+
+static int32_t
+committed_write(struct cpart *cp)
+{
+	char buf[64];
+	int n;
+
+	if (cp->cpath[0] == '\0' || cp->committed == cp->offset || !cp->owned)
+		return (0);
+	if (cp->cfd < 0 &&
+	    (cp->cfd = open(cp->cpath, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return (errno);
+	/* fixed width, so a rewrite always covers the old one */
+	n = snprintf(buf, sizeof (buf), "%020lld %020lld\n",
+	    (long long)cp->offset, (long long)cp->pos);
+	if (pwrite(cp->cfd, buf, n, 0) != n)
+		return (errno != 0 ? errno : EIO);
+	cp->committed = cp->offset;
+	return (0);
+}
+
+static struct cpart *
+cpart_find(streams_consumer_t cs, const char *topic, int id)
+{
+	for (int i = 0; i < cs->nparts; i++) {
+		if (cs->parts[i]->tp.id == id &&
+		    strcmp(cs->parts[i]->tp.topic, topic) == 0)
+			return (cs->parts[i]);
+	}
+	return (NULL);
+}
+
+/* start reading a partition, from the group's committed offset if any */
+static struct cpart *
+cpart_open(streams_consumer_t cs, const char *topic, int id)
+{
+	char esc[SHIM_NAME_MAX * 3];
+	struct cpart *cp;
+
+	if ((cp = cpart_find(cs, topic, id)) != NULL)
+		return (cp);
+	if (cs->nparts == SHIM_MAX_PARTS ||
+	    (cp = calloc(1, sizeof (*cp))) == NULL)
+		return (NULL);
+	snprintf(cp->tp.topic, sizeof (cp->tp.topic), "%s", topic);
+	cp->tp.id = id;
+	if (tp_part(&cp->tp) == NULL) {
+		free(cp);
+		return (NULL);
+	}
+	cp->rec.cp = cp;
+	cp->owned = 1;
+	cp->committed = -1;
+	cp->cfd = -1;
+	if (cs->group[0] != '\0') {
+		escape(esc, sizeof (esc), topic);
+		snprintf(cp->cpath, sizeof (cp->cpath), "%s/offsets/%s.%d@%s",
+		    shim_dir, esc, id, cs->group);
+		cp->cfd = open(cp->cpath, O_RDWR | O_CLOEXEC);
+	}
+	if (cp->cfd < 0 || committed_read(cp) != 0) {
+		if (cs->latest) {
+			(void) part_end(cp->tp.p, &cp->offset, &cp->pos);
+		} else {
+			cp->offset = 0;
+			cp->pos = SHIM_FILE_HDR;
+		}
+	}
+	cs->parts[cs->nparts++] = cp;
+	return (cp);
+}
+
+static void
+cpart_close(struct cpart *cp)
+{
+	if (cp->cfd >= 0)
+		close(cp->cfd);
+	free(cp->buf);
+	free(cp->msgs);
+	free(cp);
+}
+
+/*
+ * Group coordination
+ * ------------------
+ * Consumers that subscribe with a group.id share the partitions out
+ * between them.  $dir/groups/<group>/members/ has a file per consumer
+ * listing its topics, touched from every poll; one that hasn't been
+ * touched for SHIM_SESSION_NS is gone.  Each topic's partitions are
+ * dealt round robin to the live members that subscribe to it, in name
+ * order, so every member works out the same split on its own.
+ *
+ * Reading a partition also takes its file in owners/, a hard link to
+ * the member file: link() fails if someone else has it, and the link
+ * goes stale along with the member file if its owner dies.  A
+ * partition that should move is revoked and its owner file removed
+ * by the old owner before the new one can take it, so the revoked
+ * callback gets to commit first and no two members read it at once.
+ */
+
+static void
+group_file(streams_consumer_t cs, char *buf, size_t len, const char *topic,
+		int id)
+{
+	char esc[SHIM_NAME_MAX * 3];
+
+	if (topic == NULL) {
+		snprintf(buf, len, "%s/members/%s", cs->gdir, cs->member);
+	} else {
+		escape(esc, sizeof (esc), topic);
+		snprintf(buf, len, "%s/owners/%s.%d", cs->gdir, esc, id);
+	}
+}
+
+static int
+stale(const struct stat *st)
+{
+	struct timespec ts;
+	int64_t age;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	age = (int64_t)(ts.tv_sec - st->st_mtim.tv_sec) * 1000000000LL +
+	    (ts.tv_nsec - st->st_mtim.tv_nsec);
+	return (age >= (int64_t)SHIM_SESSION_NS);
+}
+
+/* (re)write our member file */
+static void
+group_join(streams_consumer_t cs)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct stat st;
+	FILE *f;
+
+	group_file(cs, path, sizeof (path), NULL, 0);
+	snprintf(tmp, sizeof (tmp), "%s/%s.tmp", cs->gdir, cs->member);
+	if ((f = fopen(tmp, "w")) == NULL)
+		return;
+	for (int t = 0; t < cs->ntopics; t++)
+		fprintf(f, "%s\n", cs->topics[t]);
+	if (fclose(f) != 0 || rename(tmp, path) != 0 ||
+	    stat(path, &st) != 0) {
+		(void) unlink(tmp);
+		return;
+	}
+	cs->ino = st.st_ino;
+	cs->joined = 1;
+}
+
+static void
+group_beat(streams_consumer_t cs)
+{
+	char path[PATH_MAX];
+	uint64_t now = now_ns();
+
+	if (cs->joined && now - cs->beat_ns < SHIM_BEAT_NS)
+		return;
+	group_file(cs, path, sizeof (path), NULL, 0);
+	/* someone took us for dead and cleaned up, join again */
+	if (!cs->joined || utimensat(AT_FDCWD, path, NULL, 0) != 0)
+		group_join(cs);
+	cs->beat_ns = now;
+}
+
+static int
+by_name(const void *a, const void *b)
+{
+	return (strcmp(((const struct member *)a)->name,
+	    ((const struct member *)b)->name));
+}
+
+/* the live members, sorted; stale member files are removed */
+static int
+members_load(streams_consumer_t cs, struct member **mp)
+{
+	char path[PATH_MAX];
+	struct member *m = NULL, *nm;
+	struct dirent *de;
+	struct stat st;
+	FILE *f;
+	DIR *d;
+	int n = 0, cap = 0;
+	size_t len;
+
+	snprintf(path, sizeof (path), "%s/members", cs->gdir);
+	if ((d = opendir(path)) == NULL)
+		return (0);
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.' ||
+		    strlen(de->d_name) >= sizeof (m->name))
+			continue;
+		snprintf(path, sizeof (path), "%s/members/%s", cs->gdir,
+		    de->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+		if (stale(&st)) {
+			(void) unlink(path);
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? 2 * cap : 16;
+			if ((nm = realloc(m, cap * sizeof (*m))) == NULL)
+				break;
+			m = nm;
+		}
+		if ((f = fopen(path, "r")) == NULL)
+			continue;
+		m[n].topics = calloc(1, st.st_size + 1);
+		len = m[n].topics == NULL ? 0 :
+		    fread(m[n].topics, 1, st.st_size, f);
+		fclose(f);
+		if (m[n].topics == NULL)
+			continue;
+		m[n].topics[len] = '\0';
+		strcpy(m[n].name, de->d_name);
+		n++;
+	}
+	closedir(d);
+	qsort(m, n, sizeof (*m), by_name);
+	*mp = m;
+	return (n);
+}
+
+static int
+member_has(const struct member *m, const char *topic)
+{
+	size_t len = strlen(topic);
+
+	for (const char *s = m->topics; *s != '\0'; s++) {
+		if (strncmp(s, topic, len) == 0 && s[len] == '\n')
+			return (1);
+		if ((s = strchr(s, '\n')) == NULL)
+			break;
+	}
+	return (0);
+}
+
+/*
+ * Is partition rank (in id order) of the topic ours?  Also if no live
+ * member has the topic, which only happens when our own file couldn't
+ * be written.
+ */
+static int
+designated(streams_consumer_t cs, struct member *m, int nm,
+		const char *topic, int rank)
+{
+	int k = 0, x;
+
+	for (x = 0; x < nm; x++)
+		k += member_has(&m[x], topic);
+	if (k == 0)
+		return (1);
+	rank %= k;
+	for (x = 0; x < nm; x++) {
+		if (member_has(&m[x], topic) && rank-- == 0)
+			break;
+	}
+	return (strcmp(m[x].name, cs->member) == 0);
+}
+
+/* do we still hold the partition's owner file? */
+static int
+owner_held(streams_consumer_t cs, const char *topic, int id)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	group_file(cs, path, sizeof (path), topic, id);
+	return (stat(path, &st) == 0 && st.st_ino == cs->ino);
+}
+
+static int
+owner_claim(streams_consumer_t cs, const char *topic, int id)
+{
+	char path[PATH_MAX], owner[PATH_MAX];
+	struct stat st;
+
+	group_file(cs, path, sizeof (path), NULL, 0);
+	group_file(cs, owner, sizeof (owner), topic, id);
+	for (int tries = 0; tries < 2; tries++) {
+		if (link(path, owner) == 0)
+			return (0);
+		if (errno != EEXIST)
+			return (errno);
+		if (stat(owner, &st) != 0)
+			continue;
+		if (st.st_ino == cs->ino)
+			return (0);
+		if (!stale(&st))
+			return (EBUSY);
+		/* its owner is gone without letting go */
+		(void) unlink(owner);
+	}
+	return (EBUSY);
+}
+
+static void
+owner_release(streams_consumer_t cs, const char *topic, int id)
+{
+	char path[PATH_MAX];
+
+	if (owner_held(cs, topic, id)) {
+		group_file(cs, path, sizeof (path), topic, id);
+		(void) unlink(path);
+	}
+}
+
+static int
+by_topic_id(const void *a, const void *b)
+{
+	const struct found *fa = a, *fb = b;
+
+	if (fa->t != fb->t)
+		return (fa->t - fb->t);
+	return (fa->id - fb->id);
+}
+
+/* drop partitions that are someone else's now, take the ones that are ours */
+static void
+group_scan(streams_consumer_t cs, struct found *f, int nf)
+{
+	streams_topic_partition_t tps[SHIM_MAX_PARTS];
+	struct cpart *cp;
+	struct member *m = NULL;
+	char mine[SHIM_MAX_PARTS], drop[SHIM_MAX_PARTS];
+	int nm, i, j, keep, ngone = 0;
+	uint32_t n = 0;
+
+	group_beat(cs);
+	nm = members_load(cs, &m);
+	qsort(f, nf, sizeof (*f), by_topic_id);
+	for (i = 0; i < nf; i = j) {
+		for (j = i; j < nf && f[j].t == f[i].t; j++)
+			mine[j] = designated(cs, m, nm, cs->topics[f[i].t],
+			    j - i);
+	}
+	for (i = 0; i < nm; i++)
+		free(m[i].topics);
+	free(m);
+
+	for (i = 0; i < cs->nparts; i++) {
+		cp = cs->parts[i];
+		for (j = 0; j < nf; j++) {
+			if (f[j].id == cp->tp.id &&
+			    strcmp(cs->topics[f[j].t], cp->tp.topic) == 0)
+				break;
+		}
+		/* someone took it while we weren't looking, don't commit */
+		if (!owner_held(cs, cp->tp.topic, cp->tp.id))
+			cp->owned = 0;
+		drop[i] = !cp->owned || j == nf || !mine[j];
+		if (drop[i])
+			tps[ngone++] = &cp->tp;
+	}
+	if (ngone > 0) {
+		/* still in parts[], so the callback can commit them */
+		if (cs->revoked != NULL)
+			cs->revoked(tps, ngone, cs->cb_ctx);
+		for (i = 0, keep = 0; i < cs->nparts; i++) {
+			cp = cs->parts[i];
+			if (!drop[i]) {
+				cs->parts[keep++] = cp;
+				continue;
+			}
+			if (cp->owned)
+				owner_release(cs, cp->tp.topic, cp->tp.id);
+			cpart_close(cp);
+		}
+		cs->nparts = keep;
+		cs->next = 0;
+	}
+
+	for (j = 0; j < nf; j++) {
+		const char *topic = cs->topics[f[j].t];
+
+		if (!mine[j] || cpart_find(cs, topic, f[j].id) != NULL ||
+		    owner_claim(cs, topic, f[j].id) != 0)
+			continue;
+		if ((cp = cpart_open(cs, topic, f[j].id)) == NULL) {
+			owner_release(cs, topic, f[j].id);
+			continue;
+		}
+		tps[n++] = &cp->tp;
+	}
+	if (n > 0 && cs->assigned != NULL)
+		cs->assigned(tps, n, cs->cb_ctx);
+}
+
+/*
+ * Pick up partitions of our topics that have appeared since last time,
+ * or with a group, the ones that are ours now.
+ */
+static void
+consumer_scan(streams_consumer_t cs)
+{
+	streams_topic_partition_t added[SHIM_MAX_PARTS];
+	struct found f[SHIM_MAX_PARTS];
+	char esc[SHIM_NAME_MAX * 3], *end;
+	struct dirent *de;
+	struct cpart *cp;
+	uint32_t nadded = 0;
+	size_t elen;
+	int nf = 0;
+	DIR *d;
+	long id;
+
+	cs->scan_ns = now_ns();
+	if (cs->ntopics == 0 || (d = opendir(shim_dir)) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL && nf < SHIM_MAX_PARTS) {
+		for (int t = 0; t < cs->ntopics; t++) {
+			escape(esc, sizeof (esc), cs->topics[t]);
+			elen = strlen(esc);
+			if (strncmp(de->d_name, esc, elen) != 0 ||
+			    de->d_name[elen] != '.')
+				continue;
+			id = strtol(de->d_name + elen + 1, &end, 10);
+			if (*end != '\0' || end == de->d_name + elen + 1)
+				continue;
+			f[nf].t = t;
+			f[nf++].id = id;
+		}
+	}
+	closedir(d);
+	if (cs->grouped) {
+		group_scan(cs, f, nf);
+		return;
+	}
+	for (int i = 0; i < nf; i++) {
+		if (cpart_find(cs, cs->topics[f[i].t], f[i].id) != NULL)
+			continue;
+		if ((cp = cpart_open(cs, cs->topics[f[i].t], f[i].id)) != NULL)
+			added[nadded++] = &cp->tp;
+	}
+	if (nadded > 0 && cs->assigned != NULL)
+		cs->assigned(added, nadded, cs->cb_ctx);
+}
+
+static void
+run_commit_callbacks(streams_consumer_t cs)
+{
+	struct pending_commit *pc;
+
+	while ((pc = cs->commits) != NULL) {
+		cs->commits = pc->next;
+		pc->cb(pc->err, pc->tps, pc->offsets, pc->n, pc->ctx);
+		free(pc->tps);
+		free(pc->offsets);
+		free(pc);
+	}
+	cs->commits_tail = &cs->commits;
+}
+
+int32_t
+streams_consumer_unsubscribe(streams_consumer_t cs)
+{
+	streams_topic_partition_t tps[SHIM_MAX_PARTS];
+	char path[PATH_MAX];
+
+	for (int i = 0; i < cs->nparts; i++)
+		tps[i] = &cs->parts[i]->tp;
+
+	if (cs->nparts > 0 && cs->revoked != NULL)
+		cs->revoked(tps, cs->nparts, cs->cb_ctx);
+	for (int i = 0; i < cs->nparts; i++) {
+		if (cs->grouped && cs->parts[i]->owned)
+			owner_release(cs, cs->parts[i]->tp.topic,
+			    cs->parts[i]->tp.id);
+		cpart_close(cs->parts[i]);
+	}
+	if (cs->joined) {
+		group_file(cs, path, sizeof (path), NULL, 0);
+		(void) unlink(path);
+	}
+	cs->nparts = 0;
+	cs->ntopics = 0;
+	cs->next = 0;
+	cs->grouped = cs->joined = 0;
+	return (0);
+}
+
+int32_t
+streams_consumer_destroy(streams_consumer_t cs)
+{
+	run_commit_callbacks(cs);
+	(void) streams_consumer_unsubscribe(cs);
+	close(cs->ifd);
+	free(cs);
+	return (0);
+}
+
+int32_t
+streams_consumer_subscribe_topics(streams_consumer_t cs, const char **topics,
+		int num_topics, streams_rebalance_cb assigned,
+		streams_rebalance_cb revoked, void *ctx)
+{
+	if (num_topics > SHIM_MAX_TOPICS)
+		return (EINVAL);
+	for (int i = 0; i < num_topics; i++) {
+		if (strlen(topics[i]) >= SHIM_NAME_MAX)
+			return (EINVAL);
+	}
+	(void) streams_consumer_unsubscribe(cs);
+	for (int i = 0; i < num_topics; i++)
+		snprintf(cs->topics[i], SHIM_NAME_MAX, "%s", topics[i]);
+	cs->ntopics = num_topics;
+	cs->assigned = assigned;
+	cs->revoked = revoked;
+	cs->cb_ctx = ctx;
+	cs->scan_ns = 0;
+	if (cs->group[0] != '\0') {
+		char esc[SHIM_NAME_MAX * 3], path[PATH_MAX];
+
+		escape(esc, sizeof (esc), cs->group);
+		snprintf(cs->gdir, sizeof (cs->gdir), "%s/groups/%s",
+		    shim_dir, esc);
+		(void) mkdir(cs->gdir, 0755);
+		snprintf(path, sizeof (path), "%s/members", cs->gdir);
+		(void) mkdir(path, 0755);
+		snprintf(path, sizeof (path), "%s/owners", cs->gdir);
+		(void) mkdir(path, 0755);
+		snprintf(cs->member, sizeof (cs->member), "%d.%lu",
+		    (int)getpid(), __atomic_add_fetch(&member_seq, 1,
+		    __ATOMIC_RELAXED));
+		/* joins from its first poll */
+		cs->grouped = 1;
+	}
+	return (0);
+}
+
+/* read exactly these partitions, without group subscription */
+int32_t
+streams_consumer_assign_partitions(streams_consumer_t cs,
+		streams_topic_partition_t *tps, uint32_t num_tps)
+{
+	(void) streams_consumer_unsubscribe(cs);
+	for (uint32_t i = 0; i < num_tps; i++) {
+		if (cpart_open(cs, tps[i]->topic, tps[i]->id) == NULL)
+			return (ENOMEM);
+	}
+	return (0);
+}
+
+int32_t
+streams_consumer_seek_to_end(streams_consumer_t cs,
+		streams_topic_partition_t *tps, uint32_t num_tps)
+{
+	struct cpart *cp;
+
+	for (uint32_t i = 0; i < num_tps; i++) {
+		cp = cpart_find(cs, tps[i]->topic, tps[i]->id);
+		if (cp == NULL)
+			return (EINVAL);
+		if (part_end(cp->tp.p, &cp->offset, &cp->pos) != 0)
+			return (EIO);
+	}
+	return (0);
+}
+
+int32_t
+streams_consumer_get_position(streams_consumer_t cs,
+		streams_topic_partition_t tp, int64_t *offset)
+{
+	struct cpart *cp = cpart_find(cs, tp->topic, tp->id);
+
+	if (cp == NULL)
+		return (EINVAL);
+	*offset = cp->offset;
+	return (0);
+}
+
+/* read what's there for one partition, returns the message count */
+static uint32_t
+cpart_fetch(streams_consumer_t cs, struct cpart *cp)
+{
+	struct loghdr h;
+	size_t off = 0, len, want = cs->fetch_max;
+	ssize_t got;
+	uint32_t n = 0;
+
+	if (topic_down(cp->tp.topic))
+		return (0);
+	for (;;) {
+		if (cp->bufsz < want) {
+			free(cp->buf);
+			cp->buf = malloc(want);
+			cp->bufsz = cp->buf == NULL ? 0 : want;
+			if (cp->buf == NULL)
+				return (0);
+		}
+		got = pread(cp->tp.p->fd, cp->buf, want, cp->pos);
+		if (got < (ssize_t)sizeof (h))
+			return (0);
+		memcpy(&h, cp->buf, sizeof (h));
+		len = sizeof (h) + h.klen + h.vlen;
+		if (len <= (size_t)got || (size_t)got < want)
+			break;
+		/* a record bigger than a whole fetch, make room for it */
+		want = len;
+	}
+
+	while (off + sizeof (h) <= (size_t)got) {
+		memcpy(&h, cp->buf + off, sizeof (h));
+		len = sizeof (h) + h.klen + h.vlen;
+		if (off + len > (size_t)got)
+			break;
+		if (n == cp->msgcap) {
+			cp->msgcap = cp->msgcap ? 2 * cp->msgcap : 256;
+			cp->msgs = realloc(cp->msgs,
+			    cp->msgcap * sizeof (*cp->msgs));
+		}
+		cp->msgs[n].koff = off + sizeof (h);
+		cp->msgs[n].klen = h.klen;
+		cp->msgs[n].voff = off + sizeof (h) + h.klen;
+		cp->msgs[n].vlen = h.vlen;
+		cp->msgs[n].offset = h.offset;
+		cp->msgs[n].ts_ms = h.ts_ms;
+		n++;
+		off += len;
+	}
+	if (n > 0) {
+		cp->pos += off;
+		cp->offset = cp->msgs[n - 1].offset + 1;
+	}
+	cp->rec.n = n;
+	return (n);
+}
+
+static uint32_t
+consumer_fetch(streams_consumer_t cs)
+{
+	uint32_t n = 0;
+	int i, k;
+
+	/* rotate the starting partition so none gets starved */
+	for (k = 0; k < cs->nparts; k++) {
+		i = (cs->next + k) % cs->nparts;
+		if (cpart_fetch(cs, cs->parts[i]) > 0)
+			cs->recs[n++] = &cs->parts[i]->rec;
+	}
+	if (cs->nparts > 0)
+		cs->next = (cs->next + 1) % cs->nparts;
+	return (n);
+}
+
+/* drain inotify, returns non-zero if a file was created */
+static int
+consumer_events(streams_consumer_t cs)
+{
+	char buf[4096]
+	    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	int created = 0;
+
+	while ((n = read(cs->ifd, buf, sizeof (buf))) > 0) {
+		for (char *p = buf; p < buf + n;
+		    p += sizeof (*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & (IN_CREATE | IN_Q_OVERFLOW))
+				created = 1;
+		}
+	}
+	return (created);
+}
+
+/*
+ * Records handed back stay valid until the next poll.  Waits on
+ * inotify rather than sleeping, so an idle consumer costs nothing and
+ * a busy one sees new records as soon as they're written.
+ */
+int32_t
+streams_consumer_poll(streams_consumer_t cs, long timeout_ms,
+		streams_consumer_record_t **records, uint32_t *num_records)
+{
+	struct pollfd pfd = { .fd = cs->ifd, .events = POLLIN };
+	uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ULL;
+	uint64_t now, rescan, wait;
+	uint32_t n;
+
+	rescan = cs->grouped ? SHIM_GROUP_RESCAN_NS : SHIM_RESCAN_NS;
+	run_commit_callbacks(cs);
+	for (;;) {
+		if (consumer_events(cs) || now_ns() - cs->scan_ns >= rescan)
+			consumer_scan(cs);
+		if ((n = consumer_fetch(cs)) > 0)
+			break;
+		now = now_ns();
+		if (now >= deadline)
+			break;
+		wait = deadline - now;
+		/* a group member has to keep up its heartbeat */
+		if (cs->grouped && wait > rescan)
+			wait = rescan;
+		(void) poll(&pfd, 1, (wait + 999999) / 1000000);
+	}
+	*records = cs->recs;
+	*num_records = n;
+	return (0);
+}
+
+int32_t
+streams_consumer_commit_all_sync(streams_consumer_t cs)
+{
+	int32_t err = 0, e;
+
+	for (int i = 0; i < cs->nparts; i++) {
+		if ((e = committed_write(cs->parts[i])) != 0)
+			err = e;
+	}
+	return (err);
+}
+
+/* commits right away, the callback runs from the next poll */
+int32_t
+streams_consumer_commit_all_async(streams_consumer_t cs,
+		streams_commit_cb cb, void *ctx)
+{
+	struct pending_commit *pc;
+
+	if (cb == NULL)
+		return (streams_consumer_commit_all_sync(cs));
+	if ((pc = calloc(1, sizeof (*pc))) == NULL)
+		return (ENOMEM);
+	pc->tps = calloc(cs->nparts + 1, sizeof (*pc->tps));
+	pc->offsets = calloc(cs->nparts + 1, sizeof (*pc->offsets));
+	if (pc->tps == NULL || pc->offsets == NULL) {
+		free(pc->tps);
+		free(pc->offsets);
+		free(pc);
+		return (ENOMEM);
+	}
+	pc->err = streams_consumer_commit_all_sync(cs);
+	for (int i = 0; i < cs->nparts; i++) {
+		pc->tps[i] = &cs->parts[i]->tp;
+		pc->offsets[i] = cs->parts[i]->offset;
+	}
+	pc->n = cs->nparts;
+	pc->cb = cb;
+	pc->ctx = ctx;
+	*cs->commits_tail = pc;
+	cs->commits_tail = &pc->next;
+	return (0);
+}
+
+int32_t
+streams_consumer_record_get_topic(streams_consumer_record_t record,
+		const char **topic, uint32_t *len)
+{
+	*topic = record->cp->tp.topic;
+	*len = strlen(*topic);
+	return (0);
+}
+
+int32_t
+streams_consumer_record_get_partitionid(streams_consumer_record_t record,
+		int *partitionid)
+{
+	*partitionid = record->cp->tp.id;
+	return (0);
+}
+
+int32_t
+streams_consumer_record_get_message_count(streams_consumer_record_t record,
+		uint32_t *count)
+{
+	*count = record->n;
+	return (0);
+}
+
+int32_t
+streams_msg_get_key(streams_consumer_record_t record, uint32_t i, void **key,
+		uint32_t *klen)
+{
+	if (i >= record->n)
+		return (EINVAL);
+	*key = record->cp->buf + record->cp->msgs[i].koff;
+	*klen = record->cp->msgs[i].klen;
+	return (0);
+}
+
+int32_t
+streams_msg_get_value(streams_consumer_record_t record, uint32_t i,
+		void **value, uint32_t *vlen)
+{
+	if (i >= record->n)
+		return (EINVAL);
+	*value = record->cp->buf + record->cp->msgs[i].voff;
+	*vlen = record->cp->msgs[i].vlen;
+	return (0);
+}
+
+int32_t
+streams_msg_get_offset(streams_consumer_record_t record, uint32_t i,
+		int64_t *offset)
+{
+	if (i >= record->n)
+		return (EINVAL);
+	*offset = record->cp->msgs[i].offset;
+	return (0);
+}
+
+int32_t
+streams_msg_get_timestamp(streams_consumer_record_t record, uint32_t i,
+		int64_t *ts_ms)
+{
+	if (i >= record->n)
+		return (EINVAL);
+	*ts_ms = record->cp->msgs[i].ts_ms;
+	return (0);
+}
@@ -0,0 +1,121 @@
+#ifndef STREAMS_SHIM_H
+#define STREAMS_SHIM_H
+
+#include <stdint.h>
+
+/*
+ * Local stand-in for the MapR Streams client
+ * ------------------------------------------
+ * The subset of <streams/streams.h> the producer, consumer and bench
+ * use, backed by a log on the local filesystem instead of a cluster.
+ * Build with `./build.sh shim` to link against it (shim/streams.c).
+ *
+ * Each topic partition is one append-only file in $STREAMS_SHIM_DIR
+ * (default /dev/shm/streams-shim, so it lives in memory), so a producer
+ * and a consumer in different processes on one host see the same data.
+ * Topics and partitions spring into being on first use.  Offsets count
+ * records per partition from 0, like a real cluster's.
+ *
+ * Sends are asynchronous: a writer thread per producer appends whatever
+ * has been queued, an acker thread runs the callbacks.  Callbacks run
+ * on the acker thread, consumer commit callbacks from within
+ * streams_consumer_poll().  These environment variables make it
+ * misbehave:
+ *
+ *   STREAMS_SHIM_LATENCY_US   ack no sooner than this after the send
+ *   STREAMS_SHIM_JITTER_US    plus a random extra of up to this much
+ *   STREAMS_SHIM_FAIL_PCT     fail this percentage of sends (0-100)
+ *
+ * and a stream path prefix written to $STREAMS_SHIM_DIR/down, one per
+ * line, takes that "cluster" down: sends to it fail after the latency,
+ * polls from it return nothing.  Remove the file to bring it back.
+ *
+ * Producer config honours buffer.memory (sends block beyond it until
+ * callbacks free space); consumer config honours group.id,
+ * auto.offset.reset and max.partition.fetch.bytes.  Consumers that
+ * subscribe with the same group.id, in any process, split the
+ * partitions between them and hand them over through the rebalance
+ * callbacks as members come and go (see group_scan() in streams.c);
+ * the group's committed offsets go with the partitions.  Without a
+ * group.id, or with assign_partitions, a consumer reads everything.
+ */
+
+typedef struct streams_config_s *streams_config_t;
+typedef struct streams_producer_s *streams_producer_t;
+typedef struct streams_consumer_s *streams_consumer_t;
+typedef struct streams_topic_partition_s *streams_topic_partition_t;
+typedef struct streams_producer_record_s *streams_producer_record_t;
+typedef struct streams_consumer_record_s *streams_consumer_record_t;
+
+typedef void (*streams_producer_cb)(int32_t err,
+    streams_producer_record_t record, int partitionid, int64_t offset,
+    void *ctx);
+typedef void (*streams_rebalance_cb)(streams_topic_partition_t *partitions,
+    uint32_t num_partitions, void *ctx);
+typedef void (*streams_commit_cb)(int32_t err,
+    streams_topic_partition_t *partitions, int64_t *offsets,
+    uint32_t num_partitions, void *ctx);
+
+int32_t streams_config_create(streams_config_t *config);
+int32_t streams_config_destroy(streams_config_t config);
+int32_t streams_config_set(streams_config_t config, const char *name,
+    const char *value);
+
+int32_t streams_topic_partition_create(const char *topic, int partitionid,
+    streams_topic_partition_t *tp);
+int32_t streams_topic_partition_destroy(streams_topic_partition_t tp);
+int32_t streams_topic_partition_get_topic(streams_topic_partition_t tp,
+    char *buf, uint32_t len);
+int32_t streams_topic_partition_get_partitionid(streams_topic_partition_t tp,
+    int *partitionid);
+
+int32_t streams_producer_create(streams_config_t config,
+    streams_producer_t *producer);
+int32_t streams_producer_destroy(streams_producer_t producer);
+int32_t streams_producer_record_create(streams_topic_partition_t tp,
+    const void *key, uint32_t klen, const void *value, uint32_t vlen,
+    streams_producer_record_t *record);
+int32_t streams_producer_record_destroy(streams_producer_record_t record);
+int32_t streams_producer_record_get_key(streams_producer_record_t record,
+    const void **key, uint32_t *klen);
+int32_t streams_producer_record_get_value(streams_producer_record_t record,
+    const void **value, uint32_t *vlen);
+int32_t streams_producer_send(streams_producer_t producer,
+    streams_producer_record_t record, streams_producer_cb cb, void *ctx);
+int32_t streams_producer_flush(streams_producer_t producer);
+
+int32_t streams_consumer_create(streams_config_t config,
+    streams_consumer_t *consumer);
+int32_t streams_consumer_destroy(streams_consumer_t consumer);
+int32_t streams_consumer_subscribe_topics(streams_consumer_t consumer,
+    const char **topics, int num_topics, streams_rebalance_cb assigned,
+    streams_rebalance_cb revoked, void *ctx);
+int32_t streams_consumer_unsubscribe(streams_consumer_t consumer);
+int32_t streams_consumer_assign_partitions(streams_consumer_t consumer,
+    streams_topic_partition_t *tps, uint32_t num_tps);
+int32_t streams_consumer_seek_to_end(streams_consumer_t consumer,
+    streams_topic_partition_t *tps, uint32_t num_tps);
+int32_t streams_consumer_get_position(streams_consumer_t consumer,
+    streams_topic_partition_t tp, int64_t *offset);
+int32_t streams_consumer_poll(streams_consumer_t consumer, long timeout_ms,
+    streams_consumer_record_t **records, uint32_t *num_records);
+int32_t streams_consumer_commit_all_sync(streams_consumer_t consumer);
+int32_t streams_consumer_commit_all_async(streams_consumer_t consumer,
+    streams_commit_cb cb, void *ctx);
+
+int32_t streams_consumer_record_get_topic(streams_consumer_record_t record,
+    const char **topic, uint32_t *len);
+int32_t streams_consumer_record_get_partitionid(
+    streams_consumer_record_t record, int *partitionid);
+int32_t streams_consumer_record_get_message_count(
+    streams_consumer_record_t record, uint32_t *count);
+int32_t streams_msg_get_key(streams_consumer_record_t record, uint32_t i,
+    void **key, uint32_t *klen);
+int32_t streams_msg_get_value(streams_consumer_record_t record, uint32_t i,
+    void **value, uint32_t *vlen);
+int32_t streams_msg_get_offset(streams_consumer_record_t record, uint32_t i,
+    int64_t *offset);
+int32_t streams_msg_get_timestamp(streams_consumer_record_t record,
+    uint32_t i, int64_t *ts_ms);
+
+#endif /* STREAMS_SHIM_H */
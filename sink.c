@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "sink.h"
+
+/* io_uring sink: this many buffers of this size in flight */
+#define URING_QD 8
+#define URING_BUFSZ (1024 * 1024)
+
+/*
+ * stdout
+ * ------
+ */
+static int
+stdout_write(struct sink *sk, const void *buf, size_t len)
+{
+	(void) sk;
+	return (fwrite(buf, 1, len, stdout) == len ? 0 : -1);
+}
+
+static int
+stdout_flush(struct sink *sk)
+{
+	(void) sk;
+	return (fflush(stdout) == 0 ? 0 : -1);
+}
+
+static void
+stdout_close(struct sink *sk)
+{
+	fflush(stdout);
+	free(sk);
+}
+
+static const struct sink_ops stdout_ops = {
+	stdout_write, stdout_flush, stdout_close
+};
+
+/*
+ * null
+ * ----
+ */
+static int
+null_write(struct sink *sk, const void *buf, size_t len)
+{
+	(void) sk;
+	(void) buf;
+	(void) len;
+	return (0);
+}
+
+static int
+null_flush(struct sink *sk)
+{
+	(void) sk;
+	return (0);
+}
+
+static void
+null_close(struct sink *sk)
+{
+	free(sk);
+}
+
+static const struct sink_ops null_ops = {
+	null_write, null_flush, null_close
+};
+
+/*
+ * writev
+ * ------
+ */
+struct wvsink {
+	struct sink sk;
+	int fd;
+	int niov;
+	struct iovec iov[IOV_MAX];
+};
+
+/* write all of iov, picking up after short writes */
+static int
+writev_all(int fd, struct iovec *iov, int niov)
+{
+	ssize_t n;
+
+	while (niov > 0) {
+		n = writev(fd, iov, niov);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		while (niov > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return (0);
+}
+
+static int
+wv_flush(struct sink *sk)
+{
+	struct wvsink *wv = (struct wvsink *)sk;
+	int ret_val;
+
+	if (wv->niov == 0)
+		return (0);
+	ret_val = writev_all(wv->fd, wv->iov, wv->niov);
+	wv->niov = 0;
+	return (ret_val);
+}
+
+static int
+wv_write(struct sink *sk, const void *buf, size_t len)
+{
+	struct wvsink *wv = (struct wvsink *)sk;
+
+	if (len == 0)
+		return (0);
+	if (wv->niov == IOV_MAX && wv_flush(sk) != 0)
+		return (-1);
+	wv->iov[wv->niov].iov_base = (void *)buf;
+	wv->iov[wv->niov].iov_len = len;
+	wv->niov++;
+	return (0);
+}
+
+static void
+wv_close(struct sink *sk)
+{
+	struct wvsink *wv = (struct wvsink *)sk;
+
+	wv_flush(sk);
+	if (wv->fd != STDOUT_FILENO)
+		close(wv->fd);
+	free(wv);
+}
+
+static const struct sink_ops wv_ops = {
+	wv_write, wv_flush, wv_close
+};
+
+static struct sink *
+wv_open(const char *path)
+{
+	struct wvsink *wv;
+
+	wv = calloc(1, sizeof (*wv));
+	if (wv == NULL)
+		return (NULL);
+	wv->sk.ops = &wv_ops;
+	wv->sk.name = "writev";
+	wv->fd = STDOUT_FILENO;
+	if (path != NULL) {
+		wv->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (wv->fd < 0) {
+			free(wv);
+			return (NULL);
+		}
+	}
+	return (&wv->sk);
+}
+
+/*
+ * io_uring
+ * --------
+ * Talks to the kernel directly rather than through liburing, we only
+ * need to queue writes and reap their completions.  Values are copied
+ * into URING_BUFSZ buffers, a full buffer (or whatever is there at
+ * flush time) is queued as one write at the next file offset and we
+ * only block when all URING_QD buffers are in flight, or to flush.
+ * The file is appended to like the writev sink's, but by offset from
+ * where it ended at open: with O_APPEND the kernel ignores the offsets
+ * and writes in flight together could land in any order.
+ */
+struct urbuf {
+	char *data;
+	size_t len;
+	int busy;
+};
+
+struct ursink {
+	struct sink sk;
+	int fd;
+	int ring_fd;
+	off_t off;
+	int cur;		/* buffer being filled */
+	int inflight;
+	int error;
+	struct urbuf bufs[URING_QD];
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	struct io_uring_cqe *cqes;
+};
+
+static int
+ur_enter(int fd, unsigned submit, unsigned wait)
+{
+	return (syscall(__NR_io_uring_enter, fd, submit, wait,
+	    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0));
+}
+
+/* finish a write the kernel only did part of */
+static void
+ur_finish_short(struct ursink *ur, struct urbuf *b, off_t off, int done)
+{
+	ssize_t n;
+
+	while ((size_t)done < b->len) {
+		n = pwrite(ur->fd, b->data + done, b->len - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ur->error = errno;
+			return;
+		}
+		done += n;
+	}
+}
+
+static void
+ur_reap(struct ursink *ur, int wait)
+{
+	struct io_uring_cqe *cqe;
+	struct urbuf *b;
+	unsigned head;
+
+	if (wait && ur->inflight > 0)
+		(void) ur_enter(ur->ring_fd, 0, 1);
+
+	head = *ur->cq_head;
+	while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		b = &ur->bufs[cqe->user_data & 0xffff];
+		if (cqe->res < 0)
+			ur->error = -cqe->res;
+		else if ((size_t)cqe->res < b->len)
+			ur_finish_short(ur, b, (off_t)(cqe->user_data >> 16),
+			    cqe->res);
+		b->len = 0;
+		b->busy = 0;
+		ur->inflight--;
+		head++;
+	}
+	__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int
+ur_submit_cur(struct ursink *ur)
+{
+	struct urbuf *b = &ur->bufs[ur->cur];
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	if (b->len == 0)
+		return (0);
+
+	tail = *ur->sq_tail;
+	idx = tail & *ur->sq_mask;
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof (*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = ur->fd;
+	sqe->addr = (unsigned long)b->data;
+	sqe->len = b->len;
+	sqe->off = ur->off;
+	/* buffer index in the low bits, file offset above for short writes */
+	sqe->user_data = ((unsigned long long)ur->off << 16) | ur->cur;
+	ur->sq_array[idx] = idx;
+	__atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (ur_enter(ur->ring_fd, 1, 0) < 0)
+		return (-1);
+	b->busy = 1;
+	ur->inflight++;
+	ur->off += b->len;
+
+	/* move on to a free buffer, waiting for one if we have to */
+	for (;;) {
+		ur_reap(ur, 0);
+		for (int i = 1; i <= URING_QD; i++) {
+			int c = (ur->cur + i) % URING_QD;
+
+			if (!ur->bufs[c].busy) {
+				ur->cur = c;
+				return (ur->error ? -1 : 0);
+			}
+		}
+		ur_reap(ur, 1);
+	}
+}
+
+static int
+ur_write(struct sink *sk, const void *buf, size_t len)
+{
+	struct ursink *ur = (struct ursink *)sk;
+	struct urbuf *b;
+	size_t n;
+
+	while (len > 0) {
+		b = &ur->bufs[ur->cur];
+		n = URING_BUFSZ - b->len;
+		if (n > len)
+			n = len;
+		memcpy(b->data + b->len, buf, n);
+		b->len += n;
+		buf = (const char *)buf + n;
+		len -= n;
+		if (b->len == URING_BUFSZ && ur_submit_cur(ur) != 0)
+			return (-1);
+	}
+	return (ur->error ? -1 : 0);
+}
+
+static int
+ur_flush(struct sink *sk)
+{
+	struct ursink *ur = (struct ursink *)sk;
+
+	if (ur_submit_cur(ur) != 0)
+		return (-1);
+	while (ur->inflight > 0)
+		ur_reap(ur, 1);
+	return (ur->error ? -1 : 0);
+}
+
+static void
+ur_close(struct sink *sk)
+{
+	struct ursink *ur = (struct ursink *)sk;
+
+	ur_submit_cur(ur);
+	while (ur->inflight > 0)
+		ur_reap(ur, 1);
+	munmap(ur->sqes, ur->sqes_sz);
+	munmap(ur->sq_ptr, ur->sq_sz);
+	if (ur->cq_ptr != ur->sq_ptr)
+		munmap(ur->cq_ptr, ur->cq_sz);
+	close(ur->ring_fd);
+	close(ur->fd);
+	for (int i = 0; i < URING_QD; i++)
+		free(ur->bufs[i].data);
+	free(ur);
+}
+
+static const struct sink_ops ur_ops = {
+	ur_write, ur_flush, ur_close
+};
+
+static int
+ur_setup(struct ursink *ur)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof (p));
+	ur->ring_fd = syscall(__NR_io_uring_setup, URING_QD * 2, &p);
+	if (ur->ring_fd < 0)
+		return (-1);
+
+	ur->sq_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	ur->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cq_sz > ur->sq_sz)
+			ur->sq_sz = ur->cq_sz;
+		ur->cq_sz = ur->sq_sz;
+	}
+	ur->sq_ptr = mmap(NULL, ur->sq_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQ_RING);
+	if (ur->sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ptr = ur->sq_ptr;
+	} else {
+		ur->cq_ptr = mmap(NULL, ur->cq_sz, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_CQ_RING);
+		if (ur->cq_ptr == MAP_FAILED)
+			goto fail;
+	}
+	ur->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ur->ring_fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = ur->sq_ptr;
+	cq = ur->cq_ptr;
+	ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return (0);
+fail:
+	close(ur->ring_fd);
+	return (-1);
+}
+
+static struct sink *
+ur_open(const char *path)
+{
+	struct ursink *ur;
+
+	ur = calloc(1, sizeof (*ur));
+	if (ur == NULL)
+		return (NULL);
+	ur->sk.ops = &ur_ops;
+	ur->sk.name = "uring";
+	ur->fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (ur->fd < 0) {
+		free(ur);
+		return (NULL);
+	}
+	if ((ur->off = lseek(ur->fd, 0, SEEK_END)) < 0) {
+		close(ur->fd);
+		free(ur);
+		return (NULL);
+	}
+	for (int i = 0; i < URING_QD; i++) {
+		ur->bufs[i].data = malloc(URING_BUFSZ);
+		if (ur->bufs[i].data == NULL)
+			goto fail;
+	}
+	if (ur_setup(ur) != 0) {
+		/* old kernel or seccomp, writev does the same job in-line */
+		fprintf(stderr, "io_uring not available (%s), using writev\n",
+		    strerror(errno));
+		close(ur->fd);
+		for (int i = 0; i < URING_QD; i++)
+			free(ur->bufs[i].data);
+		free(ur);
+		return (wv_open(path));
+	}
+	return (&ur->sk);
+fail:
+	for (int i = 0; i < URING_QD; i++)
+		free(ur->bufs[i].data);
+	close(ur->fd);
+	free(ur);
+	return (NULL);
+}
+
+struct sink *
+sink_open(const char *spec)
+{
+	struct sink *sk = NULL;
+
+	if (spec == NULL || strcmp(spec, "stdout") == 0) {
+		sk = calloc(1, sizeof (*sk));
+		if (sk != NULL) {
+			sk->ops = &stdout_ops;
+			sk->name = "stdout";
+		}
+	} else if (strcmp(spec, "null") == 0) {
+		sk = calloc(1, sizeof (*sk));
+		if (sk != NULL) {
+			sk->ops = &null_ops;
+			sk->name = "null";
+		}
+	} else if (strcmp(spec, "writev") == 0) {
+		sk = wv_open(NULL);
+	} else if (strncmp(spec, "writev:", 7) == 0) {
+		sk = wv_open(spec + 7);
+	} else if (strncmp(spec, "uring:", 6) == 0) {
+		sk = ur_open(spec + 6);
+	}
+	return (sk);
+}
@@ -0,0 +1,63 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stddef.h>
+
+/*
+ * Consumer output sinks
+ * ---------------------
+ * Where consumed values go.  Every sink is handed the value and its
+ * length, values don't need to be NUL-terminated.  Pick one with a
+ * spec string:
+ *
+ *   stdout        stdio-buffered writes to standard output (default)
+ *   writev[:path] gather values into an iovec and write them with one
+ *                 writev() per flush or IOV_MAX values, to stdout or path
+ *   uring:path    copy values into large buffers and write them to path
+ *                 with io_uring, several writes in flight at once
+ *   null          count and drop, for benchmarking the consumer itself
+ *
+ * The writev sink points straight at the client's message buffers, so
+ * sink_flush() must be called before the next poll invalidates them.
+ * Every sink's flush returns once what was written is with the kernel,
+ * the consumer flushes after every poll, before it commits.
+ */
+
+struct sink;
+
+struct sink_ops {
+	int (*write)(struct sink *sk, const void *buf, size_t len);
+	int (*flush)(struct sink *sk);
+	void (*close)(struct sink *sk);
+};
+
+struct sink {
+	const struct sink_ops *ops;
+	const char *name;
+	unsigned long msgs;
+	unsigned long bytes;
+};
+
+struct sink *sink_open(const char *spec);
+
+static inline int
+sink_write(struct sink *sk, const void *buf, size_t len)
+{
+	sk->msgs++;
+	sk->bytes += len;
+	return (sk->ops->write(sk, buf, len));
+}
+
+static inline int
+sink_flush(struct sink *sk)
+{
+	return (sk->ops->flush(sk));
+}
+
+static inline void
+sink_close(struct sink *sk)
+{
+	sk->ops->close(sk);
+}
+
+#endif /* SINK_H */
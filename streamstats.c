@@ -0,0 +1,730 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "metrics.h"
+
+/*
+ * Stream statistics collector
+ * ---------------------------
+ * Reports the topics of one or more streams to OpenTSDB, from
+ * `maprcli stream topic list` and `maprcli stream topic info`, under
+ * the names report.py used:
+ *
+ *   streamstats.<stream>.<topic>.producer_rate  messages/s written
+ *   streamstats.<stream>.<topic>.consumer_rate  messages/s read, by the
+ *                                               slowest consumer
+ *   streamstats.<stream>.<topic>.unconsumed     messages not read yet, 0
+ *                                               below UNCONS_TOLERANCE
+ *   streamstats.<stream>.<topic>.physical_size  bytes, and logical_size
+ *   streamstats.<stream>.<topic>.time_lag       seconds from the oldest
+ *                                               message to the newest
+ *   streamstats.<stream>.total_rate             both rates summed over
+ *                                               the stream's topics
+ *
+ * A topic's numbers are summed over its partitions (time_lag is the
+ * worst one), and -P also reports each partition as
+ * <topic>.<partition>.<metric>.  total_rate is sent under each topic's
+ * name too, which is where report.py left it and where the dashboards
+ * look for it.
+ *
+ * Each round lists every stream's topics, then a pool of worker
+ * threads runs the info commands, so a round takes about as long as
+ * the slowest command rather than all of them back to back.  A command
+ * that hangs (say the CLDB is unreachable) is killed after the timeout
+ * and the topic's last values are sent again, as report.py did.  A
+ * partition only keeps its last two samples, for the rates, and
+ * topics that disappear from the list are forgotten, so memory stays
+ * put however long this runs.  Everything goes out over metrics.c's
+ * one connection.
+ *
+ * MAPRCLI overrides the maprcli binary, e.g. with a script printing
+ * canned JSON, and METRICS_HOST and METRICS_PORT (see metrics.h) point
+ * the output at a local listener.
+ */
+
+#define NAME_PREFIX "streamstats"
+#define MAPRCLI_DEFAULT "/usr/bin/maprcli"
+
+#define DEF_INTERVAL_S 5
+#define DEF_TIMEOUT_S 10
+#define DEF_WORKERS 8
+#define MAX_WORKERS 64
+#define MAX_STREAMS 16
+#define MAX_PARTS 4096
+#define TOPIC_NAME_MAX 256
+
+/* some slack in reporting how much is left */
+#define UNCONS_TOLERANCE 12000
+
+/* most command output we'll take */
+#define CMD_OUT_MAX (16 * 1024 * 1024)
+
+/* how long a sample may wait for room on the metrics queue */
+#define PUT_WAIT_MS 1000
+
+#define M_PROD_RATE 0
+#define M_CONS_RATE 1
+#define M_UNCONSUMED 2
+#define M_PHYS_SIZE 3
+#define M_LOGICAL_SIZE 4
+#define M_TIME_LAG 5
+#define M_NUM 6
+
+static const char *mnames[M_NUM] = {
+	"producer_rate", "consumer_rate", "unconsumed", "physical_size",
+	"logical_size", "time_lag"
+};
+
+struct sample {
+	long long ms;		/* when we got it */
+	long maxoff;
+	long consoff;		/* minoffsetacrossconsumers */
+};
+
+struct part {
+	int n;			/* samples held, up to 2 */
+	int fresh;		/* got one this round */
+	struct sample s[2];	/* s[1] is the latest */
+	long m[M_NUM];
+};
+
+struct topic {
+	char name[TOPIC_NAME_MAX];
+	int seen;		/* in the latest list */
+	int ok;			/* info worked this round */
+	int have;		/* m has something to send */
+	int nparts;
+	struct part *parts;	/* by partition id */
+	long m[M_NUM];
+};
+
+struct stream {
+	const char *path;
+	int ntopics;
+	int cap;
+	struct topic *topics;
+};
+
+struct job {
+	struct stream *st;
+	struct topic *t;
+};
+
+static const char *maprcli = MAPRCLI_DEFAULT;
+static long timeout_ms = DEF_TIMEOUT_S * 1000L;
+static int nworkers = DEF_WORKERS;
+static int per_part;
+static int debug_on;
+
+static int nstreams;
+static struct stream streams[MAX_STREAMS];
+
+#define DPRINTF(...) if (debug_on) { fprintf(stderr, __VA_ARGS__); }
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Run a command and collect its output, NUL-terminated, in *out.  The
+ * command gets its own process group so that whatever it starts dies
+ * with it on a timeout.  -1 if it fails, times out or says too much.
+ */
+static int
+run_cmd(char *const argv[], char **out)
+{
+	char *buf = NULL, *nbuf;
+	size_t len = 0, cap = 0;
+	long long deadline = now_ms() + timeout_ms, left;
+	struct pollfd pfd;
+	int fds[2], status, ret = -1;
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe2(fds, O_CLOEXEC) != 0)
+		return (-1);
+	if ((pid = fork()) < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return (-1);
+	}
+	if (pid == 0) {
+		setpgid(0, 0);
+		dup2(fds[1], STDOUT_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	close(fds[1]);
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		if ((left = deadline - now_ms()) <= 0) {
+			fprintf(stderr, "%s %s %s: timed out\n", argv[0],
+			    argv[1], argv[2]);
+			break;
+		}
+		if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+			break;
+		if (pfd.revents == 0)
+			continue;
+		if (cap - len < 4096) {
+			if (cap >= CMD_OUT_MAX)
+				break;
+			cap = cap == 0 ? 65536 : cap * 2;
+			if ((nbuf = realloc(buf, cap)) == NULL)
+				break;
+			buf = nbuf;
+		}
+		n = read(fds[0], buf + len, cap - len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			ret = n == 0 ? EXIT_SUCCESS : -1;
+			break;
+		}
+		len += n;
+	}
+	close(fds[0]);
+	if (ret != EXIT_SUCCESS)
+		kill(-pid, SIGKILL);
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+	if (ret == EXIT_SUCCESS && (!WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0))
+		ret = -1;
+	if (ret != EXIT_SUCCESS || buf == NULL) {
+		free(buf);
+		return (-1);
+	}
+	buf[len] = '\0';
+	*out = buf;
+	return (EXIT_SUCCESS);
+}
+
+/*
+ * Just enough JSON for maprcli's output: the objects in the top-level
+ * "data" array, and their scalar fields.
+ */
+static const char *
+json_data(const char *js)
+{
+	const char *p;
+
+	if ((p = strstr(js, "\"data\"")) == NULL)
+		return (NULL);
+	for (p += 6; *p == ' ' || *p == ':' || *p == '\n' || *p == '\t'; p++)
+		;
+	return (*p == '[' ? p + 1 : NULL);
+}
+
+/* the next {...} in the array at *pp, NULL at the end of it */
+static const char *
+json_next_obj(const char **pp, const char **endp)
+{
+	const char *p = *pp, *start;
+	int depth = 0, instr = 0;
+
+	for (; *p != '{'; p++) {
+		if (*p == ']' || *p == '\0')
+			return (NULL);
+	}
+	for (start = p; *p != '\0'; p++) {
+		if (instr) {
+			if (*p == '\\' && p[1] != '\0')
+				p++;
+			else if (*p == '"')
+				instr = 0;
+		} else if (*p == '"') {
+			instr = 1;
+		} else if (*p == '{' || *p == '[') {
+			depth++;
+		} else if ((*p == '}' || *p == ']') && --depth == 0) {
+			*pp = *endp = p + 1;
+			return (start);
+		}
+	}
+	return (NULL);
+}
+
+/* the value of a top-level field of the object, without quotes */
+static int
+json_get(const char *obj, const char *end, const char *key, char *val,
+    size_t vlen)
+{
+	size_t klen = strlen(key), n;
+	const char *p, *q, *v;
+	int depth = 0, match;
+
+	for (p = obj; p < end; p++) {
+		if (*p == '{' || *p == '[') {
+			depth++;
+			continue;
+		}
+		if (*p == '}' || *p == ']') {
+			depth--;
+			continue;
+		}
+		if (*p != '"')
+			continue;
+
+		/* a string, and a key if a ':' follows */
+		for (q = p + 1; q < end && *q != '"'; q++) {
+			if (*q == '\\')
+				q++;
+		}
+		if (q >= end)
+			return (-1);
+		match = depth == 1 && (size_t)(q - p - 1) == klen &&
+		    memcmp(p + 1, key, klen) == 0;
+		for (v = q + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+			;
+		if (!match || v >= end || *v != ':') {
+			p = q;
+			continue;
+		}
+		for (v++; v < end && (*v == ' ' || *v == '\t'); v++)
+			;
+		if (v < end && *v == '"') {
+			for (q = ++v; q < end && *q != '"'; q++)
+				;
+		} else {
+			for (q = v; q < end && *q != ',' && *q != '}' &&
+			    *q != ' ' && *q != '\n'; q++)
+				;
+		}
+		n = q - v < (long)vlen ? (size_t)(q - v) : vlen - 1;
+		memcpy(val, v, n);
+		val[n] = '\0';
+		return (EXIT_SUCCESS);
+	}
+	return (-1);
+}
+
+/* a numeric field, maprcli quotes some of them */
+static long
+json_long(const char *obj, const char *end, const char *key, long def)
+{
+	char val[64], *e;
+	long v;
+
+	if (json_get(obj, end, key, val, sizeof (val)) != EXIT_SUCCESS)
+		return (def);
+	v = strtol(val, &e, 10);
+	return (e == val ? def : v);
+}
+
+/* an ISO 8601 time like 2016-08-09T17:32:41.000-0700, in ms */
+static long long
+iso_ms(const char *s)
+{
+	struct tm tm;
+	const char *p;
+	long long ms = 0, scale = 100;
+	int off = 0, sign;
+
+	memset(&tm, 0, sizeof (tm));
+	if ((p = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm)) == NULL)
+		return (-1);
+	if (*p == '.') {
+		for (p++; *p >= '0' && *p <= '9'; p++, scale /= 10)
+			ms += (*p - '0') * scale;
+	}
+	if (*p == '+' || *p == '-') {
+		sign = *p++ == '-' ? -1 : 1;
+		if (strlen(p) >= 4 && p[2] == ':')
+			off = ((p[0] - '0') * 10 + p[1] - '0') * 60 +
+			    (p[3] - '0') * 10 + p[4] - '0';
+		else if (strlen(p) >= 4)
+			off = ((p[0] - '0') * 10 + p[1] - '0') * 60 +
+			    (p[2] - '0') * 10 + p[3] - '0';
+		off *= sign * 60;
+	}
+	return (((long long)timegm(&tm) - off) * 1000 + ms);
+}
+
+/* a topic in the stream's table, added if it's new */
+static struct topic *
+topic_get(struct stream *st, const char *name)
+{
+	struct topic *t;
+
+	for (int i = 0; i < st->ntopics; i++) {
+		if (strcmp(st->topics[i].name, name) == 0)
+			return (&st->topics[i]);
+	}
+	if (st->ntopics == st->cap) {
+		st->cap = st->cap == 0 ? 16 : st->cap * 2;
+		t = realloc(st->topics, st->cap * sizeof (*t));
+		if (t == NULL)
+			return (NULL);
+		st->topics = t;
+	}
+	t = &st->topics[st->ntopics++];
+	memset(t, 0, sizeof (*t));
+	snprintf(t->name, sizeof (t->name), "%s", name);
+	return (t);
+}
+
+/*
+ * Run fn(arg, i) for each of njobs jobs on up to nworkers threads,
+ * each taking the next job as it finishes the last.
+ */
+struct pool {
+	int njobs;
+	int next;
+	void (*fn)(void *, int);
+	void *arg;
+};
+
+static void *
+pool_worker(void *arg)
+{
+	struct pool *p = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) <
+	    p->njobs)
+		p->fn(p->arg, i);
+	return (NULL);
+}
+
+static void
+pool_run(int njobs, void (*fn)(void *, int), void *arg)
+{
+	struct pool p = { njobs, 0, fn, arg };
+	pthread_t th[MAX_WORKERS];
+	int n = njobs < nworkers ? njobs : nworkers, started;
+
+	for (started = 0; started < n; started++) {
+		if (pthread_create(&th[started], NULL, pool_worker, &p) != 0)
+			break;
+	}
+	/* without threads we do it all ourselves */
+	if (started == 0)
+		pool_worker(&p);
+	for (int i = 0; i < started; i++)
+		pthread_join(th[i], NULL);
+}
+
+/* which topics the stream has now, forgetting the ones it hasn't */
+static void
+list_job(void *arg, int i)
+{
+	struct stream *st = &streams[i];
+	char *argv[] = { (char *)maprcli, "stream", "topic", "list", "-path",
+	    (char *)st->path, "-json", NULL };
+	char *out, name[TOPIC_NAME_MAX];
+	const char *p, *obj, *end;
+	struct topic *t;
+	int n = 0;
+
+	(void) arg;
+	if (run_cmd(argv, &out) != EXIT_SUCCESS) {
+		/* keep going with the topics we knew about */
+		fprintf(stderr, "can't list the topics of %s\n", st->path);
+		return;
+	}
+	if ((p = json_data(out)) == NULL) {
+		fprintf(stderr, "no topic list for %s\n", st->path);
+		free(out);
+		return;
+	}
+	for (int j = 0; j < st->ntopics; j++)
+		st->topics[j].seen = 0;
+	while ((obj = json_next_obj(&p, &end)) != NULL) {
+		if (json_get(obj, end, "topic", name, sizeof (name)) != 0)
+			continue;
+		if ((t = topic_get(st, name)) != NULL)
+			t->seen = 1;
+	}
+	free(out);
+
+	for (int j = 0; j < st->ntopics; j++) {
+		if (st->topics[j].seen) {
+			st->topics[n++] = st->topics[j];
+			continue;
+		}
+		DPRINTF("%s: topic %s is gone\n", st->path,
+		    st->topics[j].name);
+		free(st->topics[j].parts);
+	}
+	st->ntopics = n;
+}
+
+/* a new sample for each of the topic's partitions */
+static void
+info_job(void *arg, int i)
+{
+	struct job *j = (struct job *)arg + i;
+	struct topic *t = j->t;
+	char *argv[] = { (char *)maprcli, "stream", "topic", "info", "-path",
+	    (char *)j->st->path, "-topic", t->name, "-json", NULL };
+	char *out, ts[64];
+	const char *p, *obj, *end;
+	long long now = now_ms(), lo, hi;
+	struct part *pt;
+	long id;
+
+	t->ok = 0;
+	if (run_cmd(argv, &out) != EXIT_SUCCESS) {
+		fprintf(stderr, "no info for %s:%s\n", j->st->path, t->name);
+		return;
+	}
+	if ((p = json_data(out)) == NULL) {
+		free(out);
+		return;
+	}
+	while ((obj = json_next_obj(&p, &end)) != NULL) {
+		id = json_long(obj, end, "partitionid", 0);
+		if (id < 0 || id >= MAX_PARTS)
+			continue;
+		if (id >= t->nparts) {
+			pt = realloc(t->parts, (id + 1) * sizeof (*pt));
+			if (pt == NULL)
+				break;
+			memset(pt + t->nparts, 0,
+			    (id + 1 - t->nparts) * sizeof (*pt));
+			t->parts = pt;
+			t->nparts = id + 1;
+		}
+		pt = &t->parts[id];
+		pt->s[0] = pt->s[1];
+		pt->s[1].ms = now;
+		pt->s[1].maxoff = json_long(obj, end, "maxoffset", 0);
+		pt->s[1].consoff = json_long(obj, end,
+		    "minoffsetacrossconsumers", 0);
+		if (pt->n < 2)
+			pt->n++;
+		pt->fresh = 1;
+
+		pt->m[M_PHYS_SIZE] = json_long(obj, end, "physicalsize", 0);
+		pt->m[M_LOGICAL_SIZE] = json_long(obj, end, "logicalsize", 0);
+		pt->m[M_TIME_LAG] = 0;
+		if (json_get(obj, end, "mintimestamp", ts, sizeof (ts)) == 0 &&
+		    (lo = iso_ms(ts)) >= 0 &&
+		    json_get(obj, end, "maxtimestamp", ts, sizeof (ts)) == 0 &&
+		    (hi = iso_ms(ts)) >= lo)
+			pt->m[M_TIME_LAG] = (hi - lo) / 1000;
+	}
+	free(out);
+	t->ok = 1;
+}
+
+/*
+ * Rates from each partition's two samples, and the topic's totals.
+ * Like report.py we wait for a second sample before reporting.
+ */
+static void
+topic_update(struct topic *t)
+{
+	long m[M_NUM] = { 0 };
+	struct part *pt;
+	struct sample *cur, *prev;
+	double dt;
+	int rated = 0;
+
+	for (int i = 0; i < t->nparts; i++) {
+		pt = &t->parts[i];
+		if (!pt->fresh)
+			continue;
+		pt->fresh = 0;
+		cur = &pt->s[1];
+		prev = &pt->s[0];
+		if (pt->n == 2 && cur->ms > prev->ms) {
+			dt = (cur->ms - prev->ms) / 1000.0;
+			pt->m[M_PROD_RATE] = (cur->maxoff - prev->maxoff) / dt;
+			pt->m[M_CONS_RATE] = (cur->consoff - prev->consoff) / dt;
+			rated = 1;
+		}
+		pt->m[M_UNCONSUMED] = cur->maxoff > cur->consoff ?
+		    cur->maxoff - cur->consoff : 0;
+		for (int k = 0; k < M_NUM; k++) {
+			if (k == M_TIME_LAG)
+				m[k] = pt->m[k] > m[k] ? pt->m[k] : m[k];
+			else
+				m[k] += pt->m[k];
+		}
+	}
+	if (!rated)
+		return;
+	if (m[M_UNCONSUMED] < UNCONS_TOLERANCE)
+		m[M_UNCONSUMED] = 0;
+	memcpy(t->m, m, sizeof (m));
+	t->have = 1;
+}
+
+static void
+put(long v, const char *fmt, ...)
+{
+	char name[METRICS_NAME_MAX];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(name, sizeof (name), fmt, ap);
+	va_end(ap);
+	DPRINTF("%s = %ld\n", name, v);
+	metrics_put_wait(name, v, PUT_WAIT_MS);
+}
+
+/* everything we know, the last values again for topics that failed */
+static void
+report(struct stream *st)
+{
+	struct topic *t;
+	long total = 0;
+
+	for (int i = 0; i < st->ntopics; i++) {
+		t = &st->topics[i];
+		if (t->ok)
+			topic_update(t);
+		if (!t->have)
+			continue;
+		for (int k = 0; k < M_NUM; k++)
+			put(t->m[k], "%s.%s.%s.%s", NAME_PREFIX, st->path,
+			    t->name, mnames[k]);
+		for (int p = 0; per_part && t->ok && p < t->nparts; p++) {
+			for (int k = 0; k < M_NUM; k++)
+				put(t->parts[p].m[k], "%s.%s.%s.%d.%s",
+				    NAME_PREFIX, st->path, t->name, p,
+				    mnames[k]);
+		}
+		total += t->m[M_PROD_RATE] + t->m[M_CONS_RATE];
+	}
+	put(total, "%s.%s.total_rate", NAME_PREFIX, st->path);
+	for (int i = 0; i < st->ntopics; i++) {
+		if (st->topics[i].have)
+			put(total, "%s.%s.%s.total_rate", NAME_PREFIX,
+			    st->path, st->topics[i].name);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct job *jobs = NULL, *nj;
+	struct timespec ts;
+	long interval_ms = DEF_INTERVAL_S * 1000L, rounds = 0, elapsed;
+	long long start;
+	int opt, njobs, failed, cap = 0;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "i:n:Pt:vw:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval_ms = strtod(optarg, &end) * 1000;
+			if (*end != '\0' || interval_ms <= 0)
+				goto usage;
+			break;
+		case 'n':
+			rounds = strtol(optarg, &end, 10);
+			if (*end != '\0' || rounds < 0)
+				goto usage;
+			break;
+		case 'P':
+			per_part = 1;
+			break;
+		case 't':
+			timeout_ms = strtod(optarg, &end) * 1000;
+			if (*end != '\0' || timeout_ms <= 0)
+				goto usage;
+			break;
+		case 'v':
+			debug_on = 1;
+			break;
+		case 'w':
+			nworkers = atoi(optarg);
+			if (nworkers < 1 || nworkers > MAX_WORKERS)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc || argc - optind > MAX_STREAMS)
+		goto usage;
+	for (; optind < argc; optind++)
+		streams[nstreams++].path = argv[optind];
+	if (getenv("MAPRCLI") != NULL)
+		maprcli = getenv("MAPRCLI");
+
+	if (metrics_init() != EXIT_SUCCESS) {
+		fprintf(stderr, "can't start the metrics emitter\n");
+		exit(-1);
+	}
+
+	for (long r = 0; rounds == 0 || r < rounds; r++) {
+		start = now_ms();
+		pool_run(nstreams, list_job, NULL);
+
+		njobs = 0;
+		for (int i = 0; i < nstreams; i++) {
+			for (int k = 0; k < streams[i].ntopics; k++) {
+				if (njobs == cap) {
+					cap = cap == 0 ? 64 : cap * 2;
+					nj = realloc(jobs, cap * sizeof (*nj));
+					if (nj == NULL) {
+						fprintf(stderr, "out of memory\n");
+						exit(-1);
+					}
+					jobs = nj;
+				}
+				jobs[njobs].st = &streams[i];
+				jobs[njobs++].t = &streams[i].topics[k];
+			}
+		}
+		pool_run(njobs, info_job, jobs);
+
+		for (int i = 0; i < nstreams; i++)
+			report(&streams[i]);
+		failed = 0;
+		for (int i = 0; i < njobs; i++)
+			failed += !jobs[i].t->ok;
+		elapsed = now_ms() - start;
+		put(elapsed, "%s.collect_ms", NAME_PREFIX);
+		printf("gathered %d topic(s) from %d stream(s) in %ldms, "
+		    "%d failed\n", njobs, nstreams, elapsed, failed);
+		fflush(stdout);
+
+		/* a round that ran long just starts the next one late */
+		if (elapsed < interval_ms && (rounds == 0 || r + 1 < rounds)) {
+			ts.tv_sec = (interval_ms - elapsed) / 1000;
+			ts.tv_nsec = (interval_ms - elapsed) % 1000 * 1000000L;
+			while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+				;
+		}
+	}
+	metrics_shutdown();
+	free(jobs);
+	return (EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "usage:  %s [-i interval_s] [-n rounds] [-P] "
+	    "[-t timeout_s] [-v] [-w workers] /path_to_stream ...\n"
+	    "  -i  seconds from the start of one round to the next "
+	    "(default %d)\n"
+	    "  -n  stop after this many rounds (default: keep going)\n"
+	    "  -P  report each partition as well as each topic\n"
+	    "  -t  kill a maprcli command after this many seconds "
+	    "(default %d)\n"
+	    "  -v  print each metric as it's sent\n"
+	    "  -w  run up to this many maprcli commands at once "
+	    "(default %d)\n", argv[0], DEF_INTERVAL_S, DEF_TIMEOUT_S,
+	    DEF_WORKERS);
+	exit(-1);
+}